@@ -1,6 +1,25 @@
 // swift-tools-version: 6.2
 import PackageDescription
 
+// KASAN=1 builds the kernel with the address sanitizer (see kasan.c), checking
+// the shadow inline; KASAN=outline calls into kasan.c for every access
+// instead, which is smaller but much slower.
+let kasan = Context.environment["KASAN"]
+let kasanDefines: [SwiftSetting] = kasan == nil ? [] : [.define("KASAN")]
+let kasanCDefines: [CSetting] = kasan == nil ? [] : [.define("KASAN")]
+let kasanFlags: [String] =
+    kasan == nil
+    ? []
+    : [
+        "-Xfrontend", "-sanitize=address",
+        "-Xfrontend", "-sanitize-recover=address",
+        // Must match KASAN_SHADOW_OFFSET in CSupport.h.
+        "-Xllvm", "-asan-mapping-offset=0xffffe00000000000",
+        "-Xllvm", "-asan-globals=0",
+        "-Xllvm", "-asan-stack=0",
+        "-Xllvm", "-asan-instrumentation-with-call-threshold=\(kasan == "outline" ? 0 : 1_000_000)",
+    ]
+
 let package = Package(
     name: "SwiftOS",
     platforms: [.macOS(.v14)],
@@ -13,21 +32,23 @@ let package = Package(
             swiftSettings: [
                 .enableExperimentalFeature("Embedded"),
                 .enableExperimentalFeature("Extern"),
-                .unsafeFlags([
-                    "-wmo",
-                    "-Xfrontend", "-disable-stack-protector",
-                    "-Xfrontend", "-disable-stack-protector",
-                    // TODO: add kasan
-                    // "-sanitize=address",
-                    // "-Xc", "-fno-sanitize-address-globals",
-                ]),
-            ]
+                // Most verbose log level compiled in (see Log.swift).
+                .define("LOG_LEVEL_TRACE", .when(configuration: .debug)),
+                .define("LOG_LEVEL_INFO", .when(configuration: .release)),
+                .unsafeFlags(
+                    [
+                        "-wmo",
+                        "-Xfrontend", "-disable-stack-protector",
+                        "-Xfrontend", "-disable-stack-protector",
+                    ] + kasanFlags),
+            ] + kasanDefines
         ),
         .target(
             name: "Boot",
             path: "Sources/Boot",
             exclude: ["linker.ld"],
-            publicHeadersPath: "include"
+            publicHeadersPath: "include",
+            cSettings: kasanCDefines
         ),
         .target(
             name: "CSupport",
@@ -37,7 +58,7 @@ let package = Package(
                 .unsafeFlags([
                     "-ffreestanding"
                 ])
-            ]
+            ] + kasanCDefines
         ),
         .target(
             name: "InitialProcess",
@@ -51,10 +72,18 @@ let package = Package(
             name: "BuildImagePlugin",
             capability: .command(
                 intent: .custom(
-                    verb: "build-image", description: "Build the kernel image and ramdisk"),
+                    verb: "build-image",
+                    description: "Build the kernel image and ramdisk; with bench, also run the benchmarks"),
                 permissions: [.writeToPackageDirectory(reason: "Generate final build artifacts")]
             ),
             path: "Plugins/BuildImagePlugin"
         ),
+        // Host tests for code shared by the kernel and the build plugin
+        // (symlinked in): swift test --filter KernelTests
+        .testTarget(
+            name: "KernelTests",
+            path: "Tests/KernelTests",
+            swiftSettings: [.define("KERNEL_HOST_TESTS")]
+        ),
     ]
 )
@@ -0,0 +1,56 @@
+import Foundation
+
+/// Write `root` as a newc CPIO archive. File data is padded to start on a
+/// `dataAlignment` boundary (by NUL-padding the name, which newc readers
+/// ignore) so the kernel can map ramdisk pages directly. The Multiboot loader
+/// places modules on a page boundary, so archive offsets carry over.
+func writeCPIO(root: URL, to output: URL, dataAlignment: Int) throws {
+    let fm = FileManager.default
+    var archive = Data()
+    var ino = 1
+
+    func hex8(_ v: Int) -> String {
+        let s = String(v, radix: 16, uppercase: true)
+        return String(repeating: "0", count: max(0, 8 - s.count)) + s
+    }
+
+    func pad4() {
+        while archive.count % 4 != 0 { archive.append(0) }
+    }
+
+    func append(name: String, mode: Int, mtime: Int, data: Data) {
+        let nameBytes = Array(name.utf8) + [0]
+        var nameSize = nameBytes.count
+        if !data.isEmpty {
+            let dataStart = archive.count + 110 + nameSize
+            let aligned = (dataStart + dataAlignment - 1) / dataAlignment * dataAlignment
+            nameSize = aligned - archive.count - 110
+        }
+        let fields = [
+            ino, mode, 0, 0, 1, mtime, data.count, 0, 0, 0, 0, nameSize, 0,
+        ]
+        archive.append(contentsOf: Array("070701".utf8))
+        for f in fields { archive.append(contentsOf: Array(hex8(f).utf8)) }
+        archive.append(contentsOf: nameBytes)
+        archive.append(contentsOf: [UInt8](repeating: 0, count: nameSize - nameBytes.count))
+        pad4()
+        archive.append(data)
+        pad4()
+        ino += 1
+    }
+
+    let paths = (fm.enumerator(atPath: root.path)?.allObjects as? [String] ?? []).sorted()
+    for rel in paths {
+        let url = root.appendingPathComponent(rel)
+        let attrs = try fm.attributesOfItem(atPath: url.path)
+        let perms = (attrs[.posixPermissions] as? Int) ?? 0o644
+        let mtime = Int((attrs[.modificationDate] as? Date)?.timeIntervalSince1970 ?? 0)
+        if (attrs[.type] as? FileAttributeType) == .typeDirectory {
+            append(name: rel, mode: 0o040000 | perms, mtime: mtime, data: Data())
+        } else {
+            append(name: rel, mode: 0o100000 | perms, mtime: mtime, data: try Data(contentsOf: url))
+        }
+    }
+    append(name: "TRAILER!!!", mode: 0, mtime: 0, data: Data())
+    try archive.write(to: output)
+}
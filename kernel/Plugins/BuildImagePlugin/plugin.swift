@@ -24,8 +24,33 @@ struct BuildImagePlugin: CommandPlugin {
             }
         }
 
+        func option(_ names: String...) -> String? {
+            guard let i = arguments.firstIndex(where: { names.contains($0) }), i + 1 < arguments.count
+            else { return nil }
+            return arguments[i + 1]
+        }
+
+        // "bench": boot the image in benchmark mode afterwards (see Bench.swift)
+        let bench = arguments.contains("bench")
+        // Link the objects of this configuration's `swift build`. Benchmarks
+        // measure the release kernel unless asked otherwise.
+        let configuration = option("-c", "--configuration") ?? (bench ? "release" : "debug")
+        guard configuration == "debug" || configuration == "release" else {
+            throw NSError(
+                domain: "BuildImagePlugin", code: 1,
+                userInfo: [NSLocalizedDescriptionKey: "unknown configuration \(configuration)"])
+        }
         let buildDir = context.package.directoryURL.appendingPathComponent(".build")
-            .appendingPathComponent(triple).appendingPathComponent("debug")
+            .appendingPathComponent(triple).appendingPathComponent(configuration)
+        guard FileManager.default.fileExists(atPath: buildDir.appendingPathComponent("Kernel.build").path)
+        else {
+            throw NSError(
+                domain: "BuildImagePlugin", code: 1,
+                userInfo: [
+                    NSLocalizedDescriptionKey:
+                        "no \(configuration) build; run swift build -c \(configuration) --triple \(triple) first"
+                ])
+        }
 
         let kernelElf64 = buildDir.appendingPathComponent("kernel.elf64")
         let kernelElf32 = buildDir.appendingPathComponent("kernel")
@@ -36,7 +61,11 @@ struct BuildImagePlugin: CommandPlugin {
 
         // Check if we should use a Mach-O binary instead of the flat init
         let useMachO = arguments.contains("--macho")
-        let machoBinary = arguments.first(where: { !$0.hasPrefix("-") && $0 != "build-image" })
+        let valueOptions: Set = ["-c", "--configuration", "--baseline", "--tolerance", "--shared-cache"]
+        let machoBinary = arguments.enumerated().first(where: { i, arg in
+            let isValue = i > 0 && valueOptions.contains(arguments[i - 1])
+            return !arg.hasPrefix("-") && !isValue && arg != "build-image" && arg != "bench"
+        })?.element
 
         let sharedCachePath = arguments.first(where: {
             let idx = arguments.firstIndex(of: $0) ?? -1
@@ -82,25 +111,27 @@ struct BuildImagePlugin: CommandPlugin {
             cpioCmd += " && cp \(initBin.path) \(ramdiskRoot.path)/init"
         }
 
-        cpioCmd += " && cd \(ramdiskRoot.path) && find * | cpio -o -H newc > \(ramdiskCpio.path)"
-
         try run("/bin/sh", ["-c", cpioCmd])
+        try writeCPIO(root: ramdiskRoot, to: ramdiskCpio, dataAlignment: 4096)
 
-        // Collect all kernel .o files
-        let kernelBuildDir = buildDir.appendingPathComponent("Kernel.build")
-        let kernelObjects: [String]
-        do {
-            let files = try FileManager.default.contentsOfDirectory(atPath: kernelBuildDir.path)
-            kernelObjects = files.filter { $0.hasSuffix(".o") }.map {
-                kernelBuildDir.appendingPathComponent($0).path
-            }
-        } catch {
-            print("Warning: Could not list kernel build dir, using known files")
-            kernelObjects = [
-                "CPIO.swift.o", "KernelMain.swift.o", "Multiboot.swift.o",
-                "virtio_gpu.swift.o", "MachO.swift.o", "Syscall.swift.o", "MachIPC.swift.o",
-            ].map { kernelBuildDir.appendingPathComponent($0).path }
+        // One object per source the targets declare. Listing the build
+        // directories instead would also pick up stale objects of deleted or
+        // renamed files. Swift objects are named after the file alone, C
+        // objects after its path inside the target.
+        func objects(of targetName: String) throws -> [String] {
+            guard let target = try context.package.targets(named: [targetName]).first as? SourceModuleTarget
+            else { return [] }
+            let sourceDir = target.directoryURL.path + "/"
+            let objectDir = buildDir.appendingPathComponent("\(targetName).build")
+            return target.sourceFiles.filter { $0.type == .source }.map { file in
+                let name =
+                    file.url.pathExtension == "swift"
+                    ? file.url.lastPathComponent : String(file.url.path.dropFirst(sourceDir.count))
+                return objectDir.appendingPathComponent(name + ".o").path
+            }.sorted()
         }
+        let kernelObjects = try objects(of: "Kernel")
+        let supportObjects = try objects(of: "CSupport")
 
         print("Linking Kernel (\(kernelObjects.count) objects)...")
         var linkArgs = [
@@ -109,11 +140,9 @@ struct BuildImagePlugin: CommandPlugin {
             "-o", kernelElf64.path,
         ]
         linkArgs += kernelObjects
-        linkArgs += [
-            buildDir.appendingPathComponent("Boot.build/boot.S.o").path,
-            buildDir.appendingPathComponent("CSupport.build/runtime.c.o").path,
-            "--nostdlib", "-static",
-        ]
+        linkArgs.append(buildDir.appendingPathComponent("Boot.build/boot.S.o").path)
+        linkArgs += supportObjects
+        linkArgs += ["--nostdlib", "-static"]
         try run("\(toolchainPath)/ld.lld", linkArgs)
 
         print("Creating kernel (elf32)...")
@@ -126,6 +155,16 @@ struct BuildImagePlugin: CommandPlugin {
             let diskCmd =
                 "rm -f \(diskImg.path) && dd if=/dev/zero of=\(diskImg.path) bs=1M count=1 && dd if=\(scPath) of=\(diskImg.path) bs=1M seek=1"
             try run("/bin/sh", ["-c", diskCmd])
+
+            // Reserve the last 16 MiB (sector-aligned) for the kernel's
+            // trace dump; the marker tells it the space is free to use.
+            let disk = try FileHandle(forWritingTo: diskImg)
+            let end = try disk.seekToEnd()
+            var area = Data(count: Int((512 - end % 512) % 512))
+            area.append(contentsOf: Array("SWTRACE0".utf8))
+            area.append(Data(count: (16 << 20) - 8))
+            disk.write(area)
+            try disk.close()
         }
 
         print("\nBuild Completed!")
@@ -141,5 +180,106 @@ struct BuildImagePlugin: CommandPlugin {
             qemu += " -drive file=\(diskImg.path),if=virtio,format=raw"
         }
         print(qemu)
+
+        if bench {
+            try runBenchmarks(
+                qemu: qemu, buildDir: buildDir, baseline: option("--baseline"),
+                tolerance: option("--tolerance").flatMap(Double.init) ?? 0.2)
+        }
+    }
+}
+
+/// Boot the image with "bench" on the command line and collect what the
+/// kernel prints between the BENCH markers. Results are written to
+/// bench.json; with a baseline (an earlier bench.json), any result whose
+/// time per operation grew by more than `tolerance` fails the command.
+func runBenchmarks(qemu: String, buildDir: URL, baseline: String?, tolerance: Double) throws {
+    let log = buildDir.appendingPathComponent("bench.log")
+    let output = buildDir.appendingPathComponent("bench.json")
+    try? FileManager.default.removeItem(at: log)
+
+    // The kernel leaves through isa-debug-exit once it has reported.
+    let command =
+        qemu.replacingOccurrences(of: "-serial stdio", with: "-serial file:\(log.path)")
+        + " -append bench -no-reboot -device isa-debug-exit,iobase=0xf4,iosize=0x04"
+    print("\nRunning benchmarks...")
+    let process = Process()
+    process.executableURL = URL(fileURLWithPath: "/bin/sh")
+    process.arguments = ["-c", "exec " + command]
+    process.standardOutput = FileHandle.standardError
+    try process.run()
+    let deadline = Date().addingTimeInterval(300)
+    while process.isRunning && Date() < deadline { Thread.sleep(forTimeInterval: 0.1) }
+    if process.isRunning {
+        process.terminate()
+        throw NSError(
+            domain: "BuildImagePlugin", code: 1,
+            userInfo: [NSLocalizedDescriptionKey: "benchmark run timed out; see \(log.path)"])
+    }
+
+    let text = (try? String(contentsOf: log, encoding: .utf8)) ?? ""
+    guard let begin = text.range(of: "=== BENCH BEGIN ==="),
+        let end = text.range(of: "=== BENCH END ===", range: begin.upperBound..<text.endIndex)
+    else {
+        throw NSError(
+            domain: "BuildImagePlugin", code: 1,
+            userInfo: [NSLocalizedDescriptionKey: "no benchmark results in \(log.path)"])
+    }
+
+    // "tsc_hz hz", then "name ops bytes ns" per result, all in hex.
+    var tscHz = 0
+    var results: [[String: Any]] = []
+    for line in text[begin.upperBound..<end.lowerBound].split(separator: "\n") {
+        let f = line.split(separator: " ").map(String.init)
+        if f.count == 2 && f[0] == "tsc_hz" {
+            tscHz = Int(f[1], radix: 16) ?? 0
+        } else if f.count == 4, let ops = Int(f[1], radix: 16), let bytes = Int(f[2], radix: 16),
+            let ns = Int(f[3], radix: 16)
+        {
+            results.append(["name": f[0], "ops": ops, "bytes": bytes, "ns": ns])
+        }
+    }
+
+    func perOp(_ r: [String: Any]) -> Double {
+        let ops = r["ops"] as? Int ?? 0
+        return ops == 0 ? 0 : Double(r["ns"] as? Int ?? 0) / Double(ops)
+    }
+    print("\nTSC: \(tscHz) Hz")
+    for r in results {
+        let name = r["name"] as? String ?? ""
+        var row = name.padding(toLength: 24, withPad: " ", startingAt: 0)
+            + String(format: "%14.1f ns/op  x%-6d", perOp(r), r["ops"] as? Int ?? 0)
+        if let bytes = r["bytes"] as? Int, bytes > 0, let ns = r["ns"] as? Int, ns > 0 {
+            row += String(format: "  %8.1f MB/s", Double(bytes) * 1000 / Double(ns))
+        }
+        print(row)
+    }
+
+    let json: [String: Any] = ["tsc_hz": tscHz, "results": results]
+    let data = try JSONSerialization.data(withJSONObject: json, options: [.prettyPrinted, .sortedKeys])
+    try data.write(to: output)
+    print("Results: \(output.path)")
+
+    guard let baseline = baseline else { return }
+    let old = try JSONSerialization.jsonObject(with: Data(contentsOf: URL(fileURLWithPath: baseline)))
+    let oldResults = (old as? [String: Any])?["results"] as? [[String: Any]] ?? []
+    var regressions: [String] = []
+    for r in results {
+        guard let name = r["name"] as? String,
+            let before = oldResults.first(where: { $0["name"] as? String == name }),
+            perOp(before) > 0
+        else { continue }
+        let change = perOp(r) / perOp(before) - 1
+        if change > tolerance {
+            regressions.append(name + String(format: " %+.1f%%", change * 100))
+        }
+    }
+    if !regressions.isEmpty {
+        print("\nRegressions against \(baseline):")
+        for r in regressions { print("  " + r) }
+        throw NSError(
+            domain: "BuildImagePlugin", code: 1,
+            userInfo: [NSLocalizedDescriptionKey: "\(regressions.count) benchmark regressions"])
     }
+    print("No regressions against \(baseline) (tolerance \(Int(tolerance * 100))%)")
 }
@@ -0,0 +1,154 @@
+/*
+ * console.c
+ * Buffered serial console on COM1
+ *
+ * Output is queued in a ring and moved to the UART sixteen bytes at a time
+ * (the FIFO serial_init enables). Every write tops up the FIFO if the
+ * transmitter is already empty, without waiting; whatever is left is drained
+ * by the TX-empty interrupt, routed through the IOAPIC once console_irq_init
+ * has run. A writer only spins when the ring itself is full.
+ *
+ * console_panic switches to polled output for good: the ring is flushed so
+ * earlier messages keep their order, and from then on bytes go straight to
+ * the UART without taking the lock.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "CSupport.h"
+
+#define COM1 0x3F8
+#define UART_IER (COM1 + 1)
+#define UART_IIR (COM1 + 2)
+#define UART_LSR (COM1 + 5)
+#define UART_IER_THRI 0x02
+#define UART_LSR_THRE 0x20
+#define UART_FIFO_SIZE 16
+#define COM1_ISA_IRQ 4
+
+#define CONSOLE_RING_SIZE 65536 // power of two
+
+static uint8_t ring[CONSOLE_RING_SIZE];
+// Free-running indexes; the ring holds [tail, head).
+static volatile uint32_t head, tail;
+static volatile int lock;
+static int irq_enabled;
+static int tx_irq_armed;
+static volatile int panicking;
+
+static void lock_acquire(void) {
+  while (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE))
+    __asm__ volatile("pause");
+}
+
+static void lock_release(void) { __atomic_clear(&lock, __ATOMIC_RELEASE); }
+
+static void putc_polled(uint8_t c) {
+  while (!(inb(UART_LSR) & UART_LSR_THRE))
+    ;
+  outb(COM1, c);
+}
+
+// Move up to a FIFO's worth of queued bytes if the transmitter is empty.
+// Returns whether the UART could take data. Called with the lock held.
+static int fill_fifo(void) {
+  if (!(inb(UART_LSR) & UART_LSR_THRE))
+    return 0;
+  for (int i = 0; i < UART_FIFO_SIZE && tail != head; i++) {
+    outb(COM1, ring[tail & (CONSOLE_RING_SIZE - 1)]);
+    tail++;
+  }
+  return 1;
+}
+
+// Keep the TX-empty interrupt enabled exactly while bytes are queued.
+static void update_tx_irq(void) {
+  if (!irq_enabled)
+    return;
+  int want = head != tail;
+  if (want != tx_irq_armed) {
+    outb(UART_IER, want ? UART_IER_THRI : 0);
+    tx_irq_armed = want;
+  }
+}
+
+void console_write(const uint8_t *buf, size_t len) {
+  if (panicking) {
+    for (size_t i = 0; i < len; i++)
+      putc_polled(buf[i]);
+    return;
+  }
+  lock_acquire();
+  for (size_t i = 0; i < len; i++) {
+    // Ring full: make room the slow way.
+    while (head - tail == CONSOLE_RING_SIZE) {
+      while (!fill_fifo())
+        __asm__ volatile("pause");
+    }
+    ring[head & (CONSOLE_RING_SIZE - 1)] = buf[i];
+    head++;
+  }
+  fill_fifo();
+  update_tx_irq();
+  lock_release();
+}
+
+void serial_putc(uint8_t c) { console_write(&c, 1); }
+
+void serial_print(const char *s) {
+  size_t n = 0;
+  while (s[n])
+    n++;
+  console_write((const uint8_t *)s, n);
+}
+
+void console_flush(void) {
+  if (panicking)
+    return;
+  lock_acquire();
+  while (tail != head) {
+    while (!fill_fifo())
+      __asm__ volatile("pause");
+  }
+  update_tx_irq();
+  lock_release();
+}
+
+void console_panic(void) {
+  if (panicking)
+    return;
+  // The lock holder may be the code that faulted; don't wait for it.
+  for (int spins = 0; spins < 1000000 && __atomic_load_n(&lock, __ATOMIC_RELAXED);
+       spins++)
+    __asm__ volatile("pause");
+  while (tail != head) {
+    putc_polled(ring[tail & (CONSOLE_RING_SIZE - 1)]);
+    tail++;
+  }
+  outb(UART_IER, 0);
+  panicking = 1;
+}
+
+static void console_irq(uint64_t vector) {
+  (void)vector;
+  if (panicking)
+    return;
+  inb(UART_IIR); // acknowledge
+  lock_acquire();
+  fill_fifo();
+  update_tx_irq();
+  lock_release();
+}
+
+void console_irq_init(void) {
+  if (irq_route_isa(COM1_ISA_IRQ, console_irq) < 0) {
+    serial_print("Console: no vector, staying polled\n");
+    return;
+  }
+  lock_acquire();
+  irq_enabled = 1;
+  update_tx_irq();
+  lock_release();
+  serial_print("Console: interrupt-driven\n");
+}
@@ -0,0 +1,414 @@
+/*
+ * cpu.c
+ * Per-CPU data, GDT/TSS and application processor start-up
+ *
+ * Every CPU has a struct cpu_data that GS points at while it runs kernel
+ * code (user GS sits in KERNEL_GS_BASE and SWAPGS trades them on every
+ * entry and exit). The block holds the CPU's own GDT and TSS, the stack
+ * taken on entry from user mode (by SYSCALL through cpu_data and by
+ * interrupts through TSS.RSP0; the scheduler points both at the running
+ * thread's kernel stack) and separate IST stacks for NMI, #DF and #MC, so a
+ * fault on a bad kernel stack still has somewhere to run.
+ *
+ * APs are started with INIT-SIPI-SIPI. The SIPI vector points at a copy of
+ * ap_trampoline in low memory, which climbs from real mode to long mode on
+ * the boot page tables, switches to the page tables, control registers and
+ * stack the BSP left in its mailbox and calls ap_main. An AP that does not
+ * claim its cpu_data in time is sent INIT again and its block and stacks are
+ * freed before the next AP is given the trampoline and the index.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "CSupport.h"
+
+#define ENTRY_STACK_SIZE 65536
+#define IST_STACK_SIZE 16384
+#define IDLE_STACK_SIZE 16384
+
+#define AP_TRAMPOLINE_ADDR 0x8000 // page-aligned, below 1 MiB
+#define STR_(x) #x
+#define STR(x) STR_(x)
+#define TRAMP STR(AP_TRAMPOLINE_ADDR)
+
+struct tss {
+  uint32_t res0;
+  uint64_t rsp0;
+  uint64_t rsp1;
+  uint64_t rsp2;
+  uint64_t res1;
+  uint64_t ist[7];
+  uint64_t res2;
+  uint16_t res3;
+  uint16_t iopb;
+} __attribute__((packed));
+
+// The first fields are read by the entry stubs at fixed %gs offsets.
+struct cpu_data {
+  struct cpu_data *self;  // %gs:0
+  uint64_t kernel_rsp;    // %gs:8, top of the entry stack
+  uint64_t user_rsp;      // %gs:16, scratch for syscall_entry
+  uint32_t index;         // %gs:24
+  uint32_t apic_id;       // %gs:28
+  struct tss tss __attribute__((aligned(16)));
+  uint64_t gdt[8] __attribute__((aligned(16)));
+  uint32_t startup; // AP_PENDING, then whichever side claims it first
+};
+
+// cpu_data.startup: a late AP and a BSP that has given up on it race for
+// the block, so exactly one of them gets to use it.
+#define AP_PENDING 0
+#define AP_CLAIMED 1   // the AP got there first and owns the block
+#define AP_ABANDONED 2 // the BSP gave up; the AP must not touch it
+
+static const uint64_t gdt_template[8] = {
+    0,
+    0x00af9b000000ffff, // 0x08 kernel code
+    0x00cf93000000ffff, // 0x10 kernel data
+    0x00affb000000ffff, // 0x18 user code (32-bit slot for SYSRET)
+    0x00cff3000000ffff, // 0x20 user data
+    0x00affa000000ffff, // 0x28 user code
+    0,                  // 0x30 TSS, two slots
+    0};
+
+static struct cpu_data *cpus[MAX_CPUS];
+static volatile uint32_t online_count;
+
+// The BSP's block and stacks are static: they are needed before the heap.
+static struct cpu_data bsp_data;
+static uint8_t bsp_entry_stack[ENTRY_STACK_SIZE] __attribute__((aligned(16)));
+static uint8_t bsp_ist_stacks[3][IST_STACK_SIZE] __attribute__((aligned(16)));
+
+extern void *kernel_alloc(size_t size, size_t align);
+extern void kernel_free(void *ptr);
+extern int fpu_use_xsave;
+// Implemented in Swift (SMP.swift); does not return.
+extern void kernel_ap_main(uint32_t index);
+
+static inline void wrmsr(uint32_t msr, uint64_t v) {
+  __asm__ volatile("wrmsr"
+                   :
+                   : "c"(msr), "a"((uint32_t)v), "d"((uint32_t)(v >> 32)));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static void cpu_setup_tables(struct cpu_data *cpu, uint8_t *entry_stack,
+                             uint8_t *ist1, uint8_t *ist2, uint8_t *ist3) {
+  cpu->self = cpu;
+  cpu->kernel_rsp = (uintptr_t)entry_stack + ENTRY_STACK_SIZE;
+  cpu->tss.rsp0 = cpu->kernel_rsp;
+  cpu->tss.ist[IST_DOUBLE_FAULT - 1] = (uintptr_t)ist1 + IST_STACK_SIZE;
+  cpu->tss.ist[IST_NMI - 1] = (uintptr_t)ist2 + IST_STACK_SIZE;
+  cpu->tss.ist[IST_MACHINE_CHECK - 1] = (uintptr_t)ist3 + IST_STACK_SIZE;
+  cpu->tss.iopb = sizeof(cpu->tss);
+
+  memcpy(cpu->gdt, gdt_template, sizeof(gdt_template));
+  uint64_t base = (uintptr_t)&cpu->tss;
+  uint32_t limit = sizeof(cpu->tss) - 1;
+  cpu->gdt[6] = (limit & 0xffff) | ((base & 0xffff) << 16) |
+                ((base & 0xff0000) << 16) | (0x89ULL << 40) |
+                (((base & 0xff000000) >> 24) << 56);
+  cpu->gdt[7] = (base >> 32);
+}
+
+// Load the calling CPU's GDT, TSS and GS base.
+static void cpu_load(struct cpu_data *cpu) {
+  struct {
+    uint16_t limit;
+    uint64_t base;
+  } __attribute__((packed)) gdtr = {sizeof(cpu->gdt) - 1, (uintptr_t)cpu->gdt};
+  __asm__ volatile("lgdt %0" : : "m"(gdtr));
+  __asm__ volatile("ltr %%ax" : : "a"((uint16_t)0x30));
+  wrmsr(0xC0000101, (uintptr_t)cpu); // GS_BASE
+  wrmsr(0xC0000102, 0);              // KERNEL_GS_BASE: user GS
+}
+
+void cpu_init_bsp(void) {
+  cpu_setup_tables(&bsp_data, bsp_entry_stack, bsp_ist_stacks[0],
+                   bsp_ist_stacks[1], bsp_ist_stacks[2]);
+  bsp_data.index = 0;
+  bsp_data.apic_id = lapic_id();
+  cpu_load(&bsp_data);
+  cpus[0] = &bsp_data;
+  online_count = 1;
+  serial_print("GDT/TSS loaded\n");
+}
+
+uint32_t cpu_current_index(void) {
+  uint32_t index;
+  __asm__ volatile("movl %%gs:24, %0" : "=r"(index));
+  return index;
+}
+
+uint32_t cpu_online_count(void) {
+  return __atomic_load_n(&online_count, __ATOMIC_ACQUIRE);
+}
+
+void cpu_set_kernel_stack(uint64_t top) {
+  struct cpu_data *cpu;
+  __asm__ volatile("movq %%gs:0, %0" : "=r"(cpu));
+  cpu->kernel_rsp = top;
+  cpu->tss.rsp0 = top;
+}
+
+void cpu_send_ipi(uint32_t index, uint8_t vector) {
+  if (index < MAX_CPUS && cpus[index])
+    lapic_send_ipi(cpus[index]->apic_id, vector); // fixed, edge
+}
+
+// MARK: - TLB shootdown
+
+// One request at a time: the sender holds shootdown_lock, publishes the
+// range and the CPUs that must flush it, and spins until each has cleared
+// its bit. Targets take the IPI in user mode or while halted; in the kernel
+// (interrupts off) they pick it up from tlb_shootdown_poll in their lock
+// spins, and a sender waiting for the lock serves requests aimed at it.
+#define SHOOTDOWN_INVLPG_LIMIT (32 * 4096)
+
+static uint8_t shootdown_vector;
+static spinlock_t shootdown_lock;
+static volatile uint64_t shootdown_pending;
+static uint64_t shootdown_start, shootdown_end;
+
+void tlb_shootdown_poll(void) {
+  uint64_t bit = 1ull << cpu_current_index();
+  if (!(__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE) & bit))
+    return;
+  uint64_t start = shootdown_start, end = shootdown_end;
+  if (end == 0 || end - start > SHOOTDOWN_INVLPG_LIMIT) {
+    asm_set_cr3(asm_get_cr3());
+  } else {
+    for (uint64_t v = start; v < end; v += 4096)
+      asm_invlpg((void *)(uintptr_t)v);
+  }
+  __atomic_fetch_and(&shootdown_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+static void shootdown_irq(uint64_t vector) {
+  (void)vector;
+  tlb_shootdown_poll();
+}
+
+void tlb_shootdown_setup(void) {
+  int v = irq_alloc_vector(shootdown_irq);
+  if (v < 0) {
+    serial_print("TLB: no shootdown vector\n");
+    return;
+  }
+  shootdown_vector = (uint8_t)v;
+}
+
+void tlb_shootdown(uint64_t cpus, uint64_t start, uint64_t end) {
+  cpus &= ~(1ull << cpu_current_index());
+  uint32_t online = cpu_online_count();
+  if (online < 64)
+    cpus &= (1ull << online) - 1;
+  if (!cpus || !shootdown_vector)
+    return;
+  while (!spin_trylock(&shootdown_lock))
+    tlb_shootdown_poll();
+  shootdown_start = start;
+  shootdown_end = end;
+  __atomic_store_n(&shootdown_pending, cpus, __ATOMIC_RELEASE);
+  for (uint32_t i = 0; i < MAX_CPUS; i++)
+    if (cpus & (1ull << i))
+      cpu_send_ipi(i, shootdown_vector);
+  while (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE))
+    __asm__ volatile("pause");
+  spin_unlock(&shootdown_lock);
+}
+
+// MARK: - AP start-up
+
+// Entered in real mode with CS:IP = AP_TRAMPOLINE_ADDR >> 4 : 0. Until long
+// mode, references are to the copy, so they are written relative to
+// ap_trampoline and rebased by hand; after that they are RIP-relative. The
+// AP runs on the kernel's boot page tables (below 4 GiB, identity mapping
+// low memory, and what VMM.kernelRoot points at) and takes EFER, CR0, CR4
+// and its stack from the mailbox the BSP fills in.
+__asm__(".section .rodata\n"
+        ".global ap_trampoline\n"
+        ".global ap_trampoline_end\n"
+        ".global ap_mailbox\n"
+        ".code16\n"
+        "ap_trampoline:\n"
+        "cli\n"
+        "cld\n"
+        "xor %ax, %ax\n"
+        "mov %ax, %ds\n"
+        "lgdtl (" TRAMP " + ap_gdt_ptr - ap_trampoline)\n"
+        "mov %cr0, %eax\n"
+        "or $1, %eax\n"
+        "mov %eax, %cr0\n"
+        "ljmpl $0x08, $(" TRAMP " + ap_protected - ap_trampoline)\n"
+        ".code32\n"
+        "ap_protected:\n"
+        "mov $0x10, %ax\n"
+        "mov %ax, %ds\n"
+        "mov %ax, %es\n"
+        "mov %ax, %ss\n"
+        "mov %cr4, %eax\n"
+        "or $(1 << 5), %eax\n" // PAE
+        "mov %eax, %cr4\n"
+        "mov (" TRAMP " + ap_mailbox - ap_trampoline), %eax\n" // CR3
+        "mov %eax, %cr3\n"
+        "mov $0xC0000080, %ecx\n" // EFER as on the BSP, less LMA
+        "mov (" TRAMP " + ap_mailbox + 8 - ap_trampoline), %eax\n"
+        "and $~(1 << 10), %eax\n"
+        "xor %edx, %edx\n"
+        "wrmsr\n"
+        "mov (" TRAMP " + ap_mailbox + 16 - ap_trampoline), %eax\n" // CR0
+        "mov %eax, %cr0\n"
+        "ljmpl $0x18, $(" TRAMP " + ap_long - ap_trampoline)\n"
+        ".code64\n"
+        "ap_long:\n"
+        "mov $0x10, %ax\n"
+        "mov %ax, %ds\n"
+        "mov %ax, %es\n"
+        "mov %ax, %ss\n"
+        "mov ap_mailbox + 24(%rip), %rax\n" // CR4
+        "mov %rax, %cr4\n"
+        "mov ap_mailbox + 32(%rip), %rsp\n"
+        "mov ap_mailbox + 40(%rip), %rdi\n"
+        "mov ap_mailbox + 48(%rip), %rax\n"
+        "xor %ebp, %ebp\n"
+        "call *%rax\n"
+        "1: hlt\n"
+        "jmp 1b\n"
+        ".align 16\n"
+        "ap_gdt:\n"
+        ".quad 0\n"
+        ".quad 0x00cf9a000000ffff\n" // 0x08 32-bit code
+        ".quad 0x00cf92000000ffff\n" // 0x10 data
+        ".quad 0x00af9a000000ffff\n" // 0x18 64-bit code
+        "ap_gdt_ptr:\n"
+        ".word ap_gdt_ptr - ap_gdt - 1\n"
+        ".long " TRAMP " + ap_gdt - ap_trampoline\n"
+        ".align 8\n"
+        "ap_mailbox:\n" // struct ap_mailbox
+        ".skip 56\n"
+        "ap_trampoline_end:\n"
+        ".code64\n"
+        ".previous\n");
+
+extern const uint8_t ap_trampoline[], ap_trampoline_end[], ap_mailbox[];
+extern uint8_t p4_table[];
+
+struct ap_mailbox {
+  uint64_t cr3;
+  uint64_t efer;
+  uint64_t cr0;
+  uint64_t cr4;
+  uint64_t stack;
+  uint64_t cpu;
+  uint64_t entry;
+};
+
+static void ap_main(struct cpu_data *cpu) {
+  uint32_t pending = AP_PENDING;
+  if (!__atomic_compare_exchange_n(&cpu->startup, &pending, AP_CLAIMED, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    // Too late: the BSP has moved on and will INIT this CPU.
+    for (;;)
+      __asm__ volatile("cli\nhlt");
+  }
+  cpu_load(cpu);
+  idt_load();
+  lapic_init_cpu();
+  setup_syscall_msrs();
+  // XCR0 is per CPU; CR4.OSXSAVE came over with the BSP's CR4.
+  if (fpu_use_xsave) {
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    __asm__ volatile("xsetbv" : : "a"(lo | 0x7), "d"(hi), "c"(0));
+  }
+  // CR0 and CR4 came from the BSP after VMM.setup. Without WP kernel
+  // writes go straight through copy-on-write pages; without PCIDE the first
+  // switch to a tagged CR3 faults.
+  if (!(asm_get_cr0() & (1u << 16)) ||
+      ((cpu_features & CPU_FEATURE_PCID) && !(asm_get_cr4() & (1u << 17)))) {
+    console_panic();
+    serial_print("AP: CR0.WP or CR4.PCIDE not set\n");
+    for (;;)
+      __asm__ volatile("cli\nhlt");
+  }
+  __atomic_add_fetch(&online_count, 1, __ATOMIC_RELEASE);
+  kernel_ap_main(cpu->index);
+}
+
+// Busy-wait on PIT channel 2 (1.193182 MHz), which needs no calibration.
+void pit_delay_us(uint32_t us) {
+  uint64_t ticks = (uint64_t)us * 1193182 / 1000000 + 1;
+  while (ticks) {
+    uint16_t n = ticks > 0xFFFF ? 0xFFFF : (uint16_t)ticks;
+    ticks -= n;
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x02) | 0x01); // gate on, speaker off
+    outb(0x43, 0xB0);                  // channel 2, lo/hi, mode 0
+    outb(0x42, n & 0xFF);
+    outb(0x42, n >> 8);
+    while (!(inb(0x61) & 0x20)) // OUT2 rises at terminal count
+      __asm__ volatile("pause");
+  }
+}
+
+int cpu_start_ap(uint32_t index, uint32_t apic_id) {
+  if (index == 0 || index >= MAX_CPUS)
+    return 0;
+  struct cpu_data *cpu = kernel_alloc(sizeof(struct cpu_data), 64);
+  uint8_t *stacks = kernel_alloc(
+      ENTRY_STACK_SIZE + 3 * IST_STACK_SIZE + IDLE_STACK_SIZE, 4096);
+  memset(cpu, 0, sizeof(*cpu));
+  cpu_setup_tables(cpu, stacks, stacks + ENTRY_STACK_SIZE,
+                   stacks + ENTRY_STACK_SIZE + IST_STACK_SIZE,
+                   stacks + ENTRY_STACK_SIZE + 2 * IST_STACK_SIZE);
+  cpu->index = index;
+  cpu->apic_id = apic_id;
+  cpus[index] = cpu;
+
+  uint8_t *tramp = (uint8_t *)(uintptr_t)AP_TRAMPOLINE_ADDR;
+  memcpy(tramp, ap_trampoline, ap_trampoline_end - ap_trampoline);
+  struct ap_mailbox *mb =
+      (struct ap_mailbox *)(tramp + (ap_mailbox - ap_trampoline));
+  // CR3[11:0] is zero, as loading a CR4 with PCIDE set requires.
+  mb->cr3 = (uintptr_t)p4_table;
+  mb->efer = rdmsr(0xC0000080);
+  mb->cr0 = asm_get_cr0();
+  mb->cr4 = asm_get_cr4();
+  mb->stack = (uintptr_t)stacks + ENTRY_STACK_SIZE + 3 * IST_STACK_SIZE +
+              IDLE_STACK_SIZE;
+  mb->cpu = (uintptr_t)cpu;
+  mb->entry = (uintptr_t)ap_main;
+  asm_memory_fence();
+
+  lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+  pit_delay_us(10000);
+  for (int i = 0; i < 2; i++) {
+    lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_ADDR >> 12));
+    pit_delay_us(200);
+  }
+  // Give it up to 100 ms to reach ap_main.
+  for (int i = 0; i < 1000; i++) {
+    if (__atomic_load_n(&cpu->startup, __ATOMIC_ACQUIRE) != AP_PENDING)
+      break;
+    pit_delay_us(100);
+  }
+  uint32_t pending = AP_PENDING;
+  if (!__atomic_compare_exchange_n(&cpu->startup, &pending, AP_ABANDONED, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return 1; // claimed, if only just: the index and block are its
+  // Hold the CPU in wait-for-SIPI wherever it got to, so it can neither
+  // run on the stacks freed here nor pick up the next AP's mailbox.
+  lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+  pit_delay_us(10000);
+  cpus[index] = 0;
+  kernel_free(stacks);
+  kernel_free(cpu);
+  return 0;
+}
@@ -2,21 +2,39 @@
 #include <stdint.h>
 
 void serial_init(void);
+void outb(uint16_t port, uint8_t v);
+uint8_t inb(uint16_t port);
+
+// Console (console.c). Output is buffered and drained by the UART interrupt
+// once console_irq_init has run.
 void serial_putc(uint8_t c);
-void setup_gdt_tss(uint64_t kstack);
+void serial_print(const char *s);
+void console_write(const uint8_t *buf, size_t len);
+// Wait until everything queued has reached the UART.
+void console_flush(void);
+// Flush and switch to polled, lock-free output for the rest of the run.
+void console_panic(void);
+void console_irq_init(void);
 void setup_syscall_msrs(void);
 void setup_idt(void);
+// Load the shared IDT on the calling CPU.
+void idt_load(void);
 void enable_fsgsbase(void);
 void jump_to_user(uint64_t rip, uint64_t rsp);
+// Enter user mode with rdi..r9 set from args[0..5].
+void jump_to_user_args(uint64_t rip, uint64_t rsp, const uint64_t *args);
 void asm_hlt(void);
 uint32_t pci_config_read(uint8_t b, uint8_t s, uint8_t f, uint8_t o);
 void *memcpy(void *dest, const void *src, size_t n);
 void *memset(void *s, int c, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
 uint64_t get_stack_top(void);
+uint64_t get_kernel_end(void);
 void pci_config_write(uint8_t b, uint8_t s, uint8_t f, uint8_t o, uint32_t v);
 void asm_pause(void);
 void asm_volatile_barrier(void);
+void asm_memory_fence(void);
 
 struct cpio_newc_header {
   unsigned char c_magic[6];
@@ -35,7 +53,166 @@ struct cpio_newc_header {
   unsigned char c_check[8];
 };
 
+uint64_t asm_get_cr0(void);
+void asm_set_cr0(uint64_t cr0);
 uint64_t asm_get_cr3(void);
 void asm_set_cr3(uint64_t cr3);
 void asm_invlpg(void *addr);
+uint64_t asm_get_cr4(void);
+void asm_set_cr4(uint64_t cr4);
+// type: 0 = address, 1 = single context, 2 = all incl. global, 3 = all
+void asm_invpcid(uint64_t type, uint64_t pcid, uint64_t addr);
 void asm_wrmsr(uint32_t msr, uint64_t v);
+uint64_t asm_rdtsc(void);
+
+// Device interrupts (MSI/MSI-X through the local APIC)
+typedef void (*irq_handler_t)(uint64_t vector);
+void irq_init(void);
+// Returns the IDT vector now routed to `handler`, or -1 if none are left.
+int irq_alloc_vector(irq_handler_t handler);
+// Route a legacy ISA interrupt through the IOAPIC to `handler`. Returns the
+// vector, or -1 if none are left.
+int irq_route_isa(uint8_t irq, irq_handler_t handler);
+// Message address that targets the boot CPU's local APIC.
+uint64_t irq_msi_address(void);
+// Enable the calling CPU's local APIC.
+void lapic_init_cpu(void);
+uint32_t lapic_id(void);
+#define LAPIC_ICR_INIT 0x4500    // INIT, level assert
+#define LAPIC_ICR_STARTUP 0x4600 // SIPI; OR in the start page number
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low);
+// Periodic interrupts on `vector` at `hz` on the calling CPU. The first call
+// calibrates the timer against the PIT.
+void lapic_timer_start(uint8_t vector, uint32_t hz);
+void pit_delay_us(uint32_t us);
+// Enable interrupts just long enough to halt until the next one.
+void asm_wait_for_interrupt(void);
+
+// CPU feature bits detected once at boot by cpu_features_init()
+#define CPU_FEATURE_ERMS 0x1u
+#define CPU_FEATURE_FSRM 0x2u
+#define CPU_FEATURE_AVX2 0x4u
+#define CPU_FEATURE_PCID 0x8u
+#define CPU_FEATURE_INVPCID 0x10u
+#define CPU_FEATURE_INVARIANT_TSC 0x20u
+
+extern uint32_t cpu_features;
+void cpu_features_init(void);
+void asm_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *regs);
+
+// Per-CPU state (cpu.c). GS points at the running CPU's block in the kernel.
+#define MAX_CPUS 64
+// IST slots in every CPU's TSS
+#define IST_DOUBLE_FAULT 1
+#define IST_NMI 2
+#define IST_MACHINE_CHECK 3
+
+// Set up and load the boot CPU's GDT, TSS and per-CPU block.
+void cpu_init_bsp(void);
+// Start the AP with `apic_id` as CPU `index`. Returns 1 once it is running.
+int cpu_start_ap(uint32_t index, uint32_t apic_id);
+uint32_t cpu_current_index(void);
+uint32_t cpu_online_count(void);
+// Stack taken on the next entry from user mode (SYSCALL and TSS.RSP0).
+void cpu_set_kernel_stack(uint64_t top);
+void cpu_send_ipi(uint32_t index, uint8_t vector);
+// TLB shootdown (cpu.c): allocate the IPI vector; flush [start, end) (or, if
+// end is 0, everything non-global) on every CPU in `cpus` other than the
+// caller and wait until they have; and run any flush asked of this CPU.
+// Code that spins with interrupts off must poll, or a sender waits forever.
+void tlb_shootdown_setup(void);
+void tlb_shootdown(uint64_t cpus, uint64_t start, uint64_t end);
+void tlb_shootdown_poll(void);
+
+// Locks (sched.c)
+typedef struct {
+  volatile uint32_t locked;
+} spinlock_t;
+void spin_lock(spinlock_t *l);
+int spin_trylock(spinlock_t *l);
+void spin_unlock(spinlock_t *l);
+// The kernel lock: recursive on the owning CPU.
+void kernel_lock(void);
+// Take the kernel lock only if no other CPU holds it; returns 1 if taken.
+int kernel_trylock(void);
+void kernel_unlock(void);
+// Release the kernel lock entirely if this CPU holds it; returns the depth
+// to hand to kernel_lock_retake.
+uint32_t kernel_lock_drop(void);
+void kernel_lock_retake(uint32_t depth);
+
+// Thread switching (sched.c). A new thread's stack, prepared by
+// thread_init_stack, starts in kernel_thread_start (Swift).
+void thread_switch(uint64_t *save_rsp, uint64_t next_rsp,
+                   volatile uint64_t *old_on_cpu);
+uint64_t thread_init_stack(uint64_t top);
+
+// Large enough for XSAVE of x87, SSE and AVX; must be 64-byte aligned.
+#define FPU_AREA_SIZE 1024
+void fpu_init_area(void *area);
+void fpu_save(void *area);
+void fpu_restore(const void *area);
+// Save the FPU state to old_fpu, load new_fpu, then thread_switch.
+void context_switch(uint64_t *save_rsp, uint64_t next_rsp,
+                    volatile uint64_t *old_on_cpu, void *old_fpu,
+                    const void *new_fpu);
+
+// Event trace (trace.c): a lock-free ring of trace_records per CPU.
+#define TRACE_MAGIC "SWTRACE1"
+#define TRACE_SERIAL_BEGIN "=== SWTRACE BEGIN ==="
+#define TRACE_SERIAL_END "=== SWTRACE END ==="
+#define TRACE_SERIAL_LINE 32 // bytes of trace per hex line
+
+struct trace_header {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t ncpu;
+  uint64_t tsc_hz;
+  uint64_t count; // records that follow
+};
+
+struct trace_record {
+  uint64_t tsc;
+  uint16_t event;
+  uint16_t cpu;
+  uint32_t tid;
+  uint64_t arg0;
+  uint64_t arg1;
+};
+
+// Nonzero while events are recorded.
+extern volatile uint32_t trace_enabled;
+// Give CPU `cpu` a ring of `capacity` records (a power of two).
+void trace_attach(uint32_t cpu, void *buffer, uint64_t capacity);
+// The thread id stamped on this CPU's records from now on.
+void trace_set_thread(uint64_t tid);
+void trace_event(uint32_t event, uint64_t arg0, uint64_t arg1);
+// Copy bytes [offset, offset + len) of the serialized trace to dst, cut to
+// the whole records that fit in `limit` bytes; returns the cut stream's size,
+// which is all it does when dst is null.
+size_t trace_serialize(uint8_t *dst, size_t offset, size_t len, size_t limit,
+                       uint64_t tsc_hz);
+// Hex-encode the trace to the console between marker lines, serializing it
+// through buf a window of `capacity` bytes at a time.
+void trace_dump_serial(uint8_t *buf, size_t capacity, uint64_t tsc_hz);
+
+// KASAN (kasan.c). Shadow byte for address A: (A >> 3) + KASAN_SHADOW_OFFSET.
+#define KASAN_SHADOW_OFFSET 0xFFFFE00000000000ull
+#define KASAN_GRANULE 8
+// Shadow tags for poisoned granules
+#define KASAN_PAGE_REDZONE 0xFE // past the end of a large allocation
+#define KASAN_SLAB_REDZONE 0xFC // past the end of a slab object
+#define KASAN_FREED 0xFB        // freed (in quarantine or on a free list)
+#define KASAN_SLAB_FREE 0xFA    // slab object never handed out
+// Mark [addr, addr + size) inaccessible; addr is granule aligned and size
+// is rounded up to a granule. Callers serialize (the heap lock).
+void kasan_poison(void *addr, size_t size, uint8_t tag);
+// Mark [addr, addr + size) accessible; addr is granule aligned.
+void kasan_unpoison(void *addr, size_t size);
+// Report a free of memory that is already freed.
+void kasan_check_free(void *addr);
+// Page fault on the shadow that was only a stale TLB entry; returns 1 if so.
+int kasan_fault(uint64_t addr, uint64_t error);
+// Unchecked 8-byte access, for heap metadata inside poisoned objects.
+uint64_t kasan_peek(uint64_t addr);
+void kasan_poke(uint64_t addr, uint64_t value);
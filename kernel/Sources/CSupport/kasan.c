@@ -2,90 +2,231 @@
  * kasan.c
  * Kernel Address Sanitizer Runtime
  *
- * Implements the __asan_load/store hooks emitted by the compiler.
- * Uses a shadow memory bitmap where each byte tracks the state of 8 bytes of
- * real memory. 0 = good, non-zero = poisoned.
+ * With KASAN=1 the Swift kernel is built with -sanitize=address, mapped so
+ * the shadow byte for address A is at (A >> 3) + KASAN_SHADOW_OFFSET: 0 if
+ * all 8 bytes of its granule are addressable, k if only the first k are,
+ * and a negative KASAN_* tag if none are. The compiler checks the shadow
+ * inline and calls __asan_report_* on a hit; with KASAN=outline it calls
+ * the __asan_load/store hooks below for every access instead.
+ *
+ * boot.S maps the shadow of the whole lower half to one read-only zero
+ * page, so everything reads as addressable until marked otherwise. Only the
+ * heap marks memory (redzones, freed objects), and the first time it
+ * touches a shadow page kasan_poison and kasan_unpoison swap in a frame of
+ * its own from PMM. Another CPU may still have the zero page in its TLB for
+ * that address; kasan_fault recognises the resulting write fault.
+ *
+ * C code is not instrumented, so its accesses go unchecked; the heap uses
+ * kasan_peek/kasan_poke to reach its free-list links inside poisoned
+ * objects.
  */
 
 #include <stddef.h>
 #include <stdint.h>
 
-// KASAN Shadow Offset
-// For x86_64, a common offset is 0xdffffc0000000000
-// But we need to tailor this to our kernel memory map.
-// Let's assume a simpler offset for now if we can, or just stick to the
-// standard one if we map it high.
-#define KASAN_SHADOW_OFFSET 0xdffffc0000000000ULL
+#include "CSupport.h"
 
-static inline int8_t *kasan_mem_to_shadow(const void *addr) {
-  return (int8_t *)((((uintptr_t)addr) >> 3) + KASAN_SHADOW_OFFSET);
-}
+#ifdef KASAN
 
-void kasan_report(uintptr_t addr, size_t size, int is_write, uintptr_t ip);
+#define KASAN_SHADOW_SIZE (1ull << 44) // shadow of the 128 TB lower half
+// Memory whose shadow kasan.c can populate: the identity map.
+#define KASAN_POPULATE_LIMIT (8ull << 30)
+#define PTE_P 0x1ull
+#define PTE_RW 0x2ull
+#define PTE_ADDR 0x000FFFFFFFFFF000ull
 
-// External kernel print helper
-void serial_putc(char c);
+extern uint64_t kasan_zero_pt[512], kasan_low_pd[512]; // boot.S
+extern uint64_t kasan_alloc_frame(void); // PMM, zeroed; 0 when out of memory
 
-void print_hex64(uint64_t val) {
-  char hex[] = "0123456789ABCDEF";
-  for (int i = 60; i >= 0; i -= 4) {
-    serial_putc(hex[(val >> i) & 0xF]);
+static inline int8_t *kasan_mem_to_shadow(uintptr_t addr) {
+  return (int8_t *)((addr >> 3) + KASAN_SHADOW_OFFSET);
+}
+
+static const char *tag_name(int8_t tag) {
+  switch ((uint8_t)tag) {
+  case KASAN_PAGE_REDZONE:
+    return "heap-out-of-bounds (large)";
+  case KASAN_SLAB_REDZONE:
+    return "heap-out-of-bounds";
+  case KASAN_FREED:
+    return "use-after-free";
+  case KASAN_SLAB_FREE:
+    return "use of unallocated memory";
+  default:
+    return "out-of-bounds";
   }
 }
 
-void kasan_report(uintptr_t addr, size_t size, int is_write, uintptr_t ip) {
-  char msg1[] = "\nKASAN: Use-after-free or out-of-bounds access\n";
-  char *p = msg1;
-  while (*p)
-    serial_putc(*p++);
+static void print_hex64(uint64_t val) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (int i = 60; i >= 0; i -= 4)
+    serial_putc(hex[(val >> i) & 0xF]);
+}
 
-  char msg2[] = "Addr: ";
-  p = msg2;
-  while (*p)
-    serial_putc(*p++);
+static void report(const char *what, const char *access, uintptr_t addr,
+                   size_t size, uintptr_t ip) {
+  console_panic();
+  serial_print("\nKASAN: ");
+  serial_print(what);
+  serial_print(access);
+  print_hex64(size);
+  serial_print(" bytes at ");
   print_hex64(addr);
-
-  char msg3[] = " IP: ";
-  p = msg3;
-  while (*p)
-    serial_putc(*p++);
+  serial_print(" IP: ");
   print_hex64(ip);
-
+  serial_print(" shadow: ");
+  print_hex64((uint8_t)*kasan_mem_to_shadow(addr));
   serial_putc('\n');
   while (1) {
     __asm__ volatile("hlt");
   }
 }
 
-void __asan_loadN_noabort(uintptr_t addr, size_t size) {
-  int8_t *shadow = kasan_mem_to_shadow((void *)addr);
-  int8_t val = *shadow;
-  if (val != 0) {
-    // Slow path check
-    // If val > 0, strict check first k bytes
-    if ((int8_t)((addr & 7) + size) >= val) {
-      kasan_report(addr, size, 0, (uintptr_t)__builtin_return_address(0));
-    }
+static void kasan_report(uintptr_t addr, size_t size, int is_write,
+                         uintptr_t ip) {
+  report(tag_name(*kasan_mem_to_shadow(addr)),
+         is_write ? "\nWrite of " : "\nRead of ", addr, size, ip);
+}
+
+// First byte of [addr, addr + size) that is not addressable, or 0.
+static uintptr_t first_bad(uintptr_t addr, size_t size) {
+  if (size == 0)
+    return 0;
+  uintptr_t last = addr + size - 1;
+  for (uintptr_t g = addr & ~7ull; g <= last; g += 8) {
+    int8_t s = *kasan_mem_to_shadow(g);
+    if (s == 0)
+      continue;
+    uintptr_t lo = g < addr ? addr : g;
+    uintptr_t hi = last < g + 7 ? last : g + 7;
+    if (s < 0)
+      return lo;
+    if ((int8_t)(hi & 7) >= s)
+      return g + s > lo ? g + s : lo;
   }
+  return 0;
 }
 
-void __asan_storeN_noabort(uintptr_t addr, size_t size) {
-  int8_t *shadow = kasan_mem_to_shadow((void *)addr);
-  int8_t val = *shadow;
-  if (val != 0) {
-    if ((int8_t)((addr & 7) + size) >= val) {
-      kasan_report(addr, size, 1, (uintptr_t)__builtin_return_address(0));
-    }
+static inline void check(uintptr_t addr, size_t size, int is_write,
+                         uintptr_t ip) {
+  uintptr_t bad = first_bad(addr, size);
+  if (bad)
+    kasan_report(bad, size, is_write, ip);
+}
+
+// MARK: Shadow pages
+
+// The shadow PTE for `shadow`, giving its shadow page table a frame of its
+// own first if `populate`. Null outside the populated range or on OOM.
+static uint64_t *shadow_pte(uintptr_t shadow, int populate) {
+  uint64_t off = shadow - KASAN_SHADOW_OFFSET;
+  if (off >= (KASAN_POPULATE_LIMIT >> 3))
+    return 0;
+  uint64_t *pde = &kasan_low_pd[off >> 21];
+  uint64_t *pt = (uint64_t *)(*pde & PTE_ADDR);
+  if (pt == kasan_zero_pt) {
+    if (!populate)
+      return 0;
+    uint64_t frame = kasan_alloc_frame();
+    if (!frame)
+      return 0;
+    pt = (uint64_t *)frame;
+    for (int i = 0; i < 512; i++)
+      pt[i] = kasan_zero_pt[i];
+    *pde = frame | PTE_P | PTE_RW;
+  }
+  return &pt[(off >> 12) & 511];
+}
+
+// Give the shadow pages of [start, end) frames of their own.
+static int populate(uintptr_t start, uintptr_t end) {
+  for (uintptr_t s = start & ~0xFFFull; s < end; s += 4096) {
+    uint64_t *pte = shadow_pte(s, 1);
+    if (!pte)
+      return 0;
+    if (*pte & PTE_RW)
+      continue;
+    uint64_t frame = kasan_alloc_frame();
+    if (!frame)
+      return 0;
+    *pte = frame | PTE_P | PTE_RW;
+    __asm__ volatile("invlpg (%0)" : : "r"(s) : "memory");
   }
+  return 1;
+}
+
+// Shadow (and so the populated frames) for [addr, addr + size).
+static int8_t *shadow_range(uintptr_t addr, size_t size) {
+  int8_t *start = kasan_mem_to_shadow(addr);
+  int8_t *end = kasan_mem_to_shadow(addr + size + 7);
+  if (!populate((uintptr_t)start, (uintptr_t)end))
+    return 0;
+  return start;
+}
+
+void kasan_poison(void *addr, size_t size, uint8_t tag) {
+  size = (size + 7) & ~7ull;
+  int8_t *s = shadow_range((uintptr_t)addr, size);
+  if (s)
+    memset(s, tag, size >> 3);
 }
 
-// Fixed size hooks
+void kasan_unpoison(void *addr, size_t size) {
+  int8_t *s = shadow_range((uintptr_t)addr, size);
+  if (!s)
+    return;
+  memset(s, 0, size >> 3);
+  if (size & 7)
+    s[size >> 3] = (int8_t)(size & 7);
+}
+
+void kasan_check_free(void *addr) {
+  if (*kasan_mem_to_shadow((uintptr_t)addr) == (int8_t)KASAN_FREED)
+    report("double-free", "\nFree of ", (uintptr_t)addr, 0,
+           (uintptr_t)__builtin_return_address(0));
+}
+
+int kasan_fault(uint64_t addr, uint64_t error) {
+  if (addr - KASAN_SHADOW_OFFSET >= KASAN_SHADOW_SIZE || !(error & 2))
+    return 0;
+  // Stale zero-page TLB entry for a shadow page another CPU populated.
+  uint64_t *pte = shadow_pte(addr, 0);
+  if (!pte || !(*pte & PTE_RW))
+    return 0;
+  __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+  return 1;
+}
+
+// MARK: Compiler hooks
+
+#define IP ((uintptr_t)__builtin_return_address(0))
+
+void __asan_loadN_noabort(uintptr_t addr, size_t size) {
+  check(addr, size, 0, IP);
+}
+void __asan_storeN_noabort(uintptr_t addr, size_t size) {
+  check(addr, size, 1, IP);
+}
+void __asan_report_load_n_noabort(uintptr_t addr, size_t size) {
+  kasan_report(addr, size, 0, IP);
+}
+void __asan_report_store_n_noabort(uintptr_t addr, size_t size) {
+  kasan_report(addr, size, 1, IP);
+}
+
+// Out-of-line checks (KASAN=outline) and the reports inline checks call.
 #define DEFINE_ASAN_LOAD_STORE(size)                                           \
   void __asan_load##size##_noabort(uintptr_t addr) {                           \
-    __asan_loadN_noabort(addr, size);                                          \
+    check(addr, size, 0, IP);                                                  \
   }                                                                            \
   void __asan_store##size##_noabort(uintptr_t addr) {                          \
-    __asan_storeN_noabort(addr, size);                                         \
+    check(addr, size, 1, IP);                                                  \
+  }                                                                            \
+  void __asan_report_load##size##_noabort(uintptr_t addr) {                    \
+    kasan_report(addr, size, 0, IP);                                           \
+  }                                                                            \
+  void __asan_report_store##size##_noabort(uintptr_t addr) {                   \
+    kasan_report(addr, size, 1, IP);                                           \
   }
 
 DEFINE_ASAN_LOAD_STORE(1)
@@ -94,13 +235,31 @@ DEFINE_ASAN_LOAD_STORE(4)
 DEFINE_ASAN_LOAD_STORE(8)
 DEFINE_ASAN_LOAD_STORE(16)
 
+// memcpy and friends on instrumented memory come here.
+void *__asan_memcpy(void *dst, const void *src, size_t n) {
+  check((uintptr_t)src, n, 0, IP);
+  check((uintptr_t)dst, n, 1, IP);
+  return memcpy(dst, src, n);
+}
+void *__asan_memmove(void *dst, const void *src, size_t n) {
+  check((uintptr_t)src, n, 0, IP);
+  check((uintptr_t)dst, n, 1, IP);
+  return memmove(dst, src, n);
+}
+void *__asan_memset(void *dst, int c, size_t n) {
+  check((uintptr_t)dst, n, 1, IP);
+  return memset(dst, c, n);
+}
+
+// Stack and globals are not instrumented (-asan-stack=0, -asan-globals=0),
+// and module constructors never run.
 void __asan_handle_no_return(void) {}
-void __asan_before_dynamic_init(const char *module_name) {}
-void __asan_after_dynamic_init(void) {}
-
-// Global init - called manually
-void kasan_init(void) {
-  // Map shadow memory... This needs to be done in boot.S really
-  // Or we assume it's mapped.
-  // We should at least unpoison the kernel code/data segments.
+void __asan_init(void) {}
+void __asan_version_mismatch_check_v8(void) {}
+
+#endif // KASAN
+
+uint64_t kasan_peek(uint64_t addr) { return *(volatile uint64_t *)addr; }
+void kasan_poke(uint64_t addr, uint64_t value) {
+  *(volatile uint64_t *)addr = value;
 }
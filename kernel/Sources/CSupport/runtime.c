@@ -1,6 +1,9 @@
+#include <immintrin.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "CSupport.h"
+
 void outb(uint16_t p, uint8_t v) {
   __asm__ volatile("outb %0, %1" : : "a"(v), "dN"(p));
 }
@@ -21,50 +24,305 @@ void serial_init(void) {
   outb(0x3F8 + 4, 0x0B); // IRQs enabled, RTS/DSR set
 }
 
-void serial_putc(uint8_t c) {
-  while (!(inb(0x3f8 + 5) & 0x20))
-    ;
-  outb(0x3f8, c);
+// ========================= CPU features =========================
+uint32_t cpu_features;
+
+void asm_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *regs) {
+  __asm__ volatile("cpuid"
+                   : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+                   : "a"(leaf), "c"(subleaf));
 }
 
-void serial_print(const char *s) {
-  while (*s)
-    serial_putc(*s++);
+// ========================= mem* =========================
+// Copies below 16 bytes use overlapping scalar moves, medium sizes use
+// SSE2 (or AVX2 once enabled) and large ones use rep movsb/stosb when the CPU
+// advertises ERMS. The vector width and rep thresholds are picked once by
+// cpu_features_init(); until then the SSE2 baseline is used.
+
+#define MEM_REP_THRESHOLD_ERMS 2048
+#define MEM_REP_THRESHOLD_FSRM 256
+
+static size_t memcpy_rep_threshold = SIZE_MAX;
+static size_t memset_rep_threshold = SIZE_MAX;
+static int mem_use_avx2;
+
+static inline __attribute__((always_inline)) void
+copy_small(unsigned char *d, const unsigned char *s, size_t n) {
+  // Both halves are loaded before anything is stored, so this is also safe
+  // for overlapping memmove.
+  if (n >= 8) {
+    uint64_t a, b;
+    __builtin_memcpy(&a, s, 8);
+    __builtin_memcpy(&b, s + n - 8, 8);
+    __builtin_memcpy(d, &a, 8);
+    __builtin_memcpy(d + n - 8, &b, 8);
+  } else if (n >= 4) {
+    uint32_t a, b;
+    __builtin_memcpy(&a, s, 4);
+    __builtin_memcpy(&b, s + n - 4, 4);
+    __builtin_memcpy(d, &a, 4);
+    __builtin_memcpy(d + n - 4, &b, 4);
+  } else if (n > 0) {
+    unsigned char a = s[0], b = s[n >> 1], c = s[n - 1];
+    d[0] = a;
+    d[n >> 1] = b;
+    d[n - 1] = c;
+  }
 }
 
-void *memset(void *s, int c, size_t n) {
-  unsigned char *p = s;
-  while (n--)
-    *p++ = (unsigned char)c;
-  return s;
+static void copy_rep(void *d, const void *s, size_t n) {
+  __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+// n >= 16. The tail is loaded up front so the forward loop is also valid for
+// memmove with dest < src.
+static void copy_fwd_sse2(unsigned char *d, const unsigned char *s, size_t n) {
+  __m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(s + i + 32));
+    __m128i e = _mm_loadu_si128((const __m128i *)(s + i + 48));
+    _mm_storeu_si128((__m128i *)(d + i), a);
+    _mm_storeu_si128((__m128i *)(d + i + 16), b);
+    _mm_storeu_si128((__m128i *)(d + i + 32), c);
+    _mm_storeu_si128((__m128i *)(d + i + 48), e);
+  }
+  for (; i + 16 <= n; i += 16)
+    _mm_storeu_si128((__m128i *)(d + i),
+                     _mm_loadu_si128((const __m128i *)(s + i)));
+  _mm_storeu_si128((__m128i *)(d + n - 16), tail);
+}
+
+// n >= 32.
+__attribute__((target("avx2"))) static void
+copy_fwd_avx2(unsigned char *d, const unsigned char *s, size_t n) {
+  __m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+  size_t i = 0;
+  for (; i + 128 <= n; i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(s + i + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i *)(s + i + 96));
+    _mm256_storeu_si256((__m256i *)(d + i), a);
+    _mm256_storeu_si256((__m256i *)(d + i + 32), b);
+    _mm256_storeu_si256((__m256i *)(d + i + 64), c);
+    _mm256_storeu_si256((__m256i *)(d + i + 96), e);
+  }
+  for (; i + 32 <= n; i += 32)
+    _mm256_storeu_si256((__m256i *)(d + i),
+                        _mm256_loadu_si256((const __m256i *)(s + i)));
+  _mm256_storeu_si256((__m256i *)(d + n - 32), tail);
+}
+
+// n >= 16, dest > src. Mirror of copy_fwd_sse2 walking down from the end.
+static void copy_bwd_sse2(unsigned char *d, const unsigned char *s, size_t n) {
+  __m128i head = _mm_loadu_si128((const __m128i *)s);
+  size_t i = n;
+  for (; i >= 16; i -= 16)
+    _mm_storeu_si128((__m128i *)(d + i - 16),
+                     _mm_loadu_si128((const __m128i *)(s + i - 16)));
+  _mm_storeu_si128((__m128i *)d, head);
 }
+
 void *memcpy(void *dest, const void *src, size_t n) {
   unsigned char *d = dest;
   const unsigned char *s = src;
-  while (n--)
-    *d++ = *s++;
+  if (n < 16)
+    copy_small(d, s, n);
+  else if (n >= memcpy_rep_threshold)
+    copy_rep(d, s, n);
+  else if (mem_use_avx2 && n >= 32)
+    copy_fwd_avx2(d, s, n);
+  else
+    copy_fwd_sse2(d, s, n);
   return dest;
 }
+
 void *memmove(void *dest, const void *src, size_t n) {
   unsigned char *d = dest;
   const unsigned char *s = src;
-  if (d < s)
-    while (n--)
-      *d++ = *s++;
-  else {
-    d += n;
-    s += n;
-    while (n--)
-      *(--d) = *(--s);
+  if (n < 16) {
+    copy_small(d, s, n);
+  } else if (d + n <= s || s + n <= d) {
+    memcpy(d, s, n);
+  } else if (d < s) {
+    copy_fwd_sse2(d, s, n);
+  } else if (d > s) {
+    copy_bwd_sse2(d, s, n);
   }
   return dest;
 }
+
+__attribute__((target("avx2"))) static void set_avx2(unsigned char *p, int c,
+                                                     size_t n) {
+  __m256i v = _mm256_set1_epi8((char)c);
+  size_t i = 0;
+  for (; i + 128 <= n; i += 128) {
+    _mm256_storeu_si256((__m256i *)(p + i), v);
+    _mm256_storeu_si256((__m256i *)(p + i + 32), v);
+    _mm256_storeu_si256((__m256i *)(p + i + 64), v);
+    _mm256_storeu_si256((__m256i *)(p + i + 96), v);
+  }
+  for (; i + 32 <= n; i += 32)
+    _mm256_storeu_si256((__m256i *)(p + i), v);
+  _mm256_storeu_si256((__m256i *)(p + n - 32), v);
+}
+
+void *memset(void *s, int c, size_t n) {
+  unsigned char *p = s;
+  if (n < 16) {
+    uint64_t v = 0x0101010101010101ULL * (unsigned char)c;
+    if (n >= 8) {
+      __builtin_memcpy(p, &v, 8);
+      __builtin_memcpy(p + n - 8, &v, 8);
+    } else if (n >= 4) {
+      __builtin_memcpy(p, &v, 4);
+      __builtin_memcpy(p + n - 4, &v, 4);
+    } else if (n > 0) {
+      p[0] = (unsigned char)c;
+      p[n >> 1] = (unsigned char)c;
+      p[n - 1] = (unsigned char)c;
+    }
+  } else if (n >= memset_rep_threshold) {
+    void *d = p;
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+  } else if (mem_use_avx2 && n >= 32) {
+    set_avx2(p, c, n);
+  } else {
+    __m128i v = _mm_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+      _mm_storeu_si128((__m128i *)(p + i), v);
+      _mm_storeu_si128((__m128i *)(p + i + 16), v);
+      _mm_storeu_si128((__m128i *)(p + i + 32), v);
+      _mm_storeu_si128((__m128i *)(p + i + 48), v);
+    }
+    for (; i + 16 <= n; i += 16)
+      _mm_storeu_si128((__m128i *)(p + i), v);
+    _mm_storeu_si128((__m128i *)(p + n - 16), v);
+  }
+  return s;
+}
+
+__attribute__((target("avx2"))) static size_t
+cmp_avx2(const unsigned char *a, const unsigned char *b, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    uint32_t ne = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (ne)
+      return i + __builtin_ctz(ne);
+  }
+  return i;
+}
+
+int memcmp(const void *s1, const void *s2, size_t n) {
+  const unsigned char *p1 = s1, *p2 = s2;
+  size_t i = 0;
+  if (mem_use_avx2 && n >= 32) {
+    i = cmp_avx2(p1, p2, n);
+    if (i + 32 <= n)
+      return p1[i] - p2[i];
+  }
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(p1 + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(p2 + i));
+    uint32_t ne = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+    if (ne) {
+      i += __builtin_ctz(ne);
+      return p1[i] - p2[i];
+    }
+  }
+  for (; i < n; i++) {
+    if (p1[i] != p2[i])
+      return p1[i] - p2[i];
+  }
+  return 0;
+}
+
+// Set once XSAVE is enabled; isr_common then saves AVX state, not just SSE.
+int fpu_use_xsave;
+
+static void enable_avx(void) {
+  uint64_t cr4;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+  cr4 |= (1ULL << 18); // OSXSAVE
+  __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  lo |= 0x7; // x87 | SSE | AVX state
+  __asm__ volatile("xsetbv" : : "a"(lo), "d"(hi), "c"(0));
+  fpu_use_xsave = 1;
+}
+
+void cpu_features_init(void) {
+  uint32_t r[4];
+  asm_cpuid(0, 0, r);
+  uint32_t max_leaf = r[0];
+
+  asm_cpuid(1, 0, r);
+  int has_xsave = (r[2] >> 26) & 1;
+  int has_avx = (r[2] >> 28) & 1;
+  if (r[2] & (1u << 17))
+    cpu_features |= CPU_FEATURE_PCID;
+
+  if (max_leaf >= 7) {
+    asm_cpuid(7, 0, r);
+    if (r[1] & (1u << 9))
+      cpu_features |= CPU_FEATURE_ERMS;
+    if (r[3] & (1u << 4))
+      cpu_features |= CPU_FEATURE_FSRM;
+    if ((r[1] & (1u << 5)) && has_avx && has_xsave)
+      cpu_features |= CPU_FEATURE_AVX2;
+    if (r[1] & (1u << 10))
+      cpu_features |= CPU_FEATURE_INVPCID;
+  }
+
+  asm_cpuid(0x80000000, 0, r);
+  if (r[0] >= 0x80000007) {
+    asm_cpuid(0x80000007, 0, r);
+    if (r[3] & (1u << 8))
+      cpu_features |= CPU_FEATURE_INVARIANT_TSC;
+  }
+
+  if (cpu_features & CPU_FEATURE_AVX2) {
+    enable_avx();
+    mem_use_avx2 = 1;
+  }
+  if (cpu_features & CPU_FEATURE_FSRM)
+    memcpy_rep_threshold = MEM_REP_THRESHOLD_FSRM;
+  else if (cpu_features & CPU_FEATURE_ERMS)
+    memcpy_rep_threshold = MEM_REP_THRESHOLD_ERMS;
+  if (cpu_features & CPU_FEATURE_ERMS)
+    memset_rep_threshold = MEM_REP_THRESHOLD_ERMS;
+
+  serial_print("CPU features:");
+  if (cpu_features & CPU_FEATURE_ERMS)
+    serial_print(" erms");
+  if (cpu_features & CPU_FEATURE_FSRM)
+    serial_print(" fsrm");
+  if (cpu_features & CPU_FEATURE_AVX2)
+    serial_print(" avx2");
+  if (cpu_features & CPU_FEATURE_PCID)
+    serial_print(" pcid");
+  if (cpu_features & CPU_FEATURE_INVPCID)
+    serial_print(" invpcid");
+  if (cpu_features & CPU_FEATURE_INVARIANT_TSC)
+    serial_print(" invtsc");
+  serial_print("\n");
+}
+
 int putchar(int c) {
   serial_putc((uint8_t)c);
   return c;
 }
 extern uint8_t stack_top;
 uint64_t get_stack_top(void) { return (uintptr_t)&stack_top; }
+extern uint8_t kernel_end;
+uint64_t get_kernel_end(void) { return (uintptr_t)&kernel_end; }
 
 // ========================= IDT =========================
 struct idt_entry {
@@ -95,10 +353,177 @@ static void print_hex64(uint64_t v) {
     serial_putc(hex[(v >> i) & 0xF]);
 }
 
+// MARK: - Device interrupts
+//
+// The legacy PICs are remapped out of the exception range and masked; device
+// interrupts arrive as MSI/MSI-X on vectors IRQ_VECTOR_BASE.. through the
+// local APIC. The generic stub reports vector 255, which is also the APIC
+// spurious vector, and is ignored.
+
+#define IRQ_VECTOR_BASE 0x40
+#define IRQ_VECTOR_COUNT 16
+#define IRQ_VECTOR_SPURIOUS 0xFF
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_TPR 0x80
+#define LAPIC_REG_EOI 0xB0
+#define LAPIC_REG_SVR 0xF0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INIT 0x380
+#define LAPIC_REG_TIMER_COUNT 0x390
+#define LAPIC_REG_TIMER_DIV 0x3E0
+#define LAPIC_TIMER_PERIODIC (1u << 17)
+#define LAPIC_TIMER_MASKED (1u << 16)
+#define LAPIC_ICR_PENDING (1u << 12)
+
+static volatile uint32_t *lapic;
+static irq_handler_t irq_handlers[IRQ_VECTOR_COUNT];
+static int irq_next_vector = IRQ_VECTOR_BASE;
+
+static uint64_t rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+void irq_init(void) {
+  // ICW1-4: remap master to 0x20, slave to 0x28, then mask everything.
+  outb(0x20, 0x11);
+  outb(0xA0, 0x11);
+  outb(0x21, 0x20);
+  outb(0xA1, 0x28);
+  outb(0x21, 0x04);
+  outb(0xA1, 0x02);
+  outb(0x21, 0x01);
+  outb(0xA1, 0x01);
+  outb(0x21, 0xFF);
+  outb(0xA1, 0xFF);
+
+  lapic_init_cpu();
+  serial_print("LAPIC enabled\n");
+}
+
+// Every CPU's LAPIC sits at the same address; each sees its own.
+void lapic_init_cpu(void) {
+  uint64_t base = rdmsr(0x1B); // IA32_APIC_BASE
+  asm_wrmsr(0x1B, base | (1 << 11));
+  lapic = (volatile uint32_t *)(uintptr_t)(base & 0xFFFFF000);
+  lapic[LAPIC_REG_TPR / 4] = 0;
+  lapic[LAPIC_REG_SVR / 4] = 0x100 | IRQ_VECTOR_SPURIOUS; // software enable
+}
+
+uint32_t lapic_id(void) {
+  if (!lapic) {
+    uint32_t regs[4];
+    asm_cpuid(1, 0, regs);
+    return regs[1] >> 24;
+  }
+  return lapic[LAPIC_REG_ID / 4] >> 24;
+}
+
+// Timer ticks (divide by 16) per millisecond, measured once on the BSP.
+static uint32_t lapic_timer_per_ms;
+
+void lapic_timer_start(uint8_t vector, uint32_t hz) {
+  lapic[LAPIC_REG_TIMER_DIV / 4] = 0x3; // divide by 16
+  if (!lapic_timer_per_ms) {
+    lapic[LAPIC_REG_LVT_TIMER / 4] = LAPIC_TIMER_MASKED;
+    lapic[LAPIC_REG_TIMER_INIT / 4] = 0xFFFFFFFF;
+    pit_delay_us(10000);
+    uint32_t elapsed = 0xFFFFFFFF - lapic[LAPIC_REG_TIMER_COUNT / 4];
+    lapic_timer_per_ms = elapsed / 10 ? elapsed / 10 : 1;
+  }
+  lapic[LAPIC_REG_LVT_TIMER / 4] = LAPIC_TIMER_PERIODIC | vector;
+  lapic[LAPIC_REG_TIMER_INIT / 4] = lapic_timer_per_ms * 1000 / hz;
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low) {
+  lapic[LAPIC_REG_ICR_HIGH / 4] = apic_id << 24;
+  lapic[LAPIC_REG_ICR_LOW / 4] = icr_low;
+  while (lapic[LAPIC_REG_ICR_LOW / 4] & LAPIC_ICR_PENDING)
+    __asm__ volatile("pause");
+}
+
+int irq_alloc_vector(irq_handler_t handler) {
+  if (irq_next_vector >= IRQ_VECTOR_BASE + IRQ_VECTOR_COUNT)
+    return -1;
+  int vector = irq_next_vector++;
+  irq_handlers[vector - IRQ_VECTOR_BASE] = handler;
+  return vector;
+}
+
+// QEMU's IOAPIC sits at the architectural default; the MADT is not parsed.
+// ISA IRQs below 16 other than the timer are identity-mapped to GSIs there.
+#define IOAPIC_BASE 0xFEC00000ull
+
+static void ioapic_write(uint32_t reg, uint32_t v) {
+  volatile uint32_t *ioapic = (volatile uint32_t *)(uintptr_t)IOAPIC_BASE;
+  ioapic[0] = reg;
+  ioapic[4] = v;
+}
+
+int irq_route_isa(uint8_t irq, irq_handler_t handler) {
+  int vector = irq_alloc_vector(handler);
+  if (vector < 0)
+    return -1;
+  uint32_t apic_id = lapic_id();
+  // Edge-triggered, active high, fixed delivery, physical destination.
+  ioapic_write(0x10 + 2 * irq + 1, apic_id << 24);
+  ioapic_write(0x10 + 2 * irq, (uint32_t)vector);
+  return vector;
+}
+
+uint64_t irq_msi_address(void) {
+  uint32_t apic_id = lapic_id();
+  return 0xFEE00000ull | ((uint64_t)apic_id << 12);
+}
+
+void asm_wait_for_interrupt(void) {
+  // STI only takes effect after the next instruction, so an interrupt that
+  // is already pending wakes the HLT instead of being lost.
+  __asm__ volatile("sti\nhlt\ncli" ::: "memory");
+}
+
+// Implemented in Swift (MM/VMMap.swift). Returns nonzero if the fault was
+// resolved and the faulting instruction can be restarted; does not return
+// at all if it ended the faulting task instead.
+extern int handle_page_fault(uint64_t addr, uint64_t error, uint64_t rip);
+// Implemented in Swift (Sched/Scheduler.swift).
+extern void sched_preempt_point(void);
+
 // Generic exception handler called from assembly stubs
 void exception_handler(uint64_t vector, uint64_t error, uint64_t rip,
                        uint64_t cs, uint64_t rflags, uint64_t rsp,
                        uint64_t ss) {
+  if (vector >= IRQ_VECTOR_BASE &&
+      vector < IRQ_VECTOR_BASE + IRQ_VECTOR_COUNT) {
+    irq_handler_t h = irq_handlers[vector - IRQ_VECTOR_BASE];
+    if (h)
+      h(vector);
+    lapic[LAPIC_REG_EOI / 4] = 0;
+    // Interrupted user code can be switched out here; kernel code (only
+    // ever interrupted inside asm_wait_for_interrupt) cannot.
+    if ((cs & 3) == 3)
+      sched_preempt_point();
+    return;
+  }
+  if (vector == IRQ_VECTOR_SPURIOUS)
+    return;
+
+  if (vector == 14) {
+    uint64_t fault_addr;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(fault_addr));
+#ifdef KASAN
+    if (kasan_fault(fault_addr, error))
+      return;
+#endif
+    if (handle_page_fault(fault_addr, error, rip))
+      return;
+  }
+
+  console_panic();
   const char *names[] = {"#DE Divide Error",
                          "#DB Debug",
                          "NMI Interrupt",
@@ -178,7 +603,7 @@ void exception_handler(uint64_t vector, uint64_t error, uint64_t rip,
   // Dump saved general registers (from isr_common stack)
   // At this point, exception_handler was called with saved regs on stack above
   // us. We can read the saved regs via inline asm or just dump what we have.
-  // The ISR stub pushes: rdi, rsi, rdx, rcx, r8, r9, r10, r11
+  // The ISR stub pushes: rax, rdi, rsi, rdx, rcx, r8, r9, r10, r11, rbp
   // Those are at known offsets from our frame pointer.
 
   serial_print("  (exception_handler args: rdi(vector)=");
@@ -206,11 +631,18 @@ void exception_handler(uint64_t vector, uint64_t error, uint64_t rip,
           "pushq $" #n "\n"                                                    \
           "jmp isr_common\n");
 
+// Faults can now be resolved and resumed (demand paging), so the stub keeps
+// every caller-saved register, including rax and the FPU/vector state, which
+// the C and Swift handlers are free to clobber. The save area lives below a
+// 64-byte aligned rsp, with rbp holding the frame:
+//   0(%rbp) rbp, 8..64 r11..rdi, 72 rax, 80 vector, 88 error, 96 rip,
+//   104 cs, 112 rflags, 120 rsp, 128 ss
 __asm__("isr_common:\n"
         "testq $3, 24(%rsp)\n"
         "jz 1f\n"
         "swapgs\n"
         "1:\n"
+        "push %rax\n"
         "push %rdi\n"
         "push %rsi\n"
         "push %rdx\n"
@@ -219,15 +651,49 @@ __asm__("isr_common:\n"
         "push %r9\n"
         "push %r10\n"
         "push %r11\n"
-        "mov 64(%rsp), %rdi\n"
-        "mov 72(%rsp), %rsi\n"
-        "mov 80(%rsp), %rdx\n"
-        "mov 88(%rsp), %rcx\n"
-        "mov 96(%rsp), %r8\n"
-        "mov 104(%rsp), %r9\n"
-        "push 112(%rsp)\n"
+        "push %rbp\n"
+        "mov %rsp, %rbp\n"
+        "sub $1024, %rsp\n"
+        "and $-64, %rsp\n"
+        "cmpl $0, fpu_use_xsave(%rip)\n"
+        "je 3f\n"
+        // XRSTOR faults on a garbage header, and XSAVE only writes XSTATE_BV.
+        "movq $0, 512(%rsp)\n"
+        "movq $0, 520(%rsp)\n"
+        "movq $0, 528(%rsp)\n"
+        "movq $0, 536(%rsp)\n"
+        "movq $0, 544(%rsp)\n"
+        "movq $0, 552(%rsp)\n"
+        "movq $0, 560(%rsp)\n"
+        "movq $0, 568(%rsp)\n"
+        "mov $7, %eax\n"
+        "xor %edx, %edx\n"
+        "xsave (%rsp)\n"
+        "jmp 4f\n"
+        "3:\n"
+        "fxsave (%rsp)\n"
+        "4:\n"
+        "mov 80(%rbp), %rdi\n"
+        "mov 88(%rbp), %rsi\n"
+        "mov 96(%rbp), %rdx\n"
+        "mov 104(%rbp), %rcx\n"
+        "mov 112(%rbp), %r8\n"
+        "mov 120(%rbp), %r9\n"
+        "sub $8, %rsp\n"
+        "push 128(%rbp)\n"
         "call exception_handler\n"
-        "add $8, %rsp\n"
+        "add $16, %rsp\n"
+        "cmpl $0, fpu_use_xsave(%rip)\n"
+        "je 5f\n"
+        "mov $7, %eax\n"
+        "xor %edx, %edx\n"
+        "xrstor (%rsp)\n"
+        "jmp 6f\n"
+        "5:\n"
+        "fxrstor (%rsp)\n"
+        "6:\n"
+        "mov %rbp, %rsp\n"
+        "pop %rbp\n"
         "pop %r11\n"
         "pop %r10\n"
         "pop %r9\n"
@@ -236,6 +702,7 @@ __asm__("isr_common:\n"
         "pop %rdx\n"
         "pop %rsi\n"
         "pop %rdi\n"
+        "pop %rax\n"
         "add $16, %rsp\n"
         "testq $3, 8(%rsp)\n"
         "jz 2f\n"
@@ -264,6 +731,22 @@ ISR_ERRCODE(17)
 ISR_NOERRCODE(18)
 ISR_NOERRCODE(19)
 ISR_NOERRCODE(20)
+ISR_NOERRCODE(64)
+ISR_NOERRCODE(65)
+ISR_NOERRCODE(66)
+ISR_NOERRCODE(67)
+ISR_NOERRCODE(68)
+ISR_NOERRCODE(69)
+ISR_NOERRCODE(70)
+ISR_NOERRCODE(71)
+ISR_NOERRCODE(72)
+ISR_NOERRCODE(73)
+ISR_NOERRCODE(74)
+ISR_NOERRCODE(75)
+ISR_NOERRCODE(76)
+ISR_NOERRCODE(77)
+ISR_NOERRCODE(78)
+ISR_NOERRCODE(79)
 
 // Also define a generic IRQ stub for testing
 __asm__(".global irq_stub_generic\n"
@@ -293,6 +776,22 @@ extern void isr_stub_17(void);
 extern void isr_stub_18(void);
 extern void isr_stub_19(void);
 extern void isr_stub_20(void);
+extern void isr_stub_64(void);
+extern void isr_stub_65(void);
+extern void isr_stub_66(void);
+extern void isr_stub_67(void);
+extern void isr_stub_68(void);
+extern void isr_stub_69(void);
+extern void isr_stub_70(void);
+extern void isr_stub_71(void);
+extern void isr_stub_72(void);
+extern void isr_stub_73(void);
+extern void isr_stub_74(void);
+extern void isr_stub_75(void);
+extern void isr_stub_76(void);
+extern void isr_stub_77(void);
+extern void isr_stub_78(void);
+extern void isr_stub_79(void);
 extern void irq_stub_generic(void);
 
 typedef void (*isr_func)(void);
@@ -310,18 +809,36 @@ void setup_idt(void) {
   for (int i = 0; i < 21; i++) {
     set_idt_gate(i, (uint64_t)stubs[i], 0, 0x8E);
   }
+  // These can arrive with the kernel stack in any state; give them their
+  // own (see cpu.c).
+  idt[2].ist = IST_NMI;
+  idt[8].ist = IST_DOUBLE_FAULT;
+  idt[18].ist = IST_MACHINE_CHECK;
   // Fill rest with generic stub to avoid #GP on unexpected interrupts
   for (int i = 21; i < 256; i++) {
     set_idt_gate(i, (uint64_t)irq_stub_generic, 0, 0x8E);
   }
 
+  isr_func irq_stubs[] = {isr_stub_64, isr_stub_65, isr_stub_66, isr_stub_67,
+                          isr_stub_68, isr_stub_69, isr_stub_70, isr_stub_71,
+                          isr_stub_72, isr_stub_73, isr_stub_74, isr_stub_75,
+                          isr_stub_76, isr_stub_77, isr_stub_78, isr_stub_79};
+  for (int i = 0; i < IRQ_VECTOR_COUNT; i++) {
+    set_idt_gate(IRQ_VECTOR_BASE + i, (uint64_t)irq_stubs[i], 0, 0x8E);
+  }
+
+  idt_load();
+  serial_print("IDT loaded\n");
+}
+
+// All CPUs share the one table.
+void idt_load(void) {
   struct {
     uint16_t limit;
     uint64_t base;
   } __attribute__((packed)) idtr = {sizeof(idt) - 1, (uintptr_t)idt};
 
   __asm__ volatile("lidt %0" : : "m"(idtr));
-  serial_print("IDT loaded\n");
 }
 
 void enable_fsgsbase(void) {
@@ -338,80 +855,37 @@ void enable_fsgsbase(void) {
   }
 }
 
-struct tss_entry {
-  uint32_t res0;
-  uint64_t rsp0;
-  uint64_t rsp1;
-  uint64_t rsp2;
-  uint64_t res1;
-  uint64_t ist[7];
-  uint64_t res2;
-  uint16_t res3;
-  uint16_t iopb;
-} __attribute__((packed, aligned(16))) tss;
-
-uint64_t gdt[] __attribute__((aligned(16))) = {0,
-                                               0x00af9b000000ffff,
-                                               0x00cf93000000ffff,
-                                               0x00affb000000ffff,
-                                               0x00cff3000000ffff,
-                                               0x00affa000000ffff,
-                                               0,
-                                               0};
-
-void setup_gdt_tss(uint64_t kstack) {
-  serial_print("GDT init with stack: 0x");
-  print_hex64(kstack);
-  serial_print("\n");
-  memset(&tss, 0, sizeof(tss));
-  tss.rsp0 = kstack;
-  tss.iopb = sizeof(tss);
-
-  uint64_t base = (uintptr_t)&tss;
-  uint32_t limit = sizeof(tss) - 1;
-  gdt[6] = (limit & 0xffff) | ((base & 0xffff) << 16) |
-           ((base & 0xff0000) << 16) | (0x89ULL << 40) |
-           (((base & 0xff000000) >> 24) << 56);
-  gdt[7] = (base >> 32);
-
-  struct {
-    uint16_t limit;
-    uint64_t base;
-  } __attribute__((packed)) gdtr = {sizeof(gdt) - 1, (uintptr_t)gdt};
-  __asm__ volatile("lgdt %0" : : "m"(gdtr));
-  serial_print("GDT loaded\n");
-  __asm__ volatile("ltr %%ax" : : "a"((uint16_t)0x30));
-  serial_print("TSS loaded\n");
-}
-
 extern uint64_t handle_syscall(uint64_t n, uint64_t a1, uint64_t a2,
                                uint64_t a3, uint64_t a4, uint64_t a5,
                                uint64_t a6);
+// Only the registers the SysV ABI lets handle_syscall clobber are saved;
+// rbx, rbp and r12-r15 are preserved by the callee. The arguments are shifted
+// one register over in place (rax becomes the first argument) and r9, the
+// sixth syscall argument, goes on the stack. The user rsp is kept on the
+// thread's kernel stack too, since the thread may block and another one
+// enter on this CPU; with the eight saves and the stack argument that keeps
+// the call 16-byte aligned.
 __asm__(".global syscall_entry\n"
         "syscall_entry:\n"
         "swapgs\n"
-        "mov %rsp, %gs:12\n"
-        "mov %gs:4, %rsp\n"
-        "push %r11\n"
-        "push %rcx\n"
-        "push %rax\n"
+        "mov %rsp, %gs:16\n" // cpu_data.user_rsp
+        "mov %gs:8, %rsp\n"  // cpu_data.kernel_rsp
+        "pushq %gs:16\n"
+        "push %r11\n" // user rflags
+        "push %rcx\n" // user rip
         "push %rdi\n"
         "push %rsi\n"
         "push %rdx\n"
         "push %r10\n"
         "push %r8\n"
         "push %r9\n"
-        "push %r12\n"
-        "pop %r12\n"
-        "sub $8, %rsp\n"
-        "mov 8(%rsp), %r12\n"
-        "mov %r12, (%rsp)\n"
-        "mov 56(%rsp), %rdi\n"
-        "mov 48(%rsp), %rsi\n"
-        "mov 40(%rsp), %rdx\n"
-        "mov 32(%rsp), %rcx\n"
-        "mov 24(%rsp), %r8\n"
-        "mov 16(%rsp), %r9\n"
+        "push %r9\n"
+        "mov %r8, %r9\n"
+        "mov %r10, %r8\n"
+        "mov %rdx, %rcx\n"
+        "mov %rsi, %rdx\n"
+        "mov %rdi, %rsi\n"
+        "mov %rax, %rdi\n"
         "call handle_syscall\n"
         "add $8, %rsp\n"
         "pop %r9\n"
@@ -420,10 +894,9 @@ __asm__(".global syscall_entry\n"
         "pop %rdx\n"
         "pop %rsi\n"
         "pop %rdi\n"
-        "add $8, %rsp\n"
         "pop %rcx\n"
         "pop %r11\n"
-        "mov %gs:12, %rsp\n"
+        "pop %rsp\n"
         "swapgs\n"
         "sysretq\n");
 
@@ -437,11 +910,6 @@ void setup_syscall_msrs() {
   uint32_t star_hi = (0x0018 << 16) | 0x0008;
   __asm__ volatile("wrmsr" : : "c"(0xC0000081), "a"(0), "d"(star_hi));
   __asm__ volatile("wrmsr" : : "c"(0xC0000084), "a"(0x200), "d"(0));
-  uintptr_t base = (uintptr_t)&tss;
-  __asm__ volatile("wrmsr"
-                   :
-                   : "c"(0xC0000102), "a"((uint32_t)base),
-                     "d"((uint32_t)(base >> 32)));
   uint32_t l, h;
   __asm__ volatile("rdmsr" : "=a"(l), "=d"(h) : "c"(0xC0000080));
   __asm__ volatile("wrmsr" : : "c"(0xC0000080), "a"(l | 1), "d"(h));
@@ -460,15 +928,52 @@ void jump_to_user(uint64_t rip, uint64_t rsp) {
                    "mov %%ax, %%es\n"
                    "pushq $0x23\n"
                    "pushq %1\n"
-                   "pushq $0x002\n" // IF=0
+                   // IF=1: device interrupts (and the console drain) are
+                   // taken while user code runs. The kernel itself stays
+                   // at IF=0; SYSCALL masks it on entry.
+                   "pushq $0x202\n"
                    "pushq $0x2B\n"
                    "pushq %0\n"
+                   // GS base was the kernel's cpu_data; leave with user GS.
+                   "swapgs\n"
                    "iretq"
                    :
                    : "r"(rip), "r"(rsp)
                    : "ax", "memory");
 }
 
+// jump_to_user_args(rip, rsp, args): like jump_to_user, with rdi..r9 taken
+// from args[0..5] and every other register cleared.
+__asm__(".global jump_to_user_args\n"
+        "jump_to_user_args:\n"
+        "cli\n"
+        "mov $0x23, %eax\n"
+        "mov %eax, %ds\n"
+        "mov %eax, %es\n"
+        "pushq $0x23\n"
+        "push %rsi\n"
+        "pushq $0x202\n"
+        "pushq $0x2B\n"
+        "push %rdi\n"
+        "mov %rdx, %rax\n"
+        "mov 0(%rax), %rdi\n"
+        "mov 8(%rax), %rsi\n"
+        "mov 16(%rax), %rdx\n"
+        "mov 24(%rax), %rcx\n"
+        "mov 32(%rax), %r8\n"
+        "mov 40(%rax), %r9\n"
+        "xor %eax, %eax\n"
+        "xor %ebx, %ebx\n"
+        "xor %ebp, %ebp\n"
+        "xor %r10d, %r10d\n"
+        "xor %r11d, %r11d\n"
+        "xor %r12d, %r12d\n"
+        "xor %r13d, %r13d\n"
+        "xor %r14d, %r14d\n"
+        "xor %r15d, %r15d\n"
+        "swapgs\n"
+        "iretq\n");
+
 void asm_hlt() { __asm__ volatile("hlt"); }
 uint32_t pci_config_read(uint8_t b, uint8_t s, uint8_t f, uint8_t o) {
   uint32_t a = (1U << 31) | (b << 16) | (s << 11) | (f << 8) | (o & 0xfc);
@@ -485,8 +990,10 @@ void pci_config_write(uint8_t b, uint8_t s, uint8_t f, uint8_t o, uint32_t v) {
 void asm_pause(void) { __asm__ volatile("pause"); }
 
 extern void *kernel_alloc(size_t size, size_t align);
+extern void kernel_free(void *ptr);
+extern size_t kernel_alloc_size(void *ptr);
 void *malloc(size_t size) { return kernel_alloc(size, 16); }
-void free(void *ptr) {}
+void free(void *ptr) { kernel_free(ptr); }
 void *calloc(size_t nmemb, size_t size) {
   size_t total = nmemb * size;
   void *p = malloc(total);
@@ -497,7 +1004,19 @@ void *calloc(size_t nmemb, size_t size) {
 void *realloc(void *ptr, size_t size) {
   if (!ptr)
     return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return 0;
+  }
+  size_t old_size = kernel_alloc_size(ptr);
+  if (old_size >= size)
+    return ptr;
   void *new_ptr = malloc(size);
+  if (new_ptr) {
+    // Early-arena blocks have no recorded size; copy what was asked for.
+    memcpy(new_ptr, ptr, old_size ? old_size : size);
+    free(ptr);
+  }
   return new_ptr;
 }
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
@@ -505,15 +1024,12 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) {
   return 0;
 }
 void asm_volatile_barrier(void) { __asm__ volatile("" : : : "memory"); }
-int memcmp(const void *s1, const void *s2, size_t n) {
-  const unsigned char *p1 = s1, *p2 = s2;
-  while (n--) {
-    if (*p1 != *p2)
-      return *p1 - *p2;
-    p1++;
-    p2++;
-  }
-  return 0;
+// Full fence: orders earlier stores before later loads, which x86 can reorder.
+void asm_memory_fence(void) { __asm__ volatile("mfence" : : : "memory"); }
+uint64_t asm_rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
 }
 double ceil(double x) {
   long i = (long)x;
@@ -533,17 +1049,40 @@ const unsigned char _swift_stdlib_nfd_decompositions[1] = {0};
 int _swift_stdlib_isExtendedPictographic(uint32_t s) { return 0; }
 int _swift_stdlib_isInCB_Consonant(uint32_t s) { return 0; }
 int _swift_stdlib_getGraphemeBreakProperty(uint32_t s) { return 0; }
+uint64_t asm_get_cr0(void) {
+  uint64_t cr0;
+  __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+void asm_set_cr0(uint64_t cr0) {
+  __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
 uint64_t asm_get_cr3(void) {
   uint64_t cr3;
   __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
   return cr3;
 }
 void asm_set_cr3(uint64_t cr3) {
-  __asm__ volatile("mov %0, %%cr3" : : "r"(cr3));
+  __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
 }
 void asm_invlpg(void *addr) {
   __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
 }
+uint64_t asm_get_cr4(void) {
+  uint64_t cr4;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+void asm_set_cr4(uint64_t cr4) {
+  __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+void asm_invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+  struct {
+    uint64_t pcid;
+    uint64_t addr;
+  } desc = {pcid, addr};
+  __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
 
 void asm_wrmsr(uint32_t msr, uint64_t v) {
   uint32_t l = v & 0xFFFFFFFF;
@@ -0,0 +1,175 @@
+/*
+ * sched.c
+ * Locks and the low half of thread switching
+ *
+ * Spin locks are plain test-and-set. The kernel runs with interrupts off, so
+ * a holder is never interrupted on its own CPU; a lock must just never be
+ * held across asm_wait_for_interrupt or a thread switch. For the same reason
+ * spinners serve TLB shootdowns by polling (see cpu.c).
+ *
+ * Most of the kernel (VM, IPC, VFS, drivers) still assumes one thread of
+ * control and runs under the kernel lock: taken on entry from user mode and
+ * by device interrupt handlers, recursive on the CPU that holds it (so an
+ * interrupt taken while its holder waits in asm_wait_for_interrupt proceeds,
+ * as it always did), and dropped whole while a thread is switched out.
+ * Scheduling itself only takes spin locks.
+ *
+ * thread_switch saves the callee-saved registers on the old thread's kernel
+ * stack and resumes the new one. It clears the old thread's on-CPU word only
+ * once its stack is no longer in use, so another CPU that has already picked
+ * the thread waits for that before switching to it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "CSupport.h"
+
+#define NO_OWNER 0xFFFFFFFFu
+
+void spin_lock(spinlock_t *l) {
+  while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED)) {
+      tlb_shootdown_poll();
+      __asm__ volatile("pause");
+    }
+}
+
+int spin_trylock(spinlock_t *l) {
+  return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+void spin_unlock(spinlock_t *l) {
+  __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+// MARK: - Kernel lock
+
+static volatile uint32_t klock_owner = NO_OWNER;
+static uint32_t klock_depth; // only touched by the owner
+
+void kernel_lock(void) {
+  uint32_t me = cpu_current_index();
+  if (__atomic_load_n(&klock_owner, __ATOMIC_RELAXED) == me) {
+    klock_depth++;
+    return;
+  }
+  uint32_t expected = NO_OWNER;
+  while (!__atomic_compare_exchange_n(&klock_owner, &expected, me, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    expected = NO_OWNER;
+    tlb_shootdown_poll();
+    __asm__ volatile("pause");
+  }
+  klock_depth = 1;
+}
+
+int kernel_trylock(void) {
+  uint32_t me = cpu_current_index();
+  if (__atomic_load_n(&klock_owner, __ATOMIC_RELAXED) == me) {
+    klock_depth++;
+    return 1;
+  }
+  uint32_t expected = NO_OWNER;
+  if (!__atomic_compare_exchange_n(&klock_owner, &expected, me, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+  klock_depth = 1;
+  return 1;
+}
+
+void kernel_unlock(void) {
+  if (--klock_depth == 0)
+    __atomic_store_n(&klock_owner, NO_OWNER, __ATOMIC_RELEASE);
+}
+
+uint32_t kernel_lock_drop(void) {
+  if (__atomic_load_n(&klock_owner, __ATOMIC_RELAXED) != cpu_current_index())
+    return 0;
+  uint32_t depth = klock_depth;
+  klock_depth = 0;
+  __atomic_store_n(&klock_owner, NO_OWNER, __ATOMIC_RELEASE);
+  return depth;
+}
+
+void kernel_lock_retake(uint32_t depth) {
+  if (depth == 0)
+    return;
+  kernel_lock();
+  klock_depth = depth;
+}
+
+// MARK: - Thread switch
+
+// thread_switch(save_rsp, next_rsp, old_on_cpu)
+__asm__(".global thread_switch\n"
+        "thread_switch:\n"
+        "push %rbp\n"
+        "push %rbx\n"
+        "push %r12\n"
+        "push %r13\n"
+        "push %r14\n"
+        "push %r15\n"
+        "mov %rsp, (%rdi)\n"
+        // Stores are not reordered on x86: whoever sees 0 sees the save.
+        "movq $0, (%rdx)\n"
+        "mov %rsi, %rsp\n"
+        "pop %r15\n"
+        "pop %r14\n"
+        "pop %r13\n"
+        "pop %r12\n"
+        "pop %rbx\n"
+        "pop %rbp\n"
+        "ret\n");
+
+// First return of a new thread lands here, on a 16-byte aligned stack.
+__asm__("thread_trampoline:\n"
+        "xor %ebp, %ebp\n"
+        "call kernel_thread_start\n"
+        "ud2\n");
+
+extern void thread_trampoline(void);
+
+uint64_t thread_init_stack(uint64_t top) {
+  uint64_t *sp = (uint64_t *)(top & ~15ull);
+  *--sp = (uintptr_t)thread_trampoline;
+  for (int i = 0; i < 6; i++) // rbp, rbx, r12-r15
+    *--sp = 0;
+  return (uintptr_t)sp;
+}
+
+// MARK: - FPU state
+
+extern int fpu_use_xsave;
+
+void fpu_init_area(void *area) {
+  memset(area, 0, FPU_AREA_SIZE);
+  // FXSAVE layout: FCW at 0, MXCSR at 24. A zero XSTATE_BV makes XRSTOR
+  // load the init state for x87, SSE and AVX but still take MXCSR.
+  *(uint16_t *)area = 0x037F;
+  *(uint32_t *)((uint8_t *)area + 24) = 0x1F80;
+}
+
+void fpu_save(void *area) {
+  if (fpu_use_xsave)
+    __asm__ volatile("xsave (%0)" : : "r"(area), "a"(7), "d"(0) : "memory");
+  else
+    __asm__ volatile("fxsave (%0)" : : "r"(area) : "memory");
+}
+
+void fpu_restore(const void *area) {
+  if (fpu_use_xsave)
+    __asm__ volatile("xrstor (%0)" : : "r"(area), "a"(7), "d"(0) : "memory");
+  else
+    __asm__ volatile("fxrstor (%0)" : : "r"(area) : "memory");
+}
+
+void context_switch(uint64_t *save_rsp, uint64_t next_rsp,
+                    volatile uint64_t *old_on_cpu, void *old_fpu,
+                    const void *new_fpu) {
+  // Swift code in between could touch the vector registers, so the FPU
+  // state moves here, next to the switch.
+  fpu_save(old_fpu);
+  fpu_restore(new_fpu);
+  thread_switch(save_rsp, next_rsp, old_on_cpu);
+}
@@ -0,0 +1,151 @@
+/*
+ * trace.c
+ * Per-CPU binary event trace
+ *
+ * Each CPU appends fixed-size records to a ring of its own, so recording an
+ * event takes no lock and touches no shared cache line: the slot is claimed
+ * with a single XADD (interrupts on the same CPU cannot split it and no other
+ * CPU writes the ring, so it needs no LOCK prefix), then filled in with the
+ * TSC and the thread running on the CPU. The rings wrap, keeping the newest
+ * records. An interrupt may fill its slot before the one it interrupted, so
+ * records are only roughly in time order; readers sort by timestamp.
+ *
+ * trace_serialize lays the rings out as one stream (a trace_header, then
+ * every CPU's records oldest first) and fills a caller's buffer with any
+ * window of it, so the kernel can write out a trace far bigger than one
+ * contiguous allocation through a small bounce buffer; trace_dump_serial
+ * does the same for the console. Tracing should be off while they run.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "CSupport.h"
+
+struct trace_ring {
+  struct trace_record *records;
+  uint64_t mask; // capacity - 1
+  uint64_t head; // records ever claimed
+  uint32_t tid;
+} __attribute__((aligned(64)));
+
+static struct trace_ring rings[MAX_CPUS];
+volatile uint32_t trace_enabled;
+
+void trace_attach(uint32_t cpu, void *buffer, uint64_t capacity) {
+  if (cpu >= MAX_CPUS || (capacity & (capacity - 1)) != 0)
+    return;
+  rings[cpu].mask = capacity - 1;
+  rings[cpu].head = 0;
+  __atomic_store_n(&rings[cpu].records, (struct trace_record *)buffer,
+                   __ATOMIC_RELEASE);
+}
+
+void trace_set_thread(uint64_t tid) {
+  rings[cpu_current_index()].tid = (uint32_t)tid;
+}
+
+void trace_event(uint32_t event, uint64_t arg0, uint64_t arg1) {
+  uint32_t cpu = cpu_current_index();
+  struct trace_ring *r = &rings[cpu];
+  if (!trace_enabled || !r->records)
+    return;
+  uint64_t slot = 1;
+  __asm__ volatile("xaddq %0, %1" : "+r"(slot), "+m"(r->head));
+  struct trace_record *rec = &r->records[slot & r->mask];
+  rec->tsc = asm_rdtsc();
+  rec->event = (uint16_t)event;
+  rec->cpu = (uint16_t)cpu;
+  rec->tid = r->tid;
+  rec->arg0 = arg0;
+  rec->arg1 = arg1;
+}
+
+static uint64_t ring_count(const struct trace_ring *r) {
+  return r->head > r->mask ? r->mask + 1 : r->head;
+}
+
+// The part of [pos, pos + n) that falls inside the window [off, off + len),
+// copied from src to its place in dst.
+static void window_copy(uint8_t *dst, size_t off, size_t len, size_t pos,
+                        const void *src, size_t n) {
+  size_t lo = pos > off ? pos : off;
+  size_t hi = pos + n < off + len ? pos + n : off + len;
+  if (lo < hi)
+    memcpy(dst + (lo - off), (const uint8_t *)src + (lo - pos), hi - lo);
+}
+
+size_t trace_serialize(uint8_t *dst, size_t offset, size_t len, size_t limit,
+                       uint64_t tsc_hz) {
+  uint64_t total = 0;
+  uint32_t ncpu = 0;
+  for (uint32_t i = 0; i < MAX_CPUS; i++) {
+    if (!rings[i].records)
+      continue;
+    total += ring_count(&rings[i]);
+    ncpu = i + 1;
+  }
+  const size_t hsize = sizeof(struct trace_header);
+  const size_t rsize = sizeof(struct trace_record);
+  uint64_t fit = limit > hsize ? (limit - hsize) / rsize : 0;
+  if (total > fit)
+    total = fit;
+  size_t size = hsize + total * rsize;
+  if (!dst || offset >= size)
+    return size;
+  if (len > size - offset)
+    len = size - offset;
+
+  struct trace_header h;
+  memcpy(h.magic, TRACE_MAGIC, 8);
+  h.record_size = rsize;
+  h.ncpu = ncpu;
+  h.tsc_hz = tsc_hz;
+  h.count = total;
+  window_copy(dst, offset, len, 0, &h, hsize);
+
+  // Each ring's records are at most two runs of its buffer: from the oldest
+  // to the end, then from the start to the newest.
+  size_t pos = hsize;
+  uint64_t left = total;
+  for (uint32_t i = 0; i < ncpu && left && pos < offset + len; i++) {
+    const struct trace_ring *r = &rings[i];
+    if (!r->records)
+      continue;
+    uint64_t n = ring_count(r);
+    if (n > left)
+      n = left;
+    left -= n;
+    uint64_t first = (r->head - ring_count(r)) & r->mask;
+    uint64_t run = r->mask + 1 - first < n ? r->mask + 1 - first : n;
+    window_copy(dst, offset, len, pos, &r->records[first], run * rsize);
+    window_copy(dst, offset, len, pos + run * rsize, r->records,
+                (n - run) * rsize);
+    pos += n * rsize;
+  }
+  return size;
+}
+
+void trace_dump_serial(uint8_t *buf, size_t capacity, uint64_t tsc_hz) {
+  static const char hex[] = "0123456789abcdef";
+  uint8_t line[2 * TRACE_SERIAL_LINE + 1];
+  size_t size = trace_serialize(NULL, 0, 0, SIZE_MAX, tsc_hz);
+  // Whole lines per window, so the output does not depend on capacity.
+  capacity -= capacity % TRACE_SERIAL_LINE;
+  serial_print("\n" TRACE_SERIAL_BEGIN "\n");
+  for (size_t base = 0; base < size; base += capacity) {
+    size_t chunk = size - base < capacity ? size - base : capacity;
+    trace_serialize(buf, base, chunk, SIZE_MAX, tsc_hz);
+    for (size_t off = 0; off < chunk; off += TRACE_SERIAL_LINE) {
+      size_t n = chunk - off < TRACE_SERIAL_LINE ? chunk - off : TRACE_SERIAL_LINE;
+      for (size_t i = 0; i < n; i++) {
+        line[2 * i] = hex[buf[off + i] >> 4];
+        line[2 * i + 1] = hex[buf[off + i] & 0xF];
+      }
+      line[2 * n] = '\n';
+      console_write(line, 2 * n + 1);
+    }
+  }
+  serial_print(TRACE_SERIAL_END "\n");
+  console_flush();
+}
@@ -0,0 +1,107 @@
+/*
+ * ACPI.swift
+ * Locating ACPI tables and reading the processor list from the MADT
+ *
+ * The RSDP is found the legacy-BIOS way, by scanning the first KiB of the
+ * EBDA and then 0xE0000-0xFFFFF on 16-byte boundaries. Tables are read in
+ * place through the identity map; nothing is copied or kept.
+ */
+
+import CSupport
+
+private let sdtHeaderSize = 36
+
+struct ACPIProcessor {
+    let apicID: UInt32
+}
+
+struct ACPI {
+    private static func checksumOK(_ p: UnsafePointer<UInt8>, _ length: Int) -> Bool {
+        var sum: UInt8 = 0
+        for i in 0..<length { sum &+= p[i] }
+        return sum == 0
+    }
+
+    private static func scanRSDP(from start: UInt, to end: UInt) -> UnsafePointer<UInt8>? {
+        let signature: StaticString = "RSD PTR "
+        var addr = start
+        while addr + 20 <= end {
+            let p = UnsafePointer<UInt8>(bitPattern: addr)!
+            if memcmp(p, signature.utf8Start, 8) == 0 && checksumOK(p, 20) {
+                return p
+            }
+            addr += 16
+        }
+        return nil
+    }
+
+    private static func findRSDP() -> UnsafePointer<UInt8>? {
+        let ebdaSegment = UnsafePointer<UInt16>(bitPattern: UInt(0x40E))!.pointee
+        let ebda = UInt(ebdaSegment) << 4
+        if ebda >= 0x80000 && ebda < 0xA0000,
+            let p = scanRSDP(from: ebda, to: ebda + 1024)
+        {
+            return p
+        }
+        return scanRSDP(from: 0xE0000, to: 0x100000)
+    }
+
+    /// The first table with `signature`, or nil.
+    static func findTable(_ signature: StaticString) -> UnsafeRawPointer? {
+        guard let rsdp = findRSDP() else { return nil }
+        let raw = UnsafeRawPointer(rsdp)
+        let revision = rsdp[15]
+        // ACPI 2.0+ points at the XSDT (64-bit entries); fall back to the RSDT.
+        let xsdt = revision >= 2 ? raw.loadUnaligned(fromByteOffset: 24, as: UInt64.self) : 0
+        let root = xsdt != 0 ? xsdt : UInt64(raw.loadUnaligned(fromByteOffset: 16, as: UInt32.self))
+        let entrySize = xsdt != 0 ? 8 : 4
+        guard let sdt = UnsafeRawPointer(bitPattern: UInt(root)) else { return nil }
+        let length = Int(sdt.loadUnaligned(fromByteOffset: 4, as: UInt32.self))
+        var off = sdtHeaderSize
+        while off + entrySize <= length {
+            let addr =
+                entrySize == 8
+                ? sdt.loadUnaligned(fromByteOffset: off, as: UInt64.self)
+                : UInt64(sdt.loadUnaligned(fromByteOffset: off, as: UInt32.self))
+            off += entrySize
+            guard let table = UnsafeRawPointer(bitPattern: UInt(addr)) else { continue }
+            if memcmp(table, signature.utf8Start, 4) != 0 { continue }
+            let tableLength = Int(table.loadUnaligned(fromByteOffset: 4, as: UInt32.self))
+            if !checksumOK(table.assumingMemoryBound(to: UInt8.self), tableLength) {
+                kprint("ACPI: bad checksum on ")
+                console_write(signature.utf8Start, 4)
+                kprint("\n")
+                continue
+            }
+            return table
+        }
+        return nil
+    }
+
+    /// Usable CPUs from the MADT's local APIC entries, in firmware order (the
+    /// boot CPU is not necessarily first), or [] without a MADT.
+    static func processors() -> [ACPIProcessor] {
+        guard let madt = findTable("APIC") else { return [] }
+        let length = Int(madt.loadUnaligned(fromByteOffset: 4, as: UInt32.self))
+        var result: [ACPIProcessor] = []
+        // Header, then the local APIC address and flags.
+        var off = sdtHeaderSize + 8
+        while off + 2 <= length {
+            let type = madt.load(fromByteOffset: off, as: UInt8.self)
+            let entryLength = Int(madt.load(fromByteOffset: off + 1, as: UInt8.self))
+            if entryLength < 2 { break }
+            // Type 0: processor local APIC. x2APIC entries (type 9) only
+            // describe IDs above 255, which xAPIC IPIs can't reach.
+            if type == 0 && entryLength >= 8 {
+                let apicID = madt.load(fromByteOffset: off + 3, as: UInt8.self)
+                let flags = madt.loadUnaligned(fromByteOffset: off + 4, as: UInt32.self)
+                // Bit 0: enabled; bit 1: online capable (ACPI 6.3).
+                if flags & 3 != 0 {
+                    result.append(ACPIProcessor(apicID: UInt32(apicID)))
+                }
+            }
+            off += entryLength
+        }
+        return result
+    }
+}
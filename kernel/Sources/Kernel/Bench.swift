@@ -0,0 +1,311 @@
+/*
+ * Bench.swift
+ * Boot and exec benchmarks
+ *
+ * Booting with "bench" on the Multiboot command line times each phase of
+ * kmain with the TSC, from entry to the first syscall dyld makes. That
+ * syscall then runs the microbenchmarks before it returns, so dyld and
+ * everything after it are held off while they run: frame allocation, page
+ * mapping, block reads and the syscall round trip, the last measured by a
+ * small user-mode probe in dyld's address space. Results go to the serial
+ * console between the BENCH marker lines, one "name ops bytes ns" line each
+ * in hex, and the kernel then exits QEMU through isa-debug-exit if the
+ * device is there, or goes on booting if not. `build-image bench` runs the
+ * whole thing and reads the results back.
+ *
+ * Without "bench" the only cost is a load and branch in handleSyscall.
+ */
+
+import CSupport
+
+enum BenchPhase: Int {
+    case cpuSetup  // GDT, IDT, interrupts, syscall MSRs
+    case coreSetup  // PMM through SMP start
+    case pciScan  // PCI probing, taken out of virtio
+    case virtio  // device init and the shared cache
+    case vmm  // init's address space and the shared region
+    case ramdisk  // CPIO index and root mount
+    case loadDyld
+    case loadInit
+    case firstSyscall  // dyld queued to its first syscall
+
+    static let count = 9
+
+    /// The phase this one is timed inside of. Its time is taken back out of
+    /// that phase, so the phases still add up to boot.total.
+    var enclosing: BenchPhase? {
+        self == .pciScan ? .virtio : nil
+    }
+
+    var name: StaticString {
+        switch self {
+        case .cpuSetup: return "phase.cpu_setup"
+        case .coreSetup: return "phase.core_setup"
+        case .pciScan: return "phase.pci_scan"
+        case .virtio: return "phase.virtio"
+        case .vmm: return "phase.vmm"
+        case .ramdisk: return "phase.ramdisk"
+        case .loadDyld: return "phase.load_dyld"
+        case .loadInit: return "phase.load_init"
+        case .firstSyscall: return "phase.first_syscall"
+        }
+    }
+}
+
+private struct BenchResult {
+    let name: StaticString
+    let ops: UInt64
+    let bytes: UInt64
+    let cycles: UInt64
+}
+
+private let frameIterations = 4096
+private let mapIterations = 512
+private let blockLatencyReads = 256
+private let blockBulkReads = 64
+private let blockBulkSectors = 256  // 128 KiB
+private let syscallIterations: UInt32 = 10000
+private let probeTimeoutMs: UInt32 = 10_000
+/// Unused stretch of dyld's address space between the boot identity map and
+/// the mmap area, for the probe's code page and the mapping benchmark's
+/// (kernel-only) pages.
+private let mapScratch: UInt64 = 0xF_0000_0000
+private let probeBase: UInt64 = 0xF_0020_0000
+private let debugExitPort: UInt16 = 0xF4
+
+nonisolated(unsafe) private var benchEnabled = false
+nonisolated(unsafe) private var bootTSC: UInt64 = 0
+nonisolated(unsafe) private var userTSC: UInt64 = 0
+nonisolated(unsafe) private var userReached = false
+nonisolated(unsafe) private var phaseCycles:
+    (UInt64, UInt64, UInt64, UInt64, UInt64, UInt64, UInt64, UInt64, UInt64) =
+        (0, 0, 0, 0, 0, 0, 0, 0, 0)
+nonisolated(unsafe) private var probeThread: Thread?
+nonisolated(unsafe) private var probeCalls: UInt32 = 0
+nonisolated(unsafe) private var probeStart: UInt64 = 0
+nonisolated(unsafe) private var probeEnd: UInt64 = 0
+nonisolated(unsafe) private var probeDone: WaitQueue?
+
+struct Bench {
+    static var enabled: Bool { benchEnabled }
+
+    /// Check the command line. First thing in kmain, since the boot
+    /// timestamp is taken here.
+    static func setup(info: MultibootInfo) {
+        bootTSC = asm_rdtsc()
+        benchEnabled = commandLineHas(info: info, "bench")
+        if benchEnabled { kprint("Bench: benchmark mode\n") }
+    }
+
+    /// Start of a measured stretch; 0 when not benchmarking.
+    @inline(__always)
+    static func now() -> UInt64 {
+        benchEnabled ? asm_rdtsc() : 0
+    }
+
+    /// Charge the time since `start` (from now()) to `phase`.
+    static func phase(_ phase: BenchPhase, since start: UInt64) {
+        if !benchEnabled { return }
+        let cycles = asm_rdtsc() &- start
+        withUnsafeMutableBytes(of: &phaseCycles) { buf in
+            let p = buf.baseAddress!.assumingMemoryBound(to: UInt64.self)
+            p[phase.rawValue] &+= cycles
+            if let outer = phase.enclosing { p[outer.rawValue] &-= cycles }
+        }
+    }
+
+    /// dyld is about to be queued.
+    static func userLaunch() {
+        userTSC = now()
+    }
+
+    /// From handleSyscall, under the kernel lock, for every syscall while
+    /// benchmarking.
+    static func syscallEntered() {
+        if let probe = probeThread, Thread.current === probe {
+            probeCalls += 1
+            if probeCalls == 1 {
+                probeStart = asm_rdtsc()
+            } else if probeCalls == syscallIterations {
+                probeEnd = asm_rdtsc()
+                probeDone?.wakeOne()
+            }
+            return
+        }
+        if userReached { return }
+        userReached = true
+        phase(.firstSyscall, since: userTSC)
+        let total = asm_rdtsc() &- bootTSC
+        run(bootCycles: total)
+    }
+
+    // MARK: Microbenchmarks
+
+    private static func run(bootCycles: UInt64) {
+        var results: [BenchResult] = []
+        results.append(BenchResult(name: "boot.total", ops: 1, bytes: 0, cycles: bootCycles))
+        benchFrames(into: &results)
+        benchMap(into: &results)
+        benchBlock(into: &results)
+        benchSyscall(into: &results)
+        report(results)
+
+        // QEMU's -device isa-debug-exit ends the run here; elsewhere the
+        // write goes nowhere and boot carries on.
+        outb(debugExitPort, 0x10)
+    }
+
+    /// PMM.allocateFrame and PMM.freeFrame, one frame at a time.
+    private static func benchFrames(into results: inout [BenchResult]) {
+        var frames: [PhysAddr] = []
+        frames.reserveCapacity(frameIterations)
+        var t = asm_rdtsc()
+        while frames.count < frameIterations, let f = PMM.allocateFrame() { frames.append(f) }
+        let alloc = asm_rdtsc() &- t
+        t = asm_rdtsc()
+        for f in frames { PMM.freeFrame(f) }
+        let free = asm_rdtsc() &- t
+        let n = UInt64(frames.count)
+        results.append(BenchResult(name: "pmm.allocate_frame", ops: n, bytes: 0, cycles: alloc))
+        results.append(BenchResult(name: "pmm.free_frame", ops: n, bytes: 0, cycles: free))
+    }
+
+    /// VMM.map of single 4 KiB pages, each with its invlpg. The page table
+    /// they land in is built before timing starts.
+    private static func benchMap(into results: inout [BenchResult]) {
+        guard let frame = PMM.allocateFrame() else { return }
+        VMM.map(virt: mapScratch, phys: frame, flags: PTE_WRITABLE)
+        let t = asm_rdtsc()
+        for i in 0..<mapIterations {
+            VMM.map(virt: mapScratch + UInt64(i) * PAGE_SIZE, phys: frame, flags: PTE_WRITABLE)
+        }
+        let cycles = asm_rdtsc() &- t
+        VMM.unmapRange(virt: mapScratch, size: UInt64(mapIterations) * PAGE_SIZE)
+        PMM.freeFrame(frame)
+        results.append(
+            BenchResult(name: "vmm.map", ops: UInt64(mapIterations), bytes: 0, cycles: cycles))
+    }
+
+    /// virtioBlockRead: single sectors for latency, then 128 KiB requests
+    /// from the start of the disk for throughput.
+    private static func benchBlock(into results: inout [BenchResult]) {
+        guard let dev = blockDevice, dev.capacitySectors != 0 else { return }
+        let pages = blockBulkSectors * 512 / Int(PAGE_SIZE)
+        guard let frames = PMM.allocateFrames(count: pages, zero: false) else { return }
+        let buf = UnsafeMutableRawPointer(bitPattern: UInt(frames.value))!
+        let capacity = dev.capacitySectors
+
+        var t = asm_rdtsc()
+        var ok = 0
+        for i in 0..<blockLatencyReads {
+            let sector = UInt64(i * 8) % capacity
+            if virtioBlockRead(sector: sector, count: 1, buffer: buf) { ok += 1 }
+        }
+        var cycles = asm_rdtsc() &- t
+        results.append(
+            BenchResult(
+                name: "blk.read_latency", ops: UInt64(ok), bytes: UInt64(ok) * 512, cycles: cycles))
+
+        let bulk = UInt64(blockBulkSectors)
+        let reads = min(UInt64(blockBulkReads), capacity / bulk)
+        t = asm_rdtsc()
+        ok = 0
+        for i in 0..<reads {
+            if virtioBlockRead(sector: i * bulk, count: blockBulkSectors, buffer: buf) { ok += 1 }
+        }
+        cycles = asm_rdtsc() &- t
+        results.append(
+            BenchResult(
+                name: "blk.read_bulk", ops: UInt64(ok), bytes: UInt64(ok) * bulk * 512,
+                cycles: cycles))
+        PMM.freeFrames(frames, count: pages)
+    }
+
+    /// Round trips of getpid from a user thread running the probe below,
+    /// timed between its first and last entries into handleSyscall.
+    private static func benchSyscall(into results: inout [BenchResult]) {
+        guard let space = AddressSpace.current else { return }
+        space.mapObject(
+            start: probeBase, size: PAGE_SIZE,
+            prot: VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE,
+            object: VMObject(backing: .anonymous, size: PAGE_SIZE))
+
+        //     mov $iterations, %r12d
+        // 1:  mov $0x2000014, %eax      ; getpid
+        //     syscall
+        //     dec %r12d
+        //     jnz 1b
+        //     mov $0x2000169, %eax      ; bsdthread_terminate(0, 0, 0, 0)
+        //     xor %edi, %edi
+        //     xor %esi, %esi
+        //     xor %edx, %edx
+        //     xor %r10d, %r10d
+        //     syscall
+        var code: [UInt8] = [
+            0x41, 0xBC, 0, 0, 0, 0,
+            0xB8, 0x14, 0x00, 0x00, 0x02,
+            0x0F, 0x05,
+            0x41, 0xFF, 0xCC,
+            0x75, 0xF4,
+            0xB8, 0x69, 0x01, 0x00, 0x02,
+            0x31, 0xFF,
+            0x31, 0xF6,
+            0x31, 0xD2,
+            0x45, 0x31, 0xD2,
+            0x0F, 0x05,
+        ]
+        for i in 0..<4 { code[2 + i] = UInt8(truncatingIfNeeded: syscallIterations >> (8 * UInt32(i))) }
+        let page = UnsafeMutableRawPointer(bitPattern: UInt(probeBase))!
+        code.withUnsafeBytes { _ = memcpy(page, $0.baseAddress!, $0.count) }
+
+        // The probe never touches its stack; the top of its page will do.
+        let t = Thread(userEntry: probeBase, stack: probeBase + PAGE_SIZE)
+        let done = WaitQueue()
+        probeCalls = 0
+        probeThread = t
+        probeDone = done
+        Scheduler.enqueue(t)
+        _ = done.wait(timeout: probeTimeoutMs)
+        probeThread = nil
+        probeDone = nil
+        space.unmap(start: probeBase, size: PAGE_SIZE)
+
+        if probeCalls < syscallIterations {
+            kprint("Bench: syscall probe timed out\n")
+            return
+        }
+        results.append(
+            BenchResult(
+                name: "syscall.roundtrip", ops: UInt64(syscallIterations - 1), bytes: 0,
+                cycles: probeEnd &- probeStart))
+    }
+
+    // MARK: Output
+
+    private static func report(_ results: [BenchResult]) {
+        kprint("\n=== BENCH BEGIN ===\n")
+        kprint("tsc_hz ")
+        kprint_hex(Clock.tscFrequency)
+        kprint("\n")
+        withUnsafeBytes(of: &phaseCycles) { buf in
+            let p = buf.baseAddress!.assumingMemoryBound(to: UInt64.self)
+            for i in 0..<BenchPhase.count {
+                line(BenchPhase(rawValue: i)!.name, ops: 1, bytes: 0, cycles: p[i])
+            }
+        }
+        for r in results { line(r.name, ops: r.ops, bytes: r.bytes, cycles: r.cycles) }
+        kprint("=== BENCH END ===\n")
+        console_flush()
+    }
+
+    private static func line(_ name: StaticString, ops: UInt64, bytes: UInt64, cycles: UInt64) {
+        kprint(name)
+        kprint(" ")
+        kprint_hex(ops)
+        kprint(" ")
+        kprint_hex(bytes)
+        kprint(" ")
+        kprint_hex(Clock.nanoseconds(cycles: cycles))
+        kprint("\n")
+    }
+}
@@ -0,0 +1,321 @@
+/*
+ * BlockCache.swift
+ * Page-granular buffer cache over the VirtIO block device
+ *
+ * The device is cached in 4 KiB blocks (8 sectors), each held in its own PMM
+ * frame. Blocks are found through a chained hash table and recycled in LRU
+ * order once the cache is full. Two consecutive misses on adjacent blocks
+ * start read-ahead: the following blocks are submitted asynchronously, with
+ * the window doubling while the access stays sequential, up to the end of the
+ * device. A block whose read-ahead is still in flight is waited on, not
+ * re-read; only those blocks are pinned, since each read-ahead's completion
+ * callback settles its entry whether or not anyone asks for the block.
+ *
+ * The cache is read-only; nothing writes to the block device yet.
+ */
+
+import CSupport
+
+let BLOCK_CACHE_BLOCK_SIZE: UInt64 = 4096
+private let sectorsPerBlock: UInt64 = BLOCK_CACHE_BLOCK_SIZE / 512
+private let defaultCapacity = 2048  // 8 MiB
+private let minReadAhead = 4
+private let maxReadAhead = 64
+private let noEntry: Int32 = -1
+
+public struct BlockCacheStats {
+    public var hits: UInt64 = 0
+    public var misses: UInt64 = 0
+    public var readAheadIssued: UInt64 = 0
+    /// Hits on blocks brought in by read-ahead.
+    public var readAheadHits: UInt64 = 0
+    public var evictions: UInt64 = 0
+    public var errors: UInt64 = 0
+}
+
+private struct CacheEntry {
+    var block: UInt64 = 0
+    var frame: UInt64 = 0
+    var valid = false
+    var readAhead = false
+    var hashNext: Int32 = noEntry
+    var lruPrev: Int32 = noEntry
+    var lruNext: Int32 = noEntry
+}
+
+nonisolated(unsafe) private var entries: UnsafeMutablePointer<CacheEntry>!
+nonisolated(unsafe) private var capacity = 0
+nonisolated(unsafe) private var used = 0
+nonisolated(unsafe) private var buckets: UnsafeMutablePointer<Int32>!
+nonisolated(unsafe) private var bucketMask: UInt64 = 0
+/// Most recently used at the head, eviction candidates at the tail.
+nonisolated(unsafe) private var lruHead: Int32 = noEntry
+nonisolated(unsafe) private var lruTail: Int32 = noEntry
+/// In-flight reads, indexed by entry.
+nonisolated(unsafe) private var inflight: [BlockRequest?] = []
+nonisolated(unsafe) private var stats = BlockCacheStats()
+
+// Sequential access detection
+nonisolated(unsafe) private var lastMiss: UInt64 = UInt64.max
+nonisolated(unsafe) private var readAheadWindow = 0
+/// Read-ahead has been issued up to (not including) this block.
+nonisolated(unsafe) private var readAheadEnd: UInt64 = 0
+
+public struct BlockCache {
+    public static func setup(capacityPages: Int = defaultCapacity) {
+        capacity = capacityPages
+        var nb = 1
+        while nb < capacity * 2 { nb <<= 1 }
+        bucketMask = UInt64(nb - 1)
+
+        entries = kernelAlloc(size: capacity * MemoryLayout<CacheEntry>.stride)
+            .bindMemory(to: CacheEntry.self, capacity: capacity)
+        for i in 0..<capacity { entries[i] = CacheEntry() }
+        buckets = kernelAlloc(size: nb * 4).bindMemory(to: Int32.self, capacity: nb)
+        for i in 0..<nb { buckets[i] = noEntry }
+        inflight = [BlockRequest?](repeating: nil, count: capacity)
+        kprint("Block cache: ")
+        kprint_hex(UInt64(capacity))
+        kprint(" pages\n")
+    }
+
+    /// Read `count` sectors starting at `sector` through the cache.
+    public static func read(sector: UInt64, count: Int, buffer: UnsafeMutableRawPointer) -> Bool {
+        if count <= 0 { return true }
+        if entries == nil { return virtioBlockRead(sector: sector, count: count, buffer: buffer) }
+
+        var s = sector
+        let end = sector + UInt64(count)
+        var out = buffer
+        while s < end {
+            let block = s / sectorsPerBlock
+            let first = s % sectorsPerBlock
+            let n = min(end - s, sectorsPerBlock - first)
+            guard let page = self.page(block: block) else { return false }
+            memcpy(out, page.advanced(by: Int(first * 512)), Int(n * 512))
+            out = out.advanced(by: Int(n * 512))
+            s += n
+        }
+        return true
+    }
+
+    /// The cached contents of 4 KiB block `block`, reading it on a miss.
+    /// The pointer stays valid until the next cache call.
+    public static func page(block: UInt64) -> UnsafeRawPointer? {
+        if entries == nil { return nil }
+
+        if let i = lookup(block) {
+            if !complete(i) { return nil }
+            stats.hits += 1
+            if entries[Int(i)].readAhead {
+                stats.readAheadHits += 1
+                entries[Int(i)].readAhead = false
+                // Stay ahead of a reader consuming the window.
+                if block + UInt64(readAheadWindow / 2) >= readAheadEnd {
+                    issueReadAhead(from: max(readAheadEnd, block + 1), keeping: i)
+                }
+            }
+            touch(i)
+            return UnsafeRawPointer(bitPattern: UInt(entries[Int(i)].frame))
+        }
+
+        stats.misses += 1
+        if lastMiss != UInt64.max && block == lastMiss + 1 {
+            readAheadWindow =
+                readAheadWindow == 0 ? minReadAhead : min(readAheadWindow * 2, maxReadAhead)
+        } else {
+            readAheadWindow = 0
+        }
+        lastMiss = block
+
+        guard let i = insert(block) else {
+            stats.errors += 1
+            return nil
+        }
+        let frame = entries[Int(i)].frame
+        // wait() returns only once the device is done with the frame, so a
+        // failed read can hand it straight back.
+        if !virtioBlockRead(
+            sector: block * sectorsPerBlock, count: Int(sectorsPerBlock),
+            buffer: UnsafeMutableRawPointer(bitPattern: UInt(frame))!)
+        {
+            remove(i)
+            stats.errors += 1
+            return nil
+        }
+        entries[Int(i)].valid = true
+        if readAheadWindow > 0 { issueReadAhead(from: block + 1, keeping: i) }
+        return UnsafeRawPointer(bitPattern: UInt(frame))
+    }
+
+    public static var statistics: BlockCacheStats { stats }
+
+    public static func dumpStats() {
+        kprint("Block cache: hits=")
+        kprint_hex(stats.hits)
+        kprint(" misses=")
+        kprint_hex(stats.misses)
+        kprint(" ra=")
+        kprint_hex(stats.readAheadIssued)
+        kprint(" raHits=")
+        kprint_hex(stats.readAheadHits)
+        kprint(" evict=")
+        kprint_hex(stats.evictions)
+        kprint("\n")
+    }
+
+    // MARK: - Internals
+
+    private static func hash(_ block: UInt64) -> Int {
+        return Int((block &* 0x9E37_79B9_7F4A_7C15) >> 32 & bucketMask)
+    }
+
+    private static func lookup(_ block: UInt64) -> Int32? {
+        var i = buckets[hash(block)]
+        while i != noEntry {
+            if entries[Int(i)].block == block { return i }
+            i = entries[Int(i)].hashNext
+        }
+        return nil
+    }
+
+    /// Take a fresh entry for `block` (a new frame while below capacity,
+    /// otherwise the least recently used idle entry) and link it in.
+    private static func insert(_ block: UInt64) -> Int32? {
+        var i: Int32
+        if used < capacity {
+            guard let frame = PMM.allocateFrame(zero: false) else { return nil }
+            i = Int32(used)
+            used += 1
+            entries[Int(i)] = CacheEntry()
+            entries[Int(i)].frame = frame.value
+        } else {
+            i = lruTail
+            while i != noEntry && inflight[Int(i)] != nil { i = entries[Int(i)].lruPrev }
+            if i == noEntry { return nil }
+            unlink(i)
+            unhash(i)
+            stats.evictions += 1
+        }
+        entries[Int(i)].block = block
+        entries[Int(i)].valid = false
+        entries[Int(i)].readAhead = false
+        let b = hash(block)
+        entries[Int(i)].hashNext = buckets[b]
+        buckets[b] = i
+        pushFront(i)
+        return i
+    }
+
+    /// Drop an entry whose read failed. Its frame goes back to the LRU tail
+    /// for reuse.
+    private static func remove(_ i: Int32) {
+        unhash(i)
+        unlink(i)
+        entries[Int(i)].valid = false
+        entries[Int(i)].block = UInt64.max
+        entries[Int(i)].hashNext = noEntry
+        pushBack(i)
+    }
+
+    /// Wait for an in-flight read-ahead on entry `i`. Returns whether the
+    /// entry now holds valid data.
+    private static func complete(_ i: Int32) -> Bool {
+        if let req = inflight[Int(i)] {
+            _ = req.wait()
+            // Still pinned if the device somehow has not let go of the frame.
+            if !req.isDone { return false }
+        }
+        return entries[Int(i)].valid
+    }
+
+    /// Settle entry `i` once its read-ahead finishes: unpin it, and keep the
+    /// block or give the frame back for reuse.
+    private static func readAheadDone(_ i: Int32, _ req: BlockRequest) {
+        if inflight[Int(i)] !== req { return }
+        inflight[Int(i)] = nil
+        if req.succeeded {
+            entries[Int(i)].valid = true
+        } else {
+            remove(i)
+            stats.errors += 1
+        }
+    }
+
+    /// Read ahead from `start`, leaving the new entries just behind the
+    /// demand block `demand` in LRU order.
+    private static func issueReadAhead(from start: UInt64, keeping demand: Int32) {
+        if readAheadWindow == 0 { return }
+        let deviceBlocks = (blockDevice?.capacitySectors ?? 0) / sectorsPerBlock
+        var b = start
+        let stop = min(start + UInt64(readAheadWindow), deviceBlocks)
+        while b < stop {
+            if lookup(b) == nil {
+                guard let i = insert(b) else { break }
+                let buf = UnsafeMutableRawPointer(bitPattern: UInt(entries[Int(i)].frame))!
+                guard
+                    let req = virtioBlockSubmit(
+                        sector: b * sectorsPerBlock, count: Int(sectorsPerBlock), buffer: buf,
+                        completion: { readAheadDone(i, $0) })
+                else {
+                    remove(i)
+                    break
+                }
+                inflight[Int(i)] = req
+                entries[Int(i)].readAhead = true
+                stats.readAheadIssued += 1
+            }
+            b += 1
+        }
+        readAheadEnd = max(readAheadEnd, b)
+        touch(demand)
+    }
+
+    private static func touch(_ i: Int32) {
+        if lruHead == i { return }
+        unlink(i)
+        pushFront(i)
+    }
+
+    private static func pushFront(_ i: Int32) {
+        entries[Int(i)].lruPrev = noEntry
+        entries[Int(i)].lruNext = lruHead
+        if lruHead != noEntry { entries[Int(lruHead)].lruPrev = i }
+        lruHead = i
+        if lruTail == noEntry { lruTail = i }
+    }
+
+    private static func pushBack(_ i: Int32) {
+        entries[Int(i)].lruNext = noEntry
+        entries[Int(i)].lruPrev = lruTail
+        if lruTail != noEntry { entries[Int(lruTail)].lruNext = i }
+        lruTail = i
+        if lruHead == noEntry { lruHead = i }
+    }
+
+    private static func unlink(_ i: Int32) {
+        let p = entries[Int(i)].lruPrev
+        let n = entries[Int(i)].lruNext
+        if p != noEntry { entries[Int(p)].lruNext = n } else { lruHead = n }
+        if n != noEntry { entries[Int(n)].lruPrev = p } else { lruTail = p }
+        entries[Int(i)].lruPrev = noEntry
+        entries[Int(i)].lruNext = noEntry
+    }
+
+    private static func unhash(_ i: Int32) {
+        let b = hash(entries[Int(i)].block)
+        var link = buckets[b]
+        var prev = noEntry
+        while link != noEntry && link != i {
+            prev = link
+            link = entries[Int(link)].hashNext
+        }
+        if link == noEntry { return }
+        if prev == noEntry {
+            buckets[b] = entries[Int(i)].hashNext
+        } else {
+            entries[Int(prev)].hashNext = entries[Int(i)].hashNext
+        }
+        entries[Int(i)].hashNext = noEntry
+    }
+}
@@ -1,42 +1,148 @@
+/*
+ * CPIO.swift
+ * One-pass index over a newc (070701) archive
+ *
+ * The archive is walked once. Each entry is decoded straight from the header
+ * bytes into a fixed-size record; names are not copied but referenced in
+ * place, so the archive itself is the name pool. A hash table over the full
+ * paths answers findFile, and RamdiskFS builds its tree from the same records.
+ */
+
+#if KERNEL_HOST_TESTS
+import Foundation
+#else
 import CSupport
+#endif
 
-func findFile(in ramdisk: UnsafeRawPointer, size: Int, named target: StaticString) -> (
-    data: UnsafeRawPointer, size: Int
-)? {
-    var ptr = ramdisk
-    let end = ramdisk.advanced(by: size)
-    while ptr < end {
-        let raw = ptr.assumingMemoryBound(to: UInt8.self)
-        // CPIO magic "070701"
-        if raw[0] != 48 || raw[1] != 55 || raw[2] != 48 || raw[3] != 55 || raw[4] != 48
-            || raw[5] != 49
-        {
-            break
+let CPIO_HEADER_SIZE = 110
+let CPIO_MODE_TYPE: UInt32 = 0xF000
+let CPIO_MODE_FILE: UInt32 = 0x8000
+let CPIO_MODE_DIR: UInt32 = 0x4000
+
+struct CPIOEntry {
+    /// Path without a leading "./" or "/", relative to the archive start.
+    var nameOffset: Int
+    var nameLength: Int
+    var nameHash: UInt32
+    var mode: UInt32
+    var dataOffset: Int
+    var size: Int
+
+    var isFile: Bool { (mode & CPIO_MODE_TYPE) == CPIO_MODE_FILE }
+    var isDirectory: Bool { (mode & CPIO_MODE_TYPE) == CPIO_MODE_DIR }
+}
+
+final class CPIOIndex {
+    let base: UnsafeRawPointer
+    let size: Int
+    private(set) var entries: [CPIOEntry] = []
+    /// Open-addressed, power-of-two sized, at most half full. -1 is empty.
+    private var buckets: [Int32] = []
+
+    init(start: UnsafeRawPointer, size: Int) {
+        self.base = start
+        self.size = size
+        scan()
+        var n = 16
+        while n < entries.count * 2 { n <<= 1 }
+        buckets = [Int32](repeating: -1, count: n)
+        for i in 0..<entries.count {
+            var b = Int(entries[i].nameHash) & (n - 1)
+            while buckets[b] >= 0 { b = (b + 1) & (n - 1) }
+            buckets[b] = Int32(i)
         }
-        let ns = parseHex(raw.advanced(by: 94), length: 8)
-        let fs = parseHex(raw.advanced(by: 54), length: 8)
-        let namePtr = raw.advanced(by: 110)
-        var match = true
-        let tPtr = target.utf8Start
-        if Int(ns) < target.utf8CodeUnitCount {
-            match = false
-        } else {
-            for i in 0..<target.utf8CodeUnitCount {
-                if namePtr[i] != tPtr[i] {
-                    match = false
+    }
+
+    func name(of entry: CPIOEntry) -> UnsafeRawBufferPointer {
+        return UnsafeRawBufferPointer(
+            start: base.advanced(by: entry.nameOffset), count: entry.nameLength)
+    }
+
+    func data(of entry: CPIOEntry) -> UnsafeRawPointer {
+        return base.advanced(by: entry.dataOffset)
+    }
+
+    /// The entry with exactly this path.
+    func find(_ path: UnsafeRawBufferPointer) -> CPIOEntry? {
+        if buckets.isEmpty { return nil }
+        let h = vfsNameHash(path)
+        let mask = buckets.count - 1
+        var b = Int(h) & mask
+        while buckets[b] >= 0 {
+            let e = entries[Int(buckets[b])]
+            if e.nameHash == h && e.nameLength == path.count
+                && memcmp(base.advanced(by: e.nameOffset), path.baseAddress!, path.count) == 0
+            {
+                return e
+            }
+            b = (b + 1) & mask
+        }
+        return nil
+    }
+
+    private func scan() {
+        var offset = 0
+        while offset + CPIO_HEADER_SIZE <= size {
+            let raw = base.advanced(by: offset).assumingMemoryBound(to: UInt8.self)
+            // CPIO magic "070701"
+            if raw[0] != 48 || raw[1] != 55 || raw[2] != 48 || raw[3] != 55 || raw[4] != 48
+                || raw[5] != 49
+            {
+                break
+            }
+            let mode = UInt32(parseHex(raw.advanced(by: 14), length: 8))
+            let fileSize = parseHex(raw.advanced(by: 54), length: 8)
+            let nameSize = parseHex(raw.advanced(by: 94), length: 8)
+            if nameSize == 0 { break }
+
+            let dataOffset = offset + ((CPIO_HEADER_SIZE + nameSize + 3) & ~3)
+            if dataOffset + fileSize > size { break }
+
+            // nameSize counts the terminating NUL and any NUL padding after
+            // it (writeCPIO pads names to align file data), so the name ends
+            // at the first NUL.
+            let name = raw.advanced(by: CPIO_HEADER_SIZE)
+            var nameLength = 0
+            while nameLength < nameSize - 1 && name[nameLength] != 0 { nameLength += 1 }
+            if matches(name, nameLength, "TRAILER!!!") { break }
+            // Strip leading "/" and "./" components.
+            var skip = 0
+            while skip < nameLength {
+                if name[skip] == 47 {  // "/"
+                    skip += 1
+                } else if name[skip] == 46 && skip + 1 < nameLength && name[skip + 1] == 47 {
+                    skip += 2
+                } else {
                     break
                 }
             }
+            let nameOffset = offset + CPIO_HEADER_SIZE + skip
+            nameLength -= skip
+
+            if nameLength > 0 && !(nameLength == 1 && name[skip] == 46) {
+                let key = UnsafeRawBufferPointer(
+                    start: base.advanced(by: nameOffset), count: nameLength)
+                entries.append(
+                    CPIOEntry(
+                        nameOffset: nameOffset, nameLength: nameLength,
+                        nameHash: vfsNameHash(key), mode: mode, dataOffset: dataOffset,
+                        size: fileSize))
+            }
+            offset = (dataOffset + fileSize + 3) & ~3
         }
-        let headerAndNameSize = 110 + Int(ns)
-        let paddedHeaderSize = (headerAndNameSize + 3) & ~3
-        let dataPtr = ptr.advanced(by: paddedHeaderSize)
-        if match { return (dataPtr, Int(fs)) }
-        ptr = dataPtr.advanced(by: (Int(fs) + 3) & ~3)
-        // Trailer check "TRAILER!!!"
-        if fs == 0 && ns == 11 && namePtr[0] == 84 { break }
     }
-    return nil
+}
+
+private func matches(_ p: UnsafePointer<UInt8>, _ length: Int, _ s: StaticString) -> Bool {
+    return length == s.utf8CodeUnitCount && memcmp(p, s.utf8Start, length) == 0
+}
+
+func findFile(in index: CPIOIndex, named target: StaticString) -> (
+    data: UnsafeRawPointer, size: Int
+)? {
+    let key = UnsafeRawBufferPointer(start: target.utf8Start, count: target.utf8CodeUnitCount)
+    guard let e = index.find(key), e.isFile else { return nil }
+    return (index.data(of: e), e.size)
 }
 
 func parseHex(_ s: UnsafeRawPointer, length: Int) -> Int {
@@ -0,0 +1,332 @@
+/*
+ * Clock.swift
+ * TSC clocksource and the commpage
+ *
+ * Kernel and user time both come from the TSC, whose rate is measured once
+ * at boot against the HPET main counter (or PIT channel 2 without an HPET).
+ * mach_absolute_time counts nanoseconds since then, so the timebase is 1/1.
+ * The wall clock is the CMOS RTC as read at boot, carried forward by the TSC.
+ *
+ * The commpage is the page XNU maps read-only at 0x7FFF_FFE0_0000 in every
+ * task. libsystem computes mach_absolute_time from its nanotime fields and
+ * gettimeofday from its timestamp without trapping; the timestamp is
+ * refreshed from CPU 0's scheduler tick, well within the second after which
+ * libsystem stops trusting it and makes the syscall instead.
+ */
+
+import CSupport
+
+let COMM_PAGE_ADDRESS: UInt64 = 0x7FFF_FFE0_0000
+
+// Offsets into the commpage (osfmk/i386/cpu_capabilities.h)
+private let cpSignature = 0x000
+private let cpCapabilities64 = 0x010
+private let cpVersion = 0x01E
+private let cpCapabilities = 0x020
+private let cpNCPUs = 0x022
+private let cpCacheLineSize = 0x026
+private let cpSpinCount = 0x030
+private let cpActiveCPUs = 0x034
+private let cpPhysicalCPUs = 0x035
+private let cpLogicalCPUs = 0x036
+private let cpMemorySize = 0x038
+private let cpKernelPageShift = 0x04D
+private let cpUserPageShift64 = 0x04E
+private let cpNTTSCBase = 0x050
+private let cpNTScale = 0x058
+private let cpNTShift = 0x05C
+private let cpNTNSBase = 0x060
+private let cpNTGeneration = 0x068
+private let cpGTODGeneration = 0x06C
+private let cpGTODNSBase = 0x070
+private let cpGTODSecBase = 0x078
+private let cpApproxTime = 0x080
+private let cpApproxTimeSupported = 0x088
+private let cpContTimebase = 0x0C0
+private let cpBoottimeUsec = 0x0C8
+/// new_commpage_timeofday_data_t: TimeStamp_tick, TimeStamp_sec,
+/// TimeStamp_frac, Ticks_scale, Ticks_per_sec.
+private let cpNewTimeOfDay = 0x0D0
+
+private let commPageVersion: UInt16 = 14
+
+// _cpu_capabilities bits
+private let kHasMMX: UInt64 = 0x1
+private let kHasSSE: UInt64 = 0x2
+private let kHasSSE2: UInt64 = 0x4
+private let kHasSSE3: UInt64 = 0x8
+private let kCache64: UInt64 = 0x20
+private let kFastThreadLocalStorage: UInt64 = 0x80
+private let kHasSupplementalSSE3: UInt64 = 0x100
+private let k64Bit: UInt64 = 0x200
+private let kHasSSE4_1: UInt64 = 0x400
+private let kHasSSE4_2: UInt64 = 0x800
+private let kHasAES: UInt64 = 0x1000
+private let kUP: UInt64 = 0x8000
+private let kNumCPUsShift: UInt64 = 16
+private let kHasAVX1_0: UInt64 = 0x0100_0000
+private let kHasRDRAND: UInt64 = 0x0200_0000
+private let kHasF16C: UInt64 = 0x0400_0000
+private let kHasENFSTRG: UInt64 = 0x0800_0000
+private let kHasFMA: UInt64 = 0x1000_0000
+private let kHasAVX2_0: UInt64 = 0x2000_0000
+private let kHasBMI1: UInt64 = 0x4000_0000
+private let kHasBMI2: UInt64 = 0x8000_0000
+
+private let nsPerSec: UInt64 = 1_000_000_000
+/// Refresh the gettimeofday timestamp this often (in scheduler ticks).
+private let timestampTicks = Int(SCHED_HZ / 2)
+private let calibrationMs: UInt64 = 20
+
+nonisolated(unsafe) private var tscHz: UInt64 = 0
+nonisolated(unsafe) private var tscBase: UInt64 = 0
+/// Nanoseconds per TSC tick as a 32.32 fixed-point fraction.
+nonisolated(unsafe) private var tscScale: UInt32 = 0
+/// Wall-clock nanoseconds since the epoch at nanotime 0.
+nonisolated(unsafe) private var bootWallNs: UInt64 = 0
+nonisolated(unsafe) private var commPage: UnsafeMutableRawPointer?
+nonisolated(unsafe) private var ticksSinceStamp = 0
+
+struct Clock {
+    /// Measure the TSC and read the RTC. Call once on the boot CPU, before
+    /// the APs are started.
+    static func setup() {
+        if (cpu_features & CPU_FEATURE_INVARIANT_TSC) == 0 {
+            kprint("Clock: TSC is not invariant, time may drift\n")
+        }
+        let viaHPET = calibrateHPET()
+        if !viaHPET { calibratePIT() }
+        tscBase = asm_rdtsc()
+        // The 64-bit commpage code multiplies by a 32-bit scale, which
+        // cannot express a TSC slower than 1 GHz.
+        let scale = (nsPerSec << 32) / tscHz
+        tscScale = UInt32(clamping: scale)
+        if scale > UInt64(UInt32.max) { kprint("Clock: TSC below 1 GHz, time runs slow\n") }
+        bootWallNs = readRTC() &* nsPerSec
+
+        kprint(viaHPET ? "Clock: TSC at " : "Clock: TSC (PIT) at ")
+        kprint_hex(tscHz)
+        kprint(" Hz\n")
+    }
+
+    static var tscFrequency: UInt64 { tscHz }
+
+    /// mach_absolute_time: nanoseconds since Clock.setup.
+    static func nanotime() -> UInt64 {
+        return nanotime(tsc: asm_rdtsc())
+    }
+
+    private static func nanotime(tsc: UInt64) -> UInt64 {
+        return nanoseconds(cycles: tsc &- tscBase)
+    }
+
+    /// A TSC interval in nanoseconds.
+    static func nanoseconds(cycles: UInt64) -> UInt64 {
+        let product = cycles.multipliedFullWidth(by: UInt64(tscScale))
+        return (product.high << 32) | (product.low >> 32)
+    }
+
+    /// Seconds and microseconds since the epoch.
+    static func timeOfDay() -> (sec: UInt64, usec: UInt64) {
+        let wall = bootWallNs &+ nanotime()
+        return (wall / nsPerSec, (wall % nsPerSec) / 1000)
+    }
+
+    // MARK: Calibration
+
+    /// Count TSC ticks across calibrationMs of the HPET main counter.
+    private static func calibrateHPET() -> Bool {
+        guard let table = ACPI.findTable("HPET") else { return false }
+        // Generic address structure at 40; the address is at 44.
+        let base = table.loadUnaligned(fromByteOffset: 44, as: UInt64.self)
+        guard let hpet = UnsafeMutablePointer<UInt64>(bitPattern: UInt(base)) else { return false }
+        let periodFs = hpet[0] >> 32  // GCAP_ID: femtoseconds per tick
+        if periodFs == 0 || periodFs > 100_000_000 { return false }
+        hpet[2] |= 1  // GEN_CONF.ENABLE_CNF, 0x10
+        let wait = calibrationMs * 1_000_000_000_000 / periodFs
+
+        let start = hpet[30]  // main counter, 0xF0
+        let tsc0 = asm_rdtsc()
+        var now = start
+        while now &- start < wait {
+            asm_pause()
+            now = hpet[30]
+        }
+        let tsc1 = asm_rdtsc()
+        let elapsedFs = (now &- start) * periodFs
+        let ticks = (tsc1 &- tsc0).multipliedFullWidth(by: 1_000_000_000_000_000)
+        tscHz = elapsedFs.dividingFullWidth(ticks).quotient
+        return tscHz != 0
+    }
+
+    private static func calibratePIT() {
+        let tsc0 = asm_rdtsc()
+        pit_delay_us(UInt32(calibrationMs * 1000))
+        let tsc1 = asm_rdtsc()
+        tscHz = max((tsc1 &- tsc0) * 1000 / calibrationMs, 1)
+    }
+
+    // MARK: RTC
+
+    private static func cmos(_ reg: UInt8) -> UInt8 {
+        outb(0x70, reg)
+        return inb(0x71)
+    }
+
+    /// Seconds since the epoch from the CMOS clock, taken as UTC in 20xx.
+    private static func readRTC() -> UInt64 {
+        func snapshot() -> [UInt8] {
+            while cmos(0x0A) & 0x80 != 0 { asm_pause() }  // update in progress
+            return [cmos(0x00), cmos(0x02), cmos(0x04), cmos(0x07), cmos(0x08), cmos(0x09)]
+        }
+        var r = snapshot()
+        while true {
+            let again = snapshot()
+            if again == r { break }
+            r = again
+        }
+        let statusB = cmos(0x0B)
+        let pm = r[2] & 0x80 != 0
+        r[2] &= 0x7F
+        if statusB & 0x04 == 0 {  // BCD
+            for i in 0..<r.count { r[i] = (r[i] & 0x0F) + (r[i] >> 4) * 10 }
+        }
+        var hour = UInt64(r[2])
+        if statusB & 0x02 == 0 {  // 12-hour clock
+            if hour == 12 { hour = 0 }
+            if pm { hour += 12 }
+        }
+        let days = daysFromCivil(year: 2000 + Int64(r[5]), month: Int64(r[4]), day: Int64(r[3]))
+        return UInt64(days) * 86400 + hour * 3600 + UInt64(r[1]) * 60 + UInt64(r[0])
+    }
+
+    /// Days since 1970-01-01 for a proleptic Gregorian date.
+    private static func daysFromCivil(year: Int64, month: Int64, day: Int64) -> Int64 {
+        let y = month <= 2 ? year - 1 : year
+        let era = y / 400
+        let yoe = y - era * 400
+        let doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1
+        let doe = yoe * 365 + yoe / 4 - yoe / 100 + doy
+        return era * 146097 + doe - 719468
+    }
+
+    // MARK: Ticks
+
+    /// From CPU 0's scheduler tick.
+    static func tick() {
+        guard let page = commPage else { return }
+        let now = nanotime()
+        page.storeBytes(of: now, toByteOffset: cpApproxTime, as: UInt64.self)
+        ticksSinceStamp += 1
+        if ticksSinceStamp >= timestampTicks {
+            ticksSinceStamp = 0
+            CommPage.stamp(page, at: now)
+        }
+    }
+}
+
+// MARK: - Commpage
+
+struct CommPage {
+    /// Allocate, fill and map the commpage into the current address space.
+    static func setup() {
+        guard let frame = PMM.allocateFrame() else {
+            kprint("CommPage: no memory\n")
+            return
+        }
+        let page = UnsafeMutableRawPointer(bitPattern: UInt(frame.value))!
+        let signature: StaticString = "commpage 64-bit"
+        memcpy(page, signature.utf8Start, signature.utf8CodeUnitCount)
+        page.storeBytes(of: commPageVersion, toByteOffset: cpVersion, as: UInt16.self)
+
+        let ncpu = UInt64(min(onlineCPUCount(), 255))
+        let caps = capabilities(ncpu: ncpu)
+        page.storeBytes(of: caps, toByteOffset: cpCapabilities64, as: UInt64.self)
+        page.storeBytes(of: UInt32(truncatingIfNeeded: caps), toByteOffset: cpCapabilities, as: UInt32.self)
+        page.storeBytes(of: UInt8(ncpu), toByteOffset: cpNCPUs, as: UInt8.self)
+        page.storeBytes(of: UInt16(64), toByteOffset: cpCacheLineSize, as: UInt16.self)
+        page.storeBytes(of: UInt32(1000), toByteOffset: cpSpinCount, as: UInt32.self)
+        page.storeBytes(of: UInt8(ncpu), toByteOffset: cpActiveCPUs, as: UInt8.self)
+        page.storeBytes(of: UInt8(ncpu), toByteOffset: cpPhysicalCPUs, as: UInt8.self)
+        page.storeBytes(of: UInt8(ncpu), toByteOffset: cpLogicalCPUs, as: UInt8.self)
+        page.storeBytes(of: PMM.managedFrames * PAGE_SIZE, toByteOffset: cpMemorySize, as: UInt64.self)
+        page.storeBytes(of: UInt8(12), toByteOffset: cpKernelPageShift, as: UInt8.self)
+        page.storeBytes(of: UInt8(12), toByteOffset: cpUserPageShift64, as: UInt8.self)
+
+        // nanotime(): ((rdtsc - tsc_base) * scale >> 32) + ns_base. The
+        // generation goes nonzero last; readers spin while it is zero.
+        page.storeBytes(of: tscBase, toByteOffset: cpNTTSCBase, as: UInt64.self)
+        page.storeBytes(of: tscScale, toByteOffset: cpNTScale, as: UInt32.self)
+        page.storeBytes(of: UInt32(32), toByteOffset: cpNTShift, as: UInt32.self)
+        page.storeBytes(of: UInt64(0), toByteOffset: cpNTNSBase, as: UInt64.self)
+        page.storeBytes(of: UInt64(0), toByteOffset: cpContTimebase, as: UInt64.self)
+        page.storeBytes(of: bootWallNs / 1000, toByteOffset: cpBoottimeUsec, as: UInt64.self)
+        page.storeBytes(of: UInt8(1), toByteOffset: cpApproxTimeSupported, as: UInt8.self)
+        asm_memory_fence()
+        page.storeBytes(of: UInt32(1), toByteOffset: cpNTGeneration, as: UInt32.self)
+
+        stamp(page, at: Clock.nanotime())
+        commPage = page
+        // Present and user, not writable.
+        VMM.map(virt: COMM_PAGE_ADDRESS, phys: frame, flags: 5)
+    }
+
+    /// Publish the wall-clock time at nanotime `now` for gettimeofday.
+    fileprivate static func stamp(_ page: UnsafeMutableRawPointer, at now: UInt64) {
+        let wall = bootWallNs &+ now
+        let sec = wall / nsPerSec
+        let rem = wall % nsPerSec
+        // rem/1e9 as a 0.64 fraction, and one tick (1 ns) likewise.
+        let frac = nsPerSec.dividingFullWidth((high: rem, low: 0)).quotient
+        let scale = nsPerSec.dividingFullWidth((high: 1, low: 0)).quotient
+
+        // A zero TimeStamp_tick sends readers to the syscall until the rest
+        // is consistent again.
+        let tod = cpNewTimeOfDay
+        page.storeBytes(of: UInt64(0), toByteOffset: tod, as: UInt64.self)
+        page.storeBytes(of: UInt32(0), toByteOffset: cpGTODGeneration, as: UInt32.self)
+        asm_memory_fence()
+        page.storeBytes(of: sec, toByteOffset: tod + 8, as: UInt64.self)
+        page.storeBytes(of: frac, toByteOffset: tod + 16, as: UInt64.self)
+        page.storeBytes(of: scale, toByteOffset: tod + 24, as: UInt64.self)
+        page.storeBytes(of: nsPerSec, toByteOffset: tod + 32, as: UInt64.self)
+        // Older libsystems: seconds at ns_base, which falls on a second.
+        page.storeBytes(of: now &- rem, toByteOffset: cpGTODNSBase, as: UInt64.self)
+        page.storeBytes(of: sec, toByteOffset: cpGTODSecBase, as: UInt64.self)
+        asm_memory_fence()
+        page.storeBytes(of: now, toByteOffset: tod, as: UInt64.self)
+        page.storeBytes(of: UInt32(1), toByteOffset: cpGTODGeneration, as: UInt32.self)
+    }
+
+    /// _cpu_capabilities from CPUID and what the kernel has turned on.
+    private static func capabilities(ncpu: UInt64) -> UInt64 {
+        var r: (UInt32, UInt32, UInt32, UInt32) = (0, 0, 0, 0)
+        func cpuid(_ leaf: UInt32) {
+            withUnsafeMutableBytes(of: &r) { raw in
+                asm_cpuid(leaf, 0, raw.baseAddress!.assumingMemoryBound(to: UInt32.self))
+            }
+        }
+        var caps = kHasMMX | kHasSSE | kHasSSE2 | kCache64 | kFastThreadLocalStorage | k64Bit
+        caps |= (ncpu << kNumCPUsShift)
+        if ncpu == 1 { caps |= kUP }
+        cpuid(1)
+        let ecx = r.2
+        if ecx & (1 << 0) != 0 { caps |= kHasSSE3 }
+        if ecx & (1 << 9) != 0 { caps |= kHasSupplementalSSE3 }
+        if ecx & (1 << 19) != 0 { caps |= kHasSSE4_1 }
+        if ecx & (1 << 20) != 0 { caps |= kHasSSE4_2 }
+        if ecx & (1 << 25) != 0 { caps |= kHasAES }
+        if ecx & (1 << 30) != 0 { caps |= kHasRDRAND }
+        // AVX state is only enabled in XCR0 together with AVX2.
+        if (cpu_features & CPU_FEATURE_AVX2) != 0 {
+            caps |= kHasAVX1_0 | kHasAVX2_0
+            if ecx & (1 << 29) != 0 { caps |= kHasF16C }
+            if ecx & (1 << 12) != 0 { caps |= kHasFMA }
+        }
+        if (cpu_features & CPU_FEATURE_ERMS) != 0 { caps |= kHasENFSTRG }
+        cpuid(7)
+        if r.1 & (1 << 3) != 0 { caps |= kHasBMI1 }
+        if r.1 & (1 << 8) != 0 { caps |= kHasBMI2 }
+        return caps
+    }
+}
@@ -5,54 +5,87 @@
 
 import CSupport
 
-// Global bump allocator state
-nonisolated(unsafe) public var nextKernelAddr: UInt64 = 0x100000 + 4096 * 16  // After 1MB + 64KB stack
-
-@_cdecl("kernel_alloc")
-public func kernelAlloc(size: Int, align: Int = 16) -> UnsafeMutableRawPointer {
-    let aligned = (nextKernelAddr + UInt64(align) - 1) & ~(UInt64(align) - 1)
-    nextKernelAddr = aligned + UInt64(size)
-    return UnsafeMutableRawPointer(bitPattern: UInt(aligned))!
-}
-
 @_cdecl("kmain")
 public func kmain(magic: UInt32, infoAddr: UInt32) {
     serial_init()
     kprint("SwiftOS Kernel Booting...\n")
 
-    kprint("Magic: ")
-    kprint_hex(UInt64(magic))
-    kprint("\n")
+    // Detect CPU features and pick the mem* implementations
+    cpu_features_init()
+
+    if Log.debug {
+        kprint("Magic: ")
+        kprint_hex(UInt64(magic))
+        kprint("\n")
+    }
 
     if magic != 0x36d7_6289 && magic != 0x2BAD_B002 {
         kprint("Error: Invalid Multiboot magic\n")
         return
     }
+    let info = UnsafePointer<MultibootInfo>(bitPattern: UInt(infoAddr))!.pointee
+    Bench.setup(info: info)
 
     // Capture stack top (offset from Multiboot info or hardcoded)
     let stackAddr = get_stack_top()
-    kprint("Stack Top: ")
-    kprint_hex(stackAddr)
-    kprint("\n")
+    if Log.debug {
+        kprint("Stack Top: ")
+        kprint_hex(stackAddr)
+        kprint("\n")
+    }
 
     // Setup FSGSBASE
     enable_fsgsbase()
 
-    // Initialize GDT/TSS
-    setup_gdt_tss(stackAddr)
+    // Per-CPU block, GDT and TSS for the boot CPU
+    var phaseStart = Bench.now()
+    cpu_init_bsp()
 
-    // Setup IDT
+    // Setup IDT, then mask the legacy PICs and enable the local APIC
     setup_idt()
+    irq_init()
+    console_irq_init()
 
     // Setup Syscall MSRs
     setup_syscall_msrs()
+    Bench.phase(.cpuSetup, since: phaseStart)
 
+    // Hand usable RAM to the frame allocator
+    phaseStart = Bench.now()
+    PMM.setup(info: info)
+    // Before SMP.start: APs copy CR0 and CR4 (WP, PCIDE) from this CPU, and
+    // drivers may map MMIO through the boot root.
+    VMM.setup()
+    Trace.setup()
+    Heap.setup()
+    registerSyscalls()
+    Sysctl.setup()
+    Clock.setup()
+    Scheduler.setup()
+    SMP.start()
+    Bench.phase(.coreSetup, since: phaseStart)
+
+    phaseStart = Bench.now()
     initVirtioGpu()
     initVirtioBlock()
-    VMM.setup()
+    if blockDevice != nil {
+        BlockCache.setup()
+        loadSharedCache()
+    }
+    Bench.phase(.virtio, since: phaseStart)
 
-    // Parse Multiboot info to find ramdisk
-    let info = UnsafePointer<MultibootInfo>(bitPattern: UInt(infoAddr))!.pointee
+    phaseStart = Bench.now()
+
+    // User mappings for init go into their own address space
+    guard let initSpace = AddressSpace() else {
+        kprint("Error: Failed to create address space\n")
+        while true { asm_hlt() }
+    }
+    initSpace.activate()
+    attachSharedRegion(to: initSpace)
+    Bench.phase(.vmm, since: phaseStart)
+
+    // Find ramdisk
     if (info.flags & (1 << 3)) == 0 || info.mods_count == 0 {
         kprint("Error: No ramdisk found\n")
         while true { asm_hlt() }
@@ -65,30 +98,38 @@ public func kmain(magic: UInt32, infoAddr: UInt32) {
     kprint(" size=")
     kprint_hex(UInt64(rdSize))
     kprint("\n")
+    phaseStart = Bench.now()
+    let ramdisk = CPIOIndex(start: rdStart, size: rdSize)
+    VFS.shared.mount(root: RamdiskFS(index: ramdisk).root)
+    FileTable.current = FileTable()
+    IPCSpace.current = IPCSpace()
+    Bench.phase(.ramdisk, since: phaseStart)
 
     // Find dyld in ramdisk
-    if let (dyldData, dyldSize) = findFile(
-        in: rdStart, size: rdSize, named: "usr/lib/dyld")
-    {
+    if let (dyldData, dyldSize) = findFile(in: ramdisk, named: "usr/lib/dyld") {
         kprint("Found dyld: size=")
         kprint_hex(UInt64(dyldSize))
         kprint("\n")
 
         kprint("Loading dyld...\n")
-        if let dyldResult = loadMachO(data: dyldData, size: dyldSize, slide: 0x1000_0000) {
+        phaseStart = Bench.now()
+        let dyldLoaded = loadMachO(data: dyldData, size: dyldSize, slide: 0x1000_0000)
+        Bench.phase(.loadDyld, since: phaseStart)
+        if let dyldResult = dyldLoaded {
             kprint("dyld loaded. Entry: ")
             kprint_hex(dyldResult.entryPoint)
             kprint("\n")
 
             // Find executable (shell)
-            if let (file, size) = findFile(
-                in: rdStart, size: rdSize, named: "init")
-            {
+            if let (file, size) = findFile(in: ramdisk, named: "init") {
                 kprint("Found /bin/zsh\n")
-                if let result = loadMachO(
+                phaseStart = Bench.now()
+                let initLoaded = loadMachO(
                     data: file, size: size,
                     slide: 0xFFFF_FFFF_0200_0000  // Wrapping: 0x100000000 + this = 0x02000000
-                ) {
+                )
+                Bench.phase(.loadInit, since: phaseStart)
+                if let result = initLoaded {
                     kprint("Loaded zsh. Entry: ")
                     kprint_hex(result.entryPoint)
                     kprint("\n")
@@ -100,18 +141,18 @@ public func kmain(magic: UInt32, infoAddr: UInt32) {
                         let stackTopVirt: UInt64 = 0x7000_0000
                         let stackStartVirt = stackTopVirt - stackSize
 
-                        kprint("Mapping user stack at ")
-                        kprint_hex(stackStartVirt)
-                        kprint("...\n")
-
-                        for i in 0..<(stackSize / 4096) {
-                            if let frame = PMM.allocateFrame() {
-                                VMM.map(
-                                    virt: stackStartVirt + (UInt64(i) * 4096), phys: frame, flags: 7
-                                )
-                            }
+                        if Log.debug {
+                            kprint("Mapping user stack at ")
+                            kprint_hex(stackStartVirt)
+                            kprint("...\n")
                         }
 
+                        // Demand-zero; setupDyldStack() faults the pages in.
+                        AddressSpace.current?.mapObject(
+                            start: stackStartVirt, size: stackSize,
+                            prot: VM_PROT_READ | VM_PROT_WRITE,
+                            object: VMObject(backing: .anonymous, size: stackSize))
+
                         let zshSlide: UInt64 = 0xFFFF_FFFF_0200_0000
                         let userStack = setupDyldStack(
                             execPath: "init",
@@ -120,21 +161,17 @@ public func kmain(magic: UInt32, infoAddr: UInt32) {
                             stackTop: stackTopVirt
                         )
 
-                        // Remap user regions with USER permission (7 = Present | RW | User)
-                        remapUserRange(start: 0x0200_0000, size: 0x0100_0000)  // 16MB
-                        remapUserRange(start: 0x1000_0000, size: 0x0100_0000)  // 16MB
+                        // The dyld and init images are demand-paged regions now;
+                        // this window is still plain identity memory.
                         remapUserRange(start: 0x1EE0_0000, size: 0x0020_0000)  // 2MB
 
-                        // Map fake CommPage (address used by macOS for system info)
-                        kprint("Allocating CommPage frame...\n")
-                        if let cpFrame = PMM.allocateFrame() {
-                            kprint("Mapping CommPage...\n")
-                            VMM.map(virt: 0x7FFF_FFE0_0000, phys: cpFrame, flags: 7)
-                            kprint("CommPage mapped.\n")
-                        }
+                        // Time base and CPU description libsystem reads in place
+                        CommPage.setup()
 
                         kprint("Jumping to dyld...\n")
-                        jump_to_user(dyldResult.entryPoint, userStack)
+                        Bench.userLaunch()
+                        Scheduler.enqueue(Thread(userEntry: dyldResult.entryPoint, stack: userStack))
+                        kernelIdle()
                     }
                 } else {
                     kprint("dyld not found in ramdisk, jumping to binary entry\n")
@@ -154,7 +191,14 @@ public func kmain(magic: UInt32, infoAddr: UInt32) {
         // jump_to_user(0x800000, 0x900000)
     }
 
-    while true { asm_hlt() }
+    kernelIdle()
+}
+
+/// The boot CPU's idle thread from here on (see Scheduler.idleLoop).
+/// Interrupts are only open across its halt; that is also when the console
+/// drains whatever is still queued.
+func kernelIdle() -> Never {
+    Scheduler.idleLoop()
 }
 
 // MARK: - dyld Stack Setup
@@ -205,12 +249,14 @@ func setupDyldStack(execPath: StaticString, textBase: UInt64, entryPoint: UInt64
     spBase[5] = execPathAddr  // apple[0] (executable_path)
     spBase[6] = 0  // apple terminator
 
-    kprint("User Stack (KernelArgs):\n")
-    kprint("  SP: ")
-    kprint_hex(UInt64(UInt(bitPattern: spBase)))
-    kprint("\n  mainExec: ")
-    kprint_hex(textBase)
-    kprint("\n  argc: 1\n")
+    if Log.debug {
+        kprint("User Stack (KernelArgs):\n")
+        kprint("  SP: ")
+        kprint_hex(UInt64(UInt(bitPattern: spBase)))
+        kprint("\n  mainExec: ")
+        kprint_hex(textBase)
+        kprint("\n  argc: 1\n")
+    }
 
     return UInt64(UInt(bitPattern: spBase))
 }
@@ -220,23 +266,21 @@ func setupDyldStack(execPath: StaticString, textBase: UInt64, entryPoint: UInt64
 func kprint_hex(_ v: UInt64) {
     let hex: StaticString = "0123456789ABCDEF"
     let h = hex.utf8Start
-    for i in 0..<16 {
-        let shift = (15 - i) * 4
-        let digit = Int((v >> shift) & 0xF)
-        serial_putc(h[digit])
+    var digits: (UInt64, UInt64) = (0, 0)
+    withUnsafeMutableBytes(of: &digits) { buf in
+        for i in 0..<16 {
+            let shift = (15 - i) * 4
+            buf[i] = h[Int((v >> shift) & 0xF)]
+        }
+        console_write(buf.baseAddress!.assumingMemoryBound(to: UInt8.self), 16)
     }
 }
 
 @_silgen_name("kprint")
 func kprint(_ s: StaticString) {
-    let p = s.utf8Start
-    for i in 0..<s.utf8CodeUnitCount { serial_putc(p[i]) }
+    console_write(s.utf8Start, s.utf8CodeUnitCount)
 }
 
 func remapUserRange(start: UInt64, size: UInt64) {
-    let pages = (size + 4095) / 4096
-    for i in 0..<pages {
-        let addr = start + UInt64(i * 4096)
-        VMM.map(virt: addr, phys: PhysAddr(addr), flags: 7)
-    }
+    VMM.mapRange(virt: start, phys: PhysAddr(start), size: size, flags: 7)
 }
@@ -0,0 +1,67 @@
+/*
+ * Log.swift
+ * Leveled kernel logging
+ *
+ * The most verbose level a build can print is fixed at compile time by a
+ * LOG_LEVEL_* condition from Package.swift (debug builds: trace, release
+ * builds: info). Chatty call sites are wrapped as
+ *
+ *     if Log.debug { kprint(...); kprint_hex(...) }
+ *
+ * and Log.debug is a constant false above the build's ceiling, so the whole
+ * block is compiled out. Below it, debug.log_level can lower the level at
+ * run time.
+ */
+
+public enum LogLevel: UInt32 {
+    case error = 0
+    case warning = 1
+    case info = 2
+    case debug = 3
+    case trace = 4
+}
+
+#if LOG_LEVEL_TRACE
+    let compiledLogLevel = LogLevel.trace
+#elseif LOG_LEVEL_DEBUG
+    let compiledLogLevel = LogLevel.debug
+#elseif LOG_LEVEL_WARNING
+    let compiledLogLevel = LogLevel.warning
+#elseif LOG_LEVEL_ERROR
+    let compiledLogLevel = LogLevel.error
+#else
+    let compiledLogLevel = LogLevel.info
+#endif
+
+nonisolated(unsafe) private var runtimeLevel = compiledLogLevel.rawValue
+
+public struct Log {
+    /// The current level; never above what the build includes.
+    public static var level: LogLevel {
+        get { LogLevel(rawValue: runtimeLevel) ?? compiledLogLevel }
+        set { runtimeLevel = min(newValue.rawValue, compiledLogLevel.rawValue) }
+    }
+
+    @inline(__always)
+    public static func enabled(_ l: LogLevel) -> Bool {
+        return l.rawValue <= compiledLogLevel.rawValue && l.rawValue <= runtimeLevel
+    }
+
+    public static var info: Bool { @inline(__always) get { enabled(.info) } }
+    public static var debug: Bool { @inline(__always) get { enabled(.debug) } }
+    public static var trace: Bool { @inline(__always) get { enabled(.trace) } }
+
+    /// debug.log_level: the level as a 32-bit integer; writable.
+    static func sysctl(_ req: inout SysctlRequest) -> Int32 {
+        var v = runtimeLevel
+        if !withUnsafeBytes(of: &v, { req.output($0) }) { return 12 }  // ENOMEM
+        if let newp = req.newp {
+            if req.newLength != 4 { return 22 }  // EINVAL
+            guard let l = LogLevel(rawValue: newp.loadUnaligned(as: UInt32.self)) else {
+                return 22
+            }
+            level = l
+        }
+        return 0
+    }
+}
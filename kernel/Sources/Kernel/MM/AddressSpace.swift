@@ -0,0 +1,187 @@
+/*
+ * MM/AddressSpace.swift
+ * Per-task page tables
+ *
+ * Each AddressSpace owns a PML4 whose entries start out as shared references
+ * to the boot tables (identity map and kernel half). Tables are copied the
+ * first time a mapping below them changes (see PTE_SHARED in VMM.swift), so a
+ * fresh address space costs one page. Kernel mappings made later go to every
+ * live address space (VMM.mapRange).
+ *
+ * With PCID, every address space gets a tag of its own while one is free,
+ * and switching CR3 keeps the TLB contents of the others. A CPU flushes the
+ * tag the first time it loads the space, since an earlier owner of that tag
+ * may have left entries there. Once all tags are live, further spaces share
+ * tag 0 and flush on every switch.
+ *
+ * Changing a space's translations must reach every TLB that may hold them.
+ * CPUs with the space in CR3 right now flush by shootdown IPI (cpu.c); the
+ * others can only hold it under its tag, so they lose their flushedOn bit
+ * and flush it the next time they load the space.
+ */
+
+import CSupport
+
+private let maxPCID: UInt16 = 4095
+/// One bit per tag in use; tag 0 is the shared one and never handed out.
+nonisolated(unsafe) private var pcidInUse = [UInt64](repeating: 0, count: (Int(maxPCID) + 1) / 64)
+nonisolated(unsafe) private var nextPCID: UInt16 = 1
+/// Guards the tag bitmap and the list of live address spaces.
+nonisolated(unsafe) private var spacesLock = spinlock_t()
+nonisolated(unsafe) private var liveSpaces: AddressSpace?
+/// The space in each CPU's CR3. Holding it keeps the tables alive until the
+/// CPU loads another.
+nonisolated(unsafe) private let loadedSpaces: UnsafeMutablePointer<AddressSpace?> = {
+    let p = UnsafeMutablePointer<AddressSpace?>.allocate(capacity: Int(MAX_CPUS))
+    p.initialize(repeating: nil, count: Int(MAX_CPUS))
+    return p
+}()
+
+public final class AddressSpace {
+    /// The space loaded on this CPU.
+    public static var current: AddressSpace? { loadedSpaces[currentCPUIndex()] }
+
+    let root: UnsafeMutablePointer<UInt64>
+    let rootPhys: UInt64
+    let pcid: UInt16
+    /// CPUs that have flushed `pcid` since it was last invalidated, and so
+    /// may switch to this space without a flush; guarded by tlbLock.
+    private var flushedOn: UInt64 = 0
+    /// CPUs with this space in CR3; guarded by tlbLock.
+    private var loadedOn: UInt64 = 0
+    private let tlbLock = SpinLock()
+    /// Links in liveSpaces; the list does not keep spaces alive.
+    unowned(unsafe) private var liveNext: AddressSpace?
+    unowned(unsafe) private var livePrev: AddressSpace?
+    /// Demand-paged mappings, sorted by start address (see VMMap.swift).
+    var regions: [VMRegion] = []
+
+    public init?() {
+        guard let frame = PMM.allocateFrame(zero: false) else { return nil }
+        rootPhys = frame.value
+        root = UnsafeMutablePointer<UInt64>(bitPattern: UInt(frame.value))!
+
+        spin_lock(&spacesLock)
+        let kernel = VMM.kernelRoot
+        for i in 0..<512 {
+            var e = kernel[i]
+            if (e & PTE_PRESENT) != 0 { e |= PTE_SHARED }
+            root[i] = e
+        }
+        pcid = VMM.hasPCID ? AddressSpace.allocatePCID() : 0
+        liveNext = liveSpaces
+        liveSpaces?.livePrev = self
+        liveSpaces = self
+        spin_unlock(&spacesLock)
+    }
+
+    deinit {
+        spin_lock(&spacesLock)
+        if let prev = livePrev { prev.liveNext = liveNext } else { liveSpaces = liveNext }
+        liveNext?.livePrev = livePrev
+        if pcid != 0 { pcidInUse[Int(pcid) / 64] &= ~(UInt64(1) << UInt64(pcid % 64)) }
+        spin_unlock(&spacesLock)
+        freeTables(root, level: 4)
+    }
+
+    /// A free tag, or the shared tag 0 when every tag is live. Called with
+    /// spacesLock held.
+    private static func allocatePCID() -> UInt16 {
+        var p = nextPCID
+        for _ in 0..<Int(maxPCID) {
+            let word = Int(p) / 64
+            let bit = UInt64(1) << UInt64(p % 64)
+            if (pcidInUse[word] & bit) == 0 {
+                pcidInUse[word] |= bit
+                nextPCID = p == maxPCID ? 1 : p + 1
+                return p
+            }
+            p = p == maxPCID ? 1 : p + 1
+        }
+        return 0
+    }
+
+    /// Call `body` on every live address space, with the list locked.
+    static func forEachLive(_ body: (AddressSpace) -> Void) {
+        spin_lock(&spacesLock)
+        var s = liveSpaces
+        while let space = s {
+            body(space)
+            s = space.liveNext
+        }
+        spin_unlock(&spacesLock)
+    }
+
+    /// Load this address space into CR3. With PCID the switch keeps the TLB
+    /// entries tagged for other address spaces.
+    public func activate() {
+        let cpu = currentCPUIndex()
+        let bit = UInt64(1) << UInt64(cpu)
+        var cr3 = rootPhys
+        tlbLock.lock()
+        loadedOn |= bit
+        if VMM.hasPCID {
+            cr3 |= UInt64(pcid)
+            if pcid != 0 && (flushedOn & bit) != 0 {
+                cr3 |= 1 << 63  // CR3 no-flush bit
+            } else if pcid != 0 {
+                flushedOn |= bit
+            }
+        }
+        tlbLock.unlock()
+        asm_set_cr3(cr3)
+        let previous = loadedSpaces[cpu]
+        loadedSpaces[cpu] = self
+        if let old = previous, old !== self {
+            old.tlbLock.lock()
+            old.loadedOn &= ~bit
+            old.tlbLock.unlock()
+        }
+    }
+
+    public func map(virt: UInt64, phys: PhysAddr, flags: UInt64) {
+        mapRange(virt: virt, phys: phys, size: PAGE_SIZE, flags: flags)
+    }
+
+    public func mapRange(virt: UInt64, phys: PhysAddr, size: UInt64, flags: UInt64) {
+        let r = VMM.install(root: root, virt: virt, phys: phys.value, size: size, flags: flags)
+        // Only replaced translations can be cached anywhere.
+        if r.replaced != 0 {
+            flushTLB(start: virt & ~(PAGE_SIZE - 1), end: r.end, touched: r.touched)
+        }
+    }
+
+    /// Drop every TLB entry for this address space, on every CPU.
+    public func invalidateTLB() {
+        flushTLB(start: 0, end: 0, touched: .max)
+    }
+
+    /// Drop the translations for [start, end) from every TLB that may hold
+    /// them: here and by shootdown on the CPUs that have the space loaded,
+    /// and at the next load on the others. A `touched` count above the
+    /// invlpg limit flushes everything instead.
+    func flushTLB(start: UInt64, end: UInt64, touched: UInt64) {
+        let bit = UInt64(1) << UInt64(currentCPUIndex())
+        tlbLock.lock()
+        let loadedHere = (loadedOn & bit) != 0
+        flushedOn &= loadedHere ? bit : 0
+        let others = loadedOn & ~bit
+        tlbLock.unlock()
+        if loadedHere { VMM.flush(start: start, end: end, touched: touched) }
+        if others != 0 { VMM.shootdown(cpus: others, start: start, end: end, touched: touched) }
+    }
+
+    /// Free every table this address space owns. Shared tables and leaf
+    /// frames belong to someone else.
+    private func freeTables(_ table: UnsafeMutablePointer<UInt64>, level: Int) {
+        if level > 1 {
+            for i in 0..<512 {
+                let e = table[i]
+                if (e & PTE_PRESENT) == 0 || (e & (PTE_SHARED | PTE_HUGE)) != 0 { continue }
+                let child = UnsafeMutablePointer<UInt64>(bitPattern: UInt(e & PTE_ADDR_MASK))!
+                freeTables(child, level: level - 1)
+            }
+        }
+        PMM.freeFrame(PhysAddr(UInt64(UInt(bitPattern: table))))
+    }
+}
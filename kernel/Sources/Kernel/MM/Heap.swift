@@ -0,0 +1,346 @@
+/*
+ * MM/Heap.swift
+ * Kernel Heap
+ *
+ * Slab allocator with power-of-two size classes from 16 to 2048 bytes. Each
+ * class carves whole PMM pages into objects and keeps freed objects on a
+ * singly linked free list threaded through the objects. Larger requests are
+ * served directly from PMM as naturally aligned power-of-two blocks. A byte
+ * per physical frame records which class (or large-block order) owns it, so
+ * free() needs no header.
+ *
+ * Before PMM is up, allocations come from a bump arena right after the kernel
+ * image; those are never freed. One spin lock covers the whole heap.
+ *
+ * In KASAN builds every allocation is padded with a redzone of at least
+ * kasanRedzone bytes, kept poisoned along with the rest of the slot past
+ * the requested size (whose last 8 bytes record that size for usableSize).
+ * Freed memory is poisoned and parked in a FIFO quarantine, so a stale
+ * pointer keeps faulting for a while before the memory is reused. Free-list
+ * links live inside poisoned objects and go through kasan_peek/kasan_poke.
+ */
+
+import CSupport
+
+let HEAP_CLASS_COUNT = 8
+private let minClassShift = 4  // 16 bytes
+private let maxSlabSize = 16 << (HEAP_CLASS_COUNT - 1)  // 2048 bytes
+
+// Page owner byte values
+private let pageNotHeap: UInt8 = 0
+private let pageLarge: UInt8 = 0x80
+
+public struct HeapClassStats {
+    public var objectSize: Int = 0
+    public var allocations: UInt64 = 0
+    public var frees: UInt64 = 0
+    public var inUse: UInt64 = 0
+    public var slabPages: UInt64 = 0
+}
+
+nonisolated(unsafe) private var pageOwner: UnsafeMutablePointer<UInt8>!
+nonisolated(unsafe) private var pageOwnerCount: UInt64 = 0
+nonisolated(unsafe) private var classFreeLists: UnsafeMutablePointer<UInt64>!
+nonisolated(unsafe) private var classStats: UnsafeMutablePointer<HeapClassStats>!
+nonisolated(unsafe) private var largePagesInUse: UInt64 = 0
+
+// Pre-PMM bump arena
+nonisolated(unsafe) private var earlyNext: UInt64 = 0
+
+#if KASAN
+    private let kasanRedzone = 16
+    private let quarantineSlots = 65536
+    private let quarantineMaxBytes: UInt64 = 8 << 20
+    /// Ring of freed addresses, oldest at quarantineHead.
+    nonisolated(unsafe) private var quarantine: UnsafeMutablePointer<UInt64>!
+    nonisolated(unsafe) private var quarantineHead = 0
+    nonisolated(unsafe) private var quarantineCount = 0
+    nonisolated(unsafe) private var quarantineBytes: UInt64 = 0
+#endif
+
+/// Guards everything above; taken by allocate and free.
+nonisolated(unsafe) private var heapLock = spinlock_t()
+
+public struct Heap {
+    /// Switch from the early bump arena to slabs. Call right after PMM.setup.
+    public static func setup() {
+        pageOwnerCount = PMM.frameLimit
+        let metaBytes =
+            Int(pageOwnerCount) + HEAP_CLASS_COUNT * 8
+            + HEAP_CLASS_COUNT * MemoryLayout<HeapClassStats>.stride
+        let metaPages = (metaBytes + Int(PAGE_SIZE) - 1) / Int(PAGE_SIZE)
+        guard let meta = PMM.allocateFrames(count: metaPages) else {
+            kprint("Heap: no memory for metadata\n")
+            return
+        }
+        let base = UnsafeMutableRawPointer(bitPattern: UInt(meta.value))!
+        classStats = base.bindMemory(to: HeapClassStats.self, capacity: HEAP_CLASS_COUNT)
+        classFreeLists = base.advanced(by: HEAP_CLASS_COUNT * MemoryLayout<HeapClassStats>.stride)
+            .bindMemory(to: UInt64.self, capacity: HEAP_CLASS_COUNT)
+        pageOwner = base.advanced(
+            by: HEAP_CLASS_COUNT * MemoryLayout<HeapClassStats>.stride + HEAP_CLASS_COUNT * 8
+        ).bindMemory(to: UInt8.self, capacity: Int(pageOwnerCount))
+
+        for i in 0..<HEAP_CLASS_COUNT {
+            classStats[i] = HeapClassStats()
+            classStats[i].objectSize = 1 << (i + minClassShift)
+            classFreeLists[i] = 0
+        }
+        #if KASAN
+            let ringPages = quarantineSlots * 8 / Int(PAGE_SIZE)
+            guard let ring = PMM.allocateFrames(count: ringPages, zero: false) else {
+                kprint("Heap: no memory for the KASAN quarantine\n")
+                return
+            }
+            quarantine = UnsafeMutablePointer<UInt64>(bitPattern: UInt(ring.value))
+        #endif
+        kprint("Heap: slab allocator ready\n")
+    }
+
+    public static func allocate(size: Int, align: Int = 16) -> UnsafeMutableRawPointer? {
+        spin_lock(&heapLock)
+        defer { spin_unlock(&heapLock) }
+        if pageOwner == nil { return earlyAllocate(size: size, align: align) }
+
+        #if KASAN
+            let want = max(size + kasanRedzone, align, 1)
+        #else
+            let want = max(size, align, 1)
+        #endif
+        let p =
+            want <= maxSlabSize
+            ? slabAllocate(classIndex: classIndex(for: want)) : largeAllocate(size: want)
+        #if KASAN
+            if let p = p { kasanAllocated(UInt64(UInt(bitPattern: p)), size: size) }
+        #endif
+        return p
+    }
+
+    public static func free(_ ptr: UnsafeMutableRawPointer) {
+        spin_lock(&heapLock)
+        defer { spin_unlock(&heapLock) }
+        if pageOwner == nil { return }
+        let addr = UInt64(UInt(bitPattern: ptr))
+        let page = addr / PAGE_SIZE
+        if page >= pageOwnerCount { return }
+        if pageOwner[Int(page)] == pageNotHeap { return }  // early arena or foreign pointer
+        #if KASAN
+            kasanQuarantine(addr)
+        #else
+            release(addr)
+        #endif
+    }
+
+    /// Usable size of an allocation, or 0 for pointers the heap does not own.
+    public static func usableSize(_ ptr: UnsafeMutableRawPointer) -> Int {
+        if pageOwner == nil { return 0 }
+        let page = UInt64(UInt(bitPattern: ptr)) / PAGE_SIZE
+        if page >= pageOwnerCount { return 0 }
+        let owner = pageOwner[Int(page)]
+        if owner == pageNotHeap { return 0 }
+        #if KASAN
+            let addr = UInt64(UInt(bitPattern: ptr))
+            return Int(kasan_peek(addr + slotSize(owner) - 8))
+        #else
+            return Int(slotSize(owner))
+        #endif
+    }
+
+    public static func stats(classIndex: Int) -> HeapClassStats {
+        if classStats == nil || classIndex >= HEAP_CLASS_COUNT { return HeapClassStats() }
+        return classStats[classIndex]
+    }
+
+    public static var largePages: UInt64 { largePagesInUse }
+
+    public static func dumpStats() {
+        kprint("Heap classes (size allocs frees inUse pages):\n")
+        for i in 0..<HEAP_CLASS_COUNT {
+            let s = stats(classIndex: i)
+            kprint("  ")
+            kprint_hex(UInt64(s.objectSize))
+            kprint(" ")
+            kprint_hex(s.allocations)
+            kprint(" ")
+            kprint_hex(s.frees)
+            kprint(" ")
+            kprint_hex(s.inUse)
+            kprint(" ")
+            kprint_hex(s.slabPages)
+            kprint("\n")
+        }
+        kprint("  large pages: ")
+        kprint_hex(largePagesInUse)
+        kprint("\n")
+    }
+
+    // MARK: - Internals
+
+    /// Bytes in the slab object or large block whose first page has `owner`.
+    private static func slotSize(_ owner: UInt8) -> UInt64 {
+        if (owner & pageLarge) != 0 { return (1 << UInt64(owner & 0x7F)) * PAGE_SIZE }
+        return UInt64(classStats[Int(owner) - 1].objectSize)
+    }
+
+    /// Put a freed object back on its free list, or a large block back in PMM.
+    private static func release(_ addr: UInt64) {
+        let page = Int(addr / PAGE_SIZE)
+        let owner = pageOwner[page]
+        if (owner & pageLarge) != 0 {
+            let count = 1 << Int(owner & 0x7F)
+            pageOwner[page] = pageNotHeap
+            largePagesInUse -= UInt64(count)
+            #if KASAN
+                kasan_unpoison(
+                    UnsafeMutableRawPointer(bitPattern: UInt(addr)), count * Int(PAGE_SIZE))
+            #endif
+            PMM.freeFrames(PhysAddr(addr), count: count)
+        } else {
+            let c = Int(owner) - 1
+            storeLink(addr, classFreeLists[c])
+            classFreeLists[c] = addr
+            classStats[c].frees += 1
+            classStats[c].inUse -= 1
+        }
+    }
+
+    private static func classIndex(for size: Int) -> Int {
+        var c = 0
+        while (1 << (c + minClassShift)) < size { c += 1 }
+        return c
+    }
+
+    private static func slabAllocate(classIndex c: Int) -> UnsafeMutableRawPointer? {
+        if classFreeLists[c] == 0 && !refill(classIndex: c) { return nil }
+        let addr = classFreeLists[c]
+        classFreeLists[c] = loadLink(addr)
+        storeLink(addr, 0)
+        classStats[c].allocations += 1
+        classStats[c].inUse += 1
+        return UnsafeMutableRawPointer(bitPattern: UInt(addr))
+    }
+
+    /// Carve a fresh page into objects of class `c`.
+    private static func refill(classIndex c: Int) -> Bool {
+        guard let frame = PMM.allocateFrame(zero: false) else { return false }
+        let page = frame.value / PAGE_SIZE
+        if page >= pageOwnerCount { return false }
+        pageOwner[Int(page)] = UInt8(c + 1)
+        classStats[c].slabPages += 1
+
+        let objSize = UInt64(classStats[c].objectSize)
+        var off = PAGE_SIZE - objSize
+        while true {
+            storeLink(frame.value + off, classFreeLists[c])
+            classFreeLists[c] = frame.value + off
+            if off == 0 { break }
+            off -= objSize
+        }
+        #if KASAN
+            kasan_poison(
+                UnsafeMutableRawPointer(bitPattern: UInt(frame.value)), Int(PAGE_SIZE),
+                UInt8(KASAN_SLAB_FREE))
+        #endif
+        return true
+    }
+
+    private static func largeAllocate(size: Int) -> UnsafeMutableRawPointer? {
+        let pages = (size + Int(PAGE_SIZE) - 1) / Int(PAGE_SIZE)
+        var order = 0
+        while (1 << order) < pages { order += 1 }
+        let count = 1 << order
+        // A full power-of-two block is naturally aligned to its size, which
+        // also covers alignments above one page.
+        guard let base = PMM.allocateFrames(count: count, zero: false) else { return nil }
+        let page = Int(base.value / PAGE_SIZE)
+        pageOwner[page] = pageLarge | UInt8(order)
+        largePagesInUse += UInt64(count)
+        return UnsafeMutableRawPointer(bitPattern: UInt(base.value))
+    }
+
+    /// Free-list link in the first word of a free object.
+    @inline(__always)
+    private static func loadLink(_ addr: UInt64) -> UInt64 {
+        #if KASAN
+            return kasan_peek(addr)
+        #else
+            return UnsafePointer<UInt64>(bitPattern: UInt(addr))!.pointee
+        #endif
+    }
+
+    @inline(__always)
+    private static func storeLink(_ addr: UInt64, _ value: UInt64) {
+        #if KASAN
+            kasan_poke(addr, value)
+        #else
+            UnsafeMutablePointer<UInt64>(bitPattern: UInt(addr))!.pointee = value
+        #endif
+    }
+
+    #if KASAN
+        /// Open up the `size` bytes asked for and poison the rest of the slot.
+        private static func kasanAllocated(_ addr: UInt64, size: Int) {
+            let owner = pageOwner[Int(addr / PAGE_SIZE)]
+            let slot = slotSize(owner)
+            let used = (UInt64(size) + UInt64(KASAN_GRANULE) - 1) & ~(UInt64(KASAN_GRANULE) - 1)
+            let tag = (owner & pageLarge) != 0 ? KASAN_PAGE_REDZONE : KASAN_SLAB_REDZONE
+            kasan_unpoison(UnsafeMutableRawPointer(bitPattern: UInt(addr)), size)
+            kasan_poison(
+                UnsafeMutableRawPointer(bitPattern: UInt(addr + used)), Int(slot - used), UInt8(tag))
+            kasan_poke(addr + slot - 8, UInt64(size))
+        }
+
+        /// Poison a freed slot and hold it back from reuse, releasing the
+        /// oldest ones once the quarantine is over its limits.
+        private static func kasanQuarantine(_ addr: UInt64) {
+            let ptr = UnsafeMutableRawPointer(bitPattern: UInt(addr))
+            kasan_check_free(ptr)
+            let slot = slotSize(pageOwner[Int(addr / PAGE_SIZE)])
+            kasan_poison(ptr, Int(slot), UInt8(KASAN_FREED))
+            guard let ring = quarantine else {
+                release(addr)
+                return
+            }
+            if quarantineCount == quarantineSlots { releaseOldest() }
+            ring[(quarantineHead + quarantineCount) % quarantineSlots] = addr
+            quarantineCount += 1
+            quarantineBytes += slot
+            while quarantineBytes > quarantineMaxBytes { releaseOldest() }
+        }
+
+        private static func releaseOldest() {
+            let addr = quarantine[quarantineHead]
+            quarantineHead = (quarantineHead + 1) % quarantineSlots
+            quarantineCount -= 1
+            quarantineBytes -= slotSize(pageOwner[Int(addr / PAGE_SIZE)])
+            release(addr)
+        }
+    #endif
+
+    private static func earlyAllocate(size: Int, align: Int) -> UnsafeMutableRawPointer? {
+        if earlyNext == 0 { earlyNext = (get_kernel_end() + 0xFFF) & ~0xFFF }
+        let aligned = (earlyNext + UInt64(align) - 1) & ~(UInt64(align) - 1)
+        earlyNext = aligned + UInt64(size)
+        return UnsafeMutableRawPointer(bitPattern: UInt(aligned))
+    }
+}
+
+@_cdecl("kernel_alloc")
+public func kernelAlloc(size: Int, align: Int = 16) -> UnsafeMutableRawPointer {
+    guard let p = Heap.allocate(size: size, align: align) else {
+        kprint("kernel_alloc: out of memory\n")
+        while true { asm_hlt() }
+    }
+    return p
+}
+
+@_cdecl("kernel_free")
+public func kernelFree(_ ptr: UnsafeMutableRawPointer?) {
+    if let ptr = ptr { Heap.free(ptr) }
+}
+
+@_cdecl("kernel_alloc_size")
+public func kernelAllocSize(_ ptr: UnsafeMutableRawPointer?) -> Int {
+    guard let ptr = ptr else { return 0 }
+    return Heap.usableSize(ptr)
+}
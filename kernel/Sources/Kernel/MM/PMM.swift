@@ -1,6 +1,13 @@
 /*
  * MM/PMM.swift
  * Physical Memory Manager
+ *
+ * Binary buddy allocator over the frames reported usable by the Multiboot
+ * memory map. Free blocks are kept on per-order doubly linked lists threaded
+ * through the frames themselves (every managed frame is reachable through the
+ * boot identity map), and each frame has one metadata byte recording whether
+ * it is in use, heads a free block (and of which order) or lies inside one,
+ * so a free of any frame that is already free is caught.
  */
 
 import CSupport
@@ -10,36 +17,395 @@ public struct PhysAddr: Equatable {
     public init(_ value: UInt64) { self.value = value }
 }
 
-nonisolated(unsafe)  // Global state to avoid class initialization issues
-    private var nextFree: UInt64 = 0x0800_0000
-private let ramEnd: UInt64 = 0x2000_0000  // 512MB
+let PAGE_SIZE: UInt64 = 4096
+let HUGE_PAGE_SIZE: UInt64 = 0x20_0000
+
+/// Largest block order (2^10 frames = 4 MiB).
+private let maxOrder = 10
+/// Order of a 2 MiB huge page.
+let HUGE_PAGE_ORDER = 9
+
+/// boot.S identity maps the first 8 GB; frames above that are not reachable.
+let identityMapEnd: UInt64 = 0x2_0000_0000
+/// Everything below 128 MB stays reserved for the kernel image, the early heap
+/// arena and the fixed user load regions.
+private let lowReservedEnd: UInt64 = 0x0800_0000
+
+// Frame metadata byte values
+private let frameReserved: UInt8 = 0xFF
+private let frameInUse: UInt8 = 0x00
+private let frameFreeHead: UInt8 = 0x80
+/// A frame inside a free block other than its head.
+private let frameFreeInterior: UInt8 = 0x40
+
+nonisolated(unsafe) private var frameInfo: UnsafeMutablePointer<UInt8>!
+nonisolated(unsafe) private var frameCount: UInt64 = 0
+/// Per-order free list heads (physical address of the first block, 0 = empty).
+nonisolated(unsafe) private var freeLists: UnsafeMutablePointer<UInt64>!
+nonisolated(unsafe) private var freeFrameCount: UInt64 = 0
+nonisolated(unsafe) private var totalFrameCount: UInt64 = 0
+
+/// Frames zeroed ahead of time by the idle loop, singly linked through their
+/// first word. They are allocated as far as the buddy lists are concerned.
+nonisolated(unsafe) private var zeroPoolHead: UInt64 = 0
+nonisolated(unsafe) private var zeroPoolCount: Int = 0
+private let zeroPoolTarget = 512  // 2 MiB
+/// Below this, busy CPUs top the pool up a little on every tick too.
+private let zeroPoolLowWater = 128
+
+/// Guards the free lists, metadata and pool. Frames are zeroed outside it.
+nonisolated(unsafe) private var pmmLock = spinlock_t()
 
 public struct PMM {
-    // Primitive Bump allocator for now.
-    public static func allocateFrame() -> PhysAddr? {
-        if nextFree >= ramEnd { return nil }
-        let frame = nextFree
-        nextFree += 4096
-        // Clear frame content
-        if let ptr = UnsafeMutableRawPointer(bitPattern: UInt(frame)) {
-            memset(ptr, 0, 4096)
+    /// Build the free lists from the Multiboot memory map. Must run before
+    /// the first frame allocation.
+    static func setup(info: MultibootInfo) {
+        var top: UInt64 = 0
+        forEachUsableRange(info: info) { _, end in
+            if end > top { top = end }
         }
-        return PhysAddr(frame)
+        frameCount = top / PAGE_SIZE
+
+        // Metadata: free list heads followed by one byte per frame. It lives
+        // in the first usable range big enough to hold it.
+        let headerBytes = UInt64(maxOrder + 1) * 8
+        let metaBytes = (headerBytes + frameCount + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        var metaStart: UInt64 = 0
+        forEachUsableRange(info: info) { start, end in
+            if metaStart == 0 && end - start >= metaBytes { metaStart = start }
+        }
+        if metaStart == 0 {
+            kprint("PMM: no room for frame metadata\n")
+            return
+        }
+
+        freeLists = UnsafeMutablePointer<UInt64>(bitPattern: UInt(metaStart))!
+        for i in 0...maxOrder { freeLists[i] = 0 }
+        frameInfo = UnsafeMutablePointer<UInt8>(bitPattern: UInt(metaStart + headerBytes))!
+        memset(frameInfo, Int32(frameReserved), Int(frameCount))
+
+        forEachUsableRange(info: info) { start, end in
+            var s = start
+            if s == metaStart { s += metaBytes }
+            if s < end { addFreeRange(start: s, end: end) }
+        }
+        totalFrameCount = freeFrameCount
+
+        kprint("PMM: ")
+        kprint_hex(freeFrameCount)
+        kprint(" free frames, top=")
+        kprint_hex(top)
+        kprint("\n")
     }
 
-    public static func allocateFrames(count: Int) -> PhysAddr? {
-        let size = UInt64(count * 4096)
-        if nextFree + size >= ramEnd { return nil }
-        let frame = nextFree
-        nextFree += size
-        // Clear frame content
-        if let ptr = UnsafeMutableRawPointer(bitPattern: UInt(frame)) {
-            memset(ptr, 0, Int(size))
+    /// Allocate one frame. With `zero: false` the contents are undefined;
+    /// use it when the caller overwrites the whole frame anyway. When the
+    /// zero pool is empty the frame is zeroed here, so a caller never pays
+    /// for more than the frames it asked for.
+    public static func allocateFrame(zero: Bool = true) -> PhysAddr? {
+        spin_lock(&pmmLock)
+        if zero, let frame = popZeroPool() {
+            spin_unlock(&pmmLock)
+            Trace.event(.frameAlloc, frame, 1)
+            return PhysAddr(frame)
         }
+        let block = allocateBlock(order: 0) ?? popZeroPool()
+        spin_unlock(&pmmLock)
+        guard let frame = block else { return nil }
+        Trace.event(.frameAlloc, frame, 1)
+        if zero { zeroFrames(frame, pages: 1) }
         return PhysAddr(frame)
     }
 
+    /// Allocate `count` physically contiguous frames. The block is rounded up
+    /// to a power of two internally and the unused tail is returned at once,
+    /// so `freeFrames(_:count:)` with the same count releases everything.
+    public static func allocateFrames(count: Int, zero: Bool = true) -> PhysAddr? {
+        if count <= 0 { return nil }
+        if count == 1 { return allocateFrame(zero: zero) }
+        let order = orderFor(count: count)
+        if order > maxOrder { return nil }
+        spin_lock(&pmmLock)
+        guard let base = allocateBlock(order: order) else {
+            spin_unlock(&pmmLock)
+            return nil
+        }
+        let blockFrames = UInt64(1) << UInt64(order)
+        if UInt64(count) < blockFrames {
+            releaseRange(
+                start: base + UInt64(count) * PAGE_SIZE, end: base + blockFrames * PAGE_SIZE)
+        }
+        spin_unlock(&pmmLock)
+        Trace.event(.frameAlloc, base, UInt64(count))
+        if zero { zeroFrames(base, pages: count) }
+        return PhysAddr(base)
+    }
+
+    /// Allocate a 2 MiB-aligned, 2 MiB frame suitable for a huge-page PDE.
+    public static func allocateHugeFrame(zero: Bool = true) -> PhysAddr? {
+        spin_lock(&pmmLock)
+        let block = allocateBlock(order: HUGE_PAGE_ORDER)
+        spin_unlock(&pmmLock)
+        guard let base = block else { return nil }
+        Trace.event(.frameAlloc, base, 1 << HUGE_PAGE_ORDER)
+        if zero { zeroFrames(base, pages: 1 << HUGE_PAGE_ORDER) }
+        return PhysAddr(base)
+    }
+
     public static func freeFrame(_ frame: PhysAddr) {
-        // Leak
+        Trace.event(.frameFree, frame.value, 1)
+        spin_lock(&pmmLock)
+        freeBlock(frame.value, order: 0)
+        spin_unlock(&pmmLock)
+    }
+
+    public static func freeFrames(_ base: PhysAddr, count: Int) {
+        Trace.event(.frameFree, base.value, UInt64(count))
+        spin_lock(&pmmLock)
+        releaseRange(start: base.value, end: base.value + UInt64(count) * PAGE_SIZE)
+        spin_unlock(&pmmLock)
+    }
+
+    /// Whether `frame` belongs to this allocator, and not to the kernel image
+    /// or a reserved range, and so may be given back to it.
+    public static func manages(_ frame: PhysAddr) -> Bool {
+        let index = frame.value / PAGE_SIZE
+        return frameInfo != nil && index < frameCount && frameInfo[Int(index)] != frameReserved
+    }
+
+    public static var availableFrames: UInt64 { freeFrameCount + UInt64(zeroPoolCount) }
+    public static var managedFrames: UInt64 { totalFrameCount }
+    /// One past the highest frame number PMM can hand out.
+    public static var frameLimit: UInt64 { frameCount }
+
+    // MARK: - Pre-zeroed pool
+
+    /// Zero up to `maxFrames` free frames into the pool. Called from the idle
+    /// loop so that zeroed allocations on the mmap/exec path are a list pop,
+    /// and in small batches from the scheduler tick while the pool is below
+    /// its low-water mark, since a loaded CPU never idles. Returns the number
+    /// of frames added.
+    @discardableResult
+    public static func refillZeroPool(maxFrames: Int = 64) -> Int {
+        var added = 0
+        while added < maxFrames && zeroPoolCount < zeroPoolTarget {
+            spin_lock(&pmmLock)
+            let block = allocateBlock(order: 0)
+            spin_unlock(&pmmLock)
+            guard let frame = block else { break }
+            zeroFrames(frame, pages: 1)
+            spin_lock(&pmmLock)
+            UnsafeMutablePointer<UInt64>(bitPattern: UInt(frame))!.pointee = zeroPoolHead
+            zeroPoolHead = frame
+            zeroPoolCount += 1
+            spin_unlock(&pmmLock)
+            added += 1
+        }
+        return added
+    }
+
+    /// Whether the pool has dropped below its low-water mark.
+    public static var zeroPoolLow: Bool { zeroPoolCount < zeroPoolLowWater }
+
+    private static func popZeroPool() -> UInt64? {
+        if zeroPoolHead == 0 { return nil }
+        let frame = zeroPoolHead
+        let link = UnsafeMutablePointer<UInt64>(bitPattern: UInt(frame))!
+        zeroPoolHead = link.pointee
+        link.pointee = 0
+        zeroPoolCount -= 1
+        return frame
+    }
+
+    // MARK: - Buddy internals
+
+    private static func orderFor(count: Int) -> Int {
+        var order = 0
+        while (1 << order) < count { order += 1 }
+        return order
+    }
+
+    private static func zeroFrames(_ base: UInt64, pages: Int) {
+        if let ptr = UnsafeMutableRawPointer(bitPattern: UInt(base)) {
+            memset(ptr, 0, pages * Int(PAGE_SIZE))
+        }
+    }
+
+    private static func allocateBlock(order: Int) -> UInt64? {
+        if frameInfo == nil { return nil }
+        var o = order
+        while o <= maxOrder && freeLists[o] == 0 { o += 1 }
+        if o > maxOrder { return nil }
+
+        let block = freeLists[o]
+        listRemove(block, order: o)
+
+        // Split down to the requested order, returning upper halves.
+        while o > order {
+            o -= 1
+            let buddy = block + (PAGE_SIZE << UInt64(o))
+            listPush(buddy, order: o)
+        }
+        markInUse(block, order: order)
+        freeFrameCount -= UInt64(1) << UInt64(order)
+        return block
+    }
+
+    private static func freeBlock(_ addr: UInt64, order: Int) {
+        if frameInfo == nil { return }
+        var block = addr
+        var o = order
+        let index = Int(block / PAGE_SIZE)
+        if UInt64(index) >= frameCount || frameInfo[index] != frameInUse {
+            kprint("PMM: bad free ")
+            kprint_hex(addr)
+            kprint("\n")
+            return
+        }
+        freeFrameCount += UInt64(1) << UInt64(order)
+
+        while o < maxOrder {
+            let buddy = block ^ (PAGE_SIZE << UInt64(o))
+            let buddyIndex = buddy / PAGE_SIZE
+            if buddyIndex >= frameCount { break }
+            if frameInfo[Int(buddyIndex)] != frameFreeHead | UInt8(o) { break }
+            listRemove(buddy, order: o)
+            frameInfo[Int(buddyIndex)] = frameInUse
+            block = min(block, buddy)
+            o += 1
+        }
+        listPush(block, order: o)
+    }
+
+    /// Free an arbitrary page-aligned range by splitting it into naturally
+    /// aligned blocks. Every frame in it must be in use.
+    private static func releaseRange(start: UInt64, end: UInt64) {
+        if frameInfo == nil { return }
+        var f = start / PAGE_SIZE
+        while f < end / PAGE_SIZE {
+            if f >= frameCount || frameInfo[Int(f)] != frameInUse {
+                kprint("PMM: bad free ")
+                kprint_hex(f * PAGE_SIZE)
+                kprint("\n")
+                return
+            }
+            f += 1
+        }
+        var s = start
+        while s < end {
+            var o = 0
+            while o < maxOrder {
+                let size = PAGE_SIZE << UInt64(o + 1)
+                if (s & (size - 1)) != 0 || s + size > end { break }
+                o += 1
+            }
+            freeBlock(s, order: o)
+            s += PAGE_SIZE << UInt64(o)
+        }
+    }
+
+    private static func addFreeRange(start: UInt64, end: UInt64) {
+        let s = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        let e = end & ~(PAGE_SIZE - 1)
+        if s >= e { return }
+        // Mark the range as managed so freeBlock() will merge across it.
+        memset(
+            frameInfo.advanced(by: Int(s / PAGE_SIZE)), Int32(frameInUse),
+            Int((e - s) / PAGE_SIZE))
+        releaseRange(start: s, end: e)
+    }
+
+    private static func links(_ block: UInt64) -> UnsafeMutablePointer<UInt64> {
+        return UnsafeMutablePointer<UInt64>(bitPattern: UInt(block))!
+    }
+
+    private static func listPush(_ block: UInt64, order: Int) {
+        let head = freeLists[order]
+        let l = links(block)
+        l[0] = head  // next
+        l[1] = 0  // prev
+        if head != 0 { links(head)[1] = block }
+        freeLists[order] = block
+        let index = Int(block / PAGE_SIZE)
+        frameInfo[index] = frameFreeHead | UInt8(order)
+        if order > 0 {
+            memset(frameInfo.advanced(by: index + 1), Int32(frameFreeInterior), (1 << order) - 1)
+        }
+    }
+
+    /// Tag every frame of an allocated block in use. The head was cleared
+    /// by listRemove; the interior still says free.
+    private static func markInUse(_ block: UInt64, order: Int) {
+        let index = Int(block / PAGE_SIZE)
+        frameInfo[index] = frameInUse
+        if order > 0 {
+            memset(frameInfo.advanced(by: index + 1), Int32(frameInUse), (1 << order) - 1)
+        }
+    }
+
+    private static func listRemove(_ block: UInt64, order: Int) {
+        let l = links(block)
+        let next = l[0]
+        let prev = l[1]
+        if prev != 0 { links(prev)[0] = next } else { freeLists[order] = next }
+        if next != 0 { links(next)[1] = prev }
+        l[0] = 0
+        l[1] = 0
+        frameInfo[Int(block / PAGE_SIZE)] = frameInUse
+    }
+
+    // MARK: - Memory map
+
+    /// Call `body` for every usable physical range with reserved areas
+    /// (low memory, the ramdisk, fixed user regions) cut out.
+    private static func forEachUsableRange(
+        info: MultibootInfo, _ body: (UInt64, UInt64) -> Void
+    ) {
+        forEachMemoryRegion(info: info) { base, length, type in
+            if type != MULTIBOOT_MEMORY_AVAILABLE { return }
+            var start = base
+            var end = base + length
+            if start < lowReservedEnd { start = lowReservedEnd }
+            if end > identityMapEnd { end = identityMapEnd }
+            if start >= end { return }
+            clip(start: start, end: end, info: info, from: 0, body)
+        }
+    }
+
+    private static func clip(
+        start: UInt64, end: UInt64, info: MultibootInfo, from index: Int,
+        _ body: (UInt64, UInt64) -> Void
+    ) {
+        var i = index
+        while let r = reservedRange(i, info: info) {
+            if r.0 < end && r.1 > start {
+                if r.0 > start { clip(start: start, end: r.0, info: info, from: i + 1, body) }
+                if r.1 < end { clip(start: r.1, end: end, info: info, from: i + 1, body) }
+                return
+            }
+            i += 1
+        }
+        body(start, end)
+    }
+
+    private static func reservedRange(_ index: Int, info: MultibootInfo) -> (UInt64, UInt64)? {
+        switch index {
+        case 0: return (0x1000_0000, 0x1100_0000)  // dyld load region
+        case 1: return (0x1EE0_0000, 0x1F00_0000)
+        default:
+            // Multiboot modules (the ramdisk)
+            let mod = index - 2
+            if mod >= Int(info.mods_count) { return nil }
+            let m = UnsafePointer<MultibootModule>(bitPattern: UInt(info.mods_addr))![mod]
+            return (UInt64(m.mod_start) & ~(PAGE_SIZE - 1), UInt64(m.mod_end))
+        }
     }
 }
+
+#if KASAN
+    /// A zeroed frame for kasan.c's shadow, or 0.
+    @_cdecl("kasan_alloc_frame")
+    func kasanAllocFrame() -> UInt64 {
+        return PMM.allocateFrame()?.value ?? 0
+    }
+#endif
@@ -0,0 +1,136 @@
+/*
+ * MM/VMCopy.swift
+ * Virtual copies of address ranges, for out-of-line Mach message data
+ *
+ * A VMCopy holds the regions covering a range by reference: the same
+ * objects at the same offsets, never the pages themselves. A move takes the
+ * regions out of the sending space whole. A copy freezes the objects of
+ * private anonymous regions, so that both the sender's and the receiver's
+ * mappings copy a page into their own shadow on the first write; only pages
+ * the sender had already shadowed are duplicated up front. Inserting the
+ * copy into the receiving space just records regions; frames come in
+ * through the fault handler as usual.
+ */
+
+import CSupport
+
+struct VMCopyPiece {
+    let object: VMObject
+    /// Byte offset of the piece within `object`.
+    let offset: UInt64
+    let size: UInt64
+    let prot: UInt32
+    let isPrivate: Bool
+    let shadow: VMObject?
+}
+
+final class VMCopy {
+    let pieces: [VMCopyPiece]
+    /// Offset of the data within the first page.
+    let pageOffset: UInt64
+    /// Page-rounded size of all pieces together.
+    let mappedSize: UInt64
+
+    init(pieces: [VMCopyPiece], pageOffset: UInt64, mappedSize: UInt64) {
+        self.pieces = pieces
+        self.pageOffset = pageOffset
+        self.mappedSize = mappedSize
+    }
+}
+
+/// A new anonymous object, indexed like `source`, with private copies of the
+/// pages of `source` in [first, end) that are resident.
+private func duplicatePages(of source: VMObject, from first: UInt64, to end: UInt64) -> VMObject? {
+    let dup = VMObject(backing: .anonymous, size: source.pageCount * PAGE_SIZE)
+    for i in first..<end {
+        let src = source.resident(i)
+        if src == 0 { continue }
+        guard let frame = PMM.allocateFrame(zero: false) else { return nil }
+        memcpy(
+            UnsafeMutableRawPointer(bitPattern: UInt(frame.value))!,
+            UnsafeRawPointer(bitPattern: UInt(src))!, Int(PAGE_SIZE))
+        dup.setResident(i, phys: frame.value)
+    }
+    return dup
+}
+
+extension AddressSpace {
+    /// Capture [start, start + size) for another space. With `move` the range
+    /// is unmapped here; otherwise this space keeps it and the two share the
+    /// pages copy-on-write. Returns nil if part of the range is not mapped.
+    func copyRange(start: UInt64, size: UInt64, move: Bool) -> VMCopy? {
+        let s = start & ~(PAGE_SIZE - 1)
+        let e = (start + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        if e <= s { return nil }
+        var addr = s
+        while addr < e {
+            guard let r = region(containing: addr) else { return nil }
+            addr = r.end
+        }
+        splitRegions(at: s, and: e)
+
+        var pieces: [VMCopyPiece] = []
+        for r in regions where r.start >= s && r.end <= e {
+            let first = r.objectIndex(of: r.start)
+            let end = r.objectIndex(of: r.end - 1) + 1
+            if move {
+                pieces.append(
+                    VMCopyPiece(
+                        object: r.object, offset: r.offset, size: r.end - r.start, prot: r.prot,
+                        isPrivate: r.isPrivate, shadow: r.shadow))
+            } else if r.isPrivate {
+                r.object.isFrozen = true
+                var shadow: VMObject? = nil
+                if let own = r.shadow {
+                    guard let dup = duplicatePages(of: own, from: first, to: end) else { return nil }
+                    shadow = dup
+                }
+                pieces.append(
+                    VMCopyPiece(
+                        object: r.object, offset: r.offset, size: r.end - r.start, prot: r.prot,
+                        isPrivate: true, shadow: shadow))
+            } else {
+                // Shared mappings can't be frozen under their other users;
+                // copy the data instead.
+                let copy = VMObject(backing: .anonymous, size: r.end - r.start)
+                for i in first..<end {
+                    let src = r.object.isAnonymous ? r.object.resident(i) : (r.object.page(at: i) ?? 0)
+                    if src == 0 { continue }
+                    guard let frame = PMM.allocateFrame(zero: false) else { return nil }
+                    memcpy(
+                        UnsafeMutableRawPointer(bitPattern: UInt(frame.value))!,
+                        UnsafeRawPointer(bitPattern: UInt(src))!, Int(PAGE_SIZE))
+                    copy.setResident(i - first, phys: frame.value)
+                }
+                pieces.append(
+                    VMCopyPiece(
+                        object: copy, offset: 0, size: r.end - r.start, prot: r.prot,
+                        isPrivate: true, shadow: nil))
+            }
+        }
+
+        if move {
+            regions.removeAll { $0.start >= s && $0.end <= e }
+        }
+        // Either way no writable translation may survive: moved pages are
+        // gone, and frozen ones must fault into a shadow on the next write.
+        clearTranslations(start: s, end: e)
+        return VMCopy(pieces: pieces, pageOffset: start - s, mappedSize: e - s)
+    }
+
+    /// Map `copy` at a fresh address; returns the address of its data.
+    func insert(_ copy: VMCopy) -> UInt64 {
+        let base = reserveMmapRange(length: copy.mappedSize)
+        var addr = base
+        for p in copy.pieces {
+            // Out-of-line data arrives read-write, like vm_allocate memory.
+            let prot = p.isPrivate ? (p.prot | VM_PROT_READ | VM_PROT_WRITE) : p.prot
+            let region = VMRegion(
+                start: addr, end: addr + p.size, prot: prot, isPrivate: p.isPrivate,
+                object: p.object, offset: p.offset, shadow: p.shadow)
+            regions.insert(region, at: insertionIndex(for: addr))
+            addr += p.size
+        }
+        return base + copy.pageOffset
+    }
+}
@@ -5,45 +5,281 @@
 
 import CSupport
 
+// Page table entry bits
+let PTE_PRESENT: UInt64 = 1 << 0
+let PTE_WRITABLE: UInt64 = 1 << 1
+let PTE_USER: UInt64 = 1 << 2
+let PTE_HUGE: UInt64 = 1 << 7
+/// Software bit on a non-leaf entry: the table it points to is shared with
+/// the boot tables (or another address space) and must be copied before it
+/// is modified.
+let PTE_SHARED: UInt64 = 1 << 9
+let PTE_ADDR_MASK: UInt64 = 0x000F_FFFF_FFFF_F000
+
+/// Past this many touched entries a CR3 reload is cheaper than invlpg.
+private let invlpgFlushLimit: UInt64 = 32
+
 // Global state for VMM
-nonisolated(unsafe) private var pml4: UnsafeMutablePointer<UInt64>!
+/// The boot tables' root, which VMM.map* write and AddressSpaces start from.
+nonisolated(unsafe) private var bootPML4: UnsafeMutablePointer<UInt64>!
+nonisolated(unsafe) private var pcidEnabled = false
 
 public struct VMM {
     public static func setup() {
-        kprint("VMM setup\n")
+        if Log.debug { kprint("VMM setup\n") }
         let cr3 = asm_get_cr3()
         let physPML4 = cr3 & ~0xFFF
-        pml4 = UnsafeMutablePointer<UInt64>(bitPattern: UInt(physPML4))!
+        bootPML4 = UnsafeMutablePointer<UInt64>(bitPattern: UInt(physPML4))!
+
+        // Make supervisor writes honour read-only PTEs so copy-on-write
+        // pages fault even when the kernel writes to them.
+        asm_set_cr0(asm_get_cr0() | (1 << 16))
+
+        // CR3[11:0] is still zero here, as PCIDE requires.
+        if (cpu_features & CPU_FEATURE_PCID) != 0 {
+            asm_set_cr4(asm_get_cr4() | (1 << 17))
+            pcidEnabled = true
+            kprint("VMM: PCID enabled\n")
+        }
+        tlb_shootdown_setup()
     }
 
+    static var kernelRoot: UnsafeMutablePointer<UInt64> { bootPML4 }
+    static var hasPCID: Bool { pcidEnabled }
+
     // Flags: 1=Present, 2=RW, 4=User
-    public static func map(virt: UInt64, phys: PhysAddr, flags: UInt64) {
+    /// A kernel-wide mapping of one page, like mapRange.
+    public static func map(virt: UInt64, phys: PhysAddr, flags: UInt64, flush: Bool = true) {
+        var replaced = false
+        forEachRoot(virt: virt) { root in
+            guard let pt = pageTable(root: root, virt: virt) else { return }
+            let slot = pt.advanced(by: Int((virt >> 12) & 0x1FF))
+            if (slot.pointee & PTE_PRESENT) != 0 { replaced = true }
+            slot.pointee = phys.value | flags | PTE_PRESENT
+        }
+        if flush {
+            asm_invlpg(UnsafeMutableRawPointer(bitPattern: UInt(virt)))
+            if replaced { shootdown(cpus: ~0, start: virt, end: virt + PAGE_SIZE, touched: 1) }
+        }
+    }
+
+    /// Map [virt, virt + size) to [phys, phys + size) in the kernel root and
+    /// every address space. Uses 2 MiB PDEs wherever both addresses are 2 MiB
+    /// aligned, 4 KiB PTEs at the edges, and flushes the TLB once at the end.
+    public static func mapRange(virt: UInt64, phys: PhysAddr, size: UInt64, flags: UInt64) {
+        var r: (end: UInt64, touched: UInt64, replaced: UInt64) = (virt, 0, 0)
+        var replaced: UInt64 = 0
+        forEachRoot(virt: virt) { root in
+            r = install(root: root, virt: virt, phys: phys.value, size: size, flags: flags)
+            replaced |= r.replaced
+        }
+        let start = virt & ~(PAGE_SIZE - 1)
+        flush(start: start, end: r.end, touched: r.touched)
+        if replaced != 0 { shootdown(cpus: ~0, start: start, end: r.end, touched: r.touched) }
+    }
+
+    /// Remove a kernel-wide mapping made with map or mapRange.
+    public static func unmapRange(virt: UInt64, size: UInt64) {
+        var touched: UInt64 = 0
+        forEachRoot(virt: virt) { root in
+            touched = max(touched, unmap(root: root, virt: virt, size: size))
+        }
+        let start = virt & ~(PAGE_SIZE - 1)
+        flush(start: start, end: virt + size, touched: touched)
+        if touched != 0 { shootdown(cpus: ~0, start: start, end: virt + size, touched: touched) }
+    }
+
+    /// Run `body` on the kernel root, then on every address space root that
+    /// does not reach the kernel's tables for `virt` through a shared
+    /// top-level entry. Ranges passed along must not cross a 512 GiB slot.
+    /// A space the kernel root has gained a top-level entry since its
+    /// creation is given a shared reference to it.
+    private static func forEachRoot(virt: UInt64, _ body: (UnsafeMutablePointer<UInt64>) -> Void) {
+        body(bootPML4)
+        let i = Int((virt >> 39) & 0x1FF)
+        let kernelEntry = bootPML4[i]
+        AddressSpace.forEachLive { space in
+            let e = space.root[i]
+            if (e & PTE_PRESENT) == 0 && (kernelEntry & PTE_PRESENT) != 0 {
+                space.root[i] = kernelEntry | PTE_SHARED
+            } else if (e & PTE_SHARED) == 0 || (e & PTE_ADDR_MASK) != (kernelEntry & PTE_ADDR_MASK) {
+                body(space.root)
+            }
+        }
+    }
+
+    /// Flush the whole non-global TLB (for the current PCID).
+    public static func flushAll() {
+        asm_set_cr3(asm_get_cr3())
+    }
+
+    // MARK: - Table walking (shared with AddressSpace)
+
+    /// Write the entries for a range without flushing. Returns where it
+    /// stopped (short of the end on allocation failure), how many 4 KiB
+    /// translations were touched and how many of the entries written
+    /// replaced a present one (only those can be in a TLB).
+    static func install(
+        root: UnsafeMutablePointer<UInt64>, virt: UInt64, phys: UInt64, size: UInt64,
+        flags: UInt64
+    ) -> (end: UInt64, touched: UInt64, replaced: UInt64) {
+        let start = virt & ~(PAGE_SIZE - 1)
+        let end = (virt + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        var v = start
+        var p = phys & ~(PAGE_SIZE - 1)
+        var touched: UInt64 = 0
+        var replaced: UInt64 = 0
+
+        while v < end {
+            let hugeOK =
+                (v & (HUGE_PAGE_SIZE - 1)) == 0 && (p & (HUGE_PAGE_SIZE - 1)) == 0
+                && end - v >= HUGE_PAGE_SIZE
+            if hugeOK {
+                guard let old = installHuge(root: root, virt: v, phys: p, flags: flags) else { break }
+                if (old & PTE_PRESENT) != 0 { replaced += 1 }
+                v += HUGE_PAGE_SIZE
+                p += HUGE_PAGE_SIZE
+                touched += 512
+            } else {
+                guard let pt = pageTable(root: root, virt: v) else { break }
+                let slot = pt.advanced(by: Int((v >> 12) & 0x1FF))
+                if (slot.pointee & PTE_PRESENT) != 0 { replaced += 1 }
+                slot.pointee = p | flags | PTE_PRESENT
+                v += PAGE_SIZE
+                p += PAGE_SIZE
+                touched += 1
+            }
+        }
+        return (v, touched, replaced)
+    }
+
+    /// Clear the translations for a range without flushing, splitting huge
+    /// pages at the edges. Unpopulated upper levels are skipped rather than
+    /// allocated. Returns the number of 4 KiB translations touched.
+    static func unmap(root: UnsafeMutablePointer<UInt64>, virt: UInt64, size: UInt64) -> UInt64 {
+        let end = (virt + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        var v = virt & ~(PAGE_SIZE - 1)
+        var touched: UInt64 = 0
+
+        while v < end {
+            let l4 = root[Int((v >> 39) & 0x1FF)]
+            if (l4 & PTE_PRESENT) == 0 {
+                v = nextBoundary(v, shift: 39)
+                continue
+            }
+            let pdpt = UnsafeMutablePointer<UInt64>(bitPattern: UInt(l4 & PTE_ADDR_MASK))!
+            let l3 = pdpt[Int((v >> 30) & 0x1FF)]
+            if (l3 & PTE_PRESENT) == 0 || (l3 & PTE_HUGE) != 0 {
+                v = nextBoundary(v, shift: 30)
+                continue
+            }
+            let pdRead = UnsafeMutablePointer<UInt64>(bitPattern: UInt(l3 & PTE_ADDR_MASK))!
+            let l2 = pdRead[Int((v >> 21) & 0x1FF)]
+            if (l2 & PTE_PRESENT) == 0 {
+                v = nextBoundary(v, shift: 21)
+                continue
+            }
+            if (l2 & PTE_HUGE) != 0 && (v & (HUGE_PAGE_SIZE - 1)) == 0
+                && end - v >= HUGE_PAGE_SIZE
+            {
+                guard let pd = pageDirectory(root: root, virt: v) else { break }
+                pd[Int((v >> 21) & 0x1FF)] = 0
+                v += HUGE_PAGE_SIZE
+                touched += 512
+                continue
+            }
+            guard let pt = pageTable(root: root, virt: v) else { break }
+            pt[Int((v >> 12) & 0x1FF)] = 0
+            v += PAGE_SIZE
+            touched += 1
+        }
+        return touched
+    }
+
+    private static func nextBoundary(_ v: UInt64, shift: UInt64) -> UInt64 {
+        return (v | ((1 << shift) - 1)) &+ 1
+    }
+
+    /// Flush [start, end) from the TLBs of `cpus` other than this one, and
+    /// wait until they have. Like flush, flushes everything past the invlpg
+    /// limit.
+    static func shootdown(cpus: UInt64, start: UInt64, end: UInt64, touched: UInt64) {
+        let all = touched > invlpgFlushLimit
+        tlb_shootdown(cpus, all ? 0 : start, all ? 0 : end)
+    }
+
+    static func flush(start: UInt64, end: UInt64, touched: UInt64) {
+        if touched > invlpgFlushLimit {
+            flushAll()
+            return
+        }
+        var v = start
+        while v < end {
+            asm_invlpg(UnsafeMutableRawPointer(bitPattern: UInt(v)))
+            v += PAGE_SIZE
+        }
+    }
+
+    /// Install a 2 MiB PDE, releasing any page table it replaces, and return
+    /// the entry it replaced (nil if the directory could not be had). The
+    /// static boot.S tables live in the kernel image and are only dropped.
+    private static func installHuge(
+        root: UnsafeMutablePointer<UInt64>, virt: UInt64, phys: UInt64, flags: UInt64
+    ) -> UInt64? {
+        guard let pd = pageDirectory(root: root, virt: virt) else { return nil }
+        let entry = pd.advanced(by: Int((virt >> 21) & 0x1FF))
+        let old = entry.pointee
+        let table = PhysAddr(old & PTE_ADDR_MASK)
+        if (old & PTE_PRESENT) != 0 && (old & (PTE_HUGE | PTE_SHARED)) == 0 && PMM.manages(table) {
+            PMM.freeFrame(table)
+        }
+        entry.pointee = phys | flags | PTE_PRESENT | PTE_HUGE
+        return old
+    }
+
+    static func pageDirectory(root: UnsafeMutablePointer<UInt64>, virt: UInt64)
+        -> UnsafeMutablePointer<UInt64>?
+    {
         let pml4Index = (virt >> 39) & 0x1FF
         let pdptIndex = (virt >> 30) & 0x1FF
-        let pdIndex = (virt >> 21) & 0x1FF
-        let ptIndex = (virt >> 12) & 0x1FF
 
         // PML4 -> PDPT
-        guard let pdptPhys = getOrAllocTable(entry: &pml4[Int(pml4Index)]) else { return }
+        guard let pdptPhys = getOrAllocTable(entry: &root[Int(pml4Index)], level: 3) else {
+            return nil
+        }
         let pdpt = UnsafeMutablePointer<UInt64>(bitPattern: UInt(pdptPhys))!
 
         // PDPT -> PD
-        guard let pdPhys = getOrAllocTable(entry: &pdpt[Int(pdptIndex)]) else { return }
-        let pd = UnsafeMutablePointer<UInt64>(bitPattern: UInt(pdPhys))!
+        guard let pdPhys = getOrAllocTable(entry: &pdpt[Int(pdptIndex)], level: 2) else {
+            return nil
+        }
+        return UnsafeMutablePointer<UInt64>(bitPattern: UInt(pdPhys))!
+    }
 
-        // PD -> PT
-        guard let ptPhys = getOrAllocTable(entry: &pd[Int(pdIndex)], isL2: true) else { return }
-        let pt = UnsafeMutablePointer<UInt64>(bitPattern: UInt(ptPhys))!
+    static func pageTable(root: UnsafeMutablePointer<UInt64>, virt: UInt64)
+        -> UnsafeMutablePointer<UInt64>?
+    {
+        guard let pd = pageDirectory(root: root, virt: virt) else { return nil }
+        let pdIndex = (virt >> 21) & 0x1FF
 
-        // PT Entry
-        pt[Int(ptIndex)] = phys.value | flags | 1  // Always Present
-        asm_invlpg(UnsafeMutableRawPointer(bitPattern: UInt(virt)))
+        // PD -> PT
+        guard let ptPhys = getOrAllocTable(entry: &pd[Int(pdIndex)], level: 1) else {
+            return nil
+        }
+        return UnsafeMutablePointer<UInt64>(bitPattern: UInt(ptPhys))!
     }
 
-    private static func getOrAllocTable(entry: UnsafeMutablePointer<UInt64>, isL2: Bool = false)
+    /// Resolve the table an entry points to, allocating it if missing and
+    /// copying it first if it is shared. `level` is the level of the table
+    /// being returned (3 = PDPT, 2 = PD, 1 = PT).
+    private static func getOrAllocTable(entry: UnsafeMutablePointer<UInt64>, level: Int)
         -> UInt64?
     {
+        let isL2 = level == 1
         var val = entry.pointee
+        if (val & (PTE_PRESENT | PTE_SHARED | PTE_HUGE)) == (PTE_PRESENT | PTE_SHARED) {
+            return unshare(entry: entry, markChildren: level > 1)
+        }
         if (val & 1) == 0 {
             // Not present, allocate new table
             guard let frame = PMM.allocateFrame() else { return nil }
@@ -61,7 +297,28 @@ public struct VMM {
             return nil
         }
 
-        return val & ~0xFFF
+        return val & PTE_ADDR_MASK
+    }
+
+    /// Give the entry a private copy of the table it points to. Non-leaf
+    /// entries in the copy still point at shared tables, so they are marked
+    /// shared in turn.
+    private static func unshare(entry: UnsafeMutablePointer<UInt64>, markChildren: Bool)
+        -> UInt64?
+    {
+        let oldPhys = entry.pointee & PTE_ADDR_MASK
+        guard let frame = PMM.allocateFrame(zero: false) else { return nil }
+        let src = UnsafeMutablePointer<UInt64>(bitPattern: UInt(oldPhys))!
+        let dst = UnsafeMutablePointer<UInt64>(bitPattern: UInt(frame.value))!
+        for i in 0..<512 {
+            var e = src[i]
+            if markChildren && (e & (PTE_PRESENT | PTE_HUGE)) == PTE_PRESENT {
+                e |= PTE_SHARED
+            }
+            dst[i] = e
+        }
+        entry.pointee = frame.value | (entry.pointee & 0xFFF & ~PTE_SHARED)
+        return frame.value
     }
 
     private static func split2MBPage(entry: UnsafeMutablePointer<UInt64>) -> UInt64? {
@@ -69,7 +326,7 @@ public struct VMM {
         let hugePageFlags = entry.pointee & 0x1FF
         let ptFlags = hugePageFlags & ~UInt64(0x80)
 
-        guard let frame = PMM.allocateFrame() else { return nil }
+        guard let frame = PMM.allocateFrame(zero: false) else { return nil }
         let pt = UnsafeMutablePointer<UInt64>(bitPattern: UInt(frame.value))!
 
         for i in 0..<512 {
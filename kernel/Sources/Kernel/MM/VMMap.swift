@@ -0,0 +1,529 @@
+/*
+ * MM/VMMap.swift
+ * Demand-paged regions
+ *
+ * An AddressSpace keeps a sorted list of VMRegions, each a window onto a
+ * VMObject. Creating a region only records it; frames are allocated (or read
+ * from the backing store) by the page fault handler the first time a page is
+ * touched. Private mappings of file-backed objects map the object's pages
+ * read-only and copy a page into the region's shadow object on the first
+ * write.
+ *
+ * File pages that sit page-aligned in identity-mapped memory (the ramdisk)
+ * are not copied at all: the object borrows the frame and only ever maps it
+ * read-only.
+ */
+
+import CSupport
+
+let VM_PROT_READ: UInt32 = 0x1
+let VM_PROT_WRITE: UInt32 = 0x2
+let VM_PROT_EXECUTE: UInt32 = 0x4
+
+// #PF error code bits
+private let PF_PRESENT: UInt64 = 1 << 0
+private let PF_WRITE: UInt64 = 1 << 1
+private let PF_USER: UInt64 = 1 << 2
+
+/// Object pages per lazily allocated slot chunk (one page of entries).
+private let slotsPerChunk: UInt64 = 512
+/// Low bit of a slot: the frame is borrowed from the backing store, so it
+/// is never written through or freed.
+private let slotBorrowed: UInt64 = 1
+
+public final class VMObject {
+    public enum Backing {
+        /// Zero-filled on first touch.
+        case anonymous
+        /// Filled from a file; the object covers the file from offset 0.
+        case vnode(VNode)
+        /// Filled from kernel-visible memory (e.g. a Mach-O image in the
+        /// ramdisk); bytes past `length` read as zero.
+        case memory(UnsafeRawPointer, length: UInt64)
+        /// Filled through the block cache from `length` bytes starting at
+        /// `sector`; the rest reads as zero.
+        case blockDevice(sector: UInt64, length: UInt64)
+    }
+
+    public let backing: Backing
+    public let pageCount: UInt64
+    /// Physical frame per object page, 0 when not resident. Chunks are
+    /// allocated on first use so huge sparse reservations stay cheap.
+    private var chunks: [UnsafeMutablePointer<UInt64>?]
+    public private(set) var residentPages: UInt64 = 0
+    public private(set) var borrowedPages: UInt64 = 0
+    /// Set once a virtual copy shares the object's pages (see VMCopy.swift).
+    /// From then on no private mapping writes it directly; written pages go
+    /// to the region's shadow, as for a file.
+    var isFrozen = false
+    /// Registered in sharedFileObjects, so deinit must unregister it.
+    private var isSharedFileObject = false
+
+    public init(backing: Backing, size: UInt64) {
+        self.backing = backing
+        pageCount = (size + PAGE_SIZE - 1) / PAGE_SIZE
+        let chunkCount = Int((pageCount + slotsPerChunk - 1) / slotsPerChunk)
+        chunks = [UnsafeMutablePointer<UInt64>?](repeating: nil, count: chunkCount)
+    }
+
+    /// The object every MAP_SHARED mapping of `vnode` uses, so they all see
+    /// each other's writes. It lives as long as some mapping holds it.
+    static func shared(for vnode: VNode) -> VMObject {
+        for entry in sharedFileObjects {
+            if case .vnode(let v) = entry.object.backing, v === vnode { return entry.object }
+        }
+        let object = VMObject(backing: .vnode(vnode), size: vnode.size)
+        object.isSharedFileObject = true
+        sharedFileObjects.append(SharedFileObject(object: object))
+        return object
+    }
+
+    deinit {
+        if isSharedFileObject {
+            sharedFileObjects.removeAll { $0.object === self }
+        }
+        for chunk in chunks {
+            guard let chunk = chunk else { continue }
+            for i in 0..<Int(slotsPerChunk) where chunk[i] != 0 {
+                if (chunk[i] & slotBorrowed) == 0 { PMM.freeFrame(PhysAddr(chunk[i])) }
+            }
+            kernelFree(UnsafeMutableRawPointer(chunk))
+        }
+    }
+
+    var isAnonymous: Bool {
+        if case .anonymous = backing { return true }
+        return false
+    }
+
+    private func slot(_ index: UInt64) -> UInt64 {
+        guard index < pageCount, let chunk = chunks[Int(index / slotsPerChunk)] else { return 0 }
+        return chunk[Int(index % slotsPerChunk)]
+    }
+
+    func resident(_ index: UInt64) -> UInt64 {
+        return slot(index) & PTE_ADDR_MASK
+    }
+
+    func isBorrowed(_ index: UInt64) -> Bool {
+        return (slot(index) & slotBorrowed) != 0
+    }
+
+    /// Record `phys` as the frame for page `index`; the object now owns it.
+    func setResident(_ index: UInt64, phys: UInt64) {
+        setSlot(index, phys)
+        residentPages += 1
+    }
+
+    private func setSlot(_ index: UInt64, _ value: UInt64) {
+        let c = Int(index / slotsPerChunk)
+        if chunks[c] == nil {
+            let raw = kernelAlloc(size: Int(slotsPerChunk) * 8, align: 4096)
+            memset(raw, 0, Int(slotsPerChunk) * 8)
+            chunks[c] = raw.bindMemory(to: UInt64.self, capacity: Int(slotsPerChunk))
+        }
+        chunks[c]![Int(index % slotsPerChunk)] = value
+    }
+
+    /// The whole of page `index` when the backing store already holds it in
+    /// memory, whether or not it is page aligned.
+    private func directSource(_ index: UInt64) -> UnsafeRawPointer? {
+        let offset = index * PAGE_SIZE
+        switch backing {
+        case .anonymous:
+            return nil
+        case .vnode(let vnode):
+            if offset + PAGE_SIZE > vnode.size { return nil }
+            return vnode.mmap(offset: offset, size: Int(PAGE_SIZE))
+        case .memory(let base, let length):
+            if offset + PAGE_SIZE > length { return nil }
+            return base.advanced(by: Int(offset))
+        case .blockDevice:
+            return nil
+        }
+    }
+
+    /// Frame holding page `index`, filling it from the backing store first if
+    /// it is not resident yet.
+    func page(at index: UInt64) -> UInt64? {
+        if index >= pageCount { return nil }
+        let existing = resident(index)
+        if existing != 0 { return existing }
+
+        let direct = directSource(index)
+        if let src = direct, (UInt(bitPattern: src) & UInt(PAGE_SIZE - 1)) == 0 {
+            // Identity mapped, so the address is the frame.
+            let phys = UInt64(UInt(bitPattern: src))
+            setSlot(index, phys | slotBorrowed)
+            residentPages += 1
+            borrowedPages += 1
+            return phys
+        }
+
+        let zeroFill = isAnonymous
+        guard let frame = PMM.allocateFrame(zero: zeroFill) else { return nil }
+        let dest = UnsafeMutableRawPointer(bitPattern: UInt(frame.value))!
+        let offset = index * PAGE_SIZE
+        if let src = direct {
+            memcpy(dest, src, Int(PAGE_SIZE))
+            setResident(index, phys: frame.value)
+            return frame.value
+        }
+        switch backing {
+        case .anonymous:
+            break
+        case .vnode(let vnode):
+            let n = max(vnode.read(offset: offset, count: Int(PAGE_SIZE), buffer: dest), 0)
+            if n < Int(PAGE_SIZE) { memset(dest.advanced(by: n), 0, Int(PAGE_SIZE) - n) }
+        case .memory(let base, let length):
+            let n = offset < length ? Int(min(length - offset, PAGE_SIZE)) : 0
+            if n > 0 { memcpy(dest, base.advanced(by: Int(offset)), n) }
+            if n < Int(PAGE_SIZE) { memset(dest.advanced(by: n), 0, Int(PAGE_SIZE) - n) }
+        case .blockDevice(let sector, let length):
+            let n = offset < length ? Int(min(length - offset, PAGE_SIZE)) : 0
+            let sectors = (n + 511) / 512
+            if sectors > 0
+                && !BlockCache.read(sector: sector + offset / 512, count: sectors, buffer: dest)
+            {
+                PMM.freeFrame(frame)
+                return nil
+            }
+            if n < Int(PAGE_SIZE) { memset(dest.advanced(by: n), 0, Int(PAGE_SIZE) - n) }
+        }
+        setResident(index, phys: frame.value)
+        return frame.value
+    }
+
+    /// Like page(at:), but replaces a borrowed frame with a private copy so
+    /// the result can be mapped writable.
+    func writablePage(at index: UInt64) -> UInt64? {
+        guard let phys = page(at: index) else { return nil }
+        if !isBorrowed(index) { return phys }
+        guard let frame = PMM.allocateFrame(zero: false) else { return nil }
+        memcpy(
+            UnsafeMutableRawPointer(bitPattern: UInt(frame.value))!,
+            UnsafeRawPointer(bitPattern: UInt(phys))!, Int(PAGE_SIZE))
+        setSlot(index, frame.value)
+        borrowedPages -= 1
+        return frame.value
+    }
+
+    /// Drop the frames of pages [from, to), e.g. once munmap has removed the
+    /// last region using them. Chunks never allocated are skipped, so this
+    /// stays cheap on huge sparse reservations.
+    func release(from: UInt64, to: UInt64) {
+        let end = min(to, pageCount)
+        var i = from
+        while i < end {
+            let c = Int(i / slotsPerChunk)
+            let chunkEnd = min(UInt64(c + 1) * slotsPerChunk, end)
+            let base = UInt64(c) * slotsPerChunk
+            if let chunk = chunks[c] {
+                for j in Int(i - base)..<Int(chunkEnd - base) where chunk[j] != 0 {
+                    if (chunk[j] & slotBorrowed) != 0 {
+                        borrowedPages -= 1
+                    } else {
+                        PMM.freeFrame(PhysAddr(chunk[j]))
+                    }
+                    residentPages -= 1
+                    chunk[j] = 0
+                }
+            }
+            i = chunkEnd
+        }
+    }
+
+    /// Pages [index, index + 512) have no frames yet, so a huge frame can
+    /// back all of them.
+    fileprivate func hugeSlotFree(_ index: UInt64) -> Bool {
+        if index + 512 > pageCount { return false }
+        for i in index..<(index + 512) where resident(i) != 0 { return false }
+        return true
+    }
+}
+
+/// Unowned so the table does not keep an object alive; VMObject.deinit
+/// removes its entry.
+private struct SharedFileObject {
+    unowned(unsafe) let object: VMObject
+}
+
+nonisolated(unsafe) private var sharedFileObjects: [SharedFileObject] = []
+
+public final class VMRegion {
+    public fileprivate(set) var start: UInt64
+    public fileprivate(set) var end: UInt64
+    public fileprivate(set) var prot: UInt32
+    /// Writes go to `shadow` instead of the object (MAP_PRIVATE).
+    public let isPrivate: Bool
+    public let object: VMObject
+    /// Byte offset of `start` within the object.
+    public fileprivate(set) var offset: UInt64
+    /// Private copies of written object pages, indexed like `object`.
+    var shadow: VMObject?
+
+    init(
+        start: UInt64, end: UInt64, prot: UInt32, isPrivate: Bool, object: VMObject,
+        offset: UInt64, shadow: VMObject? = nil
+    ) {
+        self.start = start
+        self.end = end
+        self.prot = prot
+        self.isPrivate = isPrivate
+        self.object = object
+        self.offset = offset
+        self.shadow = shadow
+    }
+
+    /// Pages written through this region must be copied first.
+    var copyOnWrite: Bool { isPrivate && (!object.isAnonymous || object.isFrozen) }
+
+    func objectIndex(of va: UInt64) -> UInt64 {
+        return (offset + (va - start)) / PAGE_SIZE
+    }
+
+    /// Split at `addr` (page aligned, strictly inside); self keeps the low
+    /// half and the high half is returned.
+    fileprivate func split(at addr: UInt64) -> VMRegion {
+        let high = VMRegion(
+            start: addr, end: end, prot: prot, isPrivate: isPrivate, object: object,
+            offset: offset + (addr - start), shadow: shadow)
+        end = addr
+        return high
+    }
+}
+
+extension AddressSpace {
+    /// Record a lazily populated mapping of `object` at [start, start + size).
+    /// Anything already mapped there is replaced.
+    public func mapObject(
+        start: UInt64, size: UInt64, prot: UInt32, object: VMObject, offset: UInt64 = 0,
+        isPrivate: Bool = true
+    ) {
+        let s = start & ~(PAGE_SIZE - 1)
+        let e = (start + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        unmap(start: s, size: e - s)
+        let region = VMRegion(
+            start: s, end: e, prot: prot, isPrivate: isPrivate, object: object,
+            offset: offset & ~(PAGE_SIZE - 1))
+        regions.insert(region, at: insertionIndex(for: s))
+    }
+
+    /// Remove regions and translations in [start, start + size). Frames no
+    /// remaining region uses are freed with them, so trimming part of a
+    /// region gives its pages back too.
+    public func unmap(start: UInt64, size: UInt64) {
+        let s = start & ~(PAGE_SIZE - 1)
+        let e = (start + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        if e <= s { return }
+        splitRegions(at: s, and: e)
+        let removed = regions.filter { $0.start >= s && $0.end <= e }
+        regions.removeAll { $0.start >= s && $0.end <= e }
+        clearTranslations(start: s, end: e)
+        for r in removed { releasePages(of: r) }
+    }
+
+    /// Change protection on [start, start + size). Translations are dropped
+    /// so the next access faults them back in with the new rights.
+    public func protect(start: UInt64, size: UInt64, prot: UInt32) {
+        let s = start & ~(PAGE_SIZE - 1)
+        let e = (start + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        if e <= s { return }
+        splitRegions(at: s, and: e)
+        for r in regions where r.start >= s && r.end <= e { r.prot = prot }
+        clearTranslations(start: s, end: e)
+    }
+
+    public func region(containing addr: UInt64) -> VMRegion? {
+        var lo = 0
+        var hi = regions.count
+        while lo < hi {
+            let mid = (lo + hi) / 2
+            let r = regions[mid]
+            if addr < r.start {
+                hi = mid
+            } else if addr >= r.end {
+                lo = mid + 1
+            } else {
+                return r
+            }
+        }
+        return nil
+    }
+
+    /// Resolve a fault at `addr`. Returns false if no region allows the
+    /// access or the page cannot be had (past the end of the object, out of
+    /// memory, a failed read).
+    func handleFault(addr: UInt64, error: UInt64) -> Bool {
+        guard let r = region(containing: addr) else { return false }
+        let write = (error & PF_WRITE) != 0
+        if write && (r.prot & VM_PROT_WRITE) == 0 { return false }
+        if !write && (r.prot & (VM_PROT_READ | VM_PROT_EXECUTE)) == 0 { return false }
+
+        let va = addr & ~(PAGE_SIZE - 1)
+        let index = r.objectIndex(of: va)
+        let writable = (r.prot & VM_PROT_WRITE) != 0
+        var phys: UInt64
+        var flags = PTE_USER
+
+        if r.copyOnWrite {
+            if let shadow = r.shadow, shadow.resident(index) != 0 {
+                phys = shadow.resident(index)
+                if writable { flags |= PTE_WRITABLE }
+            } else if write {
+                // A frozen anonymous page nobody touched is zero; don't
+                // populate the shared object just to copy it.
+                let untouched = r.object.isAnonymous && r.object.resident(index) == 0
+                guard let copy = PMM.allocateFrame(zero: untouched) else { return false }
+                if !untouched {
+                    guard let src = r.object.page(at: index) else {
+                        PMM.freeFrame(copy)
+                        return false
+                    }
+                    memcpy(
+                        UnsafeMutableRawPointer(bitPattern: UInt(copy.value))!,
+                        UnsafeRawPointer(bitPattern: UInt(src))!, Int(PAGE_SIZE))
+                }
+                if r.shadow == nil {
+                    r.shadow = VMObject(
+                        backing: .anonymous, size: r.object.pageCount * PAGE_SIZE)
+                }
+                r.shadow!.setResident(index, phys: copy.value)
+                phys = copy.value
+                flags |= PTE_WRITABLE
+            } else {
+                // Read-only until the first write copies it.
+                guard let p = r.object.page(at: index) else { return false }
+                phys = p
+            }
+        } else {
+            if writable { flags |= PTE_WRITABLE }
+            if (error & PF_PRESENT) == 0 && faultHuge(region: r, va: va, flags: flags) {
+                return true
+            }
+            guard let p = write ? r.object.writablePage(at: index) : r.object.page(at: index)
+            else { return false }
+            phys = p
+            // Borrowed frames stay read-only; a later write faults again and
+            // takes a private copy first.
+            if r.object.isBorrowed(index) { flags &= ~PTE_WRITABLE }
+        }
+
+        map(virt: va, phys: PhysAddr(phys), flags: flags)
+        return true
+    }
+
+    /// Back the whole 2 MiB block around `va` with one huge frame when it
+    /// lies inside an anonymous region that has not touched it yet.
+    private func faultHuge(region r: VMRegion, va: UInt64, flags: UInt64) -> Bool {
+        guard r.object.isAnonymous else { return false }
+        let block = va & ~(HUGE_PAGE_SIZE - 1)
+        if block < r.start || block + HUGE_PAGE_SIZE > r.end { return false }
+        let first = r.objectIndex(of: block)
+        guard r.object.hugeSlotFree(first), let frame = PMM.allocateHugeFrame() else {
+            return false
+        }
+        for i in 0..<UInt64(512) {
+            r.object.setResident(first + i, phys: frame.value + i * PAGE_SIZE)
+        }
+        mapRange(virt: block, phys: frame, size: HUGE_PAGE_SIZE, flags: flags)
+        return true
+    }
+
+    // MARK: - Internals
+
+    func insertionIndex(for addr: UInt64) -> Int {
+        var lo = 0
+        var hi = regions.count
+        while lo < hi {
+            let mid = (lo + hi) / 2
+            if regions[mid].start < addr { lo = mid + 1 } else { hi = mid }
+        }
+        return lo
+    }
+
+    /// Make `s` and `e` region boundaries.
+    func splitRegions(at s: UInt64, and e: UInt64) {
+        for addr in [s, e] {
+            guard let r = region(containing: addr), r.start < addr else { continue }
+            let high = r.split(at: addr)
+            regions.insert(high, at: insertionIndex(for: high.start))
+        }
+    }
+
+    /// Free the frames of a removed region that no remaining one covers.
+    /// Unfrozen anonymous objects and shadows are only ever reached through
+    /// this space's regions (copies freeze or duplicate them), so nothing
+    /// else can be using those pages. File pages stay cached in their
+    /// object, and frozen ones are still shared with a virtual copy.
+    private func releasePages(of r: VMRegion) {
+        let first = r.objectIndex(of: r.start)
+        let end = r.objectIndex(of: r.end - 1) + 1
+        if r.object.isAnonymous && !r.object.isFrozen {
+            release(r.object, from: first, to: end) { $0.object === r.object }
+        }
+        if let shadow = r.shadow {
+            release(shadow, from: first, to: end) { $0.shadow === shadow }
+        }
+    }
+
+    private func release(
+        _ object: VMObject, from first: UInt64, to end: UInt64, usedBy uses: (VMRegion) -> Bool
+    ) {
+        var kept: [(UInt64, UInt64)] = []
+        for other in regions where uses(other) {
+            kept.append((other.objectIndex(of: other.start), other.objectIndex(of: other.end - 1) + 1))
+        }
+        kept.sort { $0.0 < $1.0 }
+        var i = first
+        for (lo, hi) in kept {
+            if hi <= i || lo >= end { continue }
+            if lo > i { object.release(from: i, to: lo) }
+            i = hi
+        }
+        if i < end { object.release(from: i, to: end) }
+    }
+
+    func clearTranslations(start: UInt64, end: UInt64) {
+        let touched = VMM.unmap(root: root, virt: start, size: end - start)
+        if touched != 0 { flushTLB(start: start, end: end, touched: touched) }
+    }
+}
+
+/// Faults from user mode take the kernel lock here; faults on user memory
+/// from inside a syscall already hold it.
+///
+/// A fault the task caused and we cannot resolve ends the task, as SIGBUS
+/// or SIGSEGV would by default: any from user mode, and those a syscall
+/// takes inside one of the task's regions (there are no copyin fixups to
+/// turn them into EFAULT). Only kernel faults outside every region are
+/// left to panic.
+@_cdecl("handle_page_fault")
+func handlePageFault(addr: UInt64, error: UInt64, rip: UInt64) -> Int32 {
+    Trace.event(.pageFaultEnter, addr, error)
+    kernel_lock()
+    let space = AddressSpace.current
+    let handled = space?.handleFault(addr: addr, error: error) ?? false
+    Trace.event(.pageFaultExit, addr, handled ? 1 : 0)
+    if handled {
+        kernel_unlock()
+        return 1
+    }
+    let region = space?.region(containing: addr)
+    if region == nil && (error & PF_USER) == 0 {
+        kernel_unlock()
+        return 0
+    }
+    // Inside a region the access was allowed but the page does not exist
+    // (past the end of the file, or unreadable): SIGBUS, as on Darwin.
+    let write = (error & PF_WRITE) != 0
+    let needed = write ? VM_PROT_WRITE : (VM_PROT_READ | VM_PROT_EXECUTE)
+    let allowed = region.map { ($0.prot & needed) != 0 } ?? false
+    kprint(allowed ? "SIGBUS" : "SIGSEGV")
+    kprint(" at 0x")
+    kprint_hex(addr)
+    kprint(" rip 0x")
+    kprint_hex(rip)
+    kprint("\n")
+    Scheduler.exitTask()
+}
@@ -1,3 +1,32 @@
+/*
+ * MachIPC.swift
+ * Mach ports, port name spaces and mach_msg
+ *
+ * A port is a kernel object with a single receive right and a bounded queue
+ * of messages. A task names the rights it holds through its IPCSpace: a
+ * table indexed by the upper 24 bits of the name, with a generation in the
+ * low 8 bits so a stale name is caught once its slot has been reused (the
+ * layout XNU uses). An entry records which rights the name denotes and the
+ * user references on its send right; the port itself counts the send and
+ * send-once rights outstanding in every space and in transit.
+ *
+ * mach_msg copies the message into a kernel buffer and turns the header's
+ * dispositions into the rights the message carries. If a receiver is already
+ * parked on the destination the message goes straight to it; otherwise it is
+ * queued. A receive takes the oldest queued message or parks until a sender
+ * hands one over or the timeout runs out.
+ *
+ * A thread parked in mach_msg blocks in the scheduler (Sched/Scheduler.swift)
+ * and is woken by whoever hands it a message, makes room in the queue or
+ * destroys the port.
+ *
+ * Inline data costs one copy in and one copy out, and the buffers of small
+ * messages are recycled rather than freed. Out-of-line memory is never
+ * copied through the kernel: the pages travel as a VMCopy and are mapped
+ * into the receiver copy-on-write, or moved outright when the sender gives
+ * them up (see MM/VMCopy.swift).
+ */
+
 import CSupport
 
 // MARK: - Mach Port Types
@@ -11,6 +40,39 @@ let MACH_PORT_DEAD: MachPortName = ~0
 let MACH_PORT_RIGHT_SEND: UInt32 = 0
 let MACH_PORT_RIGHT_RECEIVE: UInt32 = 1
 let MACH_PORT_RIGHT_SEND_ONCE: UInt32 = 2
+let MACH_PORT_RIGHT_PORT_SET: UInt32 = 3
+let MACH_PORT_RIGHT_DEAD_NAME: UInt32 = 4
+
+// Rights a name denotes, as mach_port_type() reports them
+let MACH_PORT_TYPE_SEND: UInt32 = 1 << 16
+let MACH_PORT_TYPE_RECEIVE: UInt32 = 1 << 17
+let MACH_PORT_TYPE_SEND_ONCE: UInt32 = 1 << 18
+let MACH_PORT_TYPE_DEAD_NAME: UInt32 = 1 << 20
+
+let MACH_PORT_UREFS_MAX: UInt32 = 0xFFFF
+let MACH_PORT_QLIMIT_DEFAULT = 5
+let MACH_PORT_QLIMIT_MAX = 1024
+
+// Dispositions; a right in transit is PORT_SEND, PORT_SEND_ONCE or MOVE_RECEIVE
+let MACH_MSG_TYPE_MOVE_RECEIVE: UInt32 = 16
+let MACH_MSG_TYPE_MOVE_SEND: UInt32 = 17
+let MACH_MSG_TYPE_MOVE_SEND_ONCE: UInt32 = 18
+let MACH_MSG_TYPE_COPY_SEND: UInt32 = 19
+let MACH_MSG_TYPE_MAKE_SEND: UInt32 = 20
+let MACH_MSG_TYPE_MAKE_SEND_ONCE: UInt32 = 21
+let MACH_MSG_TYPE_PORT_SEND = MACH_MSG_TYPE_MOVE_SEND
+let MACH_MSG_TYPE_PORT_SEND_ONCE = MACH_MSG_TYPE_MOVE_SEND_ONCE
+
+let MACH_MSGH_BITS_PORTS_MASK: UInt32 = 0x001F_1F1F
+let MACH_MSGH_BITS_COMPLEX: UInt32 = 0x8000_0000
+
+// Descriptor types in the body of a complex message
+let MACH_MSG_PORT_DESCRIPTOR: UInt8 = 0
+let MACH_MSG_OOL_DESCRIPTOR: UInt8 = 1
+let MACH_MSG_OOL_PORTS_DESCRIPTOR: UInt8 = 2
+let MACH_MSG_OOL_VOLATILE_DESCRIPTOR: UInt8 = 3
+
+let MACH_MSG_VIRTUAL_COPY: UInt8 = 1
 
 // Message options
 let MACH_SEND_MSG: UInt32 = 0x0000_0001
@@ -24,13 +86,50 @@ let KERN_SUCCESS: UInt32 = 0
 let KERN_INVALID_ARGUMENT: UInt32 = 4
 let KERN_NO_SPACE: UInt32 = 3
 let KERN_INVALID_NAME: UInt32 = 15
+let KERN_INVALID_RIGHT: UInt32 = 17
+let KERN_INVALID_VALUE: UInt32 = 18
+let KERN_UREFS_OVERFLOW: UInt32 = 19
+let KERN_ABORTED: UInt32 = 14
+let KERN_TERMINATED: UInt32 = 37
+let KERN_OPERATION_TIMED_OUT: UInt32 = 49
 
 let MACH_MSG_SUCCESS: UInt32 = 0
+let MACH_SEND_INVALID_DATA: UInt32 = 0x1000_0002
+let MACH_SEND_INVALID_DEST: UInt32 = 0x1000_0003
+let MACH_SEND_TIMED_OUT: UInt32 = 0x1000_0004
+let MACH_SEND_MSG_TOO_SMALL: UInt32 = 0x1000_0008
+let MACH_SEND_INVALID_REPLY: UInt32 = 0x1000_0009
+let MACH_SEND_INVALID_RIGHT: UInt32 = 0x1000_000A
+let MACH_SEND_INVALID_MEMORY: UInt32 = 0x1000_000C
+let MACH_SEND_TOO_LARGE: UInt32 = 0x1000_000E
+let MACH_SEND_INVALID_TYPE: UInt32 = 0x1000_000F
+let MACH_RCV_INVALID_NAME: UInt32 = 0x1000_4002
 let MACH_RCV_TIMED_OUT: UInt32 = 0x1000_4003
+let MACH_RCV_TOO_LARGE: UInt32 = 0x1000_4004
+let MACH_RCV_INVALID_DATA: UInt32 = 0x1000_4008
+let MACH_RCV_PORT_DIED: UInt32 = 0x1000_4009
+
+/// Answer to a MIG routine the server does not implement.
+let MIG_BAD_ID: Int32 = -303
+let MIG_BAD_ARGUMENTS: Int32 = -304
+
+// task subsystem routines served in the kernel
+let MIG_SEMAPHORE_CREATE: Int32 = 3418
+let MIG_SEMAPHORE_DESTROY: Int32 = 3419
 
 // Special ports
 let TASK_BOOTSTRAP_PORT: UInt32 = 4
 
+/// Largest message copied in; bulk data belongs in out-of-line memory.
+let IPC_KMSG_MAX_SIZE: UInt32 = 64 * 1024
+/// Messages up to this size, which covers nearly every RPC, get their
+/// buffer from a small cache instead of the heap.
+let IPC_KMSG_INLINE_SIZE = 256
+private let kmsgCacheLimit = 32
+nonisolated(unsafe) private var kmsgCache: [UnsafeMutableRawPointer] = []
+/// Entries a single space may hold.
+private let IPC_SPACE_MAX = 1 << 16
+
 // MARK: - Mach Message Header (matches XNU mach_msg_header_t)
 
 struct MachMsgHeader {
@@ -42,100 +141,655 @@ struct MachMsgHeader {
     var msgh_id: Int32
 }
 
-// MARK: - Port Table Entry
+let MACH_MSG_HEADER_SIZE = 24
+
+/// Bytes of trailer a receive with `option` asks for (REQUESTED_TRAILER_SIZE).
+private func requestedTrailerSize(_ option: UInt32) -> Int {
+    switch (option >> 24) & 0xF {
+    case 0: return 8  // mach_msg_trailer_t
+    case 1: return 12  // seqno
+    case 2: return 20  // security
+    case 3: return 52  // audit
+    case 4: return 60  // context
+    default: return 68  // mach_msg_max_trailer_t
+    }
+}
+
+// MARK: - Ports
+
+/// What a port stands for when the kernel holds its receive right.
+enum IPCKernelObject {
+    case none
+    case task
+    case thread
+    case host
+    case semaphore(Semaphore)
+
+    var isNone: Bool {
+        if case .none = self { return true }
+        return false
+    }
+}
+
+/// A thread parked in mach_msg: a receiver waiting for a message or a sender
+/// waiting for queue space.
+final class IPCWaiter {
+    let thread = Thread.current
+    /// Set by a sender that hands its message over directly.
+    var message: IPCMessage?
+    var woken = false
+}
 
-struct MachPort {
-    var name: MachPortName
-    var rightType: UInt32
-    var msgQueue: UnsafeMutablePointer<MachMsgBuffer>?
-    var msgCount: Int
+/// Park until `waiter` is woken or `timeout` milliseconds pass (nil: no
+/// limit). Returns whether it was woken.
+private func ipcBlock(_ waiter: IPCWaiter, timeout: UInt32?) -> Bool {
+    if !waiter.woken { _ = Scheduler.block(timeout: timeout) }
+    return waiter.woken
 }
 
-struct MachMsgBuffer {
-    var data: UnsafeMutablePointer<UInt8>
-    var size: Int
-    var next: UnsafeMutablePointer<MachMsgBuffer>?
+private func ipcWake(_ waiter: IPCWaiter) {
+    waiter.woken = true
+    Scheduler.wake(waiter.thread)
 }
 
-// MARK: - Port Space
+nonisolated(unsafe) private var nextPortSerial: UInt32 = 1
 
-let MAX_PORTS = 256
+final class IPCPort {
+    let kobject: IPCKernelObject
+    /// Keys the per-space reverse lookup.
+    let serial: UInt32
+    /// Cleared when the receive right is destroyed; the port is then dead.
+    private(set) var active = true
+    var sendRights = 0
+    var sendOnceRights = 0
+    var queueLimit = MACH_PORT_QLIMIT_DEFAULT
+    private var seqno: UInt32 = 0
+    private var messages: [IPCMessage] = []
+    private var receivers: [IPCWaiter] = []
+    private var senders: [IPCWaiter] = []
 
-// Global port table (single-process for now)
-nonisolated(unsafe) var portTable:
-    (
-        MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort,
-        MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort,
-        MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort,
-        MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort, MachPort
-    ) = (
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0),
-        MachPort(name: 0, rightType: 0, msgQueue: nil, msgCount: 0)
-    )
+    init(kobject: IPCKernelObject = .none) {
+        self.kobject = kobject
+        serial = nextPortSerial
+        nextPortSerial &+= 1
+    }
 
-nonisolated(unsafe) var nextPortName: MachPortName = 0x103  // Start after well-known ports
+    /// Drop one right of `type` (PORT_SEND, PORT_SEND_ONCE or MOVE_RECEIVE).
+    func release(_ type: UInt32) {
+        if type == MACH_MSG_TYPE_MOVE_RECEIVE {
+            destroy()
+        } else if type == MACH_MSG_TYPE_PORT_SEND_ONCE {
+            sendOnceRights -= 1
+        } else {
+            sendRights -= 1
+        }
+    }
 
-// MARK: - Port Operations
+    /// Destroy the receive right: queued messages are discarded and everyone
+    /// parked on the port is woken to find it dead.
+    func destroy() {
+        active = false
+        messages.removeAll()
+        for w in receivers { ipcWake(w) }
+        for w in senders { ipcWake(w) }
+        receivers.removeAll()
+        senders.removeAll()
+    }
 
-func machPortAllocate(rightType: UInt32) -> MachPortName {
-    let name = nextPortName
-    nextPortName += 1
-    return name
+    func send(_ m: IPCMessage, option: UInt32, timeout: UInt32) -> UInt32 {
+        if !active { return MACH_SEND_INVALID_DEST }
+        // A receiver is already waiting: hand the message over unqueued.
+        if !receivers.isEmpty {
+            let w = receivers.removeFirst()
+            m.seqno = nextSeqno()
+            w.message = m
+            ipcWake(w)
+            return MACH_MSG_SUCCESS
+        }
+        // Replies on send-once rights never wait for queue space.
+        while messages.count >= queueLimit && m.destinationType != MACH_MSG_TYPE_PORT_SEND_ONCE {
+            let timed = (option & MACH_SEND_TIMEOUT) != 0
+            if timed && timeout == 0 { return MACH_SEND_TIMED_OUT }
+            let w = IPCWaiter()
+            senders.append(w)
+            let woken = ipcBlock(w, timeout: timed ? timeout : nil)
+            senders.removeAll { $0 === w }
+            if !active { return MACH_SEND_INVALID_DEST }
+            if !woken { return MACH_SEND_TIMED_OUT }
+        }
+        messages.append(m)
+        return MACH_MSG_SUCCESS
+    }
+
+    /// The oldest queued message, or nil after waiting up to `timeout`
+    /// milliseconds (nil: no limit).
+    func receive(timeout: UInt32?) -> IPCMessage? {
+        if !messages.isEmpty {
+            let m = messages.removeFirst()
+            m.seqno = nextSeqno()
+            if !senders.isEmpty { ipcWake(senders.removeFirst()) }
+            return m
+        }
+        if timeout == 0 || !active { return nil }
+        let w = IPCWaiter()
+        receivers.append(w)
+        _ = ipcBlock(w, timeout: timeout)
+        receivers.removeAll { $0 === w }
+        return w.message
+    }
+
+    /// Put back a message the receiver had no room for (MACH_RCV_LARGE).
+    func requeue(_ m: IPCMessage) {
+        m.seqno = 0
+        seqno &-= 1
+        messages.insert(m, at: 0)
+    }
+
+    private func nextSeqno() -> UInt32 {
+        defer { seqno &+= 1 }
+        return seqno
+    }
 }
 
-func machTaskSelf() -> MachPortName {
-    return 0x103  // Fixed task port
+/// What a descriptor in a complex message carries while in transit.
+enum IPCCarried {
+    case port(IPCPort?, UInt32)
+    case memory(VMCopy?)
+    case ports([IPCPort?], UInt32)
 }
 
-func machReplyPort() -> MachPortName {
-    return machPortAllocate(rightType: MACH_PORT_RIGHT_RECEIVE)
+/// A message in transit: a kernel copy of its bytes and the rights and
+/// memory it carries. Whatever it still holds when it dies is released.
+final class IPCMessage {
+    let buffer: UnsafeMutableRawPointer
+    let size: Int
+    let destination: IPCPort
+    let destinationType: UInt32
+    var reply: IPCPort?
+    var replyType: UInt32 = 0
+    var seqno: UInt32 = 0
+    /// One entry per descriptor of a complex message, in order.
+    var carried: [IPCCarried] = []
+    private var holdsDestination = true
+
+    init(size: Int, destination: IPCPort, destinationType: UInt32) {
+        if size <= IPC_KMSG_INLINE_SIZE {
+            buffer = kmsgCache.popLast() ?? kernelAlloc(size: IPC_KMSG_INLINE_SIZE)
+        } else {
+            buffer = kernelAlloc(size: size)
+        }
+        self.size = size
+        self.destination = destination
+        self.destinationType = destinationType
+    }
+
+    deinit {
+        if holdsDestination { destination.release(destinationType) }
+        reply?.release(replyType)
+        for c in carried {
+            switch c {
+            case .port(let port, let type):
+                port?.release(type)
+            case .ports(let ports, let type):
+                for p in ports { p?.release(type) }
+            case .memory:
+                break
+            }
+        }
+        if size <= IPC_KMSG_INLINE_SIZE && kmsgCache.count < kmsgCacheLimit {
+            kmsgCache.append(buffer)
+        } else {
+            kernelFree(buffer)
+        }
+    }
+
+    var header: MachMsgHeader {
+        get { buffer.load(as: MachMsgHeader.self) }
+        set { buffer.storeBytes(of: newValue, as: MachMsgHeader.self) }
+    }
+
+    /// The receiver takes over the destination right (it already holds the
+    /// receive right instead) and the reply right.
+    func consumeRights() -> (reply: IPCPort?, replyType: UInt32) {
+        destination.release(destinationType)
+        holdsDestination = false
+        defer { reply = nil }
+        return (reply, replyType)
+    }
+
+    func takeCarried() -> [IPCCarried] {
+        defer { carried = [] }
+        return carried
+    }
 }
 
-func machHostSelf() -> MachPortName {
-    return 0x104  // Fixed host port
+nonisolated(unsafe) let hostPort = IPCPort(kobject: .host)
+
+// MARK: - Port Name Space
+
+private struct IPCEntry {
+    var port: IPCPort? = nil
+    /// MACH_PORT_TYPE_* bits; 0 while the slot is free.
+    var type: UInt32 = 0
+    var urefs: UInt32 = 0
+    var generation: UInt32 = 3
+    var nextFree: Int32 = -1
 }
 
-// MARK: - Mach RPC Handlers
+final class IPCSpace {
+    /// Space of the running task.
+    nonisolated(unsafe) static var current: IPCSpace?
+
+    /// Slot 0 is never handed out: its names would include MACH_PORT_NULL.
+    private var entries = [IPCEntry()]
+    private var freeHead: Int32 = -1
+    /// Open-addressed map from port serial to the entry holding a send or
+    /// receive right for it, so a right arriving for a port the task already
+    /// names lands on that name. Send-once rights always get a fresh name.
+    private var reverse = [Int32](repeating: -1, count: 64)
+    private var reverseCount = 0
+
+    let taskPort = IPCPort(kobject: .task)
+
+    init() {
+        _ = makeSend(taskPort)
+        _ = makeSend(hostPort)
+    }
+
+    deinit {
+        for i in 1..<entries.count {
+            guard let port = entries[i].port else { continue }
+            if entries[i].type & MACH_PORT_TYPE_RECEIVE != 0 { port.destroy() }
+            if entries[i].type & MACH_PORT_TYPE_SEND != 0 { port.release(MACH_MSG_TYPE_PORT_SEND) }
+            if entries[i].type & MACH_PORT_TYPE_SEND_ONCE != 0 {
+                port.release(MACH_MSG_TYPE_PORT_SEND_ONCE)
+            }
+        }
+    }
+
+    /// A new send right to a kernel-held port, named in this space.
+    func makeSend(_ port: IPCPort) -> MachPortName {
+        port.sendRights += 1
+        return copyout(port, MACH_MSG_TYPE_PORT_SEND)
+    }
+
+    // MARK: Names
+
+    private func name(_ i: Int) -> MachPortName {
+        return MachPortName(i) << 8 | entries[i].generation
+    }
+
+    private func index(of name: MachPortName) -> Int? {
+        let i = Int(name >> 8)
+        guard i > 0, i < entries.count, entries[i].type != 0,
+            entries[i].generation == name & 0xFF
+        else { return nil }
+        // Rights to a port whose receive right is gone read as a dead name.
+        if let port = entries[i].port, !port.active { kill(i) }
+        return i
+    }
+
+    private func allocateEntry(_ port: IPCPort?, type: UInt32, urefs: UInt32) -> MachPortName? {
+        let i: Int
+        if freeHead >= 0 {
+            i = Int(freeHead)
+            freeHead = entries[i].nextFree
+        } else {
+            if entries.count >= IPC_SPACE_MAX { return nil }
+            i = entries.count
+            entries.append(IPCEntry())
+        }
+        entries[i].port = port
+        entries[i].type = type
+        entries[i].urefs = urefs
+        if type & (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_RECEIVE) != 0 { reverseInsert(i) }
+        return name(i)
+    }
+
+    private func freeEntry(_ i: Int) {
+        if entries[i].type & (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_RECEIVE) != 0 {
+            reverseRemove(i)
+        }
+        let generation = (entries[i].generation &+ 4) & 0xFF
+        entries[i] = IPCEntry(generation: generation, nextFree: freeHead)
+        freeHead = Int32(i)
+    }
+
+    /// Take `bit` away from entry `i`, freeing the name if nothing is left.
+    private func removeRight(_ i: Int, _ bit: UInt32) {
+        let type = entries[i].type & ~bit
+        if type == 0 {
+            freeEntry(i)
+            return
+        }
+        if type & (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_RECEIVE) == 0 { reverseRemove(i) }
+        entries[i].type = type
+        if bit == MACH_PORT_TYPE_SEND { entries[i].urefs = 0 }
+    }
+
+    /// Turn the rights at `i` into a dead name, keeping its references.
+    private func kill(_ i: Int) {
+        guard let port = entries[i].port else { return }
+        let type = entries[i].type
+        if type & (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_RECEIVE) != 0 { reverseRemove(i) }
+        if type & MACH_PORT_TYPE_SEND != 0 { port.release(MACH_MSG_TYPE_PORT_SEND) }
+        if type & MACH_PORT_TYPE_SEND_ONCE != 0 {
+            port.release(MACH_MSG_TYPE_PORT_SEND_ONCE)
+            entries[i].urefs = 1
+        }
+        entries[i].port = nil
+        entries[i].type = MACH_PORT_TYPE_DEAD_NAME
+    }
+
+    // MARK: Reverse lookup
+
+    private func reverseHome(_ serial: UInt32) -> Int {
+        return Int(truncatingIfNeeded: (UInt64(serial) &* 0x9E37_79B9_7F4A_7C15) >> 40)
+            & (reverse.count - 1)
+    }
+
+    private func reverseFind(_ port: IPCPort) -> Int? {
+        let mask = reverse.count - 1
+        var slot = reverseHome(port.serial)
+        while reverse[slot] >= 0 {
+            let i = Int(reverse[slot])
+            if entries[i].port === port { return i }
+            slot = (slot + 1) & mask
+        }
+        return nil
+    }
+
+    private func reverseInsert(_ i: Int) {
+        if (reverseCount + 1) * 2 > reverse.count {
+            reverse = [Int32](repeating: -1, count: reverse.count * 2)
+            reverseCount = 0
+            for j in 1..<entries.count
+            where j != i
+                && entries[j].type & (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_RECEIVE) != 0
+            {
+                reverseInsert(j)
+            }
+        }
+        let mask = reverse.count - 1
+        var slot = reverseHome(entries[i].port!.serial)
+        while reverse[slot] >= 0 { slot = (slot + 1) & mask }
+        reverse[slot] = Int32(i)
+        reverseCount += 1
+    }
+
+    private func reverseRemove(_ i: Int) {
+        guard let port = entries[i].port else { return }
+        let mask = reverse.count - 1
+        var hole = reverseHome(port.serial)
+        while reverse[hole] != Int32(i) {
+            if reverse[hole] < 0 { return }
+            hole = (hole + 1) & mask
+        }
+        reverse[hole] = -1
+        reverseCount -= 1
+        // Shift the rest of the cluster back so lookups need no tombstones.
+        var slot = (hole + 1) & mask
+        while reverse[slot] >= 0 {
+            let home = reverseHome(entries[Int(reverse[slot])].port!.serial)
+            if (slot - home) & mask >= (slot - hole) & mask {
+                reverse[hole] = reverse[slot]
+                reverse[slot] = -1
+                hole = slot
+            }
+            slot = (slot + 1) & mask
+        }
+    }
+
+    // MARK: Rights in messages
+
+    private func requiredType(_ disposition: UInt32) -> UInt32 {
+        switch disposition {
+        case MACH_MSG_TYPE_MAKE_SEND, MACH_MSG_TYPE_MAKE_SEND_ONCE: return MACH_PORT_TYPE_RECEIVE
+        case MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MOVE_SEND: return MACH_PORT_TYPE_SEND
+        case MACH_MSG_TYPE_MOVE_SEND_ONCE: return MACH_PORT_TYPE_SEND_ONCE
+        case MACH_MSG_TYPE_MOVE_RECEIVE: return MACH_PORT_TYPE_RECEIVE
+        default: return 0
+        }
+    }
+
+    /// Whether `name` holds what `disposition` needs, without taking it.
+    func allows(_ name: MachPortName, _ disposition: UInt32) -> Bool {
+        guard let i = index(of: name), entries[i].port != nil else { return false }
+        return entries[i].type & requiredType(disposition) != 0
+    }
+
+    /// Take the right `disposition` asks of `name` for a message. Returns the
+    /// port and the kind of right the message now carries.
+    func copyin(_ name: MachPortName, _ disposition: UInt32) -> (IPCPort, UInt32)? {
+        guard let i = index(of: name), let port = entries[i].port,
+            entries[i].type & requiredType(disposition) != 0
+        else { return nil }
+        switch disposition {
+        case MACH_MSG_TYPE_MAKE_SEND, MACH_MSG_TYPE_COPY_SEND:
+            port.sendRights += 1
+            return (port, MACH_MSG_TYPE_PORT_SEND)
+        case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+            port.sendOnceRights += 1
+            return (port, MACH_MSG_TYPE_PORT_SEND_ONCE)
+        case MACH_MSG_TYPE_MOVE_SEND:
+            if entries[i].urefs > 1 {
+                entries[i].urefs -= 1
+                port.sendRights += 1
+            } else {
+                removeRight(i, MACH_PORT_TYPE_SEND)
+            }
+            return (port, MACH_MSG_TYPE_PORT_SEND)
+        case MACH_MSG_TYPE_MOVE_RECEIVE:
+            removeRight(i, MACH_PORT_TYPE_RECEIVE)
+            return (port, MACH_MSG_TYPE_MOVE_RECEIVE)
+        default:
+            removeRight(i, MACH_PORT_TYPE_SEND_ONCE)
+            return (port, MACH_MSG_TYPE_PORT_SEND_ONCE)
+        }
+    }
+
+    /// Give this space a right carried in a message and return its name.
+    func copyout(_ port: IPCPort, _ type: UInt32) -> MachPortName {
+        if !port.active {
+            port.release(type)
+            return MACH_PORT_DEAD
+        }
+        if type == MACH_MSG_TYPE_PORT_SEND_ONCE {
+            if let name = allocateEntry(port, type: MACH_PORT_TYPE_SEND_ONCE, urefs: 1) {
+                return name
+            }
+        } else if type == MACH_MSG_TYPE_MOVE_RECEIVE {
+            if let i = reverseFind(port) {
+                entries[i].type |= MACH_PORT_TYPE_RECEIVE
+                return name(i)
+            }
+            if let name = allocateEntry(port, type: MACH_PORT_TYPE_RECEIVE, urefs: 0) {
+                return name
+            }
+        } else if let i = reverseFind(port) {
+            if entries[i].type & MACH_PORT_TYPE_SEND != 0 {
+                // One right per name; the arriving one becomes a reference.
+                port.release(type)
+                if entries[i].urefs < MACH_PORT_UREFS_MAX { entries[i].urefs += 1 }
+            } else {
+                entries[i].type |= MACH_PORT_TYPE_SEND
+                entries[i].urefs = 1
+            }
+            return name(i)
+        } else if let name = allocateEntry(port, type: MACH_PORT_TYPE_SEND, urefs: 1) {
+            return name
+        }
+        port.release(type)
+        return MACH_PORT_DEAD
+    }
+
+    /// The port `name` holds the receive right for.
+    func receivePort(_ name: MachPortName) -> IPCPort? {
+        guard let i = index(of: name), entries[i].type & MACH_PORT_TYPE_RECEIVE != 0 else {
+            return nil
+        }
+        return entries[i].port
+    }
+
+    /// The port `name` holds a send right for.
+    func sendPort(_ name: MachPortName) -> IPCPort? {
+        guard let i = index(of: name), entries[i].type & MACH_PORT_TYPE_SEND != 0 else {
+            return nil
+        }
+        return entries[i].port
+    }
+
+    // MARK: mach_port_* calls
+
+    func allocate(right: UInt32) -> (UInt32, MachPortName) {
+        let name: MachPortName?
+        switch right {
+        case MACH_PORT_RIGHT_RECEIVE:
+            name = allocateEntry(IPCPort(), type: MACH_PORT_TYPE_RECEIVE, urefs: 0)
+        case MACH_PORT_RIGHT_DEAD_NAME:
+            name = allocateEntry(nil, type: MACH_PORT_TYPE_DEAD_NAME, urefs: 1)
+        default:
+            return (KERN_INVALID_VALUE, MACH_PORT_NULL)
+        }
+        guard let name = name else { return (KERN_NO_SPACE, MACH_PORT_NULL) }
+        return (KERN_SUCCESS, name)
+    }
+
+    /// mach_port_construct: a receive right with MPO_* options.
+    func construct(flags: UInt32, queueLimit: UInt32) -> (UInt32, MachPortName) {
+        let port = IPCPort()
+        if flags & 0x2 != 0 {  // MPO_QLIMIT
+            if queueLimit > UInt32(MACH_PORT_QLIMIT_MAX) { return (KERN_INVALID_VALUE, MACH_PORT_NULL) }
+            port.queueLimit = Int(queueLimit)
+        }
+        guard let name = allocateEntry(port, type: MACH_PORT_TYPE_RECEIVE, urefs: 0) else {
+            return (KERN_NO_SPACE, MACH_PORT_NULL)
+        }
+        if flags & 0x10 != 0 {  // MPO_INSERT_SEND_RIGHT
+            let i = Int(name >> 8)
+            port.sendRights += 1
+            entries[i].type |= MACH_PORT_TYPE_SEND
+            entries[i].urefs = 1
+        }
+        return (KERN_SUCCESS, name)
+    }
+
+    func modRefs(_ name: MachPortName, right: UInt32, delta: Int32) -> UInt32 {
+        if name == MACH_PORT_NULL || name == MACH_PORT_DEAD {
+            let soft = right == MACH_PORT_RIGHT_SEND || right == MACH_PORT_RIGHT_SEND_ONCE
+            return soft ? KERN_SUCCESS : KERN_INVALID_NAME
+        }
+        guard let i = index(of: name) else { return KERN_INVALID_NAME }
+        let type = entries[i].type
+        switch right {
+        case MACH_PORT_RIGHT_RECEIVE:
+            guard type & MACH_PORT_TYPE_RECEIVE != 0, let port = entries[i].port else {
+                return KERN_INVALID_RIGHT
+            }
+            if delta == 0 { return KERN_SUCCESS }
+            if delta != -1 { return KERN_INVALID_VALUE }
+            port.destroy()
+            if type & MACH_PORT_TYPE_SEND != 0 {
+                kill(i)
+            } else {
+                removeRight(i, MACH_PORT_TYPE_RECEIVE)
+            }
+        case MACH_PORT_RIGHT_SEND_ONCE:
+            guard type & MACH_PORT_TYPE_SEND_ONCE != 0, let port = entries[i].port else {
+                return KERN_INVALID_RIGHT
+            }
+            if delta == 0 { return KERN_SUCCESS }
+            if delta != -1 { return KERN_INVALID_VALUE }
+            port.release(MACH_MSG_TYPE_PORT_SEND_ONCE)
+            removeRight(i, MACH_PORT_TYPE_SEND_ONCE)
+        case MACH_PORT_RIGHT_SEND, MACH_PORT_RIGHT_DEAD_NAME:
+            let bit = right == MACH_PORT_RIGHT_SEND ? MACH_PORT_TYPE_SEND : MACH_PORT_TYPE_DEAD_NAME
+            guard type & bit != 0 else { return KERN_INVALID_RIGHT }
+            let urefs = Int64(entries[i].urefs) + Int64(delta)
+            if urefs < 0 { return KERN_INVALID_VALUE }
+            if urefs > Int64(MACH_PORT_UREFS_MAX) { return KERN_UREFS_OVERFLOW }
+            if urefs > 0 {
+                entries[i].urefs = UInt32(urefs)
+            } else {
+                entries[i].port?.release(MACH_MSG_TYPE_PORT_SEND)
+                removeRight(i, bit)
+            }
+        default:
+            return KERN_INVALID_VALUE
+        }
+        return KERN_SUCCESS
+    }
+
+    /// mach_port_deallocate: one reference of a send, send-once or dead name.
+    func deallocate(_ name: MachPortName) -> UInt32 {
+        if name == MACH_PORT_NULL || name == MACH_PORT_DEAD { return KERN_SUCCESS }
+        guard let i = index(of: name) else { return KERN_INVALID_NAME }
+        let type = entries[i].type
+        if type & MACH_PORT_TYPE_SEND != 0 { return modRefs(name, right: MACH_PORT_RIGHT_SEND, delta: -1) }
+        if type & MACH_PORT_TYPE_SEND_ONCE != 0 {
+            return modRefs(name, right: MACH_PORT_RIGHT_SEND_ONCE, delta: -1)
+        }
+        if type & MACH_PORT_TYPE_DEAD_NAME != 0 {
+            return modRefs(name, right: MACH_PORT_RIGHT_DEAD_NAME, delta: -1)
+        }
+        return KERN_INVALID_RIGHT
+    }
+
+    /// mach_port_insert_right. Names are chosen by the space, so the only
+    /// target name accepted is one that already denotes the same port; that
+    /// covers the usual insert_right(task, port, port, MAKE_SEND).
+    func insertRight(_ name: MachPortName, poly: MachPortName, disposition: UInt32) -> UInt32 {
+        guard let target = index(of: name), let port = entries[target].port else {
+            return KERN_INVALID_NAME
+        }
+        guard allows(poly, disposition), disposition != MACH_MSG_TYPE_MOVE_SEND_ONCE,
+            disposition != MACH_MSG_TYPE_MAKE_SEND_ONCE, entries[Int(poly >> 8)].port === port
+        else { return KERN_INVALID_RIGHT }
+        if entries[target].type & MACH_PORT_TYPE_SEND != 0
+            && entries[target].urefs >= MACH_PORT_UREFS_MAX
+        {
+            return KERN_UREFS_OVERFLOW
+        }
+        guard let (right, type) = copyin(poly, disposition) else { return KERN_INVALID_RIGHT }
+        _ = copyout(right, type)
+        return KERN_SUCCESS
+    }
+}
+
+// MARK: - mach_msg
 
 /// Handle mach_msg trap - the core IPC primitive
 func handleMachMsg(
     msgAddr: UInt64, option: UInt32, sendSize: UInt32,
     rcvSize: UInt32, rcvName: MachPortName, timeout: UInt32
 ) -> UInt32 {
-    // If sending, we need to process the message
+    guard let space = IPCSpace.current else { return MACH_SEND_INVALID_DEST }
+    guard let msg = UnsafeMutableRawPointer(bitPattern: UInt(msgAddr)) else {
+        return (option & MACH_SEND_MSG) != 0 ? MACH_SEND_INVALID_DATA : MACH_RCV_INVALID_DATA
+    }
     if (option & MACH_SEND_MSG) != 0 {
-        let hdr = UnsafePointer<MachMsgHeader>(bitPattern: UInt(msgAddr))!.pointee
+        let kr = machMsgSend(space, msg, size: sendSize, option: option, timeout: timeout)
+        if kr != MACH_MSG_SUCCESS { return kr }
+    }
+    // An RPC to a kernel port has its reply queued by now, so the receive
+    // half of a combined call finds it without waiting.
+    if (option & MACH_RCV_MSG) != 0 {
+        let limit: UInt32? = (option & MACH_RCV_TIMEOUT) != 0 ? timeout : nil
+        return machMsgReceive(space, msg, capacity: rcvSize, name: rcvName, option: option, timeout: limit)
+    }
+    return MACH_MSG_SUCCESS
+}
 
+private func machMsgSend(
+    _ space: IPCSpace, _ msg: UnsafeMutableRawPointer, size: UInt32, option: UInt32,
+    timeout: UInt32
+) -> UInt32 {
+    if size < UInt32(MACH_MSG_HEADER_SIZE) || (size & 3) != 0 { return MACH_SEND_MSG_TOO_SMALL }
+    if size > IPC_KMSG_MAX_SIZE { return MACH_SEND_TOO_LARGE }
+    let hdr = msg.load(as: MachMsgHeader.self)
+    Trace.event(.machSend, UInt64(UInt32(bitPattern: hdr.msgh_id)), UInt64(size))
+
+    if Log.trace {
         kprint("  mach_msg SEND id=")
         kprint_hex(UInt64(bitPattern: Int64(hdr.msgh_id)))
         kprint(" remote=")
@@ -143,22 +797,294 @@ func handleMachMsg(
         kprint("\n")
     }
 
-    // If receiving with timeout, return timed out (stub: nothing to receive)
-    if (option & MACH_RCV_MSG) != 0 {
-        if (option & MACH_RCV_TIMEOUT) != 0 {
-            return MACH_RCV_TIMED_OUT
+    // Check both rights before taking either, so a bad reply port leaves the
+    // destination right where it was.
+    let remoteDisposition = hdr.msgh_bits & 0x1F
+    let localDisposition = (hdr.msgh_bits >> 8) & 0x1F
+    if remoteDisposition == MACH_MSG_TYPE_MOVE_RECEIVE
+        || !space.allows(hdr.msgh_remote_port, remoteDisposition)
+    {
+        return MACH_SEND_INVALID_DEST
+    }
+    let hasReply = hdr.msgh_local_port != MACH_PORT_NULL
+    if hasReply && !space.allows(hdr.msgh_local_port, localDisposition) {
+        return MACH_SEND_INVALID_REPLY
+    }
+    guard let (dest, destType) = space.copyin(hdr.msgh_remote_port, remoteDisposition) else {
+        return MACH_SEND_INVALID_DEST
+    }
+    let m = IPCMessage(size: Int(size), destination: dest, destinationType: destType)
+    if hasReply {
+        guard let (reply, replyType) = space.copyin(hdr.msgh_local_port, localDisposition) else {
+            return MACH_SEND_INVALID_REPLY
+        }
+        m.reply = reply
+        m.replyType = replyType
+    }
+    memcpy(m.buffer, msg, Int(size))
+    m.header.msgh_size = size
+    if (hdr.msgh_bits & MACH_MSGH_BITS_COMPLEX) != 0 {
+        let kr = copyinDescriptors(space, m)
+        if kr != MACH_MSG_SUCCESS { return kr }
+    }
+
+    if !dest.kobject.isNone { return kernelServer(m) }
+    // On failure the message dies here and its rights with it.
+    return dest.send(m, option: option, timeout: timeout)
+}
+
+private func machMsgReceive(
+    _ space: IPCSpace, _ msg: UnsafeMutableRawPointer, capacity: UInt32, name: MachPortName,
+    option: UInt32, timeout: UInt32?
+) -> UInt32 {
+    guard let port = space.receivePort(name) else { return MACH_RCV_INVALID_NAME }
+    guard let m = port.receive(timeout: timeout) else {
+        return port.active ? MACH_RCV_TIMED_OUT : MACH_RCV_PORT_DIED
+    }
+    Trace.event(.machReceive, UInt64(UInt32(bitPattern: m.header.msgh_id)), UInt64(m.size))
+
+    let trailerSize = requestedTrailerSize(option)
+    if m.size + trailerSize > Int(capacity) {
+        if (option & MACH_RCV_LARGE) != 0 {
+            // Leave it queued and tell the caller how much room it needs.
+            port.requeue(m)
+            if capacity >= 8 {
+                msg.storeBytes(of: UInt32(m.size + trailerSize), toByteOffset: 4, as: UInt32.self)
+            }
+        }
+        return MACH_RCV_TOO_LARGE
+    }
+
+    var hdr = m.header
+    let (reply, replyType) = m.consumeRights()
+    let replyName = reply.map { space.copyout($0, replyType) } ?? MACH_PORT_NULL
+    hdr.msgh_bits =
+        (hdr.msgh_bits & ~MACH_MSGH_BITS_PORTS_MASK)
+        | (reply != nil ? replyType : 0) | (m.destinationType << 8)
+    hdr.msgh_remote_port = replyName
+    hdr.msgh_local_port = name
+    hdr.msgh_voucher_port = MACH_PORT_NULL
+
+    memcpy(msg, m.buffer, m.size)
+    msg.storeBytes(of: hdr, as: MachMsgHeader.self)
+    if !m.carried.isEmpty { copyoutDescriptors(space, m, into: msg) }
+    let trailer = msg.advanced(by: m.size)
+    memset(trailer, 0, trailerSize)
+    trailer.storeBytes(of: UInt32(trailerSize), toByteOffset: 4, as: UInt32.self)
+    if trailerSize >= 12 { trailer.storeBytes(of: m.seqno, toByteOffset: 8, as: UInt32.self) }
+    return MACH_MSG_SUCCESS
+}
+
+// MARK: - Descriptors
+
+/// The right a descriptor with `disposition` carries once copied in.
+private func carriedType(_ disposition: UInt32) -> UInt32 {
+    switch disposition {
+    case MACH_MSG_TYPE_MAKE_SEND_ONCE, MACH_MSG_TYPE_MOVE_SEND_ONCE: return MACH_MSG_TYPE_PORT_SEND_ONCE
+    case MACH_MSG_TYPE_MOVE_RECEIVE: return MACH_MSG_TYPE_MOVE_RECEIVE
+    default: return MACH_MSG_TYPE_PORT_SEND
+    }
+}
+
+private func isValidName(_ name: MachPortName) -> Bool {
+    return name != MACH_PORT_NULL && name != MACH_PORT_DEAD
+}
+
+/// Take the rights and memory the body's descriptors name. The descriptors
+/// stay in the kernel copy as sent, to be rewritten at copyout.
+private func copyinDescriptors(_ space: IPCSpace, _ m: IPCMessage) -> UInt32 {
+    if m.size < MACH_MSG_HEADER_SIZE + 4 { return MACH_SEND_MSG_TOO_SMALL }
+    let count = Int(m.buffer.load(fromByteOffset: MACH_MSG_HEADER_SIZE, as: UInt32.self))
+    var offset = MACH_MSG_HEADER_SIZE + 4
+    for _ in 0..<count {
+        if offset + 12 > m.size { return MACH_SEND_MSG_TOO_SMALL }
+        let d = m.buffer.advanced(by: offset)
+        let type = d.load(fromByteOffset: 11, as: UInt8.self)
+        if type == MACH_MSG_PORT_DESCRIPTOR {
+            // mach_msg_port_descriptor_t: name, pad, pad, disposition, type
+            let name = d.load(as: MachPortName.self)
+            let disposition = UInt32(d.load(fromByteOffset: 10, as: UInt8.self))
+            if !isValidName(name) {
+                m.carried.append(.port(nil, carriedType(disposition)))
+            } else if let (port, carried) = space.copyin(name, disposition) {
+                m.carried.append(.port(port, carried))
+            } else {
+                return MACH_SEND_INVALID_RIGHT
+            }
+            offset += 12
+            continue
+        }
+
+        // mach_msg_ool_descriptor64_t / mach_msg_ool_ports_descriptor64_t:
+        // address, deallocate, copy, disposition (ports), type, size/count
+        if offset + 16 > m.size { return MACH_SEND_MSG_TOO_SMALL }
+        let address = d.loadUnaligned(as: UInt64.self)
+        let deallocate = d.load(fromByteOffset: 8, as: UInt8.self) != 0
+        let sizeOrCount = d.load(fromByteOffset: 12, as: UInt32.self)
+        switch type {
+        case MACH_MSG_OOL_DESCRIPTOR, MACH_MSG_OOL_VOLATILE_DESCRIPTOR:
+            if sizeOrCount == 0 {
+                m.carried.append(.memory(nil))
+            } else {
+                guard let vm = AddressSpace.current,
+                    let copy = vm.copyRange(start: address, size: UInt64(sizeOrCount), move: deallocate)
+                else { return MACH_SEND_INVALID_MEMORY }
+                m.carried.append(.memory(copy))
+            }
+        case MACH_MSG_OOL_PORTS_DESCRIPTOR:
+            let disposition = UInt32(d.load(fromByteOffset: 10, as: UInt8.self))
+            let n = Int(sizeOrCount)
+            var ports: [IPCPort?] = []
+            if n > 0 {
+                guard n <= Int(IPC_KMSG_MAX_SIZE) / 4,
+                    let names = UnsafePointer<MachPortName>(bitPattern: UInt(address))
+                else { return MACH_SEND_INVALID_MEMORY }
+                // All or nothing, as for the header.
+                for i in 0..<n where isValidName(names[i]) && !space.allows(names[i], disposition) {
+                    return MACH_SEND_INVALID_RIGHT
+                }
+                ports.reserveCapacity(n)
+                for i in 0..<n {
+                    ports.append(isValidName(names[i]) ? space.copyin(names[i], disposition)?.0 : nil)
+                }
+                if deallocate { AddressSpace.current?.unmap(start: address, size: UInt64(n * 4)) }
+            }
+            m.carried.append(.ports(ports, carriedType(disposition)))
+        default:
+            return MACH_SEND_INVALID_TYPE
+        }
+        offset += 16
+    }
+    return MACH_MSG_SUCCESS
+}
+
+/// Hand the carried rights and memory to the receiver and patch the
+/// descriptors in its buffer to match.
+private func copyoutDescriptors(
+    _ space: IPCSpace, _ m: IPCMessage, into msg: UnsafeMutableRawPointer
+) {
+    var offset = MACH_MSG_HEADER_SIZE + 4
+    for c in m.takeCarried() {
+        let d = msg.advanced(by: offset)
+        switch c {
+        case .port(let port, let type):
+            d.storeBytes(of: port.map { space.copyout($0, type) } ?? MACH_PORT_NULL, as: UInt32.self)
+            d.storeBytes(of: UInt8(type), toByteOffset: 10, as: UInt8.self)
+            offset += 12
+            continue
+        case .memory(let copy):
+            var address: UInt64 = 0
+            if let copy = copy, let vm = AddressSpace.current { address = vm.insert(copy) }
+            d.storeBytes(of: address, as: UInt64.self)
+        case .ports(let ports, let type):
+            var address: UInt64 = 0
+            if !ports.isEmpty, let vm = AddressSpace.current {
+                let bytes = UInt64(ports.count * 4)
+                address = reserveMmapRange(length: bytes)
+                vm.mapObject(
+                    start: address, size: bytes, prot: VM_PROT_READ | VM_PROT_WRITE,
+                    object: VMObject(backing: .anonymous, size: bytes))
+                let names = UnsafeMutablePointer<MachPortName>(bitPattern: UInt(address))!
+                for (i, p) in ports.enumerated() {
+                    names[i] = p.map { space.copyout($0, type) } ?? MACH_PORT_NULL
+                }
+            }
+            d.storeBytes(of: address, as: UInt64.self)
+            d.storeBytes(of: UInt8(type), toByteOffset: 10, as: UInt8.self)
         }
-        // For pure receive without timeout, also return timed out to not block
-        return MACH_RCV_TIMED_OUT
+        d.storeBytes(of: UInt8(0), toByteOffset: 8, as: UInt8.self)  // deallocate
+        d.storeBytes(of: MACH_MSG_VIRTUAL_COPY, toByteOffset: 9, as: UInt8.self)
+        offset += 16
     }
+}
+
+// MARK: - Kernel Ports
 
+/// Requests to the task, thread and host ports. There is no MIG subsystem,
+/// so the few routines the kernel serves are decoded by hand; every other
+/// one is answered with MIG_BAD_ID, as XNU answers one it does not
+/// implement, so the client gets a prompt error on its reply port rather
+/// than waiting for a reply that never comes.
+private func kernelServer(_ request: IPCMessage) -> UInt32 {
+    let id = request.header.msgh_id
+    if Log.trace {
+        kprint("  kernel RPC id=")
+        kprint_hex(UInt64(bitPattern: Int64(id)))
+        kprint("\n")
+    }
+    let (replyPort, replyType) = request.consumeRights()
+    guard let port = replyPort else { return MACH_MSG_SUCCESS }
+
+    let reply: IPCMessage
+    switch (request.destination.kobject, id) {
+    case (.task, MIG_SEMAPHORE_CREATE):
+        reply = semaphoreCreate(request, replyTo: port, replyType: replyType)
+    case (.task, MIG_SEMAPHORE_DESTROY):
+        reply = replyError(
+            Int32(bitPattern: semaphoreDestroy(request)), id: id, to: port, type: replyType)
+    default:
+        reply = replyError(MIG_BAD_ID, id: id, to: port, type: replyType)
+    }
+    // The kernel never waits for queue space: if the reply port is full
+    // (a send right with a full queue), the reply and its rights are
+    // dropped, as a timed-out send would drop them for userspace.
+    if port.send(reply, option: MACH_SEND_TIMEOUT, timeout: 0) == MACH_SEND_TIMED_OUT && Log.debug {
+        kprint("  kernel RPC reply dropped: queue full\n")
+    }
     return MACH_MSG_SUCCESS
 }
 
-/// Handle host_info and similar Mach host RPCs
-func handleHostRPC(msgId: Int32, replyAddr: UInt64) -> UInt32 {
-    kprint("  host RPC id=")
-    kprint_hex(UInt64(bitPattern: Int64(msgId)))
-    kprint("\n")
+/// A mig_reply_error_t: header, NDR record, return code.
+private func replyError(_ code: Int32, id: Int32, to port: IPCPort, type: UInt32) -> IPCMessage {
+    let size = MACH_MSG_HEADER_SIZE + 12
+    let reply = IPCMessage(size: size, destination: port, destinationType: type)
+    memset(reply.buffer, 0, size)
+    reply.header = MachMsgHeader(
+        msgh_bits: type, msgh_size: UInt32(size), msgh_remote_port: MACH_PORT_NULL,
+        msgh_local_port: MACH_PORT_NULL, msgh_voucher_port: MACH_PORT_NULL, msgh_id: id &+ 100)
+    reply.buffer.storeBytes(of: 1, toByteOffset: MACH_MSG_HEADER_SIZE + 4, as: UInt8.self)  // little-endian ints
+    reply.buffer.storeBytes(of: code, toByteOffset: MACH_MSG_HEADER_SIZE + 8, as: Int32.self)
+    return reply
+}
+
+/// semaphore_create(task, policy, value): the reply carries a send right to
+/// the new semaphore's port in a port descriptor.
+private func semaphoreCreate(_ request: IPCMessage, replyTo port: IPCPort, replyType: UInt32)
+    -> IPCMessage
+{
+    let id = request.header.msgh_id
+    // Header, NDR record, policy, value.
+    guard request.size >= MACH_MSG_HEADER_SIZE + 16 else {
+        return replyError(MIG_BAD_ARGUMENTS, id: id, to: port, type: replyType)
+    }
+    let value = request.buffer.load(fromByteOffset: MACH_MSG_HEADER_SIZE + 12, as: Int32.self)
+    if value < 0 {
+        return replyError(Int32(KERN_INVALID_ARGUMENT), id: id, to: port, type: replyType)
+    }
+    let semPort = IPCPort(kobject: .semaphore(Semaphore(value: value)))
+    semPort.sendRights += 1
+
+    // Header, descriptor count, mach_msg_port_descriptor_t.
+    let size = MACH_MSG_HEADER_SIZE + 16
+    let reply = IPCMessage(size: size, destination: port, destinationType: replyType)
+    memset(reply.buffer, 0, size)
+    reply.header = MachMsgHeader(
+        msgh_bits: replyType | MACH_MSGH_BITS_COMPLEX, msgh_size: UInt32(size),
+        msgh_remote_port: MACH_PORT_NULL, msgh_local_port: MACH_PORT_NULL,
+        msgh_voucher_port: MACH_PORT_NULL, msgh_id: id &+ 100)
+    reply.buffer.storeBytes(of: UInt32(1), toByteOffset: MACH_MSG_HEADER_SIZE, as: UInt32.self)
+    reply.buffer.storeBytes(
+        of: MACH_MSG_PORT_DESCRIPTOR, toByteOffset: MACH_MSG_HEADER_SIZE + 4 + 11, as: UInt8.self)
+    reply.carried = [.port(semPort, MACH_MSG_TYPE_PORT_SEND)]
+    return reply
+}
+
+/// semaphore_destroy(task, semaphore): the semaphore arrives as the
+/// message's one port descriptor.
+private func semaphoreDestroy(_ request: IPCMessage) -> UInt32 {
+    guard case .port(let port?, _)? = request.carried.first,
+        case .semaphore(let sem) = port.kobject
+    else { return KERN_INVALID_ARGUMENT }
+    sem.destroy()
     return KERN_SUCCESS
 }
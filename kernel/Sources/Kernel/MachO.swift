@@ -40,12 +40,38 @@ struct DyldCacheMappingInfo {
     var initProt: UInt32
 }
 
+/// First sector of the dyld shared cache on the block device (1 MiB in).
+let SHARED_CACHE_SECTOR: UInt64 = 2048
+
+/// One cache mapping, backed lazily by the block device. The objects are
+/// shared by every address space the region is attached to, so each page is
+/// read from disk once; writable mappings are copy-on-write per task.
+struct SharedRegionMapping {
+    var address: UInt64
+    var size: UInt64
+    var initProt: UInt32
+    var object: VMObject
+}
+
+nonisolated(unsafe) var sharedRegionMappings: [SharedRegionMapping] = []
+/// Where the cache is mapped (its first mapping), or 0 if there is none.
+nonisolated(unsafe) var sharedRegionBase: UInt64 = 0
+
+/// Add the shared cache mappings to `space`. Nothing is read until a page
+/// is touched.
+func attachSharedRegion(to space: AddressSpace) {
+    for m in sharedRegionMappings {
+        space.mapObject(start: m.address, size: m.size, prot: m.initProt, object: m.object)
+    }
+}
+
 func loadSharedCache() {
     kprint("Shared Cache: Loading...\n")
 
     // Read header (sector 2048 = 1MB)
     let headerAddr = kernelAlloc(size: 512)
-    if !virtioBlockRead(sector: 2048, count: 1, buffer: headerAddr) {
+    defer { kernelFree(headerAddr) }
+    if !BlockCache.read(sector: SHARED_CACHE_SECTOR, count: 1, buffer: headerAddr) {
         kprint("Shared Cache: Failed to read header\n")
         return
     }
@@ -57,23 +83,27 @@ func loadSharedCache() {
         return
     }
 
-    kprint("Shared Cache Header: ptr=")
-    kprint_hex(UInt64(UInt(bitPattern: headerAddr)))
-    kprint("\n  Header Data: ")
-    for i in 0..<32 {
-        kprint_hex(UInt64(headerAddr.load(fromByteOffset: i, as: UInt8.self)))
-        if i % 8 == 7 { kprint(" ") }
+    if Log.trace {
+        kprint("Shared Cache Header: ptr=")
+        kprint_hex(UInt64(UInt(bitPattern: headerAddr)))
+        kprint("\n  Header Data: ")
+        for i in 0..<32 {
+            kprint_hex(UInt64(headerAddr.load(fromByteOffset: i, as: UInt8.self)))
+            if i % 8 == 7 { kprint(" ") }
+        }
+        kprint("\n")
     }
-    kprint("\n")
 
     let mappingOffset = readU32(headerAddr.advanced(by: 16))
     let mappingCount = readU32(headerAddr.advanced(by: 20))
 
-    kprint("Shared Cache Fields: Off=")
-    kprint_hex(UInt64(mappingOffset))
-    kprint(" Count=")
-    kprint_hex(UInt64(mappingCount))
-    kprint("\n")
+    if Log.debug {
+        kprint("Shared Cache Fields: Off=")
+        kprint_hex(UInt64(mappingOffset))
+        kprint(" Count=")
+        kprint_hex(UInt64(mappingCount))
+        kprint("\n")
+    }
 
     if mappingCount == 0 || mappingCount > 2000 {
         kprint("Shared Cache: Invalid mapping count criteria failed\n")
@@ -84,30 +114,50 @@ func loadSharedCache() {
     kprint_hex(UInt64(mappingCount))
     kprint(" mappings\n")
 
-    // Read mapping info (it's usually right after header in the first few blocks)
-    let mappingsAddr = kernelAlloc(size: Int(mappingCount) * 32)
-    let mappingSectors = (Int(mappingCount) * 32 + 511) / 512
-    if !virtioBlockRead(
-        sector: 2048 + UInt64(mappingOffset / 512), count: mappingSectors, buffer: mappingsAddr)
+    // Read mapping info (it's usually right after header in the first few blocks).
+    // The table need not start on a sector boundary.
+    let tableSkip = Int(mappingOffset % 512)
+    let mappingSectors = (tableSkip + Int(mappingCount) * 32 + 511) / 512
+    let mappingsAddr = kernelAlloc(size: mappingSectors * 512)
+    defer { kernelFree(mappingsAddr) }
+    if !BlockCache.read(
+        sector: SHARED_CACHE_SECTOR + UInt64(mappingOffset / 512), count: mappingSectors,
+        buffer: mappingsAddr)
     {
         kprint("Shared Cache: Failed to read mappings\n")
         return
     }
 
-    var ptr = mappingsAddr
+    var mappings: [SharedRegionMapping] = []
+    var ptr = UnsafeRawPointer(mappingsAddr).advanced(by: tableSkip)
     for _ in 0..<Int(mappingCount) {
         let addr = readU64(ptr)
         let size = readU64(ptr.advanced(by: 8))
+        let fileOffset = readU64(ptr.advanced(by: 16))
+        let initProt = readU32(ptr.advanced(by: 28))
+
+        if Log.debug {
+            kprint("  Map -> ")
+            kprint_hex(addr)
+            kprint(" size=")
+            kprint_hex(size)
+            kprint("\n")
+        }
 
-        kprint("  Map -> ")
-        kprint_hex(addr)
-        kprint(" size=")
-        kprint_hex(size)
-        kprint("\n")
-
+        if (addr & 0xFFF) != 0 || (fileOffset & 0x1FF) != 0 {
+            kprint("Shared Cache: Misaligned mapping\n")
+            return
+        }
+        let object = VMObject(
+            backing: .blockDevice(sector: SHARED_CACHE_SECTOR + fileOffset / 512, length: size),
+            size: size)
+        mappings.append(
+            SharedRegionMapping(address: addr, size: size, initProt: initProt, object: object))
         ptr = ptr.advanced(by: 32)
     }
 
+    sharedRegionMappings = mappings
+    sharedRegionBase = mappings.first?.address ?? 0
     kprint("Shared Cache: Verified\n")
 }
 
@@ -204,23 +254,27 @@ func loadMachO(data: UnsafeRawPointer, size: Int, slide: UInt64 = 0) -> MachOLoa
     //                        ncmds(4), sizeofcmds(4), flags(4), reserved(4) = 32 bytes
     let ncmds = readU32(machData.advanced(by: 16))
 
-    kprint("MachO: ptr=")
-    kprint_hex(UInt64(UInt(bitPattern: machData)))
-    kprint(" magic=")
-    kprint_hex(UInt64(magic))
-    kprint("\n")
-
-    // Hex dump first 32 bytes of header
-    kprint("  Header: ")
-    for i in 0..<32 {
-        kprint_hex(UInt64(machData.load(fromByteOffset: i, as: UInt8.self)))
-        if i % 8 == 7 { kprint(" ") }
+    if Log.trace {
+        kprint("MachO: ptr=")
+        kprint_hex(UInt64(UInt(bitPattern: machData)))
+        kprint(" magic=")
+        kprint_hex(UInt64(magic))
+        kprint("\n")
+
+        // Hex dump first 32 bytes of header
+        kprint("  Header: ")
+        for i in 0..<32 {
+            kprint_hex(UInt64(machData.load(fromByteOffset: i, as: UInt8.self)))
+            if i % 8 == 7 { kprint(" ") }
+        }
+        kprint("\n")
     }
-    kprint("\n")
 
-    kprint("MachO: Loading (")
-    kprint_hex(UInt64(ncmds))
-    kprint(" cmds)\n")
+    if Log.debug {
+        kprint("MachO: Loading (")
+        kprint_hex(UInt64(ncmds))
+        kprint(" cmds)\n")
+    }
 
     var entryIsRelative = false
     var result = MachOLoadResult(
@@ -237,11 +291,13 @@ func loadMachO(data: UnsafeRawPointer, size: Int, slide: UInt64 = 0) -> MachOLoa
         let cmd = readU32(cmdPtr)
         let cmdsize = readU32(cmdPtr.advanced(by: 4))
 
-        kprint("  LC: ")
-        kprint_hex(UInt64(cmd))
-        kprint(" sz=")
-        kprint_hex(UInt64(cmdsize))
-        kprint("\n")
+        if Log.trace {
+            kprint("  LC: ")
+            kprint_hex(UInt64(cmd))
+            kprint(" sz=")
+            kprint_hex(UInt64(cmdsize))
+            kprint("\n")
+        }
 
         switch cmd {
         case LC_SEGMENT_64:
@@ -252,6 +308,7 @@ func loadMachO(data: UnsafeRawPointer, size: Int, slide: UInt64 = 0) -> MachOLoa
             let vmsize = readU64(cmdPtr.advanced(by: 32))
             let fileoff = readU64(cmdPtr.advanced(by: 40))
             let filesize = readU64(cmdPtr.advanced(by: 48))
+            let initprot = readU32(cmdPtr.advanced(by: 60))
 
             // Skip __PAGEZERO
             if segNameIs(cmdPtr, "__PAGEZERO") {
@@ -263,20 +320,32 @@ func loadMachO(data: UnsafeRawPointer, size: Int, slide: UInt64 = 0) -> MachOLoa
                 result.textBase = vmaddr
             }
 
-            // Map segment
+            // Map segment. With an address space the pages are faulted in
+            // from the image on first touch (copy-on-write); without one the
+            // segment is copied into place up front.
             if vmsize > 0 {
                 let destAddr = UInt(vmaddr) &+ UInt(slide)
                 if let dest = UnsafeMutableRawPointer(bitPattern: destAddr) {
-                    memset(dest, 0, Int(vmsize))
-                    if filesize > 0 {
-                        let src = machData.advanced(by: Int(fileoff))
-                        memcpy(dest, src, Int(filesize))
+                    if let space = AddressSpace.current {
+                        let object = VMObject(
+                            backing: .memory(machData.advanced(by: Int(fileoff)), length: filesize),
+                            size: vmsize)
+                        space.mapObject(
+                            start: UInt64(destAddr), size: vmsize, prot: initprot, object: object)
+                    } else {
+                        memset(dest, 0, Int(vmsize))
+                        if filesize > 0 {
+                            let src = machData.advanced(by: Int(fileoff))
+                            memcpy(dest, src, Int(filesize))
+                        }
+                    }
+                    if Log.debug {
+                        kprint("  Seg -> ")
+                        kprint_hex(UInt64(destAddr))
+                        kprint(" +")
+                        kprint_hex(vmsize)
+                        kprint("\n")
                     }
-                    kprint("  Seg -> ")
-                    kprint_hex(UInt64(destAddr))
-                    kprint(" +")
-                    kprint_hex(vmsize)
-                    kprint("\n")
                 }
             }
 
@@ -290,17 +359,21 @@ func loadMachO(data: UnsafeRawPointer, size: Int, slide: UInt64 = 0) -> MachOLoa
         case LC_UNIXTHREAD:
             // thread_command: cmd(4), cmdsize(4), flavor(4), count(4), state...
             let flavor = readU32(cmdPtr.advanced(by: 8))
-            kprint("    UnixThread: flavor=")
-            kprint_hex(UInt64(flavor))
-            kprint("\n")
+            if Log.debug {
+                kprint("    UnixThread: flavor=")
+                kprint_hex(UInt64(flavor))
+                kprint("\n")
+            }
 
             if flavor == 4 {  // x86_THREAD_STATE64
                 // RIP is at offset 144 (cmd:4, sz:4, flavor:4, count:4, rax..r15:128)
                 let rip = readU64(cmdPtr.advanced(by: 144))
                 result.entryPoint = rip
-                kprint("      RIP -> ")
-                kprint_hex(rip)
-                kprint("\n")
+                if Log.debug {
+                    kprint("      RIP -> ")
+                    kprint_hex(rip)
+                    kprint("\n")
+                }
             }
 
         case LC_LOAD_DYLINKER:
@@ -313,9 +386,11 @@ func loadMachO(data: UnsafeRawPointer, size: Int, slide: UInt64 = 0) -> MachOLoa
                 len += 1
             }
             result.dylinkerPathLen = len
-            kprint("    Dylinker: ")
-            for i in 0..<len { serial_putc(pathPtr[i]) }
-            kprint("\n")
+            if Log.debug {
+                kprint("    Dylinker: ")
+                console_write(pathPtr, len)
+                kprint("\n")
+            }
 
         default:
             break
@@ -1,3 +1,10 @@
+let MULTIBOOT_INFO_MEMORY: UInt32 = 1 << 0
+let MULTIBOOT_INFO_CMDLINE: UInt32 = 1 << 2
+let MULTIBOOT_INFO_MODS: UInt32 = 1 << 3
+let MULTIBOOT_INFO_MEM_MAP: UInt32 = 1 << 6
+
+let MULTIBOOT_MEMORY_AVAILABLE: UInt32 = 1
+
 struct MultibootInfo {
     var flags: UInt32
     var mem_lower: UInt32
@@ -6,6 +13,9 @@ struct MultibootInfo {
     var cmdline: UInt32
     var mods_count: UInt32
     var mods_addr: UInt32
+    var syms: (UInt32, UInt32, UInt32, UInt32)
+    var mmap_length: UInt32
+    var mmap_addr: UInt32
 }
 
 struct MultibootModule {
@@ -14,3 +24,50 @@ struct MultibootModule {
     var string: UInt32
     var reserved: UInt32
 }
+
+/// Walk the Multiboot memory map, calling `body(base, length, type)` for each
+/// entry. Falls back to mem_upper (one available range at 1 MB) when the
+/// loader did not provide a map.
+func forEachMemoryRegion(info: MultibootInfo, _ body: (UInt64, UInt64, UInt32) -> Void) {
+    if (info.flags & MULTIBOOT_INFO_MEM_MAP) == 0 {
+        if (info.flags & MULTIBOOT_INFO_MEMORY) != 0 {
+            body(0x10_0000, UInt64(info.mem_upper) * 1024, MULTIBOOT_MEMORY_AVAILABLE)
+        }
+        return
+    }
+
+    // Entries are packed: size(4) base(8) length(8) type(4), where size does
+    // not count itself.
+    var addr = UInt(info.mmap_addr)
+    let end = addr + UInt(info.mmap_length)
+    while addr < end {
+        let entry = UnsafeRawPointer(bitPattern: addr)!
+        let size = readU32(entry)
+        let base = readU64(entry.advanced(by: 4))
+        let length = readU64(entry.advanced(by: 12))
+        let type = readU32(entry.advanced(by: 20))
+        body(base, length, type)
+        addr += UInt(size) + 4
+    }
+}
+
+/// Whether the kernel command line holds `word` as a whole space-separated
+/// word (QEMU passes the kernel path, then whatever -append gave).
+func commandLineHas(info: MultibootInfo, _ word: StaticString) -> Bool {
+    if (info.flags & MULTIBOOT_INFO_CMDLINE) == 0 || info.cmdline == 0 { return false }
+    let line = UnsafePointer<UInt8>(bitPattern: UInt(info.cmdline))!
+    let w = word.utf8Start
+    let n = word.utf8CodeUnitCount
+    var i = 0
+    while line[i] != 0 {
+        if line[i] == 0x20 {
+            i += 1
+            continue
+        }
+        var j = 0
+        while j < n && line[i + j] == w[j] { j += 1 }
+        if j == n && (line[i + j] == 0 || line[i + j] == 0x20) { return true }
+        while line[i] != 0 && line[i] != 0x20 { i += 1 }
+    }
+    return false
+}
@@ -0,0 +1,59 @@
+/*
+ * SMP.swift
+ * Bringing up the application processors
+ *
+ * The boot CPU walks the MADT and starts every other enabled CPU in turn
+ * (cpu.c does the INIT-SIPI-SIPI and the per-CPU tables). A started CPU has
+ * its own GDT, TSS, IST and entry stacks and a GS-based cpu_data block, then
+ * lands in kernelAPMain, which turns that context into the CPU's idle thread
+ * and starts taking work from the scheduler.
+ */
+
+import CSupport
+
+struct SMP {
+    static func start() {
+        let processors = ACPI.processors()
+        if processors.isEmpty {
+            kprint("SMP: no MADT, running on the boot CPU only\n")
+            return
+        }
+        let bsp = lapic_id()
+        var next: UInt32 = 1
+        for p in processors where p.apicID != bsp {
+            if next >= UInt32(MAX_CPUS) {
+                kprint("SMP: more CPUs than MAX_CPUS, ignoring the rest\n")
+                break
+            }
+            if cpu_start_ap(next, p.apicID) == 0 {
+                kprint("SMP: CPU with APIC ID ")
+                kprint_hex(UInt64(p.apicID))
+                kprint(" did not start\n")
+                continue
+            }
+            next += 1
+        }
+        kprint("SMP: ")
+        kprint_hex(UInt64(onlineCPUCount()))
+        kprint(" CPUs online\n")
+    }
+}
+
+/// First Swift code on an AP, on its idle stack with interrupts off.
+@_cdecl("kernel_ap_main")
+func kernelAPMain(_ index: UInt32) {
+    if Log.debug {
+        kprint("SMP: CPU ")
+        kprint_hex(UInt64(index))
+        kprint(" up\n")
+    }
+    Trace.startCPU()
+    Scheduler.startCPU()
+    Scheduler.idleLoop()
+}
+
+/// CPUs running the kernel.
+func onlineCPUCount() -> Int { Int(cpu_online_count()) }
+
+/// Index of the calling CPU, 0 for the boot CPU.
+func currentCPUIndex() -> Int { Int(cpu_current_index()) }
@@ -0,0 +1,27 @@
+/*
+ * Sched/Lock.swift
+ * Spin locks for objects
+ *
+ * sched.c's spinlock_t must not move while another CPU spins on it, so an
+ * object that wants a lock of its own keeps one on the heap through this
+ * wrapper. File-level globals can use spinlock_t directly, as Heap and PMM do.
+ */
+
+import CSupport
+
+final class SpinLock {
+    private let raw: UnsafeMutablePointer<spinlock_t>
+
+    init() {
+        raw = UnsafeMutablePointer<spinlock_t>.allocate(capacity: 1)
+        raw.initialize(to: spinlock_t())
+    }
+
+    deinit {
+        raw.deallocate()
+    }
+
+    func lock() { spin_lock(raw) }
+    func unlock() { spin_unlock(raw) }
+    func tryLock() -> Bool { spin_trylock(raw) != 0 }
+}
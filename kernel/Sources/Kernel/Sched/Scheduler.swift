@@ -0,0 +1,361 @@
+/*
+ * Sched/Scheduler.swift
+ * Preemptive round-robin scheduling on per-CPU run queues
+ *
+ * Every CPU has a run queue: a FIFO of runnable threads, the thread it is
+ * running and its idle thread. The local APIC timer ticks at SCHED_HZ on
+ * every CPU and asks for a reschedule, which happens on the way back to user
+ * mode (after the interrupt, or after a syscall); kernel code is never
+ * preempted. A CPU whose queue runs dry steals the oldest thread from
+ * another queue before it goes idle.
+ *
+ * A thread blocks by marking itself blocked under its own lock and then
+ * switching away, dropping the kernel lock in between. A wakeup turns a
+ * blocked thread runnable and queues it on the CPU it last ran on, or on an
+ * idle one, which then gets a reschedule IPI. Since the waker may run before
+ * the sleeper has actually left its stack, a CPU that picks a thread waits
+ * for the thread's on-CPU word to clear before switching to it.
+ *
+ * Timeouts are counted in ticks of CPU 0's timer.
+ */
+
+import CSupport
+
+let SCHED_HZ: UInt32 = 100
+private let msPerTick: UInt64 = 1000 / UInt64(SCHED_HZ)
+private let MSR_KERNEL_GS_BASE: UInt32 = 0xC000_0102
+
+final class RunQueue {
+    let index: Int
+    let lock = SpinLock()
+    /// Runnable threads, linked through Thread.runNext; guarded by lock.
+    private var head: Thread?
+    private var tail: Thread?
+    private(set) var length = 0
+    /// Only touched by this queue's own CPU.
+    var current: Thread
+    let idle: Thread
+    /// Whether current is the idle thread, for other CPUs to look at.
+    var idling = true
+    /// Set by the timer and by reschedule IPIs, cleared by schedule().
+    var needResched = false
+    /// A thread that terminated on this CPU, reaped by the next one to run.
+    var dead: Thread?
+
+    init(index: Int) {
+        self.index = index
+        let t = Thread(idleOn: index)
+        idle = t
+        current = t
+    }
+
+    func push(_ t: Thread) {
+        lock.lock()
+        t.runNext = nil
+        if let last = tail { last.runNext = t } else { head = t }
+        tail = t
+        length += 1
+        lock.unlock()
+    }
+
+    /// The oldest queued thread. With `tryOnly`, give up instead of spinning
+    /// when another CPU holds the lock.
+    func pop(tryOnly: Bool = false) -> Thread? {
+        if tryOnly {
+            if !lock.tryLock() { return nil }
+        } else {
+            lock.lock()
+        }
+        defer { lock.unlock() }
+        guard let first = head else { return nil }
+        head = first.runNext
+        if head == nil { tail = nil }
+        first.runNext = nil
+        length -= 1
+        return first
+    }
+}
+
+private struct SchedTimeout {
+    let thread: Thread
+    let seq: UInt64
+    let deadline: UInt64
+}
+
+nonisolated(unsafe) private let runQueues = UnsafeMutablePointer<RunQueue?>.allocate(capacity: Int(MAX_CPUS))
+nonisolated(unsafe) private var timerVector: UInt8 = 0
+nonisolated(unsafe) private var reschedVector: UInt8 = 0
+nonisolated(unsafe) private var ticks: UInt64 = 0
+nonisolated(unsafe) private var timeouts: [SchedTimeout] = []
+nonisolated(unsafe) private var timeoutLock = spinlock_t()
+/// Set by exit(): every thread of the task terminates on its next way out.
+nonisolated(unsafe) private var taskExiting = false
+
+struct Scheduler {
+    /// Allocate the interrupt vectors and make the boot context CPU 0's
+    /// idle thread. Call before SMP.start.
+    static func setup() {
+        for i in 0..<Int(MAX_CPUS) { (runQueues + i).initialize(to: nil) }
+        let tv = irq_alloc_vector { _ in Scheduler.tick() }
+        let rv = irq_alloc_vector { _ in Scheduler.localQueue.needResched = true }
+        if tv < 0 || rv < 0 {
+            kprint("Sched: no interrupt vectors left\n")
+            return
+        }
+        timerVector = UInt8(tv)
+        reschedVector = UInt8(rv)
+        startCPU()
+    }
+
+    /// Give the calling CPU a run queue and start its timer. Each CPU calls
+    /// this once, on the stack that becomes its idle thread.
+    static func startCPU() {
+        let index = currentCPUIndex()
+        runQueues[index] = RunQueue(index: index)
+        lapic_timer_start(timerVector, SCHED_HZ)
+    }
+
+    static var localQueue: RunQueue { runQueues[currentCPUIndex()]! }
+
+    /// Milliseconds since the scheduler started, at tick resolution.
+    static var uptimeMs: UInt64 { ticks * msPerTick }
+
+    // MARK: Run queues
+
+    /// Make `t` runnable on the CPU it last ran on, or on an idle CPU if
+    /// that one is busy, and poke that CPU if it is not the caller.
+    static func enqueue(_ t: Thread) {
+        var target = runQueues[t.cpu] ?? localQueue
+        if !target.idling {
+            for i in 0..<onlineCPUCount() {
+                if let rq = runQueues[i], rq.idling, rq.length == 0 {
+                    target = rq
+                    break
+                }
+            }
+        }
+        target.push(t)
+        if target.index != currentCPUIndex() {
+            cpu_send_ipi(UInt32(target.index), reschedVector)
+        }
+    }
+
+    /// Someone else's thread, for a CPU with nothing of its own to run.
+    private static func steal(into rq: RunQueue) -> Thread? {
+        let count = onlineCPUCount()
+        for step in 1..<max(count, 1) {
+            guard let victim = runQueues[(rq.index + step) % count], victim.length > 0 else {
+                continue
+            }
+            if let t = victim.pop(tryOnly: true) { return t }
+        }
+        return nil
+    }
+
+    // MARK: Switching
+
+    /// Run the next thread if there is one. A running caller goes back on
+    /// the queue; a blocked or terminated one does not. Must be called
+    /// without the kernel lock.
+    static func schedule() {
+        let rq = localQueue
+        let old = rq.current
+        rq.needResched = false
+
+        old.lock.lock()
+        let stillRunning = old.state == .running
+        old.lock.unlock()
+
+        var next = rq.pop()
+        if next == nil && (!stillRunning || old.isIdle) { next = steal(into: rq) }
+        guard let next = next ?? (stillRunning ? nil : rq.idle) else { return }
+        if next === old {
+            old.lock.lock()
+            old.state = .running
+            old.lock.unlock()
+            return
+        }
+        if stillRunning && !old.isIdle {
+            old.lock.lock()
+            old.state = .runnable
+            old.lock.unlock()
+            rq.push(old)
+        }
+        switchTo(next, from: old, on: rq)
+    }
+
+    private static func switchTo(_ next: Thread, from old: Thread, on rq: RunQueue) {
+        // It may still be leaving its stack on the CPU it last ran on.
+        while next.switchFrame[1] != 0 { asm_pause() }
+        next.switchFrame[1] = 1
+        next.lock.lock()
+        next.state = .running
+        next.cpu = rq.index
+        next.lock.unlock()
+        rq.current = next
+        rq.idling = next.isIdle
+        Trace.event(.contextSwitch, old.id, next.id)
+        trace_set_thread(next.id)
+
+        if let top = next.kernelStackTop { cpu_set_kernel_stack(top) }
+        asm_wrmsr(MSR_KERNEL_GS_BASE, next.tsdBase)
+        if let space = next.space, asm_get_cr3() & PTE_ADDR_MASK != space.rootPhys {
+            space.activate()
+        }
+        context_switch(
+            old.switchFrame, next.switchFrame[0], old.switchFrame + 1, old.fpuArea, next.fpuArea)
+        finishSwitch()
+    }
+
+    /// Work left by the thread switched away from, run once the old stack is
+    /// free: on return from context_switch, or first thing in a new thread.
+    static func finishSwitch() {
+        let rq = localQueue
+        if let d = rq.dead {
+            rq.dead = nil
+            d.reap()
+        }
+    }
+
+    /// Give up the CPU to another runnable thread, if there is one.
+    static func yield() {
+        let depth = kernel_lock_drop()
+        schedule()
+        kernel_lock_retake(depth)
+    }
+
+    // MARK: Blocking
+
+    /// Sleep until woken or `timeout` milliseconds pass (nil: no limit). The
+    /// caller holds the kernel lock and must have made itself findable by
+    /// its waker (on a wait queue, say) first.
+    static func block(timeout: UInt32? = nil) -> WaitResult {
+        let t = Thread.current
+        t.lock.lock()
+        // Checked under the lock exitTask's wakeup takes, so a thread can't
+        // block just after exitTask has passed it by.
+        if taskExiting {
+            t.lock.unlock()
+            return .interrupted
+        }
+        t.waitSeq &+= 1
+        t.waitResult = .awakened
+        t.state = .blocked
+        let seq = t.waitSeq
+        t.lock.unlock()
+
+        if let ms = timeout {
+            let wait = max((UInt64(ms) + msPerTick - 1) / msPerTick, 1)
+            spin_lock(&timeoutLock)
+            timeouts.append(SchedTimeout(thread: t, seq: seq, deadline: ticks + wait))
+            spin_unlock(&timeoutLock)
+        }
+
+        let depth = kernel_lock_drop()
+        schedule()
+        kernel_lock_retake(depth)
+        return t.waitResult
+    }
+
+    /// Wake `t` if it is blocked (in the wait numbered `seq`, if given).
+    /// Returns false if it was not, so a wait queue can try the next one.
+    @discardableResult
+    static func wake(_ t: Thread, result: WaitResult = .awakened, seq: UInt64? = nil) -> Bool {
+        t.lock.lock()
+        guard t.state == .blocked, seq == nil || seq == t.waitSeq else {
+            t.lock.unlock()
+            return false
+        }
+        t.state = .runnable
+        t.waitResult = result
+        t.lock.unlock()
+        enqueue(t)
+        return true
+    }
+
+    // MARK: Ticks
+
+    private static func tick() {
+        let rq = localQueue
+        rq.needResched = true
+        guard rq.index == 0 else { return }
+        ticks &+= 1
+        Clock.tick()
+
+        spin_lock(&timeoutLock)
+        var expired: [SchedTimeout] = []
+        if !timeouts.isEmpty {
+            var i = 0
+            while i < timeouts.count {
+                if timeouts[i].deadline <= ticks {
+                    expired.append(timeouts.remove(at: i))
+                } else {
+                    i += 1
+                }
+            }
+        }
+        spin_unlock(&timeoutLock)
+        for e in expired { wake(e.thread, result: .timedOut, seq: e.seq) }
+    }
+
+    // MARK: Exit
+
+    /// End the calling thread. The stack is freed by whatever runs next here.
+    static func terminate() -> Never {
+        _ = kernel_lock_drop()
+        let rq = localQueue
+        let t = rq.current
+        t.lock.lock()
+        t.state = .terminated
+        t.lock.unlock()
+        rq.dead = t
+        schedule()
+        fatalError("terminated thread resumed")
+    }
+
+    /// exit(): end the calling thread now and every other thread of the task
+    /// on its next return to user mode. Threads blocked in the kernel are
+    /// woken with .interrupted to get them there, and the other CPUs are
+    /// poked so threads running in user mode leave without waiting a tick.
+    static func exitTask() -> Never {
+        let me = Thread.current
+        taskExiting = true
+        Thread.forEachLive { t in
+            if t !== me && t.space === me.space { wake(t, result: .interrupted) }
+        }
+        for i in 0..<onlineCPUCount() where i != currentCPUIndex() {
+            cpu_send_ipi(UInt32(i), reschedVector)
+        }
+        terminate()
+    }
+
+    /// Called with interrupts off on every return to user mode.
+    static func preemptPoint() {
+        let rq = localQueue
+        if rq.current.isIdle { return }
+        if taskExiting { terminate() }
+        if rq.needResched {
+            // Busy CPUs never reach the idle loop's refill.
+            if PMM.zeroPoolLow { PMM.refillZeroPool(maxFrames: 16) }
+            schedule()
+        }
+    }
+
+    // MARK: Idle
+
+    /// Each CPU's idle thread: housekeeping, then run whatever is runnable
+    /// or halt until the next interrupt.
+    static func idleLoop() -> Never {
+        while true {
+            PMM.refillZeroPool()
+            schedule()
+            let rq = localQueue
+            if rq.length == 0 { asm_wait_for_interrupt() }
+        }
+    }
+}
+
+@_cdecl("sched_preempt_point")
+func schedPreemptPoint() {
+    Scheduler.preemptPoint()
+}
@@ -0,0 +1,186 @@
+/*
+ * Sched/Thread.swift
+ * Kernel threads
+ *
+ * A thread is a kernel stack, an FPU save area, its user GS base and a small
+ * switch frame: the saved stack pointer while it is switched out and a word
+ * that is nonzero while some CPU runs on that stack. User registers are not
+ * kept here. syscall_entry and isr_common push them on the thread's own
+ * kernel stack, where they stay while the thread is switched out in the
+ * kernel.
+ *
+ * Each CPU also has an idle thread, which is just the context the CPU came
+ * up on (kmain's boot stack, or an AP's idle stack) and never enters user
+ * mode.
+ */
+
+import CSupport
+
+let THREAD_KERNEL_STACK_SIZE = 32 * 1024
+
+enum ThreadState {
+    case runnable
+    case running
+    case blocked
+    case terminated
+}
+
+enum WaitResult {
+    case awakened
+    case timedOut
+    /// The task is exiting; the thread should make its way out.
+    case interrupted
+}
+
+nonisolated(unsafe) private var nextThreadID: UInt64 = 1
+/// Every thread but the idle ones, until it is freed. Taken before any
+/// thread or run queue lock.
+nonisolated(unsafe) private var liveThreads: Thread?
+nonisolated(unsafe) private var threadsLock = spinlock_t()
+
+final class Thread {
+    /// thread_selfid(); 0 for idle threads.
+    let id: UInt64
+    let isIdle: Bool
+    /// Nil for idle threads, and once a dead thread's stack has been reaped.
+    private(set) var kernelStack: UnsafeMutableRawPointer?
+    /// [0]: saved rsp while switched out; [1]: nonzero while on a CPU.
+    let switchFrame: UnsafeMutablePointer<UInt64>
+    let fpuArea: UnsafeMutableRawPointer
+    /// User GS base (thread_set_tsd_base), loaded into KERNEL_GS_BASE.
+    var tsdBase: UInt64 = 0
+    /// The kernel-held port thread_self names.
+    let port = IPCPort(kobject: .thread)
+    /// Loaded on every switch to the thread; nil for kernel-only threads.
+    let space: AddressSpace?
+
+    /// Guards state, waitSeq and waitResult against wakeups from other CPUs.
+    let lock = SpinLock()
+    var state: ThreadState
+    /// Bumped by every block, so a stale timeout can't wake a later wait.
+    var waitSeq: UInt64 = 0
+    var waitResult = WaitResult.awakened
+    /// Run queue the thread last ran on, and goes back to when woken.
+    var cpu: Int
+    /// Link in a run queue; guarded by that queue's lock.
+    var runNext: Thread?
+    /// Links in liveThreads, which does not keep threads alive.
+    unowned(unsafe) private var liveNext: Thread?
+    unowned(unsafe) private var livePrev: Thread?
+
+    private let body: (() -> Void)?
+    /// For a user thread: where it enters user mode, on which stack.
+    private let userEntry: UInt64
+    private let userStack: UInt64
+    /// rdi..r9 on entry to user mode; may be set until the thread first runs.
+    var userArgs: [UInt64] = []
+
+    /// A new thread that runs `body` and then terminates. It starts out
+    /// neither queued nor running; pass it to Scheduler.enqueue.
+    convenience init(body: @escaping () -> Void) {
+        self.init(body: body, userEntry: 0, userStack: 0)
+    }
+
+    /// A thread that enters user mode at `entry` on `stack`, in the current
+    /// address space.
+    convenience init(userEntry entry: UInt64, stack: UInt64) {
+        self.init(body: nil, userEntry: entry, userStack: stack)
+    }
+
+    private init(body: (() -> Void)?, userEntry: UInt64, userStack: UInt64) {
+        id = nextThreadID
+        nextThreadID += 1
+        isIdle = false
+        self.body = body
+        self.userEntry = userEntry
+        self.userStack = userStack
+        space = AddressSpace.current
+        state = .runnable
+        cpu = currentCPUIndex()
+        let stack = kernelAlloc(size: THREAD_KERNEL_STACK_SIZE, align: 16)
+        kernelStack = stack
+        switchFrame = UnsafeMutablePointer<UInt64>.allocate(capacity: 2)
+        switchFrame[0] = thread_init_stack(UInt64(UInt(bitPattern: stack)) + UInt64(THREAD_KERNEL_STACK_SIZE))
+        switchFrame[1] = 0
+        fpuArea = kernelAlloc(size: Int(FPU_AREA_SIZE), align: 64)
+        fpu_init_area(fpuArea)
+
+        spin_lock(&threadsLock)
+        liveNext = liveThreads
+        liveThreads?.livePrev = self
+        liveThreads = self
+        spin_unlock(&threadsLock)
+    }
+
+    /// The thread of control already running on CPU `cpu`.
+    init(idleOn cpu: Int) {
+        id = 0
+        isIdle = true
+        body = nil
+        userEntry = 0
+        userStack = 0
+        space = nil
+        state = .running
+        self.cpu = cpu
+        kernelStack = nil
+        switchFrame = UnsafeMutablePointer<UInt64>.allocate(capacity: 2)
+        switchFrame[0] = 0
+        switchFrame[1] = 1
+        fpuArea = kernelAlloc(size: Int(FPU_AREA_SIZE), align: 64)
+        fpu_init_area(fpuArea)
+    }
+
+    deinit {
+        if isIdle { return }
+        spin_lock(&threadsLock)
+        if let prev = livePrev { prev.liveNext = liveNext } else { liveThreads = liveNext }
+        liveNext?.livePrev = livePrev
+        spin_unlock(&threadsLock)
+    }
+
+    /// Call `body` on every thread but the idle ones, with the list locked.
+    static func forEachLive(_ body: (Thread) -> Void) {
+        spin_lock(&threadsLock)
+        var t = liveThreads
+        while let thread = t {
+            body(thread)
+            t = thread.liveNext
+        }
+        spin_unlock(&threadsLock)
+    }
+
+    /// Top of the kernel stack, for cpu_set_kernel_stack.
+    var kernelStackTop: UInt64? {
+        guard let stack = kernelStack else { return nil }
+        return UInt64(UInt(bitPattern: stack)) + UInt64(THREAD_KERNEL_STACK_SIZE)
+    }
+
+    /// Free the stack of a terminated thread once no CPU is on it. Frames on
+    /// that stack still hold references to the thread, so the object itself
+    /// outlives it.
+    func reap() {
+        kernelFree(kernelStack)
+        kernelStack = nil
+    }
+
+    fileprivate func run() {
+        if let body = body {
+            body()
+            return
+        }
+        var regs = [UInt64](repeating: 0, count: 6)
+        for (i, a) in userArgs.prefix(6).enumerated() { regs[i] = a }
+        regs.withUnsafeBufferPointer { jump_to_user_args(userEntry, userStack, $0.baseAddress) }
+    }
+
+    /// The thread running on this CPU.
+    static var current: Thread { Scheduler.localQueue.current }
+}
+
+/// First code a new thread runs, from thread_trampoline.
+@_cdecl("kernel_thread_start")
+func kernelThreadStart() {
+    Scheduler.finishSwitch()
+    Thread.current.run()
+    Scheduler.terminate()
+}
@@ -0,0 +1,87 @@
+/*
+ * Sched/WaitQueue.swift
+ * Wait queues and Mach semaphores
+ *
+ * A wait queue is a FIFO of threads blocked on some condition. Both it and
+ * the semaphores built on it live under the kernel lock; only the wakeup
+ * itself (Scheduler.wake) reaches across CPUs. A thread whose wait timed out
+ * is no longer blocked, so wakeOne skips it and takes the next.
+ */
+
+final class WaitQueue {
+    private var waiters: [Thread] = []
+
+    var isEmpty: Bool { waiters.isEmpty }
+
+    /// Block the calling thread on this queue for up to `timeout`
+    /// milliseconds (nil: no limit).
+    func wait(timeout: UInt32? = nil) -> WaitResult {
+        let t = Thread.current
+        waiters.append(t)
+        let result = Scheduler.block(timeout: timeout)
+        waiters.removeAll { $0 === t }
+        return result
+    }
+
+    /// Wake the longest waiter. Returns false if nobody was waiting.
+    @discardableResult
+    func wakeOne() -> Bool {
+        while !waiters.isEmpty {
+            if Scheduler.wake(waiters.removeFirst()) { return true }
+        }
+        return false
+    }
+
+    func wakeAll() {
+        for t in waiters { Scheduler.wake(t) }
+        waiters.removeAll()
+    }
+}
+
+// MARK: - Semaphores
+
+/// A Mach semaphore (semaphore_create): a count and the threads waiting for
+/// it to go positive. Tasks reach it through a send right to its port.
+final class Semaphore {
+    private var count: Int32
+    private let waiters = WaitQueue()
+    private(set) var active = true
+
+    init(value: Int32) {
+        count = value
+    }
+
+    /// semaphore_signal: hand the signal to a waiter, or bank it.
+    func signal() {
+        if !waiters.wakeOne() { count += 1 }
+    }
+
+    /// semaphore_signal_all: wake every waiter; nothing is banked.
+    func signalAll() {
+        waiters.wakeAll()
+    }
+
+    /// semaphore_wait / semaphore_timedwait. `timeout` in milliseconds, nil
+    /// for none.
+    func wait(timeout: UInt32? = nil) -> UInt32 {
+        if !active { return KERN_TERMINATED }
+        if count > 0 {
+            count -= 1
+            return KERN_SUCCESS
+        }
+        if timeout == 0 { return KERN_OPERATION_TIMED_OUT }
+        let result = waiters.wait(timeout: timeout)
+        if !active { return KERN_TERMINATED }
+        switch result {
+        case .awakened: return KERN_SUCCESS
+        case .timedOut: return KERN_OPERATION_TIMED_OUT
+        case .interrupted: return KERN_ABORTED
+        }
+    }
+
+    /// semaphore_destroy: waiters return KERN_TERMINATED.
+    func destroy() {
+        active = false
+        waiters.wakeAll()
+    }
+}
@@ -9,6 +9,7 @@ import CSupport
 
 let SYSCALL_CLASS_MACH: UInt64 = 0x0100_0000
 let SYSCALL_CLASS_UNIX: UInt64 = 0x0200_0000
+let SYSCALL_CLASS_MDEP: UInt64 = 0x0300_0000
 
 // MARK: - Mach Trap Numbers
 
@@ -19,12 +20,19 @@ let MACH_TRAP_HOST_SELF: UInt64 = 29
 let MACH_TRAP_MSG: UInt64 = 31
 let MACH_TRAP_MSG_OVERWRITE: UInt64 = 32
 let MACH_TRAP_SEMAPHORE_SIGNAL: UInt64 = 33
+let MACH_TRAP_SEMAPHORE_SIGNAL_ALL: UInt64 = 34
 let MACH_TRAP_SEMAPHORE_WAIT: UInt64 = 36
+let MACH_TRAP_SEMAPHORE_TIMEDWAIT: UInt64 = 38
+let MACH_TRAP_SWTCH_PRI: UInt64 = 59
+let MACH_TRAP_THREAD_SWITCH: UInt64 = 61
+let MACH_TRAP_TIMEBASE_INFO: UInt64 = 89
 let MACH_TRAP_THREAD_GET_SPECIAL_PORT: UInt64 = 0
 let MACH_TRAP_PORT_ALLOCATE: UInt64 = 3616  // _kernelrpc_mach_port_allocate_trap
 let MACH_TRAP_PORT_DEALLOCATE: UInt64 = 3618
-let MACH_TRAP_PORT_INSERT_RIGHT: UInt64 = 3619
+let MACH_TRAP_PORT_MOD_REFS: UInt64 = 3619
+let MACH_TRAP_PORT_INSERT_RIGHT: UInt64 = 3621
 let MACH_TRAP_PORT_CONSTRUCT: UInt64 = 3624
+let MACH_TRAP_PORT_DESTRUCT: UInt64 = 3625
 let MACH_TRAP_VM_ALLOCATE: UInt64 = 3610  // _kernelrpc_mach_vm_allocate_trap
 let MACH_TRAP_VM_DEALLOCATE: UInt64 = 3612
 let MACH_TRAP_VM_PROTECT: UInt64 = 3614
@@ -41,6 +49,10 @@ let SYS_CLOSE: UInt64 = 6
 let SYS_MMAP: UInt64 = 197
 let SYS_MUNMAP: UInt64 = 73
 let SYS_MPROTECT: UInt64 = 74
+
+// mmap flags (Darwin values)
+let MAP_SHARED: UInt64 = 0x0001
+let MAP_ANON: UInt64 = 0x1000
 let SYS_SIGPROCMASK: UInt64 = 48
 let SYS_IOCTL: UInt64 = 54
 let SYS_FCNTL: UInt64 = 92
@@ -60,482 +72,768 @@ let SYS_STAT64: UInt64 = 338
 let SYS_FSTAT64: UInt64 = 339
 let SYS_LSTAT64: UInt64 = 340
 let SYS_GETENTROPY: UInt64 = 500
+let SYS_GETTIMEOFDAY: UInt64 = 116
 let SYS_BRK: UInt64 = 12
 let SYS_THREAD_SELFID: UInt64 = 372
 let SYS_ACCESS: UInt64 = 33
+let SYS_DUP: UInt64 = 41
 let SYS_DUP2: UInt64 = 90
 let SYS_SIGACTION: UInt64 = 46
 let SYS_PIPE: UInt64 = 42
 let SYS_GETRLIMIT: UInt64 = 194
 let SYS_SETRLIMIT: UInt64 = 195
 let SYS_WRITEV: UInt64 = 121
+let SYS_BSDTHREAD_CREATE: UInt64 = 360
+let SYS_BSDTHREAD_TERMINATE: UInt64 = 361
+let SYS_BSDTHREAD_REGISTER: UInt64 = 366
+
+/// bsdthread_create flag: the caller supplies the stack and pthread_t.
+let PTHREAD_START_CUSTOM: UInt64 = 0x0100_0000
 
 // MARK: - Process State (simple single-process for now)
 
 nonisolated(unsafe) var currentBrk: UInt64 = 0x0400_0000  // Heap start
-// 128MB - safely within 512MB RAM
-nonisolated(unsafe) var nextMmapAddr: UInt64 = 0x0800_0000
+// Anonymous mappings live above the 8 GB boot identity map so they never
+// shadow frames handed out by the PMM.
+nonisolated(unsafe) var nextMmapAddr: UInt64 = 0x10_0000_0000
 nonisolated(unsafe) var signalMask: UInt64 = 0
+/// Set by bsdthread_register: where new threads start in libpthread, and
+/// the offset of the TSD slots in a pthread_t.
+nonisolated(unsafe) var pthreadStart: UInt64 = 0
+nonisolated(unsafe) var pthreadTSDOffset: UInt64 = 0
+
+/// An `int` argument such as a descriptor, flags or fcntl's minimum. User
+/// space passes it sign-extended or with garbage above bit 31; only the low
+/// 32 bits are the value, so -1 arrives as -1 rather than trapping.
+@inline(__always)
+func intArg(_ raw: UInt64) -> Int {
+    return Int(Int32(truncatingIfNeeded: raw))
+}
+
+/// A `size_t` byte count, or nil if it is too large to be one.
+@inline(__always)
+func sizeArg(_ raw: UInt64) -> Int? {
+    return raw > UInt64(Int.max) ? nil : Int(raw)
+}
+
+/// Copy a NUL-terminated user path into a String. Nil for a null pointer or
+/// a path longer than PATH_MAX.
+func copyInPath(_ addr: UInt64) -> String? {
+    guard let p = UnsafePointer<UInt8>(bitPattern: UInt(addr)) else { return nil }
+    var len = 0
+    while p[len] != 0 {
+        len += 1
+        if len >= 1024 { return nil }
+    }
+    return String(decoding: UnsafeBufferPointer(start: p, count: len), as: UTF8.self)
+}
+
+/// Fill a Darwin struct stat64 (144 bytes) for a vnode: st_mode at offset
+/// 4, st_size at offset 96.
+func fillStat(_ buf: UnsafeMutableRawPointer, vnode: VNode) {
+    var mode: UInt16 = 0
+    switch vnode.type {
+    case .file: mode = 0x8000 | 0o644  // S_IFREG
+    case .directory: mode = 0x4000 | 0o755  // S_IFDIR
+    case .device: mode = 0x2000 | 0o620  // S_IFCHR
+    default: mode = 0
+    }
+    memset(buf, 0, 144)
+    buf.storeBytes(of: mode, toByteOffset: 4, as: UInt16.self)
+    buf.storeBytes(of: Int64(vnode.size), toByteOffset: 96, as: Int64.self)
+}
+
+/// Reserve address space for a mapping of `length` bytes. Large reservations
+/// are 2 MiB aligned so anonymous ones can fault in huge pages.
+func reserveMmapRange(length: UInt64) -> UInt64 {
+    if length >= HUGE_PAGE_SIZE {
+        nextMmapAddr = (nextMmapAddr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1)
+    }
+    let addr = nextMmapAddr
+    nextMmapAddr = (nextMmapAddr + length + 0xFFF) & ~0xFFF
+    return addr
+}
 
 // MARK: - Main Syscall Dispatcher
 
+/// Fill the dispatch tables (see SyscallTable.swift). Called once at boot.
+func registerSyscalls() {
+    bsdSyscalls.register(SYS_EXIT, "exit", sysExit)
+    bsdSyscalls.register(SYS_MMAP, "mmap", sysMmap)
+    bsdSyscalls.register(SYS_MUNMAP, "munmap", sysMunmap)
+    bsdSyscalls.register(SYS_MPROTECT, "mprotect", sysMprotect)
+    bsdSyscalls.register(SYS_BRK, "brk", sysBrk)
+    bsdSyscalls.register(SYS_SIGPROCMASK, "sigprocmask", sysSigprocmask)
+    bsdSyscalls.register(SYS_SIGACTION, "sigaction", sysSigaction)
+    bsdSyscalls.register(SYS_GETPID, "getpid", sysGetpid)
+    bsdSyscalls.register(SYS_GETUID, "getuid", sysGetuid)
+    bsdSyscalls.register(SYS_GETEUID, "geteuid", sysGetuid)
+    bsdSyscalls.register(SYS_GETGID, "getgid", sysGetgid)
+    bsdSyscalls.register(SYS_GETEGID, "getegid", sysGetgid)
+    bsdSyscalls.register(SYS_ISSETUGID, "issetugid", sysIssetugid)
+    bsdSyscalls.register(SYS_IOCTL, "ioctl", sysIoctl)
+    bsdSyscalls.register(SYS_FCNTL, "fcntl", sysFcntl)
+    bsdSyscalls.register(SYS_CSOPS, "csops", sysCsops)
+    bsdSyscalls.register(SYS_CSOPS_AUDITTOKEN, "csops_audittoken", sysCsops)
+    bsdSyscalls.register(SYS_PROC_INFO, "proc_info", sysProcInfo)
+    bsdSyscalls.register(SYS_SHARED_REGION_CHECK, "shared_region_check", sysSharedRegionCheck)
+    bsdSyscalls.register(SYS_SYSCTL, "sysctl", sysSysctl)
+    bsdSyscalls.register(SYS_SYSCTLBYNAME, "sysctlbyname", sysSysctlbyname)
+    bsdSyscalls.register(SYS_OPEN, "open", sysOpen)
+    bsdSyscalls.register(SYS_CLOSE, "close", sysClose)
+    bsdSyscalls.register(SYS_READ, "read", sysRead)
+    bsdSyscalls.register(SYS_WRITE, "write", sysWrite)
+    bsdSyscalls.register(SYS_FSTAT64, "fstat64", sysFstat64)
+    bsdSyscalls.register(SYS_STAT64, "stat64", sysStat64)
+    bsdSyscalls.register(SYS_LSTAT64, "lstat64", sysStat64)
+    bsdSyscalls.register(SYS_GETENTROPY, "getentropy", sysGetentropy)
+    bsdSyscalls.register(SYS_GETTIMEOFDAY, "gettimeofday", sysGettimeofday)
+    bsdSyscalls.register(SYS_THREAD_SELFID, "thread_selfid", sysThreadSelfid)
+    bsdSyscalls.register(SYS_ACCESS, "access", sysAccess)
+    bsdSyscalls.register(SYS_GETRLIMIT, "getrlimit", sysGetrlimit)
+    bsdSyscalls.register(SYS_SETRLIMIT, "setrlimit", sysSetrlimit)
+    bsdSyscalls.register(SYS_WRITEV, "writev", sysWritev)
+    bsdSyscalls.register(SYS_PIPE, "pipe", sysPipe)
+    bsdSyscalls.register(SYS_DUP, "dup", sysDup)
+    bsdSyscalls.register(SYS_DUP2, "dup2", sysDup2)
+    bsdSyscalls.register(SYS_BSDTHREAD_CREATE, "bsdthread_create", sysBsdthreadCreate)
+    bsdSyscalls.register(SYS_BSDTHREAD_TERMINATE, "bsdthread_terminate", sysBsdthreadTerminate)
+    bsdSyscalls.register(SYS_BSDTHREAD_REGISTER, "bsdthread_register", sysBsdthreadRegister)
+
+    machTraps.register(MACH_TRAP_REPLY_PORT, "reply_port", trapReplyPort)
+    machTraps.register(MACH_TRAP_THREAD_SELF, "thread_self", trapThreadSelf)
+    machTraps.register(MACH_TRAP_TASK_SELF, "task_self", trapTaskSelf)
+    machTraps.register(MACH_TRAP_HOST_SELF, "host_self", trapHostSelf)
+    machTraps.register(MACH_TRAP_MSG, "msg", trapMsg)
+    machTraps.register(MACH_TRAP_MSG_OVERWRITE, "msg_overwrite", trapMsg)
+    machTraps.register(MACH_TRAP_PORT_ALLOCATE, "port_allocate", trapPortAllocate)
+    machTraps.register(MACH_TRAP_PORT_DEALLOCATE, "port_deallocate", trapPortDeallocate)
+    machTraps.register(MACH_TRAP_PORT_MOD_REFS, "port_mod_refs", trapPortModRefs)
+    machTraps.register(MACH_TRAP_PORT_INSERT_RIGHT, "port_insert_right", trapPortInsertRight)
+    machTraps.register(MACH_TRAP_PORT_CONSTRUCT, "port_construct", trapPortConstruct)
+    machTraps.register(MACH_TRAP_PORT_DESTRUCT, "port_destruct", trapPortDestruct)
+    machTraps.register(MACH_TRAP_VM_ALLOCATE, "vm_allocate", trapVmAllocate)
+    machTraps.register(MACH_TRAP_VM_DEALLOCATE, "vm_deallocate", trapVmDeallocate)
+    machTraps.register(MACH_TRAP_VM_PROTECT, "vm_protect", trapVmProtect)
+    machTraps.register(MACH_TRAP_VM_MAP, "vm_map", trapVmMap)
+    machTraps.register(MACH_TRAP_SEMAPHORE_SIGNAL, "semaphore_signal", trapSemaphoreSignal)
+    machTraps.register(MACH_TRAP_SEMAPHORE_SIGNAL_ALL, "semaphore_signal_all", trapSemaphoreSignalAll)
+    machTraps.register(MACH_TRAP_SEMAPHORE_WAIT, "semaphore_wait", trapSemaphoreWait)
+    machTraps.register(MACH_TRAP_SEMAPHORE_TIMEDWAIT, "semaphore_timedwait", trapSemaphoreTimedwait)
+    machTraps.register(MACH_TRAP_SWTCH_PRI, "swtch_pri", trapYield)
+    machTraps.register(MACH_TRAP_THREAD_SWITCH, "thread_switch", trapYield)
+    machTraps.register(MACH_TRAP_TIMEBASE_INFO, "mach_timebase_info", trapTimebaseInfo)
+
+    mdepSyscalls.register(3, "thread_set_tsd_base", mdepThreadSetTSDBase)
+}
+
 /// Called from the assembly syscall_entry stub.
 /// RAX = syscall number (XNU-encoded), RDI..R9 = args
+///
+/// The handlers run under the kernel lock; on the way out the thread may be
+/// switched out if its time slice is up.
 @_cdecl("handle_syscall")
 func handleSyscall(
     num: UInt64, arg1: UInt64, arg2: UInt64, arg3: UInt64,
     arg4: UInt64, arg5: UInt64, arg6: UInt64
 ) -> UInt64 {
-    let syscallClass = num & 0xFF00_0000
+    Trace.event(.syscallEnter, num, arg1)
+    kernel_lock()
+    if Bench.enabled { Bench.syscallEntered() }
+    let r = dispatchSyscall(
+        num: num, arg1: arg1, arg2: arg2, arg3: arg3, arg4: arg4, arg5: arg5, arg6: arg6)
+    kernel_unlock()
+    Trace.event(.syscallExit, num, r)
+    Scheduler.preemptPoint()
+    return r
+}
+
+private func dispatchSyscall(
+    num: UInt64, arg1: UInt64, arg2: UInt64, arg3: UInt64,
+    arg4: UInt64, arg5: UInt64, arg6: UInt64
+) -> UInt64 {
     let syscallNum = num & 0x00FF_FFFF
+    let args = SyscallArgs(a1: arg1, a2: arg2, a3: arg3, a4: arg4, a5: arg5, a6: arg6)
 
-    switch syscallClass {
-    case SYSCALL_CLASS_UNIX:
-        return handleBSDSyscall(
-            num: syscallNum, a1: arg1, a2: arg2, a3: arg3, a4: arg4, a5: arg5, a6: arg6)
-    case SYSCALL_CLASS_MACH:
-        return handleMachTrap(
-            num: syscallNum, a1: arg1, a2: arg2, a3: arg3, a4: arg4, a5: arg5, a6: arg6)
-    case SYSCALL_CLASS_MDEP:
-        return handleMachineDependentSyscall(
-            num: syscallNum, a1: arg1, a2: arg2, a3: arg3, a4: arg4, a5: arg5, a6: arg6)
-
-    case 0:
-        // Mach traps can also be called with class 0 (negative trap numbers in XNU)
-        return handleMachTrap(
-            num: syscallNum, a1: arg1, a2: arg2, a3: arg3, a4: arg4, a5: arg5, a6: arg6)
-    default:
-        kprint("SYSCALL: Unknown class ")
-        kprint_hex(num)
+    // BSD calls are the bulk of dyld and libc startup; test for them first.
+    let syscallClass = num & 0xFF00_0000
+    if syscallClass == SYSCALL_CLASS_UNIX {
+        if let r = bsdSyscalls.dispatch(syscallNum, args) { return r }
+        kprint("BSD: Unknown syscall ")
+        kprint_hex(syscallNum)
         kprint("\n")
-        return UInt64(bitPattern: -1)
+        return 0
     }
-}
-
-let SYSCALL_CLASS_MDEP: UInt64 = 0x0300_0000
-
-func handleMachineDependentSyscall(
-    num: UInt64, a1: UInt64, a2: UInt64, a3: UInt64, a4: UInt64, a5: UInt64, a6: UInt64
-) -> UInt64 {
-    switch num {
-    case 3:  // thread_set_tsd_base
-        // a1 = new tsd base (GS Base)
-        kprint("thread_set_tsd_base: ")
-        kprint_hex(a1)
+    // Mach traps can also be called with class 0 (negative trap numbers in XNU)
+    if syscallClass == SYSCALL_CLASS_MACH || syscallClass == 0 {
+        if let r = machTraps.dispatch(syscallNum, args) { return r }
+        kprint("Mach: Unknown trap ")
+        kprint_hex(syscallNum)
         kprint("\n")
-        asm_wrmsr(0xC000_0102, a1)
         return 0
-    default:
+    }
+    if syscallClass == SYSCALL_CLASS_MDEP {
+        if let r = mdepSyscalls.dispatch(syscallNum, args) { return r }
         kprint("MDEP: Unknown syscall ")
-        kprint_hex(num)
+        kprint_hex(syscallNum)
         kprint("\n")
         return 0
     }
+    kprint("SYSCALL: Unknown class ")
+    kprint_hex(num)
+    kprint("\n")
+    return UInt64(bitPattern: -1)
 }
 
-// MARK: - BSD Syscall Handler
+// MARK: - Machine-dependent Syscalls
 
-func handleBSDSyscall(
-    num: UInt64, a1: UInt64, a2: UInt64, a3: UInt64, a4: UInt64, a5: UInt64, a6: UInt64
-) -> UInt64 {
-    switch num {
-    case SYS_EXIT:
-        kprint("exit(")
-        kprint_hex(a1)
-        kprint(")\n")
-        while true { asm_hlt() }
-
-    case SYS_WRITE:
-        // write(fd, buf, count)
-        let buf = UnsafeRawPointer(bitPattern: UInt(a2))
-        if let buf = buf {
-            let ptr = buf.assumingMemoryBound(to: UInt8.self)
-            for i in 0..<Int(a3) { serial_putc(ptr[i]) }
-        }
-        return a3
-
-    case SYS_READ:
-        // read(fd, buf, count) - stub: return 0 (EOF)
-        return 0
+private func mdepThreadSetTSDBase(_ args: SyscallArgs) -> UInt64 {
+    // a1 = new tsd base (GS Base)
+    if Log.debug {
+        kprint("thread_set_tsd_base: ")
+        kprint_hex(args.a1)
+        kprint("\n")
+    }
+    Thread.current.tsdBase = args.a1
+    asm_wrmsr(0xC000_0102, args.a1)
+    return 0
+}
 
-    case SYS_OPEN:
-        // open(path, flags, mode) - stub: return fd 3
-        if let pathPtr = UnsafeRawPointer(bitPattern: UInt(a1)) {
-            kprint("open(\"")
-            let p = pathPtr.assumingMemoryBound(to: UInt8.self)
-            var i = 0
-            while p[i] != 0 && i < 64 {
-                serial_putc(p[i])
-                i += 1
-            }
-            kprint("\")\n")
-        }
-        return UInt64(bitPattern: -1)  // ENOENT
+// MARK: - BSD Syscalls
 
-    case SYS_CLOSE:
-        return 0
+private func sysExit(_ args: SyscallArgs) -> UInt64 {
+    kprint("exit(")
+    kprint_hex(args.a1)
+    kprint(")\n")
+    Trace.dump()
+    Scheduler.exitTask()
+}
 
-    case SYS_MMAP:
-        // mmap(addr, len, prot, flags, fd, offset)
-        // a1=addr, a2=len, a3=prot, a4=flags, a5=fd, a6=offset
-        let addr = a1
-        let len = a2
-        let fd = Int(bitPattern: UInt(a5))
-        let offset = a6
-
-        let allocAddr: UInt64
-        if addr != 0 {
-            allocAddr = addr
-        } else {
-            allocAddr = nextMmapAddr
-            nextMmapAddr = (nextMmapAddr + len + 0xFFF) & ~0xFFF
-        }
+private func sysMmap(_ args: SyscallArgs) -> UInt64 {
+    // mmap(addr, len, prot, flags, fd, offset)
+    // a1=addr, a2=len, a3=prot, a4=flags, a5=fd, a6=offset
+    let addr = args.a1
+    let len = (args.a2 + 0xFFF) & ~0xFFF
+    let prot = UInt32(truncatingIfNeeded: args.a3)
+    let flags = args.a4
+    let fd = Int(bitPattern: UInt(args.a5))
+    let offset = args.a6
+    guard len != 0, let space = AddressSpace.current else {
+        return UInt64(bitPattern: -1)
+    }
 
-        // Allocate pages
-        let pageCount = (len + 0xFFF) / 4096
-        for i in 0..<pageCount {
-            if let frame = PMM.allocateFrame() {
-                VMM.map(virt: allocAddr + (i * 4096), phys: frame, flags: 7)
-            } else {
-                return UInt64(bitPattern: -1)
-            }
-        }
+    // Only the region is recorded; pages are filled on first touch.
+    let object: VMObject
+    if (flags & MAP_ANON) != 0 || fd == -1 {
+        object = VMObject(backing: .anonymous, size: len)
+    } else if let file = VFS.shared.getFileDescription(fd: fd) {
+        // Shared mappings of a file must all write the same pages; private
+        // ones only read their object, so a fresh one will do.
+        object =
+            (flags & MAP_SHARED) != 0
+            ? VMObject.shared(for: file.vnode)
+            : VMObject(backing: .vnode(file.vnode), size: file.vnode.size)
+    } else {
+        return UInt64(bitPattern: -1)  // EBADF
+    }
 
-        // File backing
-        if let dest = UnsafeMutableRawPointer(bitPattern: UInt(allocAddr)) {
-            if fd != -1 {
-                if let file = VFS.shared.getFileDescription(fd: fd) {
-                    _ = file.vnode.read(offset: offset, count: Int(len), buffer: dest)
-                }
-            }
-        }
-        return allocAddr
+    let allocAddr: UInt64
+    if addr != 0 {
+        allocAddr = addr & ~0xFFF
+    } else {
+        allocAddr = reserveMmapRange(length: len)
+    }
+    space.mapObject(
+        start: allocAddr, size: len, prot: prot, object: object, offset: offset,
+        isPrivate: (flags & MAP_SHARED) == 0)
+    return allocAddr
+}
 
-    case SYS_MUNMAP:
-        return 0
+private func sysMunmap(_ args: SyscallArgs) -> UInt64 {
+    // munmap(addr, len)
+    AddressSpace.current?.unmap(start: args.a1, size: args.a2)
+    return 0
+}
 
-    case SYS_MPROTECT:
-        return 0
+private func sysMprotect(_ args: SyscallArgs) -> UInt64 {
+    // mprotect(addr, len, prot)
+    AddressSpace.current?.protect(
+        start: args.a1, size: args.a2, prot: UInt32(truncatingIfNeeded: args.a3))
+    return 0
+}
 
-    case SYS_BRK:
-        if a1 == 0 { return currentBrk }
-        currentBrk = a1
-        return 0
+private func sysBrk(_ args: SyscallArgs) -> UInt64 {
+    if args.a1 == 0 { return currentBrk }
+    currentBrk = args.a1
+    return 0
+}
 
-    case SYS_SIGPROCMASK:
-        // sigprocmask(how, set, oset)
-        let osetAddr = a3
-        if osetAddr != 0 {
-            if let oset = UnsafeMutablePointer<UInt64>(bitPattern: UInt(osetAddr)) {
-                oset.pointee = signalMask
-            }
+private func sysSigprocmask(_ args: SyscallArgs) -> UInt64 {
+    // sigprocmask(how, set, oset)
+    let osetAddr = args.a3
+    if osetAddr != 0 {
+        if let oset = UnsafeMutablePointer<UInt64>(bitPattern: UInt(osetAddr)) {
+            oset.pointee = signalMask
         }
-        if a2 != 0 {
-            if let setPtr = UnsafePointer<UInt64>(bitPattern: UInt(a2)) {
-                let newSet = setPtr.pointee
-                switch a1 {
-                case 1: signalMask |= newSet  // SIG_BLOCK
-                case 2: signalMask &= ~newSet  // SIG_UNBLOCK
-                case 3: signalMask = newSet  // SIG_SETMASK
-                default: break
-                }
+    }
+    if args.a2 != 0 {
+        if let setPtr = UnsafePointer<UInt64>(bitPattern: UInt(args.a2)) {
+            let newSet = setPtr.pointee
+            switch args.a1 {
+            case 1: signalMask |= newSet  // SIG_BLOCK
+            case 2: signalMask &= ~newSet  // SIG_UNBLOCK
+            case 3: signalMask = newSet  // SIG_SETMASK
+            default: break
             }
         }
-        return 0
+    }
+    return 0
+}
 
-    case SYS_SIGACTION:
-        return 0
+private func sysSigaction(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
 
-    case SYS_GETPID:
-        return 1
+private func sysGetpid(_ args: SyscallArgs) -> UInt64 {
+    return 1
+}
 
-    case SYS_GETUID, SYS_GETEUID:
-        return 0  // root
+private func sysGetuid(_ args: SyscallArgs) -> UInt64 {
+    return 0  // root
+}
 
-    case SYS_GETGID, SYS_GETEGID:
-        return 0  // root
+private func sysGetgid(_ args: SyscallArgs) -> UInt64 {
+    return 0  // root
+}
 
-    case SYS_ISSETUGID:
-        return 0
+private func sysIssetugid(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
 
-    case SYS_IOCTL:
-        return 0
+private func sysIoctl(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
 
-    case SYS_FCNTL:
+private func sysFcntl(_ args: SyscallArgs) -> UInt64 {
+    // fcntl(fd, cmd, arg)
+    let fd = intArg(args.a1)
+    guard let table = FileTable.current, let file = table.get(fd) else {
+        return UInt64(bitPattern: -9)  // EBADF
+    }
+    switch args.a2 {
+    case F_DUPFD, F_DUPFD_CLOEXEC:
+        let flags = args.a2 == F_DUPFD_CLOEXEC ? FD_CLOEXEC : 0
+        let minimum = intArg(args.a3)
+        if minimum < 0 || minimum >= OPEN_MAX { return UInt64(bitPattern: -22) }  // EINVAL
+        guard let newFd = table.dup(fd, minimum: minimum, flags: flags) else {
+            return UInt64(bitPattern: -24)  // EMFILE
+        }
+        return UInt64(newFd)
+    case F_GETFD:
+        return UInt64(table.descriptorFlags(fd))
+    case F_SETFD:
+        table.setDescriptorFlags(fd, UInt8(truncatingIfNeeded: args.a3) & FD_CLOEXEC)
+        return 0
+    case F_GETFL:
+        return UInt64(file.flags)
+    case F_SETFL:
+        // Only the status flags change; the access mode is fixed at open.
+        file.flags = (file.flags & 3) | (Int(truncatingIfNeeded: args.a3) & ~3)
         return 0
+    default:
+        return UInt64(bitPattern: -22)  // EINVAL
+    }
+}
 
-    case SYS_CSOPS, SYS_CSOPS_AUDITTOKEN:
-        return 0
+private func sysCsops(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
 
-    case SYS_PROC_INFO:
-        return 0
+private func sysProcInfo(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
 
-    case SYS_SHARED_REGION_CHECK:
-        // shared_region_check_np(addr) - return 0 to indicate no shared region
-        if a1 != 0 {
-            if let p = UnsafeMutablePointer<UInt64>(bitPattern: UInt(a1)) {
-                p.pointee = 0
-            }
+private func sysSharedRegionCheck(_ args: SyscallArgs) -> UInt64 {
+    // shared_region_check_np(addr) - report where the dyld shared cache
+    // is mapped (0 if there is none)
+    if args.a1 != 0 {
+        if let p = UnsafeMutablePointer<UInt64>(bitPattern: UInt(args.a1)) {
+            p.pointee = sharedRegionBase
         }
-        return 0
+    }
+    return 0
+}
 
-    case SYS_SYSCTL:
-        return handleSysctl(a1: a1, a2: a2, a3: a3)
+private func sysSysctl(_ args: SyscallArgs) -> UInt64 {
+    return handleSysctl(a1: args.a1, a2: args.a2, a3: args.a3)
+}
 
-    case SYS_SYSCTLBYNAME:
-        return 0
+private func sysSysctlbyname(_ args: SyscallArgs) -> UInt64 {
+    return Sysctl.byName(
+        name: args.a1, nameLength: args.a2, oldp: args.a3, oldlenp: args.a4, newp: args.a5,
+        newLength: args.a6)
+}
 
-    case SYS_OPEN:
-        let pathPtr = UnsafePointer<UInt8>(bitPattern: UInt(a1))!
-        let flags = Int(a2)
-        // Convert C string to Swift String (basic)
-        var path = ""
-        var i = 0
-        while pathPtr[i] != 0 {
-            path.append(Character(UnicodeScalar(pathPtr[i])))
-            i += 1
-        }
-        if let fd = VFS.shared.open(path: path, flags: flags) {
-            return UInt64(fd)
-        }
-        return UInt64(bitPattern: -2)  // ENOENT
+private func sysOpen(_ args: SyscallArgs) -> UInt64 {
+    guard let path = copyInPath(args.a1) else { return UInt64(bitPattern: -14) }  // EFAULT
+    let flags = intArg(args.a2)
+    return UInt64(bitPattern: Int64(VFS.shared.open(path: path, flags: flags)))
+}
 
-    case SYS_CLOSE:
-        VFS.shared.close(fd: Int(a1))
-        return 0
+private func sysClose(_ args: SyscallArgs) -> UInt64 {
+    if !VFS.shared.close(fd: intArg(args.a1)) { return UInt64(bitPattern: -9) }  // EBADF
+    return 0
+}
 
-    case SYS_READ:
-        let fd = Int(a1)
-        if let buf = UnsafeMutableRawPointer(bitPattern: UInt(a2)) {
-            let count = Int(a3)
-            if let file = VFS.shared.getFileDescription(fd: fd) {
-                return UInt64(file.read(buffer: buf, count: count))
-            }
+private func sysRead(_ args: SyscallArgs) -> UInt64 {
+    let fd = intArg(args.a1)
+    guard let count = sizeArg(args.a3) else { return UInt64(bitPattern: -22) }  // EINVAL
+    if let buf = UnsafeMutableRawPointer(bitPattern: UInt(args.a2)) {
+        if let file = VFS.shared.getFileDescription(fd: fd) {
+            return UInt64(bitPattern: Int64(file.read(buffer: buf, count: count)))
         }
-        // stdin fallback?
-        return UInt64(bitPattern: -9)  // EBADF
+    }
+    // stdin fallback?
+    return UInt64(bitPattern: -9)  // EBADF
+}
 
-    case SYS_WRITE:
-        let fd = Int(a1)
-        if fd == 1 || fd == 2 {
-            if let buf = UnsafePointer<UInt8>(bitPattern: UInt(a2)) {
-                let count = Int(a3)
-                for i in 0..<count {
-                    serial_putc(buf[i])
-                }
-                return UInt64(count)
-            }
-        }
-        // TODO: VFS write
-        return UInt64(bitPattern: -9)  // EBADF
+private func sysWrite(_ args: SyscallArgs) -> UInt64 {
+    let fd = intArg(args.a1)
+    guard let count = sizeArg(args.a3) else { return UInt64(bitPattern: -22) }  // EINVAL
+    if let buf = UnsafeRawPointer(bitPattern: UInt(args.a2)),
+        let file = VFS.shared.getFileDescription(fd: fd)
+    {
+        return UInt64(bitPattern: Int64(file.write(buffer: buf, count: count)))
+    }
+    return UInt64(bitPattern: -9)  // EBADF
+}
 
-    case SYS_FSTAT64:
-        let fd = Int(a1)
-        if let statPtr = UnsafeMutableRawPointer(bitPattern: UInt(a2)) {
-            if let file = VFS.shared.getFileDescription(fd: fd) {
-                let size = file.vnode.size
-                // struct stat64 is large. We need the definition.
-                // st_mode offset 0 (kind of), st_size offset 96?
-                // Helper:
-                // mode: S_IFREG (0x8000) or S_IFDIR (0x4000)
-                var mode: UInt16 = 0
-                switch file.vnode.type {
-                case .file: mode = 0x8000 | 0o644
-                case .directory: mode = 0x4000 | 0o755
-                default: mode = 0
-                }
-
-                memset(statPtr, 0, 144)  // approximate size of stat64
-                // st_mode at offset 4 (UInt16)
-                statPtr.storeBytes(of: mode, toByteOffset: 4, as: UInt16.self)
-                // st_size at offset 96 (Int64)
-                statPtr.storeBytes(of: Int64(size), toByteOffset: 96, as: Int64.self)
-                return 0
-            }
+private func sysFstat64(_ args: SyscallArgs) -> UInt64 {
+    let fd = intArg(args.a1)
+    if let statPtr = UnsafeMutableRawPointer(bitPattern: UInt(args.a2)) {
+        if let file = VFS.shared.getFileDescription(fd: fd) {
+            fillStat(statPtr, vnode: file.vnode)
+            return 0
         }
-        return UInt64(bitPattern: -9)  // EBADF
+    }
+    return UInt64(bitPattern: -9)  // EBADF
+}
 
-    case SYS_STAT64, SYS_LSTAT64:
-        // Stat by path.
+private func sysStat64(_ args: SyscallArgs) -> UInt64 {
+    // stat64(path, buf). The ramdisk has no symlinks, so lstat is the same.
+    guard let path = copyInPath(args.a1),
+        let statPtr = UnsafeMutableRawPointer(bitPattern: UInt(args.a2))
+    else { return UInt64(bitPattern: -14) }  // EFAULT
+    guard let vnode = VFS.shared.lookup(path: path) else {
         return UInt64(bitPattern: -2)  // ENOENT
+    }
+    fillStat(statPtr, vnode: vnode)
+    return 0
+}
 
-    case SYS_GETENTROPY:
-        // getentropy(buf, buflen)
-        if let buf = UnsafeMutableRawPointer(bitPattern: UInt(a1)) {
-            let p = buf.assumingMemoryBound(to: UInt8.self)
-            for i in 0..<Int(a2) { p[i] = UInt8(truncatingIfNeeded: i &* 0x5_DEEC_E66D &+ 0xB) }
-        }
-        return 0
+private func sysGetentropy(_ args: SyscallArgs) -> UInt64 {
+    // getentropy(buf, buflen); buflen is at most 256
+    if args.a2 > 256 { return UInt64(bitPattern: -22) }  // EINVAL
+    if let buf = UnsafeMutableRawPointer(bitPattern: UInt(args.a1)) {
+        let p = buf.assumingMemoryBound(to: UInt8.self)
+        for i in 0..<Int(args.a2) { p[i] = UInt8(truncatingIfNeeded: i &* 0x5_DEEC_E66D &+ 0xB) }
+    }
+    return 0
+}
 
-    case SYS_THREAD_SELFID:
-        return 1  // Thread ID
+private func sysGettimeofday(_ args: SyscallArgs) -> UInt64 {
+    // gettimeofday(tv, tz, mach_absolute_time); libsystem only traps here
+    // when the commpage timestamp is stale
+    let now = Clock.timeOfDay()
+    if let tv = UnsafeMutableRawPointer(bitPattern: UInt(args.a1)) {
+        tv.storeBytes(of: Int64(now.sec), as: Int64.self)
+        tv.storeBytes(of: Int32(now.usec), toByteOffset: 8, as: Int32.self)
+    }
+    if let mt = UnsafeMutablePointer<UInt64>(bitPattern: UInt(args.a3)) {
+        mt.pointee = Clock.nanotime()
+    }
+    return 0
+}
 
-    case SYS_ACCESS:
-        return UInt64(bitPattern: -1)  // ENOENT
+private func sysThreadSelfid(_ args: SyscallArgs) -> UInt64 {
+    return Thread.current.id
+}
 
-    case SYS_GETRLIMIT:
-        // getrlimit(resource, rlp)
-        if let rlp = UnsafeMutablePointer<UInt64>(bitPattern: UInt(a2)) {
-            rlp[0] = 0x0080_0000  // cur (8MB)
-            rlp[1] = 0x0080_0000  // max
-        }
-        return 0
+private func sysAccess(_ args: SyscallArgs) -> UInt64 {
+    return UInt64(bitPattern: -1)  // ENOENT
+}
 
-    case SYS_SETRLIMIT:
-        return 0
+private func sysGetrlimit(_ args: SyscallArgs) -> UInt64 {
+    // getrlimit(resource, rlp)
+    if let rlp = UnsafeMutablePointer<UInt64>(bitPattern: UInt(args.a2)) {
+        rlp[0] = 0x0080_0000  // cur (8MB)
+        rlp[1] = 0x0080_0000  // max
+    }
+    return 0
+}
+
+private func sysSetrlimit(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
 
-    case SYS_WRITEV:
-        // writev(fd, iov, iovcnt)
-        // struct iovec { void *iov_base; size_t iov_len; }
-        if let iovPtr = UnsafePointer<UInt64>(bitPattern: UInt(a2)) {
-            var total: UInt64 = 0
-            for i in 0..<Int(a3) {
-                let base = iovPtr[i * 2]
-                let len = iovPtr[i * 2 + 1]
-                if let buf = UnsafeRawPointer(bitPattern: UInt(base)) {
-                    let p = buf.assumingMemoryBound(to: UInt8.self)
-                    for j in 0..<Int(len) { serial_putc(p[j]) }
-                }
-                total += len
+private func sysWritev(_ args: SyscallArgs) -> UInt64 {
+    // writev(fd, iov, iovcnt)
+    // struct iovec { void *iov_base; size_t iov_len; }
+    guard let file = VFS.shared.getFileDescription(fd: intArg(args.a1)) else {
+        return UInt64(bitPattern: -9)  // EBADF
+    }
+    let iovcnt = intArg(args.a3)
+    if iovcnt < 0 { return UInt64(bitPattern: -22) }  // EINVAL
+    if let iovPtr = UnsafePointer<UInt64>(bitPattern: UInt(args.a2)) {
+        var total: UInt64 = 0
+        for i in 0..<iovcnt {
+            let base = iovPtr[i * 2]
+            let len = iovPtr[i * 2 + 1]
+            if let buf = UnsafeRawPointer(bitPattern: UInt(base)) {
+                guard let count = sizeArg(len) else { return UInt64(bitPattern: -22) }  // EINVAL
+                let n = file.write(buffer: buf, count: count)
+                if n < 0 { return total > 0 ? total : UInt64(bitPattern: Int64(n)) }
+                total += UInt64(n)
             }
-            return total
         }
-        return UInt64(bitPattern: -1)
-
-    case SYS_PIPE:
-        return UInt64(bitPattern: -1)
+        return total
+    }
+    return UInt64(bitPattern: -14)  // EFAULT
+}
 
-    case SYS_DUP2:
-        return a2  // Return newfd
+private func sysPipe(_ args: SyscallArgs) -> UInt64 {
+    return UInt64(bitPattern: -1)
+}
 
-    default:
-        kprint("BSD: Unknown syscall ")
-        kprint_hex(num)
-        kprint("\n")
-        return 0
+private func sysDup(_ args: SyscallArgs) -> UInt64 {
+    let old = intArg(args.a1)
+    guard let fd = FileTable.current?.dup(old) else {
+        return UInt64(bitPattern: VFS.shared.getFileDescription(fd: old) == nil ? -9 : -24)  // EBADF, EMFILE
     }
+    return UInt64(fd)
 }
 
-// MARK: - Mach Trap Handler
+private func sysDup2(_ args: SyscallArgs) -> UInt64 {
+    guard let fd = FileTable.current?.dup2(intArg(args.a1), intArg(args.a2)) else {
+        return UInt64(bitPattern: -9)  // EBADF
+    }
+    return UInt64(fd)
+}
 
-func handleMachTrap(
-    num: UInt64, a1: UInt64, a2: UInt64, a3: UInt64, a4: UInt64, a5: UInt64, a6: UInt64
-) -> UInt64 {
-    switch num {
-    case MACH_TRAP_REPLY_PORT:
-        return UInt64(machReplyPort())
-
-    case MACH_TRAP_THREAD_SELF:
-        return 0x203  // Fixed thread port
-
-    case MACH_TRAP_TASK_SELF:
-        return UInt64(machTaskSelf())
-
-    case MACH_TRAP_HOST_SELF:
-        return UInt64(machHostSelf())
-
-    case MACH_TRAP_MSG, MACH_TRAP_MSG_OVERWRITE:
-        // mach_msg_trap(msg, option, send_size, rcv_size, rcv_name, timeout, notify)
-        return UInt64(
-            handleMachMsg(
-                msgAddr: a1,
-                option: UInt32(a2),
-                sendSize: UInt32(a3),
-                rcvSize: UInt32(a4),
-                rcvName: MachPortName(a5),
-                timeout: UInt32(a6)
-            ))
-
-    case MACH_TRAP_PORT_ALLOCATE:
-        // _kernelrpc_mach_port_allocate_trap(task, right, name_out)
-        let name = machPortAllocate(rightType: UInt32(a2))
-        if let nameOut = UnsafeMutablePointer<UInt32>(bitPattern: UInt(a3)) {
-            nameOut.pointee = name
-        }
-        return 0  // KERN_SUCCESS
+private func sysBsdthreadRegister(_ args: SyscallArgs) -> UInt64 {
+    // bsdthread_register(threadstart, wqthread, pthsize, init_data, init_data_size, dq_offset)
+    pthreadStart = args.a1
+    // struct _pthread_registration_data: tsd_offset follows version,
+    // dispatch_queue_offset and main_qos.
+    if args.a5 >= 28, let data = UnsafeRawPointer(bitPattern: UInt(args.a4)) {
+        pthreadTSDOffset = UInt64(data.loadUnaligned(fromByteOffset: 24, as: UInt32.self))
+    }
+    return 0  // no optional features
+}
 
-    case MACH_TRAP_PORT_DEALLOCATE:
-        return 0
+private func sysBsdthreadCreate(_ args: SyscallArgs) -> UInt64 {
+    // bsdthread_create(func, func_arg, stack, pthread, flags)
+    // Only the libpthread way, with the stack and pthread_t already set up.
+    if pthreadStart == 0 || (args.a5 & PTHREAD_START_CUSTOM) == 0 {
+        return UInt64(bitPattern: -22)  // EINVAL
+    }
+    guard let space = IPCSpace.current else { return UInt64(bitPattern: -12) }  // ENOMEM
+    let pthread = args.a4
+    // _pthread_start(pthread, kport, func, arg, stacksize, flags), below the
+    // red zone.
+    let t = Thread(userEntry: pthreadStart, stack: (args.a3 &- 128) & ~15)
+    let port = space.makeSend(t.port)
+    t.userArgs = [pthread, UInt64(port), args.a1, args.a2, 0, args.a5 & ~PTHREAD_START_CUSTOM]
+    t.tsdBase = pthread &+ pthreadTSDOffset
+    Scheduler.enqueue(t)
+    return pthread
+}
 
-    case MACH_TRAP_PORT_INSERT_RIGHT:
-        return 0
+private func sysBsdthreadTerminate(_ args: SyscallArgs) -> UInt64 {
+    // bsdthread_terminate(stackaddr, freesize, port, sem)
+    if args.a2 != 0 { AddressSpace.current?.unmap(start: args.a1, size: args.a2) }
+    if let space = IPCSpace.current {
+        if args.a3 != 0 { _ = space.deallocate(MachPortName(truncatingIfNeeded: args.a3)) }
+        if args.a4 != 0 { semaphore(named: args.a4)?.signal() }
+    }
+    Scheduler.terminate()
+}
 
-    case MACH_TRAP_PORT_CONSTRUCT:
-        // _kernelrpc_mach_port_construct_trap(task, options, context, name_out)
-        let name = machPortAllocate(rightType: MACH_PORT_RIGHT_RECEIVE)
-        if let nameOut = UnsafeMutablePointer<UInt32>(bitPattern: UInt(a3)) {
-            nameOut.pointee = name
-        }
-        return 0
+// MARK: - Mach Traps
 
-    case MACH_TRAP_VM_ALLOCATE:
-        // _kernelrpc_mach_vm_allocate_trap(task, addr_p, size, flags)
-        let size = a2
-        let addrPtr = UnsafeMutablePointer<UInt64>(bitPattern: UInt(a1))
-        let addr = nextMmapAddr
-        nextMmapAddr += (size + 0xFFF) & ~0xFFF
-        if let p = addrPtr {
-            p.pointee = addr
-        }
-        // Zero-fill
-        if let dest = UnsafeMutableRawPointer(bitPattern: UInt(addr)) {
-            memset(dest, 0, Int(size))
-        }
-        return 0
+private func trapReplyPort(_ args: SyscallArgs) -> UInt64 {
+    guard let space = IPCSpace.current else { return UInt64(MACH_PORT_NULL) }
+    return UInt64(space.allocate(right: MACH_PORT_RIGHT_RECEIVE).1)
+}
 
-    case MACH_TRAP_VM_DEALLOCATE:
-        return 0
+private func trapThreadSelf(_ args: SyscallArgs) -> UInt64 {
+    guard let space = IPCSpace.current else { return UInt64(MACH_PORT_NULL) }
+    return UInt64(space.makeSend(Thread.current.port))
+}
 
-    case MACH_TRAP_VM_PROTECT:
-        return 0
+private func trapTaskSelf(_ args: SyscallArgs) -> UInt64 {
+    guard let space = IPCSpace.current else { return UInt64(MACH_PORT_NULL) }
+    return UInt64(space.makeSend(space.taskPort))
+}
 
-    case MACH_TRAP_VM_MAP:
-        return 0
+private func trapHostSelf(_ args: SyscallArgs) -> UInt64 {
+    guard let space = IPCSpace.current else { return UInt64(MACH_PORT_NULL) }
+    return UInt64(space.makeSend(hostPort))
+}
 
-    case MACH_TRAP_SEMAPHORE_SIGNAL:
-        return 0
+private func trapMsg(_ args: SyscallArgs) -> UInt64 {
+    // mach_msg_trap(msg, option, send_size, rcv_size, rcv_name, timeout, notify)
+    return UInt64(
+        handleMachMsg(
+            msgAddr: args.a1,
+            option: UInt32(truncatingIfNeeded: args.a2),
+            sendSize: UInt32(truncatingIfNeeded: args.a3),
+            rcvSize: UInt32(truncatingIfNeeded: args.a4),
+            rcvName: MachPortName(truncatingIfNeeded: args.a5),
+            timeout: UInt32(truncatingIfNeeded: args.a6)
+        ))
+}
 
-    case MACH_TRAP_SEMAPHORE_WAIT:
-        return 0
+// The _kernelrpc_mach_port_* traps only act on the caller's own space; the
+// task argument is not checked.
 
-    default:
-        kprint("Mach: Unknown trap ")
-        kprint_hex(num)
-        kprint("\n")
-        return 0
+private func trapPortAllocate(_ args: SyscallArgs) -> UInt64 {
+    // _kernelrpc_mach_port_allocate_trap(task, right, name_out)
+    guard let space = IPCSpace.current else { return UInt64(KERN_INVALID_ARGUMENT) }
+    guard let nameOut = UnsafeMutablePointer<UInt32>(bitPattern: UInt(args.a3)) else {
+        return UInt64(KERN_INVALID_ARGUMENT)
     }
+    let (kr, name) = space.allocate(right: UInt32(truncatingIfNeeded: args.a2))
+    if kr == KERN_SUCCESS { nameOut.pointee = name }
+    return UInt64(kr)
 }
 
-// MARK: - sysctl handler
+private func trapPortDeallocate(_ args: SyscallArgs) -> UInt64 {
+    // _kernelrpc_mach_port_deallocate_trap(task, name)
+    guard let space = IPCSpace.current else { return UInt64(KERN_INVALID_ARGUMENT) }
+    return UInt64(space.deallocate(MachPortName(truncatingIfNeeded: args.a2)))
+}
 
-func handleSysctl(a1: UInt64, a2: UInt64, a3: UInt64) -> UInt64 {
-    // sysctl(name, namelen, oldp, oldlenp, newp, newlen)
-    // name is an array of int
-    guard let namePtr = UnsafePointer<Int32>(bitPattern: UInt(a1)) else {
-        return UInt64(bitPattern: -1)
-    }
-    let nameLen = Int(a2)
-    if nameLen < 2 { return UInt64(bitPattern: -1) }
+private func trapPortModRefs(_ args: SyscallArgs) -> UInt64 {
+    // _kernelrpc_mach_port_mod_refs_trap(task, name, right, delta)
+    guard let space = IPCSpace.current else { return UInt64(KERN_INVALID_ARGUMENT) }
+    return UInt64(
+        space.modRefs(
+            MachPortName(truncatingIfNeeded: args.a2), right: UInt32(truncatingIfNeeded: args.a3),
+            delta: Int32(truncatingIfNeeded: args.a4)))
+}
 
-    let mib0 = namePtr[0]
-    let mib1 = namePtr[1]
+private func trapPortInsertRight(_ args: SyscallArgs) -> UInt64 {
+    // _kernelrpc_mach_port_insert_right_trap(task, name, poly, polyPoly)
+    guard let space = IPCSpace.current else { return UInt64(KERN_INVALID_ARGUMENT) }
+    return UInt64(
+        space.insertRight(
+            MachPortName(truncatingIfNeeded: args.a2), poly: MachPortName(truncatingIfNeeded: args.a3),
+            disposition: UInt32(truncatingIfNeeded: args.a4)))
+}
 
-    // CTL_HW = 6, HW_NCPU = 3
-    if mib0 == 6 && mib1 == 3 {
-        if let oldp = UnsafeMutablePointer<Int32>(bitPattern: UInt(a3)) {
-            oldp.pointee = 1  // 1 CPU
-        }
-        return 0
+private func trapPortConstruct(_ args: SyscallArgs) -> UInt64 {
+    // _kernelrpc_mach_port_construct_trap(task, options, context, name_out)
+    guard let space = IPCSpace.current,
+        let options = UnsafeRawPointer(bitPattern: UInt(args.a2)),
+        let nameOut = UnsafeMutablePointer<UInt32>(bitPattern: UInt(args.a4))
+    else { return UInt64(KERN_INVALID_ARGUMENT) }
+    // mach_port_options_t: flags, then mpl_qlimit
+    let (kr, name) = space.construct(
+        flags: options.loadUnaligned(as: UInt32.self),
+        queueLimit: options.loadUnaligned(fromByteOffset: 4, as: UInt32.self))
+    if kr == KERN_SUCCESS { nameOut.pointee = name }
+    return UInt64(kr)
+}
+
+private func trapPortDestruct(_ args: SyscallArgs) -> UInt64 {
+    // _kernelrpc_mach_port_destruct_trap(task, name, srdelta, guard)
+    guard let space = IPCSpace.current else { return UInt64(KERN_INVALID_ARGUMENT) }
+    let name = MachPortName(truncatingIfNeeded: args.a2)
+    let srdelta = Int32(truncatingIfNeeded: args.a3)
+    guard space.receivePort(name) != nil else { return UInt64(KERN_INVALID_RIGHT) }
+    if srdelta != 0 {
+        let kr = space.modRefs(name, right: MACH_PORT_RIGHT_SEND, delta: srdelta)
+        if kr != KERN_SUCCESS { return UInt64(kr) }
     }
+    return UInt64(space.modRefs(name, right: MACH_PORT_RIGHT_RECEIVE, delta: -1))
+}
 
-    // CTL_KERN = 1, KERN_OSTYPE = 1
-    if mib0 == 1 && mib1 == 1 {
-        if let oldp = UnsafeMutableRawPointer(bitPattern: UInt(a3)) {
-            let s: StaticString = "Darwin"
-            memcpy(oldp, UnsafeRawPointer(s.utf8Start), s.utf8CodeUnitCount + 1)
-        }
-        return 0
+private func trapVmAllocate(_ args: SyscallArgs) -> UInt64 {
+    // _kernelrpc_mach_vm_allocate_trap(task, addr_p, size, flags)
+    let size = args.a2
+    let addrPtr = UnsafeMutablePointer<UInt64>(bitPattern: UInt(args.a1))
+    guard size != 0, let space = AddressSpace.current else {
+        return UInt64(KERN_NO_SPACE)
     }
+    let length = (size + 0xFFF) & ~0xFFF
+    let addr = reserveMmapRange(length: length)
+    space.mapObject(
+        start: addr, size: length, prot: VM_PROT_READ | VM_PROT_WRITE,
+        object: VMObject(backing: .anonymous, size: length))
+    if let p = addrPtr {
+        p.pointee = addr
+    }
+    return 0
+}
 
+private func trapVmDeallocate(_ args: SyscallArgs) -> UInt64 {
     return 0
 }
+
+private func trapVmProtect(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
+
+private func trapVmMap(_ args: SyscallArgs) -> UInt64 {
+    return 0
+}
+
+/// The semaphore a send right in the caller's space names.
+private func semaphore(named name: UInt64) -> Semaphore? {
+    guard let port = IPCSpace.current?.sendPort(MachPortName(truncatingIfNeeded: name)),
+        case .semaphore(let sem) = port.kobject
+    else { return nil }
+    return sem
+}
+
+private func trapSemaphoreSignal(_ args: SyscallArgs) -> UInt64 {
+    guard let sem = semaphore(named: args.a1) else { return UInt64(KERN_INVALID_ARGUMENT) }
+    sem.signal()
+    return UInt64(KERN_SUCCESS)
+}
+
+private func trapSemaphoreSignalAll(_ args: SyscallArgs) -> UInt64 {
+    guard let sem = semaphore(named: args.a1) else { return UInt64(KERN_INVALID_ARGUMENT) }
+    sem.signalAll()
+    return UInt64(KERN_SUCCESS)
+}
+
+private func trapSemaphoreWait(_ args: SyscallArgs) -> UInt64 {
+    guard let sem = semaphore(named: args.a1) else { return UInt64(KERN_INVALID_ARGUMENT) }
+    return UInt64(sem.wait())
+}
+
+private func trapSemaphoreTimedwait(_ args: SyscallArgs) -> UInt64 {
+    // semaphore_timedwait_trap(name, sec, nsec)
+    guard let sem = semaphore(named: args.a1) else { return UInt64(KERN_INVALID_ARGUMENT) }
+    let ms = args.a2.multipliedReportingOverflow(by: 1000)
+    let total = ms.overflow ? UInt64.max : ms.partialValue &+ (args.a3 & 0xFFFF_FFFF) / 1_000_000
+    return UInt64(sem.wait(timeout: UInt32(clamping: total)))
+}
+
+/// swtch_pri and thread_switch: no priorities or handoff, just yield.
+private func trapYield(_ args: SyscallArgs) -> UInt64 {
+    Scheduler.yield()
+    return UInt64(KERN_SUCCESS)
+}
+
+/// mach_absolute_time is in nanoseconds already.
+private func trapTimebaseInfo(_ args: SyscallArgs) -> UInt64 {
+    guard let info = UnsafeMutablePointer<UInt32>(bitPattern: UInt(args.a1)) else {
+        return UInt64(KERN_INVALID_ARGUMENT)
+    }
+    info[0] = 1  // numer
+    info[1] = 1  // denom
+    return UInt64(KERN_SUCCESS)
+}
@@ -0,0 +1,147 @@
+/*
+ * SyscallTable.swift
+ * Per-class syscall dispatch tables with cycle accounting
+ *
+ * Each syscall class has a table mapping the syscall number to a dense slot,
+ * and the slot holds the handler and its statistics. Dispatch is two array
+ * indexes. Every call is timed with rdtsc and counted into a log2 histogram
+ * of cycles, readable through the debug.syscall_stats sysctl.
+ */
+
+import CSupport
+
+struct SyscallArgs {
+    var a1: UInt64
+    var a2: UInt64
+    var a3: UInt64
+    var a4: UInt64
+    var a5: UInt64
+    var a6: UInt64
+}
+
+typealias SyscallHandler = (SyscallArgs) -> UInt64
+
+/// Histogram bucket i counts calls of [2^(i+6), 2^(i+7)) cycles; the first
+/// and last buckets also take everything below and above.
+let SYSCALL_HISTOGRAM_BUCKETS = 16
+private let histogramShift = 6
+private let noSlot: Int16 = -1
+
+/// One record of debug.syscall_stats, repeated for each registered syscall.
+struct SyscallStatRecord {
+    var syscallClass: UInt32
+    var number: UInt32
+    var count: UInt64
+    var cycles: UInt64
+    var maxCycles: UInt64
+    /// NUL-padded syscall name.
+    var name: (UInt64, UInt64, UInt64, UInt64)
+    var histogram:
+        (
+            UInt64, UInt64, UInt64, UInt64, UInt64, UInt64, UInt64, UInt64,
+            UInt64, UInt64, UInt64, UInt64, UInt64, UInt64, UInt64, UInt64
+        )
+}
+
+final class SyscallTable {
+    let syscallClass: UInt64
+    private var slots: [Int16] = []
+    private var handlers: [SyscallHandler] = []
+    private var numbers: [UInt64] = []
+    private var names: [StaticString] = []
+    private var counts: [UInt64] = []
+    private var cycles: [UInt64] = []
+    private var maxCycles: [UInt64] = []
+    /// SYSCALL_HISTOGRAM_BUCKETS entries per slot.
+    private var histograms: [UInt64] = []
+
+    init(syscallClass: UInt64) {
+        self.syscallClass = syscallClass
+    }
+
+    func register(_ number: UInt64, _ name: StaticString, _ handler: @escaping SyscallHandler) {
+        if Int(number) >= slots.count {
+            let grow = Int(number) + 1 - slots.count
+            slots.append(contentsOf: [Int16](repeating: noSlot, count: grow))
+        }
+        slots[Int(number)] = Int16(handlers.count)
+        handlers.append(handler)
+        numbers.append(number)
+        names.append(name)
+        counts.append(0)
+        cycles.append(0)
+        maxCycles.append(0)
+        histograms.append(contentsOf: [UInt64](repeating: 0, count: SYSCALL_HISTOGRAM_BUCKETS))
+    }
+
+    /// Run the handler for `number`, or return nil if there is none.
+    @inline(__always)
+    func dispatch(_ number: UInt64, _ args: SyscallArgs) -> UInt64? {
+        if number >= UInt64(slots.count) { return nil }
+        let slot = Int(slots[Int(number)])
+        if slot < 0 { return nil }
+
+        let start = asm_rdtsc()
+        let result = handlers[slot](args)
+        let elapsed = asm_rdtsc() &- start
+
+        counts[slot] &+= 1
+        cycles[slot] &+= elapsed
+        if elapsed > maxCycles[slot] { maxCycles[slot] = elapsed }
+        let log2 = elapsed == 0 ? 0 : 63 - elapsed.leadingZeroBitCount
+        let bucket = min(max(log2 - histogramShift, 0), SYSCALL_HISTOGRAM_BUCKETS - 1)
+        histograms[slot * SYSCALL_HISTOGRAM_BUCKETS + bucket] &+= 1
+        return result
+    }
+
+    var registeredCount: Int { handlers.count }
+
+    func record(_ slot: Int) -> SyscallStatRecord {
+        var r = SyscallStatRecord(
+            syscallClass: UInt32(syscallClass >> 24), number: UInt32(numbers[slot]),
+            count: counts[slot], cycles: cycles[slot], maxCycles: maxCycles[slot],
+            name: (0, 0, 0, 0),
+            histogram: (0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0))
+        withUnsafeMutableBytes(of: &r.name) { dst in
+            let n = min(names[slot].utf8CodeUnitCount, dst.count - 1)
+            memcpy(dst.baseAddress!, names[slot].utf8Start, n)
+        }
+        withUnsafeMutableBytes(of: &r.histogram) { dst in
+            let h = dst.bindMemory(to: UInt64.self)
+            for i in 0..<SYSCALL_HISTOGRAM_BUCKETS {
+                h[i] = histograms[slot * SYSCALL_HISTOGRAM_BUCKETS + i]
+            }
+        }
+        return r
+    }
+
+    func resetStats() {
+        for i in 0..<handlers.count {
+            counts[i] = 0
+            cycles[i] = 0
+            maxCycles[i] = 0
+        }
+        for i in 0..<histograms.count { histograms[i] = 0 }
+    }
+}
+
+nonisolated(unsafe) let bsdSyscalls = SyscallTable(syscallClass: SYSCALL_CLASS_UNIX)
+nonisolated(unsafe) let machTraps = SyscallTable(syscallClass: SYSCALL_CLASS_MACH)
+nonisolated(unsafe) let mdepSyscalls = SyscallTable(syscallClass: SYSCALL_CLASS_MDEP)
+
+/// debug.syscall_stats: an array of SyscallStatRecord. Writing anything
+/// clears the counters.
+func syscallStatsSysctl(_ req: inout SysctlRequest) -> Int32 {
+    if req.hasNewValue {
+        bsdSyscalls.resetStats()
+        machTraps.resetStats()
+        mdepSyscalls.resetStats()
+    }
+    for table in [bsdSyscalls, machTraps, mdepSyscalls] {
+        for slot in 0..<table.registeredCount {
+            let r = table.record(slot)
+            if !withUnsafeBytes(of: r, { req.output($0) }) { return 12 }  // ENOMEM
+        }
+    }
+    return 0
+}
@@ -0,0 +1,128 @@
+/*
+ * Sysctl.swift
+ * sysctl(2) and sysctlbyname(2)
+ *
+ * Named nodes are registered with a handler that streams its value through a
+ * SysctlRequest, the way SYSCTL_OUT works in XNU: the request copies what
+ * fits into the caller's buffer and tallies the total length, so a probe
+ * with a null buffer learns how much to allocate. The numeric MIB path only
+ * knows the few fixed names libc asks for at startup.
+ */
+
+import CSupport
+
+struct SysctlRequest {
+    let oldp: UnsafeMutableRawPointer?
+    let oldCapacity: Int
+    /// Bytes the node produced, whether or not they fit.
+    private(set) var oldLength = 0
+    let newp: UnsafeRawPointer?
+    let newLength: Int
+
+    var hasNewValue: Bool { newp != nil }
+
+    /// Append to the old value. False once the caller's buffer is too small.
+    mutating func output(_ bytes: UnsafeRawBufferPointer) -> Bool {
+        defer { oldLength += bytes.count }
+        guard let oldp = oldp else { return true }
+        if oldLength + bytes.count > oldCapacity { return false }
+        if let src = bytes.baseAddress {
+            memcpy(oldp.advanced(by: oldLength), src, bytes.count)
+        }
+        return true
+    }
+}
+
+/// Returns 0 or a (positive) errno.
+typealias SysctlHandler = (inout SysctlRequest) -> Int32
+
+private struct SysctlNode {
+    let name: StaticString
+    let handler: SysctlHandler
+}
+
+nonisolated(unsafe) private var nodes: [SysctlNode] = []
+
+struct Sysctl {
+    static func register(_ name: StaticString, _ handler: @escaping SysctlHandler) {
+        nodes.append(SysctlNode(name: name, handler: handler))
+    }
+
+    /// sysctlbyname(name, namelen, oldp, oldlenp, newp, newlen)
+    static func byName(
+        name: UInt64, nameLength: UInt64, oldp: UInt64, oldlenp: UInt64, newp: UInt64,
+        newLength: UInt64
+    ) -> UInt64 {
+        guard let namePtr = UnsafeRawPointer(bitPattern: UInt(name)) else {
+            return UInt64(bitPattern: -14)  // EFAULT
+        }
+        let lenPtr = UnsafeMutablePointer<UInt64>(bitPattern: UInt(oldlenp))
+        for node in nodes {
+            let n = node.name.utf8CodeUnitCount
+            if UInt64(n) != nameLength || memcmp(namePtr, node.name.utf8Start, n) != 0 {
+                continue
+            }
+            var req = SysctlRequest(
+                oldp: UnsafeMutableRawPointer(bitPattern: UInt(oldp)),
+                oldCapacity: Int(lenPtr?.pointee ?? 0),
+                newp: UnsafeRawPointer(bitPattern: UInt(newp)), newLength: Int(newLength))
+            let error = node.handler(&req)
+            lenPtr?.pointee = UInt64(req.oldLength)
+            return error == 0 ? 0 : UInt64(bitPattern: -Int64(error))
+        }
+        return UInt64(bitPattern: -2)  // ENOENT
+    }
+
+    static func setup() {
+        register("hw.ncpu") { req in
+            var ncpu = Int32(onlineCPUCount())
+            return withUnsafeBytes(of: &ncpu) { req.output($0) } ? 0 : 12  // ENOMEM
+        }
+        register("machdep.tsc.frequency") { req in
+            var hz = Int64(Clock.tscFrequency)
+            return withUnsafeBytes(of: &hz) { req.output($0) } ? 0 : 12
+        }
+        register("kern.ostype") { req in
+            let s: StaticString = "Darwin"
+            let bytes = UnsafeRawBufferPointer(start: s.utf8Start, count: s.utf8CodeUnitCount + 1)
+            return req.output(bytes) ? 0 : 12
+        }
+        register("debug.syscall_stats", syscallStatsSysctl)
+        register("debug.log_level", Log.sysctl)
+        register("debug.trace_enabled", Trace.sysctl)
+    }
+}
+
+// MARK: - Numeric MIB
+
+func handleSysctl(a1: UInt64, a2: UInt64, a3: UInt64) -> UInt64 {
+    // sysctl(name, namelen, oldp, oldlenp, newp, newlen)
+    // name is an array of int
+    guard let namePtr = UnsafePointer<Int32>(bitPattern: UInt(a1)) else {
+        return UInt64(bitPattern: -1)
+    }
+    let nameLen = Int(a2)
+    if nameLen < 2 { return UInt64(bitPattern: -1) }
+
+    let mib0 = namePtr[0]
+    let mib1 = namePtr[1]
+
+    // CTL_HW = 6, HW_NCPU = 3
+    if mib0 == 6 && mib1 == 3 {
+        if let oldp = UnsafeMutablePointer<Int32>(bitPattern: UInt(a3)) {
+            oldp.pointee = Int32(onlineCPUCount())
+        }
+        return 0
+    }
+
+    // CTL_KERN = 1, KERN_OSTYPE = 1
+    if mib0 == 1 && mib1 == 1 {
+        if let oldp = UnsafeMutableRawPointer(bitPattern: UInt(a3)) {
+            let s: StaticString = "Darwin"
+            memcpy(oldp, UnsafeRawPointer(s.utf8Start), s.utf8CodeUnitCount + 1)
+        }
+        return 0
+    }
+
+    return 0
+}
@@ -0,0 +1,139 @@
+/*
+ * Trace.swift
+ * Kernel event tracing
+ *
+ * Hot paths record TraceEvents into trace.c's per-CPU rings, which cost a
+ * TSC read and a 32-byte store per event and never take a lock. Every CPU
+ * gets a ring of ringRecords records when it comes up; recording starts at
+ * boot and can be switched with debug.trace_enabled.
+ *
+ * At exit the rings are serialized, a bounce buffer at a time, and written
+ * to the trace area, the last traceDiskSectors of the block device, if the
+ * image reserved one (its first sector starts "SWTRACE"); otherwise they
+ * are hex-dumped to the serial console. Tools/trace2chrome.py turns either into a Chrome trace
+ * that Perfetto and chrome://tracing load.
+ */
+
+import CSupport
+
+/// What a record's two arguments mean depends on its event.
+enum TraceEvent: UInt32 {
+    case syscallEnter = 1  // number with class, first argument
+    case syscallExit = 2  // number with class, return value
+    case pageFaultEnter = 3  // address, error code
+    case pageFaultExit = 4  // address, 1 if handled
+    case blockSubmit = 5  // sector, count | 1 << 63 for writes
+    case blockComplete = 6  // sector, 1 if it succeeded
+    case machSend = 7  // msgh_id, size
+    case machReceive = 8  // msgh_id, size
+    case frameAlloc = 9  // physical address, frames
+    case frameFree = 10  // physical address, frames
+    case contextSwitch = 11  // old thread id, new thread id
+}
+
+private let ringRecords: UInt64 = 32768  // 1 MiB per CPU
+private let traceDiskSectors: UInt64 = 32768  // 16 MiB
+private let traceAreaMagic: StaticString = "SWTRACE"
+private let writeChunkSectors = 256
+
+struct Trace {
+    @inline(__always)
+    static func event(_ e: TraceEvent, _ arg0: UInt64 = 0, _ arg1: UInt64 = 0) {
+        trace_event(e.rawValue, arg0, arg1)
+    }
+
+    /// Start recording on the boot CPU. Needs only PMM.
+    static func setup() {
+        startCPU()
+        trace_enabled = 1
+    }
+
+    /// Give the calling CPU its ring.
+    static func startCPU() {
+        let bytes = ringRecords * UInt64(MemoryLayout<trace_record>.size)
+        guard let frames = PMM.allocateFrames(count: Int(bytes / PAGE_SIZE), zero: false) else {
+            kprint("Trace: no memory for ring\n")
+            return
+        }
+        trace_attach(UInt32(currentCPUIndex()), UnsafeMutableRawPointer(bitPattern: UInt(frames.value)), ringRecords)
+    }
+
+    /// Stop recording and write out everything the rings hold. The stream
+    /// goes out through a bounce buffer of one disk write, so it needs no
+    /// allocation the size of the rings.
+    static func dump() {
+        trace_enabled = 0
+        let hz = Clock.tscFrequency
+        let pages = writeChunkSectors * 512 / Int(PAGE_SIZE)
+        guard let frames = PMM.allocateFrames(count: pages, zero: false) else {
+            kprint("Trace: no memory to dump\n")
+            return
+        }
+        defer { PMM.freeFrames(frames, count: pages) }
+        let buf = UnsafeMutablePointer<UInt8>(bitPattern: UInt(frames.value))!
+        if let sector = diskArea() {
+            writeToDisk(buf, at: sector, hz: hz)
+        } else {
+            trace_dump_serial(buf, writeChunkSectors * 512, hz)
+        }
+    }
+
+    /// First sector of the reserved trace area, if the disk has one.
+    private static func diskArea() -> UInt64? {
+        guard let dev = blockDevice else { return nil }
+        let capacity = dev.capacitySectors
+        if capacity < SHARED_CACHE_SECTOR + traceDiskSectors { return nil }
+        let start = capacity - traceDiskSectors
+        guard let frame = PMM.allocateFrame(zero: false) else { return nil }
+        defer { PMM.freeFrame(frame) }
+        let sector = UnsafeMutableRawPointer(bitPattern: UInt(frame.value))!
+        if !virtioBlockRead(sector: start, count: 1, buffer: sector) { return nil }
+        let n = traceAreaMagic.utf8CodeUnitCount
+        return memcmp(sector, traceAreaMagic.utf8Start, n) == 0 ? start : nil
+    }
+
+    private static func writeToDisk(_ buf: UnsafeMutablePointer<UInt8>, at start: UInt64, hz: UInt64) {
+        let limit = Int(traceDiskSectors * 512)
+        let length = trace_serialize(nil, 0, 0, limit, hz)
+        if trace_serialize(nil, 0, 0, Int.max, hz) > length {
+            // Whole records are kept; the last CPUs' are the ones cut.
+            kprint("Trace: truncated to fit the trace area\n")
+        }
+        let chunk = writeChunkSectors * 512
+        var done = 0
+        while done < length {
+            let n = min(chunk, length - done)
+            _ = trace_serialize(buf, done, n, limit, hz)
+            let sectors = (n + 511) / 512
+            memset(buf.advanced(by: n), 0, sectors * 512 - n)
+            guard
+                let req = virtioBlockSubmit(
+                    sector: start + UInt64(done / 512), count: sectors,
+                    buffer: UnsafeMutableRawPointer(buf), write: true),
+                req.wait()
+            else {
+                kprint("Trace: disk write failed after ")
+                kprint_hex(UInt64(done))
+                kprint(" of ")
+                kprint_hex(UInt64(length))
+                kprint(" bytes\n")
+                return
+            }
+            done += n
+        }
+        kprint("Trace: ")
+        kprint_hex(UInt64(length))
+        kprint(" bytes written to the trace area\n")
+    }
+
+    /// debug.trace_enabled: 1 while recording, as a 32-bit integer; writable.
+    static func sysctl(_ req: inout SysctlRequest) -> Int32 {
+        var v = trace_enabled
+        if !withUnsafeBytes(of: &v, { req.output($0) }) { return 12 }  // ENOMEM
+        if let newp = req.newp {
+            if req.newLength != 4 { return 22 }  // EINVAL
+            trace_enabled = newp.loadUnaligned(as: UInt32.self) != 0 ? 1 : 0
+        }
+        return 0
+    }
+}
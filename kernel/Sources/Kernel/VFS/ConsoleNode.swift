@@ -0,0 +1,30 @@
+/*
+ * ConsoleNode.swift
+ * The serial console as a vnode, behind descriptors 0, 1 and 2
+ */
+
+import CSupport
+
+final class ConsoleNode: VNode {
+    nonisolated(unsafe) static let shared = ConsoleNode()
+
+    let type: VNodeType = .device
+    let name: String = "console"
+    let parent: VNode? = nil
+    let size: UInt64 = 0
+
+    func lookup(name: String) -> VNode? { return nil }
+    func readdir() -> [String] { return [] }
+
+    // No input path yet; reads see end of file.
+    func read(offset: UInt64, count: Int, buffer: UnsafeMutableRawPointer) -> Int { return 0 }
+
+    func write(offset: UInt64, count: Int, buffer: UnsafeRawPointer) -> Int {
+        // Queued, not yet on the wire; see console.c.
+        console_write(buffer.assumingMemoryBound(to: UInt8.self), count)
+        return count
+    }
+
+    func mmap(offset: UInt64, size: Int) -> UnsafeRawPointer? { return nil }
+    func close() {}
+}
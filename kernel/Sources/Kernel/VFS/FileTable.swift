@@ -0,0 +1,121 @@
+/*
+ * FileTable.swift
+ * Per-process file descriptor table
+ *
+ * Descriptors index a dense array directly. A bitmap of allocated slots
+ * finds the lowest free descriptor, as POSIX requires for open and dup, with
+ * a count-trailing-zeros per 64 descriptors. A FileDescription may sit in
+ * several slots after dup; it is closed when the last slot lets go of it.
+ */
+
+import CSupport
+
+let OPEN_MAX = 256
+
+// fcntl commands and flags (Darwin values)
+let F_DUPFD: UInt64 = 0
+let F_GETFD: UInt64 = 1
+let F_SETFD: UInt64 = 2
+let F_GETFL: UInt64 = 3
+let F_SETFL: UInt64 = 4
+let F_DUPFD_CLOEXEC: UInt64 = 67
+let FD_CLOEXEC: UInt8 = 1
+
+public final class FileTable {
+    /// Table of the running process.
+    nonisolated(unsafe) public static var current: FileTable?
+
+    private var files = [FileDescription?](repeating: nil, count: OPEN_MAX)
+    /// Per-descriptor flags (FD_CLOEXEC); not shared across dup.
+    private var fdFlags = [UInt8](repeating: 0, count: OPEN_MAX)
+    /// Bit set = slot in use.
+    private var used = [UInt64](repeating: 0, count: OPEN_MAX / 64)
+
+    /// A table with the console on descriptors 0, 1 and 2.
+    public init() {
+        let console = FileDescription(vnode: ConsoleNode.shared, flags: 2)  // O_RDWR
+        for fd in 0..<3 { install(console, at: fd) }
+    }
+
+    deinit {
+        for fd in 0..<OPEN_MAX where files[fd] != nil { _ = close(fd) }
+    }
+
+    public func get(_ fd: Int) -> FileDescription? {
+        if fd < 0 || fd >= OPEN_MAX { return nil }
+        return files[fd]
+    }
+
+    /// Install `file` at the lowest free descriptor not below `minimum`.
+    public func allocate(_ file: FileDescription, minimum: Int = 0) -> Int? {
+        guard let fd = lowestFree(from: minimum) else { return nil }
+        install(file, at: fd)
+        return fd
+    }
+
+    @discardableResult
+    public func close(_ fd: Int) -> Bool {
+        guard let file = get(fd) else { return false }
+        files[fd] = nil
+        fdFlags[fd] = 0
+        used[fd >> 6] &= ~(1 << UInt64(fd & 63))
+        release(file)
+        return true
+    }
+
+    /// dup / F_DUPFD: a new descriptor for the same open file.
+    public func dup(_ fd: Int, minimum: Int = 0, flags: UInt8 = 0) -> Int? {
+        guard let file = get(fd), let newFd = allocate(file, minimum: minimum) else {
+            return nil
+        }
+        fdFlags[newFd] = flags
+        return newFd
+    }
+
+    /// dup2: make `newFd` refer to the open file of `fd`, closing whatever
+    /// `newFd` held.
+    public func dup2(_ fd: Int, _ newFd: Int) -> Int? {
+        guard let file = get(fd), newFd >= 0, newFd < OPEN_MAX else { return nil }
+        if fd == newFd { return newFd }
+        close(newFd)
+        install(file, at: newFd)
+        return newFd
+    }
+
+    public func descriptorFlags(_ fd: Int) -> UInt8 {
+        return get(fd) != nil ? fdFlags[fd] : 0
+    }
+
+    public func setDescriptorFlags(_ fd: Int, _ flags: UInt8) {
+        if get(fd) != nil { fdFlags[fd] = flags }
+    }
+
+    // MARK: - Internals
+
+    private func install(_ file: FileDescription, at fd: Int) {
+        files[fd] = file
+        fdFlags[fd] = 0
+        used[fd >> 6] |= 1 << UInt64(fd & 63)
+        file.references += 1
+    }
+
+    private func release(_ file: FileDescription) {
+        file.references -= 1
+        if file.references == 0 { file.close() }
+    }
+
+    private func lowestFree(from minimum: Int) -> Int? {
+        if minimum < 0 || minimum >= OPEN_MAX { return nil }
+        var w = minimum >> 6
+        // Pretend the slots below `minimum` in its word are taken.
+        var word = used[w] | ((1 << UInt64(minimum & 63)) &- 1)
+        while true {
+            if word != UInt64.max {
+                return w << 6 | (~word).trailingZeroBitCount
+            }
+            w += 1
+            if w == used.count { return nil }
+            word = used[w]
+        }
+    }
+}
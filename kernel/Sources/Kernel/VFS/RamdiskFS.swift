@@ -1,6 +1,10 @@
 /*
  * RamdiskFS.swift
  * Read-only file system for the initramfs (CPIO/Tar)
+ *
+ * The tree is built once from the archive index (see CPIO.swift); each
+ * directory indexes its children by name hash, so a path lookup costs one
+ * probe per component. File data is never copied and stays in the ramdisk.
  */
 
 import CSupport
@@ -42,7 +46,15 @@ class RamdiskDirectoryNode: VNode {
     let type: VNodeType = .directory
     let name: String
     let parent: VNode?
-    var children: [(String, VNode)] = []
+    /// Children in archive order, for readdir.
+    private(set) var children: [(String, VNode)] = []
+    private var hashes: [UInt32] = []
+    /// The same child typed as a directory, so unpacking can descend without
+    /// a dynamic cast.
+    private var subdirs: [RamdiskDirectoryNode?] = []
+    /// Open-addressed index into `children`, -1 for empty. Power-of-two sized,
+    /// kept at most half full.
+    private var buckets: [Int32] = []
 
     var size: UInt64 { return 0 }
 
@@ -52,9 +64,9 @@ class RamdiskDirectoryNode: VNode {
     }
 
     func lookup(name: String) -> VNode? {
-        for child in children {
-            if child.0 == name { return child.1 }
-        }
+        if name == "." { return self }
+        if name == ".." { return parent ?? self }
+        if let i = find(name, hash: vfsNameHash(name)) { return children[i].1 }
         return nil
     }
 
@@ -62,6 +74,71 @@ class RamdiskDirectoryNode: VNode {
         return children.map { $0.0 }
     }
 
+    func subdirectory(named name: UnsafeRawBufferPointer) -> RamdiskDirectoryNode? {
+        if buckets.isEmpty { return nil }
+        let h = vfsNameHash(name)
+        let mask = buckets.count - 1
+        var b = Int(h) & mask
+        while buckets[b] >= 0 {
+            let i = Int(buckets[b])
+            if hashes[i] == h && children[i].0.utf8.elementsEqual(name) { return subdirs[i] }
+            b = (b + 1) & mask
+        }
+        return nil
+    }
+
+    func insert(name: String, file: RamdiskFileNode) {
+        insert(name: name, node: file, dir: nil)
+    }
+
+    func insert(name: String, directory: RamdiskDirectoryNode) {
+        insert(name: name, node: directory, dir: directory)
+    }
+
+    /// Add a child, replacing one of the same name.
+    private func insert(name: String, node: VNode, dir: RamdiskDirectoryNode?) {
+        let h = vfsNameHash(name)
+        if let i = find(name, hash: h) {
+            children[i].1 = node
+            subdirs[i] = dir
+            return
+        }
+        children.append((name, node))
+        hashes.append(h)
+        subdirs.append(dir)
+        if children.count * 2 > buckets.count {
+            rehash()
+        } else {
+            place(children.count - 1)
+        }
+    }
+
+    private func find(_ name: String, hash: UInt32) -> Int? {
+        if buckets.isEmpty { return nil }
+        let mask = buckets.count - 1
+        var b = Int(hash) & mask
+        while buckets[b] >= 0 {
+            let i = Int(buckets[b])
+            if hashes[i] == hash && children[i].0 == name { return i }
+            b = (b + 1) & mask
+        }
+        return nil
+    }
+
+    private func place(_ i: Int) {
+        let mask = buckets.count - 1
+        var b = Int(hashes[i]) & mask
+        while buckets[b] >= 0 { b = (b + 1) & mask }
+        buckets[b] = Int32(i)
+    }
+
+    private func rehash() {
+        var n = max(buckets.count * 2, 8)
+        while n < children.count * 2 { n <<= 1 }
+        buckets = [Int32](repeating: -1, count: n)
+        for i in 0..<children.count { place(i) }
+    }
+
     func read(offset: UInt64, count: Int, buffer: UnsafeMutableRawPointer) -> Int { return -1 }
     func write(offset: UInt64, count: Int, buffer: UnsafeRawPointer) -> Int { return -1 }
     func mmap(offset: UInt64, size: Int) -> UnsafeRawPointer? { return nil }
@@ -71,68 +148,45 @@ class RamdiskDirectoryNode: VNode {
 class RamdiskFS {
     let root: RamdiskDirectoryNode
 
-    init(start: UnsafeRawPointer, size: Int) {
+    /// Build the tree from a parsed archive index. Names are read from the
+    /// archive in place; a String is only made for each node created.
+    init(index: CPIOIndex) {
         self.root = RamdiskDirectoryNode(name: "", parent: nil)
-        parseCPIO(start: start, size: size)
-    }
-
-    private func parseCPIO(start: UnsafeRawPointer, size: Int) {
-        var offset = 0
-        while offset < size {
-            if offset + MemoryLayout<cpio_newc_header>.size > size { break }
-
-            let headerPtr = start.advanced(by: offset)
-            let header = headerPtr.assumingMemoryBound(to: cpio_newc_header.self).pointee
-
-            // Magic check 070701
-            if header.c_magic.0 != 0x30 || header.c_magic.1 != 0x37 {
-                break
-            }
-
-            let namesize = parseHex8(header.c_namesize)
-            let filesize = parseHex8(header.c_filesize)
-
-            if namesize == 0 { break }
-
-            let namePtr = headerPtr.advanced(by: MemoryLayout<cpio_newc_header>.size)
-            var name = ""
-            for i in 0..<namesize - 1 {
-                let c = namePtr.load(fromByteOffset: i, as: UInt8.self)
-                if c != 0 {
-                    name.append(Character(UnicodeScalar(c)))
+        for entry in index.entries where entry.isFile || entry.isDirectory {
+            let path = index.name(of: entry)
+            var dir = root
+            var start = 0
+            // Intermediate components; archives need not list them.
+            for i in 0..<path.count where path[i] == 47 {  // "/"
+                if i > start {
+                    dir = directory(in: dir, UnsafeRawBufferPointer(rebasing: path[start..<i]))
                 }
+                start = i + 1
             }
-
-            let headerPlusName = MemoryLayout<cpio_newc_header>.size + namesize
-            let alignedHeaderPlusName = (headerPlusName + 3) & ~3
-            let fileDataPtr = headerPtr.advanced(by: alignedHeaderPlusName)
-
-            if name == "TRAILER!!!" { break }
-
-            let mode = parseHex8(header.c_mode)
-            if (mode & 0x8000) != 0 {
+            if start == path.count { continue }
+            let leaf = UnsafeRawBufferPointer(rebasing: path[start...])
+            if entry.isFile {
+                let name = String(decoding: leaf, as: UTF8.self)
                 let node = RamdiskFileNode(
-                    name: name, parent: root, size: UInt64(filesize), data: fileDataPtr)
-                root.children.append((name, node))
+                    name: name, parent: dir, size: UInt64(entry.size), data: index.data(of: entry))
+                dir.insert(name: name, file: node)
+            } else {
+                _ = directory(in: dir, leaf)
             }
-
-            let nextOffset = alignedHeaderPlusName + filesize
-            offset += (nextOffset + 3) & ~3
         }
     }
 
-    private func parseHex8(_ tuple: (UInt8, UInt8, UInt8, UInt8, UInt8, UInt8, UInt8, UInt8))
-        -> Int
+    convenience init(start: UnsafeRawPointer, size: Int) {
+        self.init(index: CPIOIndex(start: start, size: size))
+    }
+
+    private func directory(in dir: RamdiskDirectoryNode, _ name: UnsafeRawBufferPointer)
+        -> RamdiskDirectoryNode
     {
-        var str = ""
-        str.append(Character(UnicodeScalar(tuple.0)))
-        str.append(Character(UnicodeScalar(tuple.1)))
-        str.append(Character(UnicodeScalar(tuple.2)))
-        str.append(Character(UnicodeScalar(tuple.3)))
-        str.append(Character(UnicodeScalar(tuple.4)))
-        str.append(Character(UnicodeScalar(tuple.5)))
-        str.append(Character(UnicodeScalar(tuple.6)))
-        str.append(Character(UnicodeScalar(tuple.7)))
-        return Int(str, radix: 16) ?? 0
+        if let next = dir.subdirectory(named: name) { return next }
+        let s = String(decoding: name, as: UTF8.self)
+        let next = RamdiskDirectoryNode(name: s, parent: dir)
+        dir.insert(name: s, directory: next)
+        return next
     }
 }
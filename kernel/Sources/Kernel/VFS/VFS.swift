@@ -31,6 +31,8 @@ public class FileDescription {
     public let vnode: VNode
     public var offset: UInt64
     public var flags: Int
+    /// Descriptor slots referring to this open file (see FileTable).
+    var references = 0
 
     public init(vnode: VNode, flags: Int) {
         self.vnode = vnode
@@ -59,38 +61,97 @@ public class FileDescription {
     }
 }
 
+/// FNV-1a over the UTF-8 bytes of a name. Hashing the bytes directly keeps
+/// String's unicode-aware hashing out of the kernel.
+func vfsNameHash(_ name: String) -> UInt32 {
+    var h: UInt32 = 0x811C_9DC5
+    for b in name.utf8 {
+        h = (h ^ UInt32(b)) &* 0x0100_0193
+    }
+    return h
+}
+
+func vfsNameHash(_ bytes: UnsafeRawBufferPointer) -> UInt32 {
+    var h: UInt32 = 0x811C_9DC5
+    for b in bytes {
+        h = (h ^ UInt32(b)) &* 0x0100_0193
+    }
+    return h
+}
+
+/// Whole-path lookup cache. Direct-mapped; a colliding path replaces the
+/// previous entry. Misses are cached too (node == nil), since dyld probes
+/// many paths that do not exist. Only valid while the mounted tree is
+/// immutable, so it is flushed on mount.
+private struct DentryCache {
+    struct Entry {
+        var hash: UInt32
+        var path: String
+        var node: VNode?
+    }
+
+    static let slotCount = 512
+    private var slots: [Entry?] = [Entry?](repeating: nil, count: DentryCache.slotCount)
+    private(set) var hits: UInt64 = 0
+    private(set) var misses: UInt64 = 0
+
+    /// .some(node or nil) on a hit, nil on a miss.
+    mutating func lookup(_ path: String, hash: UInt32) -> VNode?? {
+        if let e = slots[Int(hash) & (DentryCache.slotCount - 1)], e.hash == hash,
+            e.path == path
+        {
+            hits += 1
+            return .some(e.node)
+        }
+        misses += 1
+        return nil
+    }
+
+    mutating func insert(_ path: String, hash: UInt32, node: VNode?) {
+        slots[Int(hash) & (DentryCache.slotCount - 1)] = Entry(hash: hash, path: path, node: node)
+    }
+
+    mutating func flush() {
+        for i in 0..<slots.count { slots[i] = nil }
+    }
+}
+
 public class VFS {
     nonisolated(unsafe) public static let shared = VFS()
     private var root: VNode?
-    private var openFiles: [(Int, FileDescription)] = []
-    private var nextFd = 3  // 0, 1, 2 are stdin/out/err
+    private var dentries = DentryCache()
 
     private init() {}
 
     public func mount(root: VNode) {
         self.root = root
+        dentries.flush()
+    }
+
+    /// Resolve a path to its vnode without opening it.
+    public func lookup(path: String) -> VNode? {
+        return resolve(path: path)
     }
 
-    public func open(path: String, flags: Int) -> Int? {
-        guard let node = resolve(path: path) else { return nil }
-        let fd = nextFd
-        nextFd += 1
-        openFiles.append((fd, FileDescription(vnode: node, flags: flags)))
-        return fd
+    public var dentryHits: UInt64 { dentries.hits }
+    public var dentryMisses: UInt64 { dentries.misses }
+
+    /// Open a path into the current process's file table. Returns the
+    /// descriptor, or a negated errno.
+    public func open(path: String, flags: Int) -> Int {
+        guard let table = FileTable.current else { return -9 }  // EBADF
+        guard let node = resolve(path: path) else { return -2 }  // ENOENT
+        if let fd = table.allocate(FileDescription(vnode: node, flags: flags)) { return fd }
+        return -24  // EMFILE
     }
 
     public func getFileDescription(fd: Int) -> FileDescription? {
-        for f in openFiles {
-            if f.0 == fd { return f.1 }
-        }
-        return nil
+        return FileTable.current?.get(fd)
     }
 
-    public func close(fd: Int) {
-        if let idx = openFiles.firstIndex(where: { $0.0 == fd }) {
-            openFiles[idx].1.close()
-            openFiles.remove(at: idx)
-        }
+    @discardableResult
+    public func close(fd: Int) -> Bool {
+        return FileTable.current?.close(fd) ?? false
     }
 
     private func resolve(path: String) -> VNode? {
@@ -98,6 +159,14 @@ public class VFS {
         // TODO: Handle absolute/relative paths properly
         guard let root = root else { return nil }
 
+        let hash = vfsNameHash(path)
+        if let cached = dentries.lookup(path, hash: hash) { return cached }
+        let node = walk(root: root, path: path)
+        dentries.insert(path, hash: hash, node: node)
+        return node
+    }
+
+    private func walk(root: VNode, path: String) -> VNode? {
         let components = path.split(separator: "/")
         var current = root
         for component in components {
@@ -9,6 +9,18 @@ let VIRTIO_PCI_CAP_NOTIFY_CFG: UInt8 = 2
 let VIRTIO_PCI_CAP_ISR_CFG: UInt8 = 3
 let VIRTIO_PCI_CAP_DEVICE_CFG: UInt8 = 4
 
+// Device status bits
+let VIRTIO_STATUS_ACKNOWLEDGE: UInt8 = 1
+let VIRTIO_STATUS_DRIVER: UInt8 = 2
+let VIRTIO_STATUS_DRIVER_OK: UInt8 = 4
+let VIRTIO_STATUS_FEATURES_OK: UInt8 = 8
+let VIRTIO_STATUS_FAILED: UInt8 = 128
+
+// Transport feature bits
+let VIRTIO_RING_F_INDIRECT_DESC: UInt64 = 1 << 28
+let VIRTIO_RING_F_EVENT_IDX: UInt64 = 1 << 29
+let VIRTIO_F_VERSION_1: UInt64 = 1 << 32
+
 struct VirtioPciCommonCfg {
     var device_feature_select: UInt32
     var device_feature: UInt32
@@ -37,18 +49,22 @@ struct VirtioConfig {
 }
 
 func scanPci(vendor: UInt16, device: UInt16) -> (UInt8, UInt8, UInt8)? {
+    let start = Bench.now()
+    defer { Bench.phase(.pciScan, since: start) }
     for slot in 0..<32 {
         let v = pciRead16(bus: 0, slot: UInt8(slot), funcNum: 0, offset: 0)
         if v == 0xFFFF { continue }
         let d = pciRead16(bus: 0, slot: UInt8(slot), funcNum: 0, offset: 2)
 
-        kprint("  PCI 00:")
-        kprint_hex(UInt64(slot))
-        kprint(" - ")
-        kprint_hex(UInt64(v))
-        kprint(":")
-        kprint_hex(UInt64(d))
-        kprint("\n")
+        if Log.debug {
+            kprint("  PCI 00:")
+            kprint_hex(UInt64(slot))
+            kprint(" - ")
+            kprint_hex(UInt64(v))
+            kprint(":")
+            kprint_hex(UInt64(d))
+            kprint("\n")
+        }
 
         if v == vendor && d == device {
             return (0, UInt8(slot), 0)
@@ -66,20 +82,24 @@ func parseVirtioCapabilities(dev: (UInt8, UInt8, UInt8), config: inout VirtioCon
             let barIdx = pciRead8(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset + 4)
             let offset = pciRead32(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset + 8)
 
-            let barRaw = pciRead32(
-                bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 0x10 + (barIdx * 4))
-            let isIO = (barRaw & 1) != 0
-            let barAddr = barRaw & 0xFFFF_FFF0
-            let addr = UnsafeMutableRawPointer(bitPattern: UInt(barAddr + offset))
-
-            kprint("    Cap: Type=")
-            kprint_hex(UInt64(type))
-            kprint(" BAR=")
-            kprint_hex(UInt64(barIdx))
-            kprint(isIO ? " (IO)" : " (Mem)")
-            kprint(" Addr=")
-            if let a = addr { kprint_hex(UInt64(UInt(bitPattern: a))) } else { kprint("NULL") }
-            kprint("\n")
+            let bar = pciBar(dev: dev, index: barIdx)
+            let isIO = bar.isIO
+            let length = pciRead32(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset + 12)
+            let addr =
+                isIO
+                ? UnsafeMutableRawPointer(bitPattern: UInt(bar.address + UInt64(offset)))
+                : mmioAddress(bar.address + UInt64(offset), size: UInt64(length))
+
+            if Log.debug {
+                kprint("    Cap: Type=")
+                kprint_hex(UInt64(type))
+                kprint(" BAR=")
+                kprint_hex(UInt64(barIdx))
+                kprint(isIO ? " (IO)" : " (Mem)")
+                kprint(" Addr=")
+                if let a = addr { kprint_hex(UInt64(UInt(bitPattern: a))) } else { kprint("NULL") }
+                kprint("\n")
+            }
 
             switch type {
             case VIRTIO_PCI_CAP_COMMON_CFG:
@@ -100,6 +120,111 @@ func parseVirtioCapabilities(dev: (UInt8, UInt8, UInt8), config: inout VirtioCon
     }
 }
 
+/// Reset the device, acknowledge it, and negotiate features: accept the
+/// intersection of what the device offers and `wanted` (VERSION_1 is always
+/// requested). Returns the accepted set, or nil if the device refuses it.
+func negotiateFeatures(_ common: UnsafeMutablePointer<VirtioPciCommonCfg>, wanted: UInt64)
+    -> UInt64?
+{
+    common.pointee.device_status = 0
+    while common.pointee.device_status != 0 { asm_pause() }
+    common.pointee.device_status |= VIRTIO_STATUS_ACKNOWLEDGE
+    common.pointee.device_status |= VIRTIO_STATUS_DRIVER
+
+    common.pointee.device_feature_select = 0
+    var offered = UInt64(common.pointee.device_feature)
+    common.pointee.device_feature_select = 1
+    offered |= UInt64(common.pointee.device_feature) << 32
+
+    let accepted = offered & (wanted | VIRTIO_F_VERSION_1)
+    common.pointee.driver_feature_select = 0
+    common.pointee.driver_feature = UInt32(truncatingIfNeeded: accepted)
+    common.pointee.driver_feature_select = 1
+    common.pointee.driver_feature = UInt32(truncatingIfNeeded: accepted >> 32)
+
+    common.pointee.device_status |= VIRTIO_STATUS_FEATURES_OK
+    if (common.pointee.device_status & VIRTIO_STATUS_FEATURES_OK) == 0 {
+        kprint("  Device rejected features\n")
+        return nil
+    }
+    return accepted
+}
+
+// MARK: - MSI-X
+
+let PCI_CAP_ID_MSIX: UInt8 = 0x11
+/// Written to config_msix_vector / queue_msix_vector for "no vector".
+let VIRTIO_MSI_NO_VECTOR: UInt16 = 0xFFFF
+
+struct MsixTable {
+    var entries: UnsafeMutablePointer<UInt32>
+    var count: Int
+}
+
+/// Find the MSI-X capability, enable it with every entry masked, and return
+/// the vector table.
+func enableMsix(dev: (UInt8, UInt8, UInt8)) -> MsixTable? {
+    var capOffset = pciRead8(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 0x34)
+    while capOffset != 0 {
+        let capId = pciRead8(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset)
+        if capId == PCI_CAP_ID_MSIX {
+            let control = pciRead16(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset + 2)
+            let tableInfo = pciRead32(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset + 4)
+            let bir = UInt8(tableInfo & 0x7)
+            let count = Int(control & 0x7FF) + 1
+            let tableAddr = pciBar(dev: dev, index: bir).address + UInt64(tableInfo & ~0x7)
+            guard
+                let entries = mmioAddress(tableAddr, size: UInt64(count * 16))?
+                    .assumingMemoryBound(to: UInt32.self)
+            else { return nil }
+            for i in 0..<count { entries[i * 4 + 3] = 1 }  // masked
+            // Enable (bit 15), clear function mask (bit 14)
+            pciWrite16(
+                bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset + 2,
+                value: (control | 0x8000) & ~0x4000)
+            return MsixTable(entries: entries, count: count)
+        }
+        capOffset = pciRead8(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: capOffset + 1)
+    }
+    return nil
+}
+
+/// Point MSI-X table entry `index` at IDT `vector` on the boot CPU.
+func msixRoute(_ table: MsixTable, index: Int, vector: Int) {
+    let addr = irq_msi_address()
+    let e = table.entries.advanced(by: index * 4)
+    e[0] = UInt32(truncatingIfNeeded: addr)
+    e[1] = UInt32(truncatingIfNeeded: addr >> 32)
+    e[2] = UInt32(vector)
+    e[3] = 0  // unmask
+}
+
+/// Base address of BAR `index`. A 64-bit memory BAR takes its high half
+/// from the next BAR register.
+func pciBar(dev: (UInt8, UInt8, UInt8), index: UInt8) -> (address: UInt64, isIO: Bool) {
+    let raw = pciRead32(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 0x10 + index * 4)
+    if (raw & 1) != 0 { return (UInt64(raw & 0xFFFF_FFFC), true) }
+    var address = UInt64(raw & 0xFFFF_FFF0)
+    if (raw & 0x6) == 0x4 && index < 5 {
+        let high = pciRead32(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 0x10 + (index + 1) * 4)
+        address |= UInt64(high) << 32
+    }
+    return (address, false)
+}
+
+/// Kernel address of `size` bytes of MMIO at `phys`. Only the boot identity
+/// map is mapped to begin with, so windows a 64-bit BAR puts above it are
+/// identity mapped here first.
+func mmioAddress(_ phys: UInt64, size: UInt64) -> UnsafeMutableRawPointer? {
+    if phys == 0 { return nil }
+    if phys + size > identityMapEnd {
+        let start = phys & ~(PAGE_SIZE - 1)
+        let end = (phys + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)
+        VMM.mapRange(virt: start, phys: PhysAddr(start), size: end - start, flags: PTE_WRITABLE)
+    }
+    return UnsafeMutableRawPointer(bitPattern: UInt(phys))
+}
+
 func pciRead8(bus: UInt8, slot: UInt8, funcNum: UInt8, offset: UInt8) -> UInt8 {
     return UInt8(pci_config_read(bus, slot, funcNum, offset) >> ((offset % 4) * 8) & 0xFF)
 }
@@ -1,4 +1,24 @@
 // VirtIO Block Driver for SwiftOS
+//
+// Each request is a chain of three descriptors (header, data, status) taken
+// from a per-queue free list; with VIRTIO_RING_F_INDIRECT_DESC the chain lives
+// in a per-slot indirect table instead and costs one ring descriptor. With
+// VIRTIO_BLK_F_MQ there is one virtqueue per CPU (capped by what the device
+// offers), and VIRTIO_RING_F_EVENT_IDX lets both sides skip doorbells and
+// interrupts the other does not need.
+//
+// Completions arrive on an MSI-X vector per queue (or are polled if the
+// device has none) and finish the matching BlockRequest. The kernel runs with
+// interrupts off, so handlers only ever run inside BlockRequest.wait() or
+// while no driver code is active. Driver state is under the kernel lock; an
+// interrupt that finds another CPU holding it leaves the completions for the
+// next wait() or interrupt on that queue (a waiter polls on every timer tick).
+//
+// A request the device has not finished by requestTimeout is still on the
+// ring, and the device may yet DMA into its buffer. wait() then resets the
+// device, which stops it touching guest memory, fails every request that was
+// in flight and brings the queues back up on the same rings, so a caller may
+// free its buffer as soon as wait() returns.
 
 import CSupport
 
@@ -7,6 +27,15 @@ let VIRTIO_PCI_DEVICE_BLOCK: UInt16 = 0x1001
 let VIRTIO_BLK_T_IN: UInt32 = 0
 let VIRTIO_BLK_T_OUT: UInt32 = 1
 
+let VIRTIO_BLK_F_MQ: UInt64 = 1 << 12
+
+private let descsPerRequest = 3
+/// How long wait() gives the device before resetting it and failing the
+/// request, polled or not, so a lost interrupt cannot hang the caller.
+private let requestTimeout: UInt64 = 5_000_000_000  // ns
+/// virtio_blk_config.num_queues
+private let blkConfigNumQueues = 34
+
 struct VirtioBlkOuthdr {
     var type: UInt32
     var reserved: UInt32
@@ -17,142 +46,504 @@ struct VirtioBlkStatus {
     var status: UInt8
 }
 
-struct VirtioBlkDevice {
-    var config: VirtioConfig
-    var queueSize: Int = 0
-    var desc: UnsafeMutablePointer<VirtqDesc>?
-    var avail: UnsafeMutablePointer<VirtqAvail>?
-    var used: UnsafeMutablePointer<VirtqUsed>?
-    var lastUsedIdx: UInt16 = 0
+/// Completion token for one block request.
+final class BlockRequest {
+    let sector: UInt64
+    let count: Int
+    let buffer: UnsafeMutableRawPointer
+    let isWrite: Bool
+    /// Called once, from the completion path, when the device finishes.
+    var onComplete: ((BlockRequest) -> Void)?
+    fileprivate(set) var isDone = false
+    fileprivate(set) var succeeded = false
+    fileprivate var queue: VirtioBlkQueue?
+
+    init(sector: UInt64, count: Int, buffer: UnsafeMutableRawPointer, isWrite: Bool) {
+        self.sector = sector
+        self.count = count
+        self.buffer = buffer
+        self.isWrite = isWrite
+    }
+
+    /// Block until the request completes. Returns whether it succeeded; either
+    /// way the device is done with the buffer.
+    func wait() -> Bool {
+        guard let q = queue else { return isDone && succeeded }
+        let deadline = Clock.nanotime() + requestTimeout
+        while !isDone {
+            q.processCompletions()
+            if isDone { break }
+            if Clock.nanotime() >= deadline {
+                kprint("Block request TIMEOUT\n")
+                blockDevice?.processCompletions()
+                if !isDone { blockDevice?.reset() }
+                break
+            }
+            // The timer tick wakes an interrupt wait even if the
+            // completion interrupt never comes.
+            if q.usesInterrupts {
+                asm_wait_for_interrupt()
+            } else {
+                tlb_shootdown_poll()
+                asm_pause()
+            }
+        }
+        return succeeded
+    }
+
+    fileprivate func finish(ok: Bool) {
+        succeeded = ok
+        isDone = true
+        queue = nil
+        if let cb = onComplete {
+            onComplete = nil
+            cb(self)
+        }
+    }
 }
 
-nonisolated(unsafe) var blockDevice: VirtioBlkDevice?
+final class VirtioBlkQueue {
+    let index: UInt16
+    let size: Int
+    let memory: UnsafeMutableRawPointer
+    let desc: UnsafeMutablePointer<VirtqDesc>
+    let avail: UnsafeMutablePointer<VirtqAvail>
+    let used: UnsafeMutablePointer<VirtqUsed>
+    let doorbell: UnsafeMutablePointer<UInt16>?
+    let indirect: Bool
+    let eventIdx: Bool
+    var usesInterrupts = false
+    private var lastUsedIdx: UInt16 = 0
+
+    // Descriptor free list, threaded through desc[].next
+    private var freeHead: UInt16 = 0
+    private var freeCount: Int
+    /// Request header, status byte and (with indirect descriptors) chain for
+    /// the request whose ring descriptor is the index.
+    private let headers: UnsafeMutablePointer<VirtioBlkOuthdr>
+    private let statuses: UnsafeMutablePointer<UInt8>
+    private let indirectTables: UnsafeMutablePointer<VirtqDesc>?
+    private var inflight: [BlockRequest?]
+    /// Requests waiting for descriptors.
+    private var pending: [BlockRequest] = []
+
+    private(set) var notifications: UInt64 = 0
+    private(set) var suppressedNotifications: UInt64 = 0
+
+    init(
+        index: UInt16, size: Int, memory: UnsafeMutableRawPointer,
+        doorbell: UnsafeMutablePointer<UInt16>?, indirect: Bool, eventIdx: Bool
+    ) {
+        self.index = index
+        self.size = size
+        self.doorbell = doorbell
+        self.indirect = indirect
+        self.eventIdx = eventIdx
+        self.memory = memory
+        desc = memory.assumingMemoryBound(to: VirtqDesc.self)
+        avail = memory.advanced(by: size * 16).assumingMemoryBound(to: VirtqAvail.self)
+        used = memory.advanced(by: VirtioBlkQueue.usedOffset(size: size))
+            .assumingMemoryBound(to: VirtqUsed.self)
 
-func initVirtioBlock() {
-    kprint("Block Probe\n")
+        freeCount = size
+        headers = kernelAlloc(size: size * MemoryLayout<VirtioBlkOuthdr>.stride)
+            .bindMemory(to: VirtioBlkOuthdr.self, capacity: size)
+        statuses = kernelAlloc(size: size).bindMemory(to: UInt8.self, capacity: size)
+        indirectTables =
+            indirect
+            ? kernelAlloc(size: size * descsPerRequest * 16, align: 16)
+                .bindMemory(to: VirtqDesc.self, capacity: size * descsPerRequest)
+            : nil
+        inflight = [BlockRequest?](repeating: nil, count: size)
+        initFreeList()
+    }
 
-    guard let dev = scanPci(vendor: VIRTIO_PCI_VENDOR, device: VIRTIO_PCI_DEVICE_BLOCK) else {
-        kprint("Block NOT FOUND\n")
-        return
+    private func initFreeList() {
+        freeHead = 0
+        freeCount = size
+        for i in 0..<size {
+            desc[i].next = UInt16((i + 1) % size)
+        }
     }
 
-    kprint("Block Found\n")
+    /// Point the device at this queue's rings and enable it, routing its
+    /// completions to MSI-X table entry `index` when `msix` is set.
+    func program(_ common: UnsafeMutablePointer<VirtioPciCommonCfg>, msix: Bool) {
+        common.pointee.queue_select = index
+        common.pointee.queue_desc = UInt64(UInt(bitPattern: desc))
+        common.pointee.queue_driver = UInt64(UInt(bitPattern: avail))
+        common.pointee.queue_device = UInt64(UInt(bitPattern: used))
+        usesInterrupts = false
+        if msix {
+            common.pointee.queue_msix_vector = index
+            usesInterrupts = common.pointee.queue_msix_vector == index
+        }
+        if !usesInterrupts { common.pointee.queue_msix_vector = VIRTIO_MSI_NO_VECTOR }
+        common.pointee.queue_enable = 1
+    }
 
-    // Enable PCI Command register: IO Space (0), Memory Space (1), Bus Master (2)
-    let cmd = pciRead16(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 4)
-    pciWrite16(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 4, value: cmd | 0x7)
+    /// Empty the rings after a device reset and return every request that
+    /// was on them or waiting for descriptors, for the caller to fail.
+    func reset() -> [BlockRequest] {
+        memset(memory, 0, VirtioBlkQueue.memorySize(size: size))
+        initFreeList()
+        lastUsedIdx = 0
+        var lost = pending
+        pending = []
+        for i in 0..<size {
+            if let req = inflight[i] {
+                lost.append(req)
+                inflight[i] = nil
+            }
+        }
+        return lost
+    }
 
-    var config = VirtioConfig()
-    parseVirtioCapabilities(dev: dev, config: &config)
+    /// Bytes of ring memory for a queue of `size` entries.
+    static func memorySize(size: Int) -> Int {
+        return usedOffset(size: size) + ((6 + size * 8 + 4095) & ~4095)
+    }
 
-    if let common = config.common {
-        kprint("Block Init\n")
-        // 1. Reset
-        common.pointee.device_status = 0
-        // 2. Acknowledge
-        common.pointee.device_status |= 1
-        // 3. Driver
-        common.pointee.device_status |= 2
-
-        // 4. Features (negotiate)
-        // For now just accept what the device offers
-        common.pointee.device_status |= 8  // FEATURES_OK
-
-        // 5. Setup Virtqueue
-        common.pointee.queue_select = 0
-        let qSize = Int(common.pointee.queue_size)
-        kprint("  Queue Size: ")
-        kprint_hex(UInt64(qSize))
-        kprint("\n")
+    private static func usedOffset(size: Int) -> Int {
+        return (size * 16 + 6 + size * 2 + 4095) & ~4095
+    }
 
-        // Allocate space for the virtqueue
-        let vq_size = (qSize * 16 + 8 + qSize * 2 + 4095) & ~4095 + (8 + qSize * 8 + 4095) & ~4095
-        let rawPtr = kernelAlloc(size: vq_size, align: 4096)
+    private var descsNeeded: Int { indirect ? 1 : descsPerRequest }
 
-        let descPtr = rawPtr.assumingMemoryBound(to: VirtqDesc.self)
-        let availPtr = rawPtr.advanced(by: qSize * 16).assumingMemoryBound(to: VirtqAvail.self)
-        let usedPtr = rawPtr.advanced(by: (qSize * 16 + 8 + qSize * 2 + 4095) & ~4095)
-            .assumingMemoryBound(to: VirtqUsed.self)
+    var inflightCount: Int { (size - freeCount) / descsNeeded }
 
-        common.pointee.queue_desc = UInt64(UInt(bitPattern: descPtr))
-        common.pointee.queue_driver = UInt64(UInt(bitPattern: availPtr))
-        common.pointee.queue_device = UInt64(UInt(bitPattern: usedPtr))
-        common.pointee.queue_enable = 1
+    func submit(_ req: BlockRequest) {
+        Trace.event(.blockSubmit, req.sector, UInt64(req.count) | (req.isWrite ? 1 << 63 : 0))
+        req.queue = self
+        if freeCount < descsNeeded {
+            pending.append(req)
+            return
+        }
+        let old = avail.pointee.idx
+        enqueue(req)
+        notify(oldIdx: old)
+    }
 
-        // 6. Driver OK
-        common.pointee.device_status |= 128
-        kprint("Block READY\n")
+    /// Reap every finished chain from the used ring, then start any requests
+    /// that were waiting for descriptors.
+    func processCompletions() {
+        let usedRing = UnsafeMutableRawPointer(used).advanced(by: 4)
+            .assumingMemoryBound(to: VirtqUsedElem.self)
+        var finished: [BlockRequest] = []
+        while true {
+            asm_volatile_barrier()
+            if used.pointee.idx == lastUsedIdx {
+                if !eventIdx { break }
+                // Ask for an interrupt on the next completion, then look once
+                // more in case one landed before the device saw the update.
+                usedEvent.pointee = lastUsedIdx
+                asm_memory_fence()
+                if used.pointee.idx == lastUsedIdx { break }
+                continue
+            }
+            let elem = usedRing[Int(lastUsedIdx % UInt16(size))]
+            lastUsedIdx = lastUsedIdx &+ 1
+
+            let head = Int(elem.id)
+            let ok = statuses[head] == 0
+            releaseChain(head: UInt16(head))
+            if let req = inflight[head] {
+                inflight[head] = nil
+                req.succeeded = ok
+                finished.append(req)
+            }
+        }
+
+        if !pending.isEmpty {
+            let old = avail.pointee.idx
+            while !pending.isEmpty && freeCount >= descsNeeded {
+                enqueue(pending.removeFirst())
+            }
+            if avail.pointee.idx != old { notify(oldIdx: old) }
+        }
+
+        for req in finished {
+            Trace.event(.blockComplete, req.sector, req.succeeded ? 1 : 0)
+            req.finish(ok: req.succeeded)
+        }
+    }
 
-        blockDevice = VirtioBlkDevice(
-            config: config,
-            queueSize: qSize,
-            desc: descPtr,
-            avail: availPtr,
-            used: usedPtr
-        )
+    // avail->used_event and used->avail_event, right after each ring
+    private var usedEvent: UnsafeMutablePointer<UInt16> {
+        return UnsafeMutableRawPointer(avail).advanced(by: 4 + size * 2)
+            .assumingMemoryBound(to: UInt16.self)
+    }
+
+    private var availEvent: UnsafeMutablePointer<UInt16> {
+        return UnsafeMutableRawPointer(used).advanced(by: 4 + size * 8)
+            .assumingMemoryBound(to: UInt16.self)
+    }
+
+    private func enqueue(_ req: BlockRequest) {
+        let head = allocDesc()
+        let h = Int(head)
+
+        headers[h].type = req.isWrite ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN
+        headers[h].reserved = 0
+        headers[h].sector = req.sector
+        statuses[h] = 0xFF
+        inflight[h] = req
+
+        if let tables = indirectTables {
+            let chain = tables.advanced(by: h * descsPerRequest)
+            fillChain(chain, slot: h, req: req, links: (1, 2))
+            desc[h].addr = UInt64(UInt(bitPattern: chain))
+            desc[h].len = UInt32(descsPerRequest * 16)
+            desc[h].flags = VIRTQ_DESC_F_INDIRECT
+        } else {
+            let data = allocDesc()
+            let tail = allocDesc()
+            fillChain(desc, slot: h, req: req, links: (data, tail), at: (h, Int(data), Int(tail)))
+        }
+
+        let ring = UnsafeMutableRawPointer(avail).advanced(by: 4)
+            .assumingMemoryBound(to: UInt16.self)
+        ring[Int(avail.pointee.idx % UInt16(size))] = head
+        asm_volatile_barrier()
+        avail.pointee.idx = avail.pointee.idx &+ 1
+    }
+
+    /// Write header, data and status descriptors at positions `at` of
+    /// `table`, linked through `links`.
+    private func fillChain(
+        _ table: UnsafeMutablePointer<VirtqDesc>, slot h: Int, req: BlockRequest,
+        links: (UInt16, UInt16), at: (Int, Int, Int) = (0, 1, 2)
+    ) {
+        table[at.0].addr = UInt64(UInt(bitPattern: headers.advanced(by: h)))
+        table[at.0].len = UInt32(MemoryLayout<VirtioBlkOuthdr>.size)
+        table[at.0].flags = VIRTQ_DESC_F_NEXT
+        table[at.0].next = links.0
+
+        table[at.1].addr = UInt64(UInt(bitPattern: req.buffer))
+        table[at.1].len = UInt32(req.count * 512)
+        table[at.1].flags = VIRTQ_DESC_F_NEXT | (req.isWrite ? 0 : VIRTQ_DESC_F_WRITE)
+        table[at.1].next = links.1
+
+        table[at.2].addr = UInt64(UInt(bitPattern: statuses.advanced(by: h)))
+        table[at.2].len = 1
+        table[at.2].flags = VIRTQ_DESC_F_WRITE
+        table[at.2].next = 0
+    }
+
+    /// Ring the doorbell for entries published since `oldIdx`, unless the
+    /// device has said (via avail_event) it does not need it yet.
+    private func notify(oldIdx: UInt16) {
+        asm_memory_fence()
+        let newIdx = avail.pointee.idx
+        if eventIdx {
+            let event = availEvent.pointee
+            if newIdx &- event &- 1 >= newIdx &- oldIdx {
+                suppressedNotifications += 1
+                return
+            }
+        }
+        notifications += 1
+        doorbell?.pointee = index
+    }
+
+    private func allocDesc() -> UInt16 {
+        let i = freeHead
+        freeHead = desc[Int(i)].next
+        freeCount -= 1
+        return i
+    }
+
+    private func releaseChain(head: UInt16) {
+        var i = head
+        while true {
+            let flags = desc[Int(i)].flags
+            let next = desc[Int(i)].next
+            desc[Int(i)].next = freeHead
+            freeHead = i
+            freeCount += 1
+            // An indirect chain occupies only its ring descriptor.
+            if (flags & VIRTQ_DESC_F_NEXT) == 0 { break }
+            i = next
+        }
     }
 }
 
-func virtioBlockRead(sector: UInt64, count: Int, buffer: UnsafeMutableRawPointer) -> Bool {
-    if count <= 0 { return true }  // Nothing to do
-    guard let dev = blockDevice, let descs = dev.desc, let avail = dev.avail else { return false }
+final class VirtioBlkDevice {
+    let config: VirtioConfig
+    let features: UInt64
+    let queues: [VirtioBlkQueue]
 
-    // Allocate space for request headers at a safe location
-    let hdr = kernelAlloc(size: MemoryLayout<VirtioBlkOuthdr>.size).assumingMemoryBound(
-        to: VirtioBlkOuthdr.self)
-    let status = kernelAlloc(size: 1).assumingMemoryBound(to: UInt8.self)
+    init(config: VirtioConfig, features: UInt64, queues: [VirtioBlkQueue]) {
+        self.config = config
+        self.features = features
+        self.queues = queues
+    }
 
-    hdr.pointee.type = VIRTIO_BLK_T_IN
-    hdr.pointee.reserved = 0
-    hdr.pointee.sector = sector
-    status.pointee = 0xFF
+    /// virtio_blk_config.capacity, in 512-byte sectors.
+    var capacitySectors: UInt64 {
+        return config.device?.load(fromByteOffset: 0, as: UInt64.self) ?? 0
+    }
 
-    descs[0].addr = UInt64(UInt(bitPattern: hdr))
-    descs[0].len = UInt32(MemoryLayout<VirtioBlkOuthdr>.size)
-    descs[0].flags = VIRTQ_DESC_F_NEXT
-    descs[0].next = 1
+    /// The queue owned by the calling CPU.
+    var queueForCurrentCPU: VirtioBlkQueue {
+        return queues[currentCPUIndex() % queues.count]
+    }
 
-    descs[1].addr = UInt64(UInt(bitPattern: buffer))
-    descs[1].len = UInt32(count * 512)
-    descs[1].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE
-    descs[1].next = 2
+    func processCompletions() {
+        for q in queues { q.processCompletions() }
+    }
 
-    descs[2].addr = UInt64(UInt(bitPattern: status))
-    descs[2].len = 1
-    descs[2].flags = VIRTQ_DESC_F_WRITE
-    descs[2].next = 0
+    /// Reset the device and bring it back with the same features and rings.
+    /// Once the reset reads back the device no longer touches any descriptor
+    /// or buffer, so every request still in flight fails.
+    func reset() {
+        guard let common = config.common else { return }
+        kprint("Block: resetting the device\n")
+        let ok = negotiateFeatures(common, wanted: features) == features
+        var lost: [BlockRequest] = []
+        for q in queues {
+            lost += q.reset()
+        }
+        if ok {
+            common.pointee.config_msix_vector = VIRTIO_MSI_NO_VECTOR
+            for q in queues { q.program(common, msix: q.usesInterrupts) }
+            common.pointee.device_status |= VIRTIO_STATUS_DRIVER_OK
+        } else {
+            common.pointee.device_status |= VIRTIO_STATUS_FAILED
+            blockDevice = nil
+        }
+        for req in lost {
+            Trace.event(.blockComplete, req.sector, 0)
+            req.finish(ok: false)
+        }
+    }
+}
 
-    // Update avail ring
-    let availIdx = Int(avail.pointee.idx % UInt16(dev.queueSize))
-    let ringPtr = UnsafeMutablePointer<UInt16>(bitPattern: UInt(bitPattern: avail) + 4)!
-    ringPtr[availIdx] = 0  // Head of descriptor chain
+nonisolated(unsafe) var blockDevice: VirtioBlkDevice?
+/// IDT vector assigned to each queue, in queue order.
+nonisolated(unsafe) private var blockQueueVectors: [Int] = []
+
+private func virtioBlockIRQ(vector: UInt64) {
+    guard let dev = blockDevice else { return }
+    // The holder may be another CPU spinning in BlockRequest.wait(), which
+    // only this interrupt's queue can satisfy; leave the completions to it.
+    if kernel_trylock() == 0 { return }
+    defer { kernel_unlock() }
+    for (i, v) in blockQueueVectors.enumerated() where v == Int(vector) {
+        dev.queues[i].processCompletions()
+    }
+}
+
+func initVirtioBlock() {
+    if Log.debug { kprint("Block Probe\n") }
 
-    // Memory barrier
-    asm_volatile_barrier()
+    guard let dev = scanPci(vendor: VIRTIO_PCI_VENDOR, device: VIRTIO_PCI_DEVICE_BLOCK) else {
+        kprint("Block NOT FOUND\n")
+        return
+    }
 
-    avail.pointee.idx = avail.pointee.idx &+ 1
+    kprint("Block Found\n")
 
-    // Notify
-    if let notify = dev.config.notify, let common = dev.config.common {
-        common.pointee.queue_select = 0
-        let off = UInt(common.pointee.queue_notify_off) * UInt(dev.config.notify_off_multiplier)
-        let notifyPtr = (notify + Int(off)).assumingMemoryBound(to: UInt16.self)
-        notifyPtr.pointee = 0  // Queue index
+    // Enable PCI Command register: IO Space (0), Memory Space (1), Bus Master (2)
+    let cmd = pciRead16(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 4)
+    pciWrite16(bus: dev.0, slot: dev.1, funcNum: dev.2, offset: 4, value: cmd | 0x7)
+
+    var config = VirtioConfig()
+    parseVirtioCapabilities(dev: dev, config: &config)
+    guard let common = config.common else { return }
+
+    if Log.debug { kprint("Block Init\n") }
+    let msix = enableMsix(dev: dev)
+
+    // 1-4. Reset, acknowledge, negotiate
+    guard
+        let features = negotiateFeatures(
+            common, wanted: VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX | VIRTIO_BLK_F_MQ)
+    else {
+        common.pointee.device_status |= VIRTIO_STATUS_FAILED
+        return
+    }
+    let indirect = (features & VIRTIO_RING_F_INDIRECT_DESC) != 0
+    let eventIdx = (features & VIRTIO_RING_F_EVENT_IDX) != 0
+    if Log.debug {
+        kprint("  Features: ")
+        kprint_hex(features)
+        kprint("\n")
     }
 
-    // Wait for completion (poll used ring)
-    var timeout = 10_000_000
-    while dev.used!.pointee.idx == blockDevice!.lastUsedIdx && timeout > 0 {
-        asm_pause()
-        timeout -= 1
+    var queueCount = 1
+    if (features & VIRTIO_BLK_F_MQ) != 0, let devCfg = config.device {
+        let offered = Int(devCfg.load(fromByteOffset: blkConfigNumQueues, as: UInt16.self))
+        queueCount = max(1, min(offered, onlineCPUCount(), Int(common.pointee.num_queues)))
     }
 
-    if timeout == 0 {
-        kprint("Block Read TIMEOUT\n")
-        return false
+    common.pointee.config_msix_vector = VIRTIO_MSI_NO_VECTOR
+
+    // 5. Set up one virtqueue per CPU
+    var queues: [VirtioBlkQueue] = []
+    var vectors: [Int] = []
+    for qi in 0..<queueCount {
+        common.pointee.queue_select = UInt16(qi)
+        let qSize = Int(common.pointee.queue_size)
+        if Log.debug {
+            kprint("  Queue ")
+            kprint_hex(UInt64(qi))
+            kprint(" Size: ")
+            kprint_hex(UInt64(qSize))
+            kprint("\n")
+        }
+
+        let bytes = VirtioBlkQueue.memorySize(size: qSize)
+        let rawPtr = kernelAlloc(size: bytes, align: 4096)
+        memset(rawPtr, 0, bytes)
+
+        var doorbell: UnsafeMutablePointer<UInt16>?
+        if let notify = config.notify {
+            let off = UInt(common.pointee.queue_notify_off) * UInt(config.notify_off_multiplier)
+            doorbell = (notify + Int(off)).assumingMemoryBound(to: UInt16.self)
+        }
+        let q = VirtioBlkQueue(
+            index: UInt16(qi), size: qSize, memory: rawPtr, doorbell: doorbell,
+            indirect: indirect, eventIdx: eventIdx)
+
+        // Route this queue's completions to a vector of its own
+        var vector = -1
+        if let table = msix, qi < table.count {
+            vector = Int(irq_alloc_vector { virtioBlockIRQ(vector: $0) })
+            if vector >= 0 { msixRoute(table, index: qi, vector: vector) }
+        }
+        q.program(common, msix: vector >= 0)
+
+        queues.append(q)
+        vectors.append(q.usesInterrupts ? vector : -1)
     }
 
-    blockDevice?.lastUsedIdx = dev.used!.pointee.idx
+    // 6. Driver OK
+    common.pointee.device_status |= VIRTIO_STATUS_DRIVER_OK
+    kprint(queues[0].usesInterrupts ? "Block READY (MSI-X)\n" : "Block READY (polled)\n")
+
+    blockQueueVectors = vectors
+    blockDevice = VirtioBlkDevice(config: config, features: features, queues: queues)
+}
+
+/// Queue a request on the calling CPU's queue and return its completion
+/// token, or nil without a device.
+@discardableResult
+func virtioBlockSubmit(
+    sector: UInt64, count: Int, buffer: UnsafeMutableRawPointer, write: Bool = false,
+    completion: ((BlockRequest) -> Void)? = nil
+) -> BlockRequest? {
+    guard let dev = blockDevice, count > 0 else { return nil }
+    let req = BlockRequest(sector: sector, count: count, buffer: buffer, isWrite: write)
+    req.onComplete = completion
+    dev.queueForCurrentCPU.submit(req)
+    return req
+}
 
-    return status.pointee == 0
+func virtioBlockRead(sector: UInt64, count: Int, buffer: UnsafeMutableRawPointer) -> Bool {
+    if count <= 0 { return true }  // Nothing to do
+    guard let req = virtioBlockSubmit(sector: sector, count: count, buffer: buffer) else {
+        return false
+    }
+    return req.wait()
 }
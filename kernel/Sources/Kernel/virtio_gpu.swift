@@ -5,7 +5,7 @@ import CSupport
 let VIRTIO_PCI_DEVICE_GPU: UInt16 = 0x1050
 
 func initVirtioGpu() {
-    kprint("GPU Probe\n")
+    if Log.debug { kprint("GPU Probe\n") }
 
     guard let dev = scanPci(vendor: VIRTIO_PCI_VENDOR, device: VIRTIO_PCI_DEVICE_GPU) else {
         kprint("GPU NOT FOUND\n")
@@ -22,19 +22,15 @@ func initVirtioGpu() {
     parseVirtioCapabilities(dev: dev, config: &config)
 
     if let common = config.common {
-        kprint("GPU Init\n")
-        // 1. Reset
-        common.pointee.device_status = 0
-        // 2. Acknowledge
-        common.pointee.device_status |= 1
-        // 3. Driver
-        common.pointee.device_status |= 2
-
-        // 4. Features (skip for now)
-        common.pointee.device_status |= 8  // FEATURES_OK
+        if Log.debug { kprint("GPU Init\n") }
+        // 1-4. Reset, acknowledge, negotiate (no optional features yet)
+        guard negotiateFeatures(common, wanted: 0) != nil else {
+            common.pointee.device_status |= VIRTIO_STATUS_FAILED
+            return
+        }
 
         // 5. Driver OK
-        common.pointee.device_status |= 128
+        common.pointee.device_status |= VIRTIO_STATUS_DRIVER_OK
         kprint("GPU READY\n")
     }
 }
@@ -0,0 +1 @@
+../../Sources/Kernel/CPIO.swift
\ No newline at end of file
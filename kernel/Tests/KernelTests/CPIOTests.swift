@@ -0,0 +1,65 @@
+import Foundation
+import Testing
+
+// CPIO.swift and CPIOWriter.swift are symlinks to the kernel's index and the
+// build plugin's writer, compiled here for the host. The kernel's hash lives
+// in VFS.swift, which does not build outside the kernel.
+func vfsNameHash(_ bytes: UnsafeRawBufferPointer) -> UInt32 {
+    var h: UInt32 = 0x811C_9DC5
+    for b in bytes {
+        h = (h ^ UInt32(b)) &* 0x0100_0193
+    }
+    return h
+}
+
+@Suite("CPIO")
+struct CPIOTests {
+    /// A ramdisk tree written by writeCPIO, as the build-image verb does.
+    func archive(alignment: Int) throws -> Data {
+        let fm = FileManager.default
+        let name = "cpio-\(UUID().uuidString)"
+        let root = fm.temporaryDirectory.appendingPathComponent(name)
+        let out = fm.temporaryDirectory.appendingPathComponent("\(name).cpio")
+        defer {
+            try? fm.removeItem(at: root)
+            try? fm.removeItem(at: out)
+        }
+        try fm.createDirectory(
+            at: root.appendingPathComponent("usr/lib"), withIntermediateDirectories: true)
+        try Data("hello".utf8).write(to: root.appendingPathComponent("init"))
+        try Data(repeating: 0xAB, count: 5000).write(to: root.appendingPathComponent("usr/lib/dyld"))
+        try Data().write(to: root.appendingPathComponent("empty"))
+        try writeCPIO(root: root, to: out, dataAlignment: alignment)
+        return try Data(contentsOf: out)
+    }
+
+    func find(_ index: CPIOIndex, _ path: String) -> CPIOEntry? {
+        var bytes = Array(path.utf8)
+        return bytes.withUnsafeMutableBytes { index.find(UnsafeRawBufferPointer($0)) }
+    }
+
+    @Test(arguments: [4, 4096])
+    func writerRoundTrip(alignment: Int) throws {
+        let data = try archive(alignment: alignment)
+        try data.withUnsafeBytes { raw in
+            let index = CPIOIndex(start: raw.baseAddress!, size: raw.count)
+            let names = index.entries.map {
+                String(decoding: index.name(of: $0), as: UTF8.self)
+            }
+            #expect(names.sorted() == ["empty", "init", "usr", "usr/lib", "usr/lib/dyld"])
+
+            let initFile = try #require(find(index, "init"))
+            #expect(initFile.isFile && initFile.size == 5)
+            #expect(initFile.dataOffset % alignment == 0)
+            #expect(memcmp(index.data(of: initFile), "hello", 5) == 0)
+
+            let dyld = try #require(find(index, "usr/lib/dyld"))
+            #expect(dyld.size == 5000 && dyld.dataOffset % alignment == 0)
+            #expect(index.data(of: dyld).load(fromByteOffset: 4999, as: UInt8.self) == 0xAB)
+
+            #expect(try #require(find(index, "usr/lib")).isDirectory)
+            #expect(try #require(find(index, "empty")).size == 0)
+            #expect(find(index, "missing") == nil)
+        }
+    }
+}
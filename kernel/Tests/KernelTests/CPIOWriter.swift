@@ -0,0 +1 @@
+../../Plugins/BuildImagePlugin/CPIOWriter.swift
\ No newline at end of file
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Convert a kernel trace dump to Chrome trace JSON (for Perfetto or
+chrome://tracing).
+
+The input is either a serial log holding a hex dump between the SWTRACE
+marker lines, or the disk image whose trace area the kernel wrote:
+
+    trace2chrome.py serial.log > trace.json
+    trace2chrome.py .build/x86_64-unknown-none-elf/debug/disk.img > trace.json
+
+Layouts are struct trace_header and struct trace_record in CSupport.h.
+"""
+
+import json
+import struct
+import sys
+
+MAGIC = b"SWTRACE1"
+HEADER = struct.Struct("<8sIIQQ")
+RECORD = struct.Struct("<QHHIQQ")
+AREA_BYTES = 16 << 20
+
+# Pairs become duration slices; everything else is an instant event.
+BEGIN = {1: "syscall", 3: "page fault"}
+END = {2: "syscall", 4: "page fault"}
+INSTANT = {
+    5: "block submit",
+    6: "block complete",
+    7: "mach_msg send",
+    8: "mach_msg receive",
+    9: "frame alloc",
+    10: "frame free",
+    11: "switch",
+}
+ARGS = {
+    1: ("number", "arg1"),
+    2: ("number", "result"),
+    3: ("address", "error"),
+    4: ("address", "handled"),
+    5: ("sector", "count"),
+    6: ("sector", "ok"),
+    7: ("msgh_id", "size"),
+    8: ("msgh_id", "size"),
+    9: ("phys", "frames"),
+    10: ("phys", "frames"),
+    11: ("from", "to"),
+}
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if b"=== SWTRACE BEGIN ===" in data:
+        text = data.decode("ascii", "replace")
+        body = text.split("=== SWTRACE BEGIN ===", 1)[1].split("=== SWTRACE END ===", 1)[0]
+        return bytes.fromhex("".join(body.split()))
+    area = data[(len(data) // 512) * 512 - AREA_BYTES:]
+    if area.startswith(MAGIC):
+        return area
+    sys.exit(f"{path}: no trace found")
+
+
+def convert(blob):
+    magic, record_size, _ncpu, tsc_hz, count = HEADER.unpack_from(blob)
+    if magic != MAGIC or record_size != RECORD.size:
+        sys.exit("unrecognized trace header")
+    records = [RECORD.unpack_from(blob, HEADER.size + i * RECORD.size) for i in range(count)]
+    records.sort(key=lambda r: r[0])
+    t0 = records[0][0] if records else 0
+    # Threads keep their syscalls and faults paired as they move between
+    # CPUs, so the thread is the track and the CPU an argument.
+    events = [{"ph": "M", "pid": 0, "name": "process_name", "args": {"name": "kernel"}}]
+    for tsc, event, cpu, tid, arg0, arg1 in records:
+        e = {"pid": 0, "tid": tid, "ts": (tsc - t0) * 1e6 / tsc_hz}
+        names = ARGS.get(event, ("arg0", "arg1"))
+        e["args"] = {"cpu": cpu, names[0]: hex(arg0), names[1]: hex(arg1)}
+        if event in BEGIN:
+            e.update(ph="B", name=BEGIN[event])
+        elif event in END:
+            e.update(ph="E", name=END[event])
+        else:
+            e.update(ph="i", s="t", name=INSTANT.get(event, f"event {event}"))
+        events.append(e)
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    json.dump(convert(load(sys.argv[1])), sys.stdout)
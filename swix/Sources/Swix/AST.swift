@@ -34,6 +34,7 @@ public indirect enum Expr: Sendable {
     case string(StringExpr, Span)
     case path(String, Span)
     case ident(String, Span)
+    case local(VarSlot, Span)  // resolved variable (see Resolver)
 
     case list([Expr], Span)
     case attrSet(AttrSet, Span)
@@ -53,6 +54,20 @@ public indirect enum Expr: Sendable {
     case binary(BinaryOp, Expr, Expr, Span)
 }
 
+/// A variable the resolver bound lexically: slot `index` of the frame
+/// `depth` levels up the environment chain from the reference.
+public struct VarSlot: Sendable, Hashable {
+    public var depth: Int
+    public var index: Int
+    public var name: String
+
+    public init(depth: Int, index: Int, name: String) {
+        self.depth = depth
+        self.index = index
+        self.name = name
+    }
+}
+
 /// String expression with interpolation segments
 public struct StringExpr: Sendable {
     public enum Segment: Sendable {
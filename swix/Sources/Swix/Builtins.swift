@@ -44,8 +44,8 @@ public struct Builtins: Sendable {
         set(b, "attrValues") { v in
             guard case .attrSet(let s) = v else { throw EvalError(message: "builtins.attrValues: expected set") }
             var results: [Value] = []
-            for key in s.keys.sorted() {
-                results.append(try await s.force(key, evaluator: evaluator))
+            for symbol in s.symbols.sorted(by: { $0.name < $1.name }) {
+                results.append(try await s.force(symbol, evaluator: evaluator))
             }
             return .list(results)
         }
@@ -67,13 +67,13 @@ public struct Builtins: Sendable {
             guard case .attrSet(let s) = v else { throw EvalError(message: "builtins.removeAttrs: expected set") }
             return .builtin("removeAttrs") { v2 in
                 guard case .list(let names) = v2 else { throw EvalError(message: "builtins.removeAttrs: expected list") }
-                let toRemove = Set(try names.map { v -> String in
+                let toRemove = Set(try names.map { v -> Symbol in
                     guard case .string(let n) = v else { throw EvalError(message: "builtins.removeAttrs: list must contain strings") }
-                    return n
+                    return Symbol(n)
                 })
                 let result = AttrSetVal()
-                for key in s.keys where !toRemove.contains(key) {
-                    result.set(key, value: try await s.force(key, evaluator: evaluator))
+                for symbol in s.symbols where !toRemove.contains(symbol) {
+                    result.set(symbol, value: try await s.force(symbol, evaluator: evaluator))
                 }
                 return .attrSet(result)
             }
@@ -83,8 +83,8 @@ public struct Builtins: Sendable {
             return .builtin("intersectAttrs") { v2 in
                 guard case .attrSet(let s2) = v2 else { throw EvalError(message: "builtins.intersectAttrs: expected set") }
                 let result = AttrSetVal()
-                for key in s1.keys {
-                    if s2.has(key) { result.set(key, value: try await s2.force(key, evaluator: evaluator)) }
+                for symbol in s1.symbols where s2.has(symbol) {
+                    result.set(symbol, value: try await s2.force(symbol, evaluator: evaluator))
                 }
                 return .attrSet(result)
             }
@@ -106,11 +106,11 @@ public struct Builtins: Sendable {
             return .builtin("mapAttrs") { v2 in
                 guard case .attrSet(let s) = v2 else { throw EvalError(message: "builtins.mapAttrs: expected set") }
                 let result = AttrSetVal()
-                for key in s.keys {
-                    let val = try await s.force(key, evaluator: evaluator)
-                    let mapped = try await Builtins.applyFn(fn, arg: .string(key), evaluator: evaluator)
+                for symbol in s.symbols {
+                    let val = try await s.force(symbol, evaluator: evaluator)
+                    let mapped = try await Builtins.applyFn(fn, arg: .string(symbol.name), evaluator: evaluator)
                     let mapped2 = try await Builtins.applyFn(mapped, arg: val, evaluator: evaluator)
-                    result.set(key, value: mapped2)
+                    result.set(symbol, value: mapped2)
                 }
                 return .attrSet(result)
             }
@@ -359,10 +359,12 @@ public struct Builtins: Sendable {
         // --- I/O ---
         set(b, "readFile") { v in
             let path = try Builtins.extractPath(v)
+            evaluator.reads?.record(.contents, path)
             return .string(try String(contentsOfFile: path, encoding: .utf8))
         }
         set(b, "readDir") { v in
             let path = try Builtins.extractPath(v)
+            evaluator.reads?.record(.listing, path)
             let fm = FileManager.default
             let entries = try fm.contentsOfDirectory(atPath: path)
             let result = AttrSetVal()
@@ -376,6 +378,7 @@ public struct Builtins: Sendable {
         }
         set(b, "pathExists") { v in
             let path = try Builtins.extractPath(v)
+            evaluator.reads?.record(.exists, path)
             return .bool(FileManager.default.fileExists(atPath: path))
         }
         set(b, "import") { v in
@@ -487,12 +490,12 @@ public struct Builtins: Sendable {
             guard case .attrSet(let s) = v else { throw EvalError(message: "removeAttrs: expected set") }
             return .builtin("removeAttrs") { v2 in
                 guard case .list(let names) = v2 else { throw EvalError(message: "removeAttrs: expected list") }
-                let toRemove = Set(names.compactMap { v -> String? in
-                    if case .string(let n) = v { return n }; return nil
+                let toRemove = Set(names.compactMap { v -> Symbol? in
+                    if case .string(let n) = v { return Symbol(n) }; return nil
                 })
                 let result = AttrSetVal()
-                for key in s.keys where !toRemove.contains(key) {
-                    result.set(key, value: try await s.force(key, evaluator: evaluator))
+                for symbol in s.symbols where !toRemove.contains(symbol) {
+                    result.set(symbol, value: try await s.force(symbol, evaluator: evaluator))
                 }
                 return .attrSet(result)
             }
@@ -0,0 +1,280 @@
+// EvalCache.swift - Persistent Parse and Flake Evaluation Cache
+//
+// Two caches under one directory ($SWIX_CACHE_DIR, else
+// $XDG_CACHE_HOME/swix, else ~/.cache/swix):
+//
+//     ast/<sha256 of source>      ExprCodec tree, memory-mapped on load
+//     flake/<fingerprint>.json    flake output values and `flake show` trees
+//
+// A flake's fingerprint hashes its directory, flake.nix and flake.lock (so
+// every locked input's hash); an edit or relock selects a new file, and
+// stale files are simply never read again. Everything else the evaluation
+// touched - files read or imported from anywhere, directories listed, paths
+// tested - is recorded with each entry as FileReads and checked when the
+// entry is loaded, so an entry is only used while the disk still looks the
+// way it did when the entry was computed.
+
+import Foundation
+
+/// A Value forced all the way down, as the flake cache stores it.
+public indirect enum CachedValue: Codable, Sendable {
+    case int(Int64)
+    case float(Double)
+    case bool(Bool)
+    case null
+    case string(String)
+    case path(String)
+    case list([CachedValue])
+    case attrs([String: CachedValue])
+
+    /// Largest value captured; anything bigger is not cached. Outputs that
+    /// reach themselves through `self` would otherwise never finish.
+    static let maxDepth = 64
+    static let maxNodes = 100_000
+
+    /// Force `value` completely. Nil if any part fails to evaluate, is a
+    /// function (a stand-in could be printed but not called, so a hit would
+    /// turn a working application into an error), or the value is bigger
+    /// than the limits above.
+    static func capture(_ value: Value, evaluator: Evaluator) async -> CachedValue? {
+        var budget = maxNodes
+        return await capture(value, evaluator: evaluator, depth: 0, budget: &budget)
+    }
+
+    private static func capture(
+        _ value: Value, evaluator: Evaluator, depth: Int, budget: inout Int
+    ) async -> CachedValue? {
+        budget -= 1
+        if depth > maxDepth || budget < 0 { return nil }
+        switch value {
+        case .int(let n): return .int(n)
+        case .float(let f): return .float(f)
+        case .bool(let b): return .bool(b)
+        case .null: return .null
+        case .string(let s): return .string(s)
+        case .path(let p): return .path(p)
+        case .list(let elems):
+            var out: [CachedValue] = []
+            out.reserveCapacity(elems.count)
+            for e in elems {
+                guard let c = await capture(e, evaluator: evaluator, depth: depth + 1, budget: &budget)
+                else { return nil }
+                out.append(c)
+            }
+            return .list(out)
+        case .attrSet(let s):
+            var out: [String: CachedValue] = [:]
+            for symbol in s.symbols {
+                guard let v = try? await s.force(symbol, evaluator: evaluator),
+                      let c = await capture(v, evaluator: evaluator, depth: depth + 1, budget: &budget)
+                else { return nil }
+                out[symbol.name] = c
+            }
+            return .attrs(out)
+        case .closure, .builtin: return nil
+        }
+    }
+
+    /// The value back.
+    public var value: Value {
+        switch self {
+        case .int(let n): return .int(n)
+        case .float(let f): return .float(f)
+        case .bool(let b): return .bool(b)
+        case .null: return .null
+        case .string(let s): return .string(s)
+        case .path(let p): return .path(p)
+        case .list(let elems): return .list(elems.map(\.value))
+        case .attrs(let fields): return .attrSet(AttrSetVal(values: fields.mapValues(\.value)))
+        }
+    }
+}
+
+/// One thing an evaluation looked at on disk, and what it saw.
+public struct FileRead: Codable, Hashable, Sendable {
+    public enum Kind: String, Codable, Sendable {
+        case contents  // readFile, import, evaluated files
+        case listing  // readDir
+        case exists  // pathExists
+    }
+
+    public var kind: Kind
+    public var path: String
+    public var digest: String
+
+    /// What `kind` sees at `path` now.
+    static func observe(_ kind: Kind, _ path: String) -> String {
+        let fm = FileManager.default
+        switch kind {
+        case .contents:
+            guard let data = fm.contents(atPath: path) else { return "absent" }
+            return SHA256.hex(Array(data))
+        case .listing:
+            guard let names = try? fm.contentsOfDirectory(atPath: path) else { return "absent" }
+            var hasher = SHA256()
+            for name in names.sorted() {
+                var isDir: ObjCBool = false
+                fm.fileExists(atPath: (path as NSString).appendingPathComponent(name), isDirectory: &isDir)
+                hasher.update("\(name)\0\(isDir.boolValue ? "directory" : "regular")\0")
+            }
+            return SHA256.hexString(hasher.finalize())
+        case .exists:
+            return fm.fileExists(atPath: path) ? "yes" : "no"
+        }
+    }
+
+    var isCurrent: Bool { Self.observe(kind, path) == digest }
+}
+
+/// The FileReads of every evaluation run by one Evaluator.
+public final class FileReads: @unchecked Sendable {
+    private var reads: [String: FileRead] = [:]
+    private let lock = NSLock()
+
+    public init() {}
+
+    /// Note that `path` is about to be read. Observing it before the read
+    /// means a change in between leaves a digest that no longer matches.
+    func record(_ kind: FileRead.Kind, _ path: String) {
+        let path = URL(fileURLWithPath: path).standardizedFileURL.path
+        let key = "\(kind.rawValue)\0\(path)"
+        lock.lock()
+        let seen = reads[key] != nil
+        lock.unlock()
+        if seen { return }
+        let read = FileRead(kind: kind, path: path, digest: FileRead.observe(kind, path))
+        lock.lock()
+        defer { lock.unlock() }
+        if reads[key] == nil { reads[key] = read }
+    }
+
+    public var all: [FileRead] {
+        lock.lock()
+        defer { lock.unlock() }
+        return reads.keys.sorted().map { reads[$0]! }
+    }
+}
+
+/// On-disk cache shared by CLI runs.
+public final class EvalCache: Sendable {
+    public let directory: URL
+
+    public init(directory: URL) {
+        self.directory = directory
+    }
+
+    /// The cache directory from the environment, as described above.
+    public static func standard() -> EvalCache {
+        let env = ProcessInfo.processInfo.environment
+        let dir: URL
+        if let custom = env["SWIX_CACHE_DIR"], !custom.isEmpty {
+            dir = URL(fileURLWithPath: custom)
+        } else if let xdg = env["XDG_CACHE_HOME"], !xdg.isEmpty {
+            dir = URL(fileURLWithPath: xdg).appendingPathComponent("swix")
+        } else {
+            dir = FileManager.default.homeDirectoryForCurrentUser
+                .appendingPathComponent(".cache/swix")
+        }
+        return EvalCache(directory: dir)
+    }
+
+    // MARK: - Parsed expressions
+
+    private func astURL(for source: String) -> URL {
+        directory.appendingPathComponent("ast").appendingPathComponent(SHA256.hex(Array(source.utf8)))
+    }
+
+    /// The parsed tree for `source`, if an earlier run stored one.
+    public func expr(for source: String) -> Expr? {
+        guard let data = try? Data(contentsOf: astURL(for: source), options: .alwaysMapped) else {
+            return nil
+        }
+        return try? ExprCodec.decode(data)
+    }
+
+    public func store(_ expr: Expr, for source: String) {
+        write(Data(ExprCodec.encode(expr)), to: astURL(for: source))
+    }
+
+    // MARK: - Flake outputs
+
+    /// A cached result and the reads it has to see again to be used.
+    private struct Recorded<Result: Codable>: Codable {
+        var result: Result
+        var reads: [FileRead]
+
+        var current: Result? { reads.allSatisfy(\.isCurrent) ? result : nil }
+    }
+
+    private struct FlakeEntries: Codable {
+        var values: [String: Recorded<CachedValue>] = [:]
+        var show: Recorded<[FlakeEvaluator.ShowNode]>?
+    }
+
+    /// Fingerprint of the flake itself: its directory, flake.nix and
+    /// flake.lock. Nil when there is no flake.nix.
+    public func fingerprint(flakeAt directory: String) -> String? {
+        let fm = FileManager.default
+        let dir = URL(fileURLWithPath: directory).standardizedFileURL.path
+        guard let flake = fm.contents(atPath: (dir as NSString).appendingPathComponent("flake.nix"))
+        else { return nil }
+        let lock = fm.contents(atPath: (dir as NSString).appendingPathComponent("flake.lock")) ?? Data()
+
+        var hasher = SHA256()
+        hasher.update("swix-flake-cache-\(ExprCodec.version)\0\(dir)\0")
+        for data in [flake, lock] {
+            hasher.update("\(data.count)\0")
+            hasher.update(Array(data))
+        }
+        return SHA256.hexString(hasher.finalize())
+    }
+
+    private func flakeURL(_ fingerprint: String) -> URL {
+        directory.appendingPathComponent("flake").appendingPathComponent("\(fingerprint).json")
+    }
+
+    private func entries(_ fingerprint: String) -> FlakeEntries {
+        guard let data = try? Data(contentsOf: flakeURL(fingerprint)),
+              let entries = try? JSONDecoder().decode(FlakeEntries.self, from: data)
+        else { return FlakeEntries() }
+        return entries
+    }
+
+    private func update(_ fingerprint: String, _ change: (inout FlakeEntries) -> Void) {
+        var e = entries(fingerprint)
+        change(&e)
+        if let data = try? JSONEncoder().encode(e) {
+            write(data, to: flakeURL(fingerprint))
+        }
+    }
+
+    private static func key(_ path: [String]) -> String {
+        path.joined(separator: "\u{1F}")
+    }
+
+    /// The value stored for `path`, unless something it read has changed.
+    public func value(fingerprint: String, path: [String]) -> CachedValue? {
+        entries(fingerprint).values[Self.key(path)]?.current
+    }
+
+    public func store(_ value: CachedValue, fingerprint: String, path: [String], reads: [FileRead]) {
+        update(fingerprint) { $0.values[Self.key(path)] = Recorded(result: value, reads: reads) }
+    }
+
+    func show(fingerprint: String) -> [FlakeEvaluator.ShowNode]? {
+        entries(fingerprint).show?.current
+    }
+
+    func store(show: [FlakeEvaluator.ShowNode], fingerprint: String, reads: [FileRead]) {
+        update(fingerprint) { $0.show = Recorded(result: show, reads: reads) }
+    }
+
+    // MARK: - Files
+
+    /// Best effort: a cache that cannot be written is just a slower run.
+    private func write(_ data: Data, to url: URL) {
+        try? FileManager.default.createDirectory(
+            at: url.deletingLastPathComponent(), withIntermediateDirectories: true)
+        try? data.write(to: url, options: .atomic)
+    }
+}
@@ -1,5 +1,6 @@
 // Evaluator.swift - Nix Expression Evaluator
 import Foundation
+import Synchronization
 
 // MARK: - Runtime Values
 
@@ -50,164 +51,397 @@ public final class ClosureVal: @unchecked Sendable {
     }
 }
 
+// MARK: - Thunk
+
+/// A suspended expression, evaluated at most once however many tasks force
+/// it. The state moves pending -> evaluating -> done by compare-and-swap; a
+/// task that finds it evaluating suspends until the evaluator publishes the
+/// value, unless it is itself the one evaluating it, which is an infinite
+/// recursion. Once done, forcing is a single atomic load.
+///
+/// A cycle can also run through several tasks, each evaluating one thunk
+/// of it and waiting for the next; WaitGraph catches that before the last
+/// task would suspend.
+public final class Thunk: @unchecked Sendable {
+    private static let pending: UInt8 = 0
+    private static let evaluating: UInt8 = 1
+    private static let done: UInt8 = 2
+
+    private let state: Atomic<UInt8>
+    // Written only by the task that moved state to evaluating, and read by
+    // others only after they see done.
+    private var expr: Expr?
+    private var env: Env?
+    private var value: Value?
+
+    private var waiters: [CheckedContinuation<Void, Never>] = []
+    private let waitersLock = NSLock()
+
+    /// The thunks the current task is evaluating, innermost first; a child
+    /// task inherits its parent's.
+    @TaskLocal private static var forcing: ForceChain?
+
+    fileprivate final class ForceChain: Sendable {
+        let thunk: Thunk
+        let next: ForceChain?
+
+        init(_ thunk: Thunk, next: ForceChain?) {
+            self.thunk = thunk
+            self.next = next
+        }
+
+        func contains(_ t: Thunk) -> Bool {
+            var link: ForceChain? = self
+            while let l = link {
+                if l.thunk === t { return true }
+                link = l.next
+            }
+            return false
+        }
+    }
+
+    public init(_ expr: Expr, env: Env) {
+        self.state = Atomic(Thunk.pending)
+        self.expr = expr
+        self.env = env
+    }
+
+    public func force(_ name: String, evaluator: Evaluator) async throws -> Value {
+        while true {
+            if state.load(ordering: .acquiring) == Thunk.done { return value! }
+
+            if state.compareExchange(
+                expected: Thunk.pending, desired: Thunk.evaluating, ordering: .acquiring
+            ).exchanged {
+                return try await evaluate(evaluator)
+            }
+
+            if state.load(ordering: .acquiring) == Thunk.evaluating {
+                let chain = Thunk.forcing
+                if chain?.contains(self) == true {
+                    throw EvalError(message: "infinite recursion detected evaluating '\(name)'")
+                }
+                // A task evaluating nothing cannot be part of a cycle.
+                let ticket = try chain.map { try WaitGraph.shared.enter($0, waitingOn: self, name: name) }
+                await wait()
+                if let ticket = ticket { WaitGraph.shared.leave(ticket) }
+            }
+        }
+    }
+
+    private func evaluate(_ evaluator: Evaluator) async throws -> Value {
+        do {
+            let val = try await Thunk.$forcing.withValue(ForceChain(self, next: Thunk.forcing)) {
+                try await evaluator.evaluate(expr!, env: env!)
+            }
+            value = val
+            // Drop the environment so frames do not stay alive through their
+            // own thunks.
+            expr = nil
+            env = nil
+            publish(Thunk.done)
+            return val
+        } catch {
+            // Nix usually caches the failure. For now, let the next force
+            // (or a waiter) try again and see the error itself.
+            publish(Thunk.pending)
+            throw error
+        }
+    }
+
+    private func publish(_ newState: UInt8) {
+        waitersLock.lock()
+        state.store(newState, ordering: .releasing)
+        let woken = waiters
+        waiters = []
+        waitersLock.unlock()
+        for w in woken { w.resume() }
+    }
+
+    fileprivate var isDone: Bool {
+        state.load(ordering: .acquiring) == Thunk.done
+    }
+
+    private func wait() async {
+        await withCheckedContinuation { (c: CheckedContinuation<Void, Never>) in
+            waitersLock.lock()
+            if state.load(ordering: .acquiring) == Thunk.evaluating {
+                waiters.append(c)
+                waitersLock.unlock()
+            } else {
+                waitersLock.unlock()
+                c.resume()
+            }
+        }
+    }
+}
+
+/// Which evaluating tasks are waiting on which thunks.
+private final class WaitGraph: @unchecked Sendable {
+    static let shared = WaitGraph()
+
+    private struct Waiting {
+        let chain: Thunk.ForceChain
+        let on: Thunk
+    }
+
+    private var waiting: [Int: Waiting] = [:]
+    private var nextTicket = 0
+    private let lock = NSLock()
+
+    /// Record that the task forcing `chain` is about to wait for `thunk`, or
+    /// throw if `thunk` can only finish after something in `chain` does.
+    func enter(_ chain: Thunk.ForceChain, waitingOn thunk: Thunk, name: String) throws -> Int {
+        lock.lock()
+        defer { lock.unlock() }
+
+        // Thunks that must finish before `thunk` can: those that tasks inside
+        // its evaluation are waiting for, and so on.
+        var needed = [thunk]
+        var followed = Set<Int>()
+        var i = 0
+        while i < needed.count {
+            let t = needed[i]
+            i += 1
+            if chain.contains(t) {
+                throw EvalError(message: "infinite recursion detected evaluating '\(name)'")
+            }
+            for (ticket, w) in waiting where !followed.contains(ticket) && w.chain.contains(t) {
+                followed.insert(ticket)
+                if !w.on.isDone { needed.append(w.on) }
+            }
+        }
+
+        let ticket = nextTicket
+        nextTicket += 1
+        waiting[ticket] = Waiting(chain: chain, on: thunk)
+        return ticket
+    }
+
+    func leave(_ ticket: Int) {
+        lock.lock()
+        waiting[ticket] = nil
+        lock.unlock()
+    }
+}
+
 // MARK: - Lazy Attribute Set
 
 /// A lazy attribute set. Fields are stored as thunks that are forced on first access.
+///
+/// Fields are kept in an array sorted by Symbol, so a lookup is a binary
+/// search over integer ids. `//` does not copy either side: the result
+/// layers its operands, and only a chain longer than `maxLayers` is
+/// flattened into a set of its own. Fields are only added while a set is
+/// being built, before any other task can see it, so reads take no lock.
 public final class AttrSetVal: @unchecked Sendable {
-    enum Thunk: Sendable {
-        case unevaluated(Expr, Env)
-        case evaluated(Value)
-        case evaluating // cycle detection
+    enum Entry {
+        case value(Value)
+        case thunk(Thunk)
     }
 
-    private var fields: [String: Thunk]
-    private let fieldsLock = NSRecursiveLock()
+    struct Field {
+        let symbol: Symbol
+        var entry: Entry
+    }
+
+    /// This set's own fields, sorted by symbol.
+    private var fields: [Field]
+    /// Sets under this one, highest priority first. Only their own fields
+    /// count; their layers are already flattened into this list.
+    private let layers: [AttrSetVal]
+
+    /// Longest `//` chain update(with:) keeps layered.
+    static let maxLayers = 8
 
     public init() {
-        self.fields = [:]
+        self.fields = []
+        self.layers = []
     }
 
     public init(values: [String: Value]) {
-        self.fields = values.mapValues { .evaluated($0) }
+        self.fields = values.map { Field(symbol: Symbol($0.key), entry: .value($0.value)) }
+            .sorted { $0.symbol < $1.symbol }
+        self.layers = []
     }
 
-    private func withLock<T>(_ body: () -> T) -> T {
-        fieldsLock.lock()
-        defer { fieldsLock.unlock() }
-        return body()
+    private init(fields: [Field], layers: [AttrSetVal]) {
+        self.fields = fields
+        self.layers = layers
+    }
+
+    /// Index of `symbol` in `fields`, or where it would be inserted.
+    private func search(_ symbol: Symbol) -> (index: Int, found: Bool) {
+        var lo = 0
+        var hi = fields.count
+        while lo < hi {
+            let mid = (lo + hi) / 2
+            let s = fields[mid].symbol
+            if s == symbol { return (mid, true) }
+            if s < symbol { lo = mid + 1 } else { hi = mid }
+        }
+        return (lo, false)
+    }
+
+    /// The entry for `symbol`, from the first layer that defines it.
+    private func entry(_ symbol: Symbol) -> Entry? {
+        let (i, found) = search(symbol)
+        if found { return fields[i].entry }
+        for layer in layers {
+            let (j, inLayer) = layer.search(symbol)
+            if inLayer { return layer.fields[j].entry }
+        }
+        return nil
+    }
+
+    private func store(_ symbol: Symbol, _ entry: Entry) {
+        // Builtins and literals mostly add fields in order.
+        if fields.last.map({ $0.symbol < symbol }) ?? true {
+            fields.append(Field(symbol: symbol, entry: entry))
+            return
+        }
+        let (i, found) = search(symbol)
+        if found {
+            fields[i].entry = entry
+        } else {
+            fields.insert(Field(symbol: symbol, entry: entry), at: i)
+        }
     }
 
     /// Store a lazy thunk.
     public func set(_ key: String, expr: Expr, env: Env) {
-        withLock {
-            fields[key] = .unevaluated(expr, env)
-        }
+        set(Symbol(key), expr: expr, env: env)
+    }
+
+    public func set(_ symbol: Symbol, expr: Expr, env: Env) {
+        store(symbol, .thunk(Thunk(expr, env: env)))
     }
 
     /// Store an already-evaluated value.
     public func set(_ key: String, value: Value) {
-        withLock {
-            fields[key] = .evaluated(value)
-        }
+        set(Symbol(key), value: value)
+    }
+
+    public func set(_ symbol: Symbol, value: Value) {
+        store(symbol, .value(value))
     }
 
     /// Force a thunk, evaluating it if necessary.
     public func force(_ key: String, evaluator: Evaluator) async throws -> Value {
-        // Read thunk state
-        let thunk = withLock { fields[key] }
-        
-        guard let t = thunk else {
-            throw EvalError(message: "attribute '\(key)' not found")
-        }
+        try await force(Symbol(key), evaluator: evaluator)
+    }
 
-        switch t {
-        case .evaluated(let v):
+    public func force(_ symbol: Symbol, evaluator: Evaluator) async throws -> Value {
+        switch entry(symbol) {
+        case .value(let v)?:
             return v
-        case .evaluating:
-            throw EvalError(message: "infinite recursion detected evaluating attribute '\(key)'")
-        case .unevaluated(let expr, let env):
-            // Mark as evaluating
-            withLock {
-                if case .unevaluated = fields[key] {
-                    fields[key] = .evaluating
-                }
-            }
-            
-            // Re-check after potentially marking
-            let currentThunk = withLock { fields[key] }
-            
-            if case .evaluated(let v) = currentThunk {
-                return v
-            }
-            
-            // Perform evaluation outside the lock
-            let val: Value
-            do {
-                val = try await evaluator.eval(expr, env: env)
-            } catch {
-                // Nix usually caches the failure. For now, just re-throw and clear evaluating state.
-                withLock {
-                    fields[key] = .unevaluated(expr, env)
-                }
-                throw error
-            }
-            
-            withLock {
-                fields[key] = .evaluated(val)
-            }
-            return val
+        case .thunk(let t)?:
+            return try await t.force(symbol.name, evaluator: evaluator)
+        case nil:
+            throw EvalError(message: "attribute '\(symbol.name)' not found")
         }
     }
 
     /// Check if a key exists.
     public func has(_ key: String) -> Bool {
-        withLock { fields[key] != nil }
+        has(Symbol(key))
+    }
+
+    public func has(_ symbol: Symbol) -> Bool {
+        entry(symbol) != nil
+    }
+
+    /// All fields' symbols, sorted.
+    public var symbols: [Symbol] {
+        let own = fields.map(\.symbol)
+        if layers.isEmpty { return own }
+        var seen = Set(own)
+        for layer in layers {
+            seen.formUnion(layer.fields.map(\.symbol))
+        }
+        return seen.sorted()
     }
 
     /// All keys in the set.
     public var keys: [String] {
-        withLock { Array(fields.keys) }
+        symbols.map(\.name)
     }
 
     /// Force all fields and return as dictionary.
     public func toDict(evaluator: Evaluator) async throws -> [String: Value] {
         var result: [String: Value] = [:]
-        for key in keys {
-            result[key] = try await force(key, evaluator: evaluator)
+        for symbol in symbols {
+            result[symbol.name] = try await force(symbol, evaluator: evaluator)
         }
         return result
     }
 
-    /// Parallel version of toDict, evaluating all fields in parallel.
+    /// Parallel version of toDict, forcing fields on a ParallelPool.
     /// This is similar to Determinate Nix's parallel evaluation.
     public func parallelToDict(evaluator: Evaluator) async throws -> [String: Value] {
-        let currentKeys = self.keys
-        return try await withThrowingTaskGroup(of: (String, Value).self) { group in
-            for key in currentKeys {
-                group.addTask {
-                    let val = try await self.force(key, evaluator: evaluator)
-                    return (key, val)
-                }
-            }
-
-            var result: [String: Value] = [:]
-            for try await (key, val) in group {
-                result[key] = val
-            }
-            return result
+        let currentSymbols = self.symbols
+        let values = try await ParallelPool.map(currentSymbols) { symbol in
+            try await self.force(symbol, evaluator: evaluator)
         }
+        var result: [String: Value] = [:]
+        for (symbol, val) in zip(currentSymbols, values) {
+            result[symbol.name] = val
+        }
+        return result
     }
 
     /// Merge with another attr set (right-biased, like //).
     public func update(with other: AttrSetVal) -> AttrSetVal {
-        let result = AttrSetVal()
-        
-        let myFields = self.withLock { self.fields }
-        let otherFields = other.withLock { other.fields }
-        
-        result.withLock {
-            for (k, v) in myFields {
-                result.fields[k] = v
-            }
-            for (k, v) in otherFields {
-                result.fields[k] = v
+        let stack = ([other] + other.layers + [self] + layers).filter { !$0.fields.isEmpty }
+        if stack.count <= Self.maxLayers {
+            return AttrSetVal(fields: [], layers: stack)
+        }
+
+        // Flatten: the first layer to define a field wins. Entries are
+        // shared, so a thunk forced through either set is forced in both.
+        var merged: [Field] = []
+        var seen = Set<Symbol>()
+        for layer in stack {
+            for field in layer.fields where seen.insert(field.symbol).inserted {
+                merged.append(field)
             }
         }
-        
-        return result
+        merged.sort { $0.symbol < $1.symbol }
+        return AttrSetVal(fields: merged, layers: [])
     }
 }
 
 // MARK: - Environment
 
 /// Persistent immutable environment for name lookups.
+///
+/// The base environment holds named bindings. Every scope under it is a
+/// frame of slots laid out by the Resolver, or an AttrSetEnv for `with`.
 public class Env: @unchecked Sendable {
     public let bindings: [String: Value]
     public let parent: Env?
+    /// Filled in right after creation for `let` and `rec` frames, whose
+    /// thunks refer back to the frame; never changed after that.
+    internal var slots: [Slot]
+
+    /// What a frame slot holds.
+    enum Slot {
+        case value(Value)
+        case thunk(Thunk)
+        /// A field of an attribute set: a `rec` key or a pattern formal.
+        case attr(AttrSetVal, Symbol)
+    }
 
     public init(bindings: [String: Value] = [:], parent: Env? = nil) {
         self.bindings = bindings
         self.parent = parent
+        self.slots = []
+    }
+
+    init(slots: [Slot], parent: Env?) {
+        self.bindings = [:]
+        self.parent = parent
+        self.slots = slots
     }
 
     public func lookup(_ name: String) -> Value? {
@@ -239,31 +473,53 @@ public struct EvalError: Error, Sendable, CustomStringConvertible {
 
 /// Tree-walking evaluator for Nix expressions.
 public struct Evaluator: Sendable {
-    public init() {}
+    /// Where parsed sources are kept between runs; nil parses every time.
+    public let cache: EvalCache?
+    /// Collects every file, directory and path the evaluation looks at, for
+    /// the flake cache to check later; nil records nothing.
+    public let reads: FileReads?
+
+    public init(cache: EvalCache? = nil, reads: FileReads? = nil) {
+        self.cache = cache
+        self.reads = reads
+    }
 
     /// Parse and evaluate a Nix expression string.
     public func eval(_ source: String) async throws -> Value {
-        var parser = Parser(source: source)
-        let expr = try parser.parse()
-        return try await eval(expr, env: Env())
+        try await eval(try parse(source), env: Env())
     }
 
     /// Parse and evaluate a Nix expression string in a given environment.
     public func eval(_ source: String, env: Env) async throws -> Value {
+        try await eval(try parse(source), env: env)
+    }
+
+    /// The tree for `source`, from the cache when an earlier run parsed it.
+    public func parse(_ source: String) throws -> Expr {
+        if let expr = cache?.expr(for: source) { return expr }
         var parser = Parser(source: source)
         let expr = try parser.parse()
-        return try await eval(expr, env: env)
+        cache?.store(expr, for: source)
+        return expr
     }
 
     /// Evaluate a Nix file, returning its value.
     public func evalFile(_ path: String, env: Env) async throws -> Value {
+        reads?.record(.contents, path)
         let url = URL(fileURLWithPath: path)
         let source = try String(contentsOf: url, encoding: .utf8)
         return try await eval(source, env: env)
     }
 
-    /// Evaluate an AST expression in the given environment.
+    /// Evaluate a parsed expression in the given environment.
     public func eval(_ expr: Expr, env: Env) async throws -> Value {
+        var resolver = Resolver()
+        return try await evaluate(try resolver.resolve(expr), env: env)
+    }
+
+    /// Evaluate a resolved expression; `env` must have the frames its
+    /// `.local` references were resolved against.
+    func evaluate(_ expr: Expr, env: Env) async throws -> Value {
         switch expr {
         // Literals
         case .int(let n, _):
@@ -284,7 +540,10 @@ public struct Evaluator: Sendable {
         case .path(let p, _):
             return .path(p)
 
-        // Identifier lookup
+        // Variables
+        case .local(let slot, _):
+            return try await lookupSlot(slot, in: env)
+
         case .ident(let name, _):
             if let val = try await lookupAsync(name, in: env) {
                 return val
@@ -295,7 +554,7 @@ public struct Evaluator: Sendable {
         case .list(let elems, _):
             var vals: [Value] = []
             for elem in elems {
-                vals.append(try await eval(elem, env: env))
+                vals.append(try await evaluate(elem, env: env))
             }
             return .list(vals)
 
@@ -321,19 +580,19 @@ public struct Evaluator: Sendable {
 
         // If/then/else
         case .ifThenElse(let cond, let thenExpr, let elseExpr, _):
-            let condVal = try await eval(cond, env: env)
+            let condVal = try await evaluate(cond, env: env)
             guard case .bool(let b) = condVal else {
                 throw EvalError(message: "if condition must be a boolean, got \(condVal)")
             }
-            return try await eval(b ? thenExpr : elseExpr, env: env)
+            return try await evaluate(b ? thenExpr : elseExpr, env: env)
 
         // Assert
         case .assert(let cond, let body, _):
-            let condVal = try await eval(cond, env: env)
+            let condVal = try await evaluate(cond, env: env)
             guard case .bool(true) = condVal else {
                 throw EvalError(message: "assertion failed")
             }
-            return try await eval(body, env: env)
+            return try await evaluate(body, env: env)
 
         // Lambda
         case .lambda(let param, let body, _):
@@ -345,14 +604,14 @@ public struct Evaluator: Sendable {
 
         // Unary operators
         case .unaryNot(let operand, _):
-            let val = try await eval(operand, env: env)
+            let val = try await evaluate(operand, env: env)
             guard case .bool(let b) = val else {
                 throw EvalError(message: "! operator requires a boolean, got \(val)")
             }
             return .bool(!b)
 
         case .unaryNeg(let operand, _):
-            let val = try await eval(operand, env: env)
+            let val = try await evaluate(operand, env: env)
             switch val {
             case .int(let n): return .int(-n)
             case .float(let f): return .float(-f)
@@ -365,15 +624,35 @@ public struct Evaluator: Sendable {
         }
     }
 
+    private func lookupSlot(_ slot: VarSlot, in env: Env) async throws -> Value {
+        var frame = env
+        for _ in 0..<slot.depth {
+            frame = frame.parent!
+        }
+        switch frame.slots[slot.index] {
+        case .value(let v):
+            return v
+        case .thunk(let thunk):
+            return try await thunk.force(slot.name, evaluator: self)
+        case .attr(let attrSet, let key):
+            return try await attrSet.force(key, evaluator: self)
+        }
+    }
+
+    /// A name the Resolver left unbound: the base environment's bindings come
+    /// first, then `with` scopes from the innermost out.
     private func lookupAsync(_ name: String, in env: Env) async throws -> Value? {
-        if let v = env.bindings[name] { return v }
-        if let attrEnv = env as? AttrSetEnv {
-            if attrEnv.attrSet.has(name) {
+        var scope: Env? = env
+        while let e = scope {
+            if let v = e.bindings[name] { return v }
+            scope = e.parent
+        }
+        scope = env
+        while let e = scope {
+            if let attrEnv = e as? AttrSetEnv, attrEnv.attrSet.has(name) {
                 return try await attrEnv.attrSet.force(name, evaluator: self)
             }
-        }
-        if let p = env.parent {
-            return try await lookupAsync(name, in: p)
+            scope = e.parent
         }
         return nil
     }
@@ -387,7 +666,7 @@ public struct Evaluator: Sendable {
             case .text(let t):
                 result += t
             case .interp(let expr):
-                let val = try await eval(expr, env: env)
+                let val = try await evaluate(expr, env: env)
                 result += try coerceToString(val)
             }
         }
@@ -414,138 +693,53 @@ public struct Evaluator: Sendable {
         let result = AttrSetVal()
 
         if attrSet.isRec {
-            // Recursive: bindings can reference each other.
-            // Create a mutable dict for the env that includes the attrset fields.
-            var recBindings: [String: Value] = [:]
-            let resultVal = Value.attrSet(result)
-
-            // First pass: set up all thunks in a shared env that includes the rec set.
-            // We'll create a "rec env" that looks up from the attrset itself.
-            // For simple single-key bindings, store as thunks in rec env.
-            // For nested attrpaths, we need to handle differently.
-
-            // Collect top-level keys
-            for binding in attrSet.bindings {
-                if binding.path.count == 1, case .ident(let name) = binding.path[0] {
-                    // Will be set as thunk below
-                    recBindings[name] = .null // placeholder
-                }
-            }
-
-            // Create rec env: parent is current env, with rec bindings
-            // The trick: each thunk's env will have a lazy reference to the attrset
-            let recEnv = env.extend(recBindings)
-
-            // Now set actual thunks using recEnv
-            for binding in attrSet.bindings {
-                try await setBinding(result, path: binding.path, value: binding.value, env: recEnv)
-            }
-
-            // Patch recEnv bindings to point to the attrset fields
-            // Since Env is immutable, we create a wrapper env that delegates to the attrset
-            let attrSetEnv = AttrSetEnv(attrSet: result, evaluator: self, parent: env)
-            // Re-set thunks with the proper env
+            // Resolved `rec` bindings are one key each, in slot order; every
+            // slot reads back the field of the set being built.
+            let frame = Env(slots: [], parent: env)
+            var slots: [Env.Slot] = []
+            slots.reserveCapacity(attrSet.bindings.count)
             for binding in attrSet.bindings {
-                try await setBinding(result, path: binding.path, value: binding.value, env: attrSetEnv)
+                let key = attrKeySymbol(binding.path[0])
+                result.set(key, expr: binding.value, env: frame)
+                slots.append(.attr(result, key))
             }
-
-            // Handle inherits
-            for inherit in attrSet.inherits {
-                try await evalInherit(inherit, into: result, env: attrSetEnv)
-            }
-
-            return resultVal
-
+            frame.slots = slots
         } else {
             // Non-recursive: thunks close over current env
             for binding in attrSet.bindings {
-                try await setBinding(result, path: binding.path, value: binding.value, env: env)
-            }
-            for inherit in attrSet.inherits {
-                try await evalInherit(inherit, into: result, env: env)
-            }
-            return .attrSet(result)
-        }
-    }
-
-    /// Set a binding in an attr set, handling nested paths like `a.b.c = val`.
-    private func setBinding(_ attrSet: AttrSetVal, path: [AttrKey], value: Expr, env: Env) async throws {
-        guard let first = path.first else { return }
-
-        let key = try attrKeyToString(first)
-
-        if path.count == 1 {
-            attrSet.set(key, expr: value, env: env)
-        } else {
-            // Nested path: a.b.c = val -> create intermediate attrsets
-            let nested: AttrSetVal
-            if attrSet.has(key) {
-                // If it already exists, it must be an attrset to allow nesting.
-                let existing = try await attrSet.force(key, evaluator: self)
-                guard case .attrSet(let existingSet) = existing else {
-                    throw EvalError(message: "attribute '\(key)' already defined and is not an attribute set")
-                }
-                nested = existingSet
-            } else {
-                nested = AttrSetVal()
-                attrSet.set(key, value: .attrSet(nested))
+                result.set(attrKeySymbol(binding.path[0]), expr: binding.value, env: env)
             }
-            let remaining = Array(path.dropFirst())
-            try await setBinding(nested, path: remaining, value: value, env: env)
         }
+        return .attrSet(result)
     }
 
-    private func attrKeyToString(_ key: AttrKey) throws -> String {
+    private func attrKeySymbol(_ key: AttrKey) -> Symbol {
         switch key {
-        case .ident(let name): return name
-        case .string(let s): return s
-        }
-    }
-
-    private func evalInherit(_ inherit: InheritClause, into attrSet: AttrSetVal, env: Env) async throws {
-        if let fromExpr = inherit.from {
-            // inherit (expr) a b c; — look up attrs from the evaluated expr
-            let fromVal = try await eval(fromExpr, env: env)
-            guard case .attrSet(let fromSet) = fromVal else {
-                throw EvalError(message: "inherit source must be an attribute set")
-            }
-            for attr in inherit.attrs {
-                let name = try attrKeyToString(attr)
-                let val = try await fromSet.force(name, evaluator: self)
-                attrSet.set(name, value: val)
-            }
-        } else {
-            // inherit a b c; — look up from env
-            for attr in inherit.attrs {
-                let name = try attrKeyToString(attr)
-                guard let val = (try await lookupAsync(name, in: env)) else {
-                    throw EvalError(message: "undefined variable '\(name)' in inherit")
-                }
-                attrSet.set(name, value: val)
-            }
+        case .ident(let name): return Symbol(name)
+        case .string(let s): return Symbol(s)
         }
     }
 
     // MARK: - Select
 
     private func evalSelect(_ baseExpr: Expr, keys: [AttrKey], defaultExpr: Expr?, env: Env) async throws -> Value {
-        var current = try await eval(baseExpr, env: env)
+        var current = try await evaluate(baseExpr, env: env)
 
         for key in keys {
-            let keyStr = try attrKeyToString(key)
+            let keySym = attrKeySymbol(key)
             guard case .attrSet(let attrSetVal) = current else {
                 if let def = defaultExpr {
-                    return try await eval(def, env: env)
+                    return try await evaluate(def, env: env)
                 }
                 throw EvalError(message: "cannot select from non-attribute-set value")
             }
-            if !attrSetVal.has(keyStr) {
+            if !attrSetVal.has(keySym) {
                 if let def = defaultExpr {
-                    return try await eval(def, env: env)
+                    return try await evaluate(def, env: env)
                 }
-                throw EvalError(message: "attribute '\(keyStr)' not found")
+                throw EvalError(message: "attribute '\(keySym.name)' not found")
             }
-            current = try await attrSetVal.force(keyStr, evaluator: self)
+            current = try await attrSetVal.force(keySym, evaluator: self)
         }
 
         return current
@@ -554,18 +748,18 @@ public struct Evaluator: Sendable {
     // MARK: - Has-attr
 
     private func evalHasAttr(_ baseExpr: Expr, keys: [AttrKey], env: Env) async throws -> Value {
-        var current = try await eval(baseExpr, env: env)
+        var current = try await evaluate(baseExpr, env: env)
 
         for key in keys {
-            let keyStr = try attrKeyToString(key)
+            let keySym = attrKeySymbol(key)
             guard case .attrSet(let attrSetVal) = current else {
                 return .bool(false)
             }
-            if !attrSetVal.has(keyStr) {
+            if !attrSetVal.has(keySym) {
                 return .bool(false)
             }
             // Force to get deeper for nested checks
-            current = try await attrSetVal.force(keyStr, evaluator: self)
+            current = try await attrSetVal.force(keySym, evaluator: self)
         }
 
         return .bool(true)
@@ -574,42 +768,49 @@ public struct Evaluator: Sendable {
     // MARK: - Let
 
     private func evalLet(_ bindings: [Binding], body: Expr, env: Env) async throws -> Value {
-        // Let bindings are mutually recursive (like rec attrsets).
-        let letSet = AttrSetVal()
-        let letEnv = AttrSetEnv(attrSet: letSet, evaluator: self, parent: env)
-
+        // Let bindings are mutually recursive: each is a thunk over the
+        // frame that holds them all, in the Resolver's slot order.
+        let frame = Env(slots: [], parent: env)
+        var slots: [Env.Slot] = []
+        slots.reserveCapacity(bindings.count)
         for binding in bindings {
-            try await setBinding(letSet, path: binding.path, value: binding.value, env: letEnv)
+            switch binding.value {
+            case .int, .float, .bool, .null, .path, .lambda:
+                slots.append(.value(try await evaluate(binding.value, env: frame)))
+            default:
+                slots.append(.thunk(Thunk(binding.value, env: frame)))
+            }
         }
+        frame.slots = slots
 
-        return try await eval(body, env: letEnv)
+        return try await evaluate(body, env: frame)
     }
 
     // MARK: - With
 
     private func evalWith(_ nsExpr: Expr, body: Expr, env: Env) async throws -> Value {
-        let nsVal = try await eval(nsExpr, env: env)
+        let nsVal = try await evaluate(nsExpr, env: env)
         guard case .attrSet(let attrSetVal) = nsVal else {
             throw EvalError(message: "with expression requires an attribute set, got \(nsVal)")
         }
 
         // Create env where lookups also check the attrset
         let withEnv = AttrSetEnv(attrSet: attrSetVal, evaluator: self, parent: env)
-        return try await eval(body, env: withEnv)
+        return try await evaluate(body, env: withEnv)
     }
 
     // MARK: - Apply
 
     private func evalApply(_ fnExpr: Expr, argExpr: Expr, env: Env) async throws -> Value {
-        let fnVal = try await eval(fnExpr, env: env)
+        let fnVal = try await evaluate(fnExpr, env: env)
 
         switch fnVal {
         case .closure(let closure):
-            let argVal = try await eval(argExpr, env: env)
+            let argVal = try await evaluate(argExpr, env: env)
             return try await applyClosure(closure, arg: argVal)
 
         case .builtin(_, let fn):
-            let argVal = try await eval(argExpr, env: env)
+            let argVal = try await evaluate(argExpr, env: env)
             return try await fn(argVal)
 
         default:
@@ -630,26 +831,28 @@ public struct Evaluator: Sendable {
     }
 
     public func applyClosure(_ closure: ClosureVal, arg: Value) async throws -> Value {
-        let bodyEnv: Env
+        let frame: Env
 
         switch closure.param {
-        case .ident(let name):
-            bodyEnv = closure.env.extend(name, arg)
+        case .ident:
+            frame = Env(slots: [.value(arg)], parent: closure.env)
 
         case .pattern(let pattern):
             guard case .attrSet(let argSet) = arg else {
                 throw EvalError(message: "function expects an attribute set argument, got \(arg)")
             }
 
-            var newBindings: [String: Value] = [:]
-
+            // Formals are read from the argument when used; defaults are
+            // thunks over the frame so they can refer to other formals.
+            frame = Env(slots: [], parent: closure.env)
+            var slots: [Env.Slot] = []
+            slots.reserveCapacity(pattern.fields.count + 1)
             for field in pattern.fields {
-                if argSet.has(field.name) {
-                    newBindings[field.name] = try await argSet.force(field.name, evaluator: self)
+                let symbol = Symbol(field.name)
+                if argSet.has(symbol) {
+                    slots.append(.attr(argSet, symbol))
                 } else if let defaultExpr = field.defaultValue {
-                    // Evaluate default in the closure's env extended with bindings so far
-                    let defEnv = closure.env.extend(newBindings)
-                    newBindings[field.name] = try await eval(defaultExpr, env: defEnv)
+                    slots.append(.thunk(Thunk(defaultExpr, env: frame)))
                 } else {
                     throw EvalError(message: "missing required attribute '\(field.name)' in function argument")
                 }
@@ -657,24 +860,20 @@ public struct Evaluator: Sendable {
 
             // Check for unexpected attributes if no ellipsis
             if !pattern.hasEllipsis {
-                let expected = Set(pattern.fields.map(\.name))
-                let allKeys = argSet.keys
-                for key in allKeys {
-                    if !expected.contains(key) {
-                        throw EvalError(message: "unexpected attribute '\(key)' in function argument")
-                    }
+                let expected = Set(pattern.fields.map { Symbol($0.name) })
+                for symbol in argSet.symbols where !expected.contains(symbol) {
+                    throw EvalError(message: "unexpected attribute '\(symbol.name)' in function argument")
                 }
             }
 
             // Bind the @name if present
-            if let asName = pattern.asName {
-                newBindings[asName] = arg
+            if let asName = pattern.asName, !pattern.fields.contains(where: { $0.name == asName }) {
+                slots.append(.value(arg))
             }
-
-            bodyEnv = closure.env.extend(newBindings)
+            frame.slots = slots
         }
 
-        return try await eval(closure.body, env: bodyEnv)
+        return try await evaluate(closure.body, env: frame)
     }
 
     // MARK: - Binary operators
@@ -683,36 +882,36 @@ public struct Evaluator: Sendable {
         // Short-circuit for logical operators
         switch op {
         case .and:
-            let leftVal = try await eval(lhs, env: env)
+            let leftVal = try await evaluate(lhs, env: env)
             guard case .bool(let lb) = leftVal else {
                 throw EvalError(message: "&& requires booleans")
             }
             if !lb { return .bool(false) }
-            let rightVal = try await eval(rhs, env: env)
+            let rightVal = try await evaluate(rhs, env: env)
             guard case .bool(let rb) = rightVal else {
                 throw EvalError(message: "&& requires booleans")
             }
             return .bool(rb)
 
         case .or:
-            let leftVal = try await eval(lhs, env: env)
+            let leftVal = try await evaluate(lhs, env: env)
             guard case .bool(let lb) = leftVal else {
                 throw EvalError(message: "|| requires booleans")
             }
             if lb { return .bool(true) }
-            let rightVal = try await eval(rhs, env: env)
+            let rightVal = try await evaluate(rhs, env: env)
             guard case .bool(let rb) = rightVal else {
                 throw EvalError(message: "|| requires booleans")
             }
             return .bool(rb)
 
         case .impl:
-            let leftVal = try await eval(lhs, env: env)
+            let leftVal = try await evaluate(lhs, env: env)
             guard case .bool(let lb) = leftVal else {
                 throw EvalError(message: "-> requires booleans")
             }
             if !lb { return .bool(true) }
-            let rightVal = try await eval(rhs, env: env)
+            let rightVal = try await evaluate(rhs, env: env)
             guard case .bool(let rb) = rightVal else {
                 throw EvalError(message: "-> requires booleans")
             }
@@ -722,8 +921,8 @@ public struct Evaluator: Sendable {
             break
         }
 
-        let leftVal = try await eval(lhs, env: env)
-        let rightVal = try await eval(rhs, env: env)
+        let leftVal = try await evaluate(lhs, env: env)
+        let rightVal = try await evaluate(rhs, env: env)
 
         switch op {
         // Arithmetic
@@ -850,7 +1049,7 @@ public struct Evaluator: Sendable {
 
 // MARK: - AttrSetEnv
 
-/// Special environment that delegates lookups to an AttrSetVal (for `with`, `rec`, `let`).
+/// Special environment that delegates lookups to an AttrSetVal (for `with`).
 final class AttrSetEnv: Env, @unchecked Sendable {
     let attrSet: AttrSetVal
     let evaluator: Evaluator
@@ -0,0 +1,486 @@
+// ExprCodec.swift - Binary Expression Serialization
+//
+// A compact encoding of parsed Expr trees for the on-disk parse cache:
+//
+//     "SWIXAST" version   header, 8 bytes
+//     count string*       every name and literal, each once
+//     expr                the tree, pre-order
+//
+// Integers are LEB128 varints (zigzag for signed values), floats their
+// 8-byte bit pattern, and strings indices into the table. The decoder
+// reads straight from the bytes of a memory-mapped file.
+
+import Foundation
+
+struct ExprCodecError: Error, Sendable {
+    var message: String
+}
+
+enum ExprCodec {
+    static let magic: [UInt8] = Array("SWIXAST".utf8)
+    /// Bump whenever the AST or this encoding changes.
+    static let version: UInt8 = 1
+
+    static func encode(_ expr: Expr) -> [UInt8] {
+        var writer = Writer()
+        writer.expr(expr)
+        var out = magic
+        out.append(version)
+        var table = Writer()
+        table.uint(UInt64(writer.strings.count))
+        for s in writer.strings {
+            let utf8 = Array(s.utf8)
+            table.uint(UInt64(utf8.count))
+            table.bytes += utf8
+        }
+        out += table.bytes
+        out += writer.bytes
+        return out
+    }
+
+    static func decode(_ data: Data) throws -> Expr {
+        try data.withUnsafeBytes { (raw: UnsafeRawBufferPointer) throws -> Expr in
+            var reader = Reader(raw)
+            for m in magic {
+                if try reader.byte() != m { throw ExprCodecError(message: "not a swix AST") }
+            }
+            if try reader.byte() != version {
+                throw ExprCodecError(message: "unsupported AST version")
+            }
+            let count = try reader.count()
+            var strings: [String] = []
+            strings.reserveCapacity(count)
+            for _ in 0..<count {
+                strings.append(try reader.rawString())
+            }
+            reader.strings = strings
+            let expr = try reader.expr()
+            if !reader.atEnd {
+                throw ExprCodecError(message: "trailing bytes after AST")
+            }
+            return expr
+        }
+    }
+
+    // Binary operators in encoding order.
+    private static let ops: [BinaryOp] = [
+        .add, .sub, .mul, .div, .eq, .neq, .lt, .gt, .lte, .gte,
+        .and, .or, .impl, .concat, .update,
+    ]
+
+    private enum Tag: UInt8 {
+        case int, float, bool, null, string, path, ident, local
+        case list, attrSet, select, hasAttr
+        case letIn, with, ifThenElse, assert
+        case lambda, apply, unaryNot, unaryNeg, binary
+    }
+
+    // MARK: - Writer
+
+    private struct Writer {
+        var bytes: [UInt8] = []
+        var strings: [String] = []
+        var stringIndex: [String: Int] = [:]
+
+        mutating func uint(_ v: UInt64) {
+            var v = v
+            while v >= 0x80 {
+                bytes.append(UInt8(truncatingIfNeeded: v) | 0x80)
+                v >>= 7
+            }
+            bytes.append(UInt8(v))
+        }
+
+        mutating func int(_ v: Int) { uint(UInt64(v)) }
+
+        mutating func sint(_ v: Int64) {
+            uint(UInt64(bitPattern: (v << 1) ^ (v >> 63)))
+        }
+
+        mutating func bool(_ b: Bool) { bytes.append(b ? 1 : 0) }
+
+        mutating func string(_ s: String) {
+            if let i = stringIndex[s] {
+                int(i)
+                return
+            }
+            stringIndex[s] = strings.count
+            int(strings.count)
+            strings.append(s)
+        }
+
+        mutating func location(_ l: SourceLocation) {
+            int(l.offset)
+            int(l.line)
+            int(l.column)
+        }
+
+        mutating func span(_ s: Span) {
+            location(s.start)
+            location(s.end)
+        }
+
+        mutating func tag(_ t: Tag) { bytes.append(t.rawValue) }
+
+        mutating func key(_ k: AttrKey) {
+            switch k {
+            case .ident(let n):
+                bytes.append(0)
+                string(n)
+            case .string(let s):
+                bytes.append(1)
+                string(s)
+            }
+        }
+
+        mutating func keys(_ ks: [AttrKey]) {
+            int(ks.count)
+            for k in ks { key(k) }
+        }
+
+        mutating func optional(_ e: Expr?) {
+            if let e = e {
+                bool(true)
+                expr(e)
+            } else {
+                bool(false)
+            }
+        }
+
+        mutating func bindings(_ bs: [Binding]) {
+            int(bs.count)
+            for b in bs {
+                keys(b.path)
+                expr(b.value)
+                span(b.span)
+            }
+        }
+
+        mutating func expr(_ e: Expr) {
+            switch e {
+            case .int(let n, let s):
+                tag(.int); sint(n); span(s)
+            case .float(let f, let s):
+                tag(.float)
+                let bits = f.bitPattern
+                for i in 0..<8 { bytes.append(UInt8(truncatingIfNeeded: bits >> (8 * UInt64(i)))) }
+                span(s)
+            case .bool(let b, let s):
+                tag(.bool); bool(b); span(s)
+            case .null(let s):
+                tag(.null); span(s)
+            case .string(let str, let s):
+                tag(.string)
+                int(str.segments.count)
+                for segment in str.segments {
+                    switch segment {
+                    case .text(let t):
+                        bytes.append(0)
+                        string(t)
+                    case .interp(let inner):
+                        bytes.append(1)
+                        expr(inner)
+                    }
+                }
+                span(s)
+            case .path(let p, let s):
+                tag(.path); string(p); span(s)
+            case .ident(let n, let s):
+                tag(.ident); string(n); span(s)
+            case .local(let slot, let s):
+                tag(.local); int(slot.depth); int(slot.index); string(slot.name); span(s)
+            case .list(let elems, let s):
+                tag(.list)
+                int(elems.count)
+                for el in elems { expr(el) }
+                span(s)
+            case .attrSet(let set, let s):
+                tag(.attrSet)
+                bool(set.isRec)
+                bindings(set.bindings)
+                int(set.inherits.count)
+                for inherit in set.inherits {
+                    optional(inherit.from)
+                    keys(inherit.attrs)
+                    span(inherit.span)
+                }
+                span(s)
+            case .select(let base, let ks, let def, let s):
+                tag(.select); expr(base); keys(ks); optional(def); span(s)
+            case .hasAttr(let base, let ks, let s):
+                tag(.hasAttr); expr(base); keys(ks); span(s)
+            case .letIn(let bs, let body, let s):
+                tag(.letIn); bindings(bs); expr(body); span(s)
+            case .with(let ns, let body, let s):
+                tag(.with); expr(ns); expr(body); span(s)
+            case .ifThenElse(let c, let t, let f, let s):
+                tag(.ifThenElse); expr(c); expr(t); expr(f); span(s)
+            case .assert(let c, let body, let s):
+                tag(.assert); expr(c); expr(body); span(s)
+            case .lambda(let param, let body, let s):
+                tag(.lambda)
+                switch param {
+                case .ident(let n):
+                    bytes.append(0)
+                    string(n)
+                case .pattern(let p):
+                    bytes.append(1)
+                    int(p.fields.count)
+                    for field in p.fields {
+                        string(field.name)
+                        optional(field.defaultValue)
+                    }
+                    bool(p.hasEllipsis)
+                    bool(p.asName != nil)
+                    if let asName = p.asName { string(asName) }
+                }
+                expr(body)
+                span(s)
+            case .apply(let fn, let arg, let s):
+                tag(.apply); expr(fn); expr(arg); span(s)
+            case .unaryNot(let operand, let s):
+                tag(.unaryNot); expr(operand); span(s)
+            case .unaryNeg(let operand, let s):
+                tag(.unaryNeg); expr(operand); span(s)
+            case .binary(let op, let l, let r, let s):
+                tag(.binary)
+                bytes.append(UInt8(ExprCodec.ops.firstIndex(of: op)!))
+                expr(l)
+                expr(r)
+                span(s)
+            }
+        }
+    }
+
+    // MARK: - Reader
+
+    private struct Reader {
+        let raw: UnsafeRawBufferPointer
+        var pos = 0
+        var strings: [String] = []
+
+        init(_ raw: UnsafeRawBufferPointer) {
+            self.raw = raw
+        }
+
+        var atEnd: Bool { pos == raw.count }
+
+        mutating func byte() throws -> UInt8 {
+            guard pos < raw.count else { throw ExprCodecError(message: "truncated AST") }
+            let b = raw[pos]
+            pos += 1
+            return b
+        }
+
+        mutating func uint() throws -> UInt64 {
+            var v: UInt64 = 0
+            var shift: UInt64 = 0
+            while true {
+                let b = try byte()
+                if shift > 63 { throw ExprCodecError(message: "bad varint") }
+                v |= UInt64(b & 0x7F) << shift
+                if b & 0x80 == 0 { return v }
+                shift += 7
+            }
+        }
+
+        mutating func int() throws -> Int {
+            let v = try uint()
+            guard v <= UInt64(Int.max) else { throw ExprCodecError(message: "bad varint") }
+            return Int(v)
+        }
+
+        /// A list length. Every element takes at least a byte, so a length
+        /// past the bytes left is corrupt; checking before anything is
+        /// reserved keeps a bad file from asking for an absurd allocation.
+        mutating func count() throws -> Int {
+            let n = try int()
+            guard n <= raw.count - pos else { throw ExprCodecError(message: "truncated AST") }
+            return n
+        }
+
+        mutating func sint() throws -> Int64 {
+            let v = try uint()
+            return Int64(bitPattern: v >> 1) ^ -Int64(bitPattern: v & 1)
+        }
+
+        mutating func bool() throws -> Bool { try byte() != 0 }
+
+        mutating func rawString() throws -> String {
+            let n = try int()
+            guard n <= raw.count - pos else { throw ExprCodecError(message: "truncated AST") }
+            let s = String(decoding: UnsafeRawBufferPointer(rebasing: raw[pos..<pos + n]), as: UTF8.self)
+            pos += n
+            return s
+        }
+
+        mutating func string() throws -> String {
+            let i = try int()
+            guard i < strings.count else { throw ExprCodecError(message: "bad string index") }
+            return strings[i]
+        }
+
+        mutating func location() throws -> SourceLocation {
+            SourceLocation(offset: try int(), line: try int(), column: try int())
+        }
+
+        mutating func span() throws -> Span {
+            Span(start: try location(), end: try location())
+        }
+
+        mutating func key() throws -> AttrKey {
+            switch try byte() {
+            case 0: return .ident(try string())
+            case 1: return .string(try string())
+            default: throw ExprCodecError(message: "bad attribute key")
+            }
+        }
+
+        mutating func keys() throws -> [AttrKey] {
+            let n = try count()
+            var ks: [AttrKey] = []
+            for _ in 0..<n { ks.append(try key()) }
+            return ks
+        }
+
+        mutating func optional() throws -> Expr? {
+            if try bool() { return try expr() }
+            return nil
+        }
+
+        mutating func bindings() throws -> [Binding] {
+            let n = try count()
+            var bs: [Binding] = []
+            bs.reserveCapacity(n)
+            for _ in 0..<n {
+                let path = try keys()
+                let value = try expr()
+                bs.append(Binding(path: path, value: value, span: try span()))
+            }
+            return bs
+        }
+
+        mutating func exprs() throws -> [Expr] {
+            let n = try count()
+            var es: [Expr] = []
+            es.reserveCapacity(n)
+            for _ in 0..<n { es.append(try expr()) }
+            return es
+        }
+
+        mutating func expr() throws -> Expr {
+            guard let t = Tag(rawValue: try byte()) else {
+                throw ExprCodecError(message: "bad expression tag")
+            }
+            switch t {
+            case .int:
+                let n = try sint()
+                return .int(n, try span())
+            case .float:
+                var bits: UInt64 = 0
+                for i in 0..<8 { bits |= UInt64(try byte()) << (8 * UInt64(i)) }
+                return .float(Double(bitPattern: bits), try span())
+            case .bool:
+                let b = try bool()
+                return .bool(b, try span())
+            case .null:
+                return .null(try span())
+            case .string:
+                let n = try count()
+                var str = StringExpr()
+                for _ in 0..<n {
+                    switch try byte() {
+                    case 0: str.segments.append(.text(try string()))
+                    case 1: str.segments.append(.interp(try expr()))
+                    default: throw ExprCodecError(message: "bad string segment")
+                    }
+                }
+                return .string(str, try span())
+            case .path:
+                let p = try string()
+                return .path(p, try span())
+            case .ident:
+                let n = try string()
+                return .ident(n, try span())
+            case .local:
+                let slot = VarSlot(depth: try int(), index: try int(), name: try string())
+                return .local(slot, try span())
+            case .list:
+                let elems = try exprs()
+                return .list(elems, try span())
+            case .attrSet:
+                var set = AttrSet(isRec: try bool())
+                set.bindings = try bindings()
+                let n = try count()
+                for _ in 0..<n {
+                    let from = try optional()
+                    let attrs = try keys()
+                    set.inherits.append(InheritClause(from: from, attrs: attrs, span: try span()))
+                }
+                return .attrSet(set, try span())
+            case .select:
+                let base = try expr()
+                let ks = try keys()
+                let def = try optional()
+                return .select(base, ks, def, try span())
+            case .hasAttr:
+                let base = try expr()
+                let ks = try keys()
+                return .hasAttr(base, ks, try span())
+            case .letIn:
+                let bs = try bindings()
+                let body = try expr()
+                return .letIn(bs, body, try span())
+            case .with:
+                let ns = try expr()
+                let body = try expr()
+                return .with(ns, body, try span())
+            case .ifThenElse:
+                let c = try expr()
+                let th = try expr()
+                let el = try expr()
+                return .ifThenElse(c, th, el, try span())
+            case .assert:
+                let c = try expr()
+                let body = try expr()
+                return .assert(c, body, try span())
+            case .lambda:
+                let param: LambdaParam
+                switch try byte() {
+                case 0:
+                    param = .ident(try string())
+                case 1:
+                    var p = PatternParam()
+                    let n = try count()
+                    for _ in 0..<n {
+                        let name = try string()
+                        p.fields.append(PatternParam.Field(name: name, defaultValue: try optional()))
+                    }
+                    p.hasEllipsis = try bool()
+                    if try bool() { p.asName = try string() }
+                    param = .pattern(p)
+                default:
+                    throw ExprCodecError(message: "bad lambda parameter")
+                }
+                let body = try expr()
+                return .lambda(param, body, try span())
+            case .apply:
+                let fn = try expr()
+                let arg = try expr()
+                return .apply(fn, arg, try span())
+            case .unaryNot:
+                let operand = try expr()
+                return .unaryNot(operand, try span())
+            case .unaryNeg:
+                let operand = try expr()
+                return .unaryNeg(operand, try span())
+            case .binary:
+                let i = Int(try byte())
+                guard i < ExprCodec.ops.count else { throw ExprCodecError(message: "bad operator") }
+                let l = try expr()
+                let r = try expr()
+                return .binary(ExprCodec.ops[i], l, r, try span())
+            }
+        }
+    }
+}
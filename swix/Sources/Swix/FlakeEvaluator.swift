@@ -11,9 +11,24 @@ public struct FlakeMetadata: Sendable {
 /// Evaluates flake.nix files and provides a structured view of the flake outputs.
 public struct FlakeEvaluator: Sendable {
     private let evaluator: Evaluator
+    private let cache: EvalCache?
 
-    public init() {
-        self.evaluator = Evaluator()
+    /// With a cache, parsed files, fully forced outputs and `flake show`
+    /// trees are reused until flake.nix, flake.lock or anything else the
+    /// evaluation read changes.
+    public init(cache: EvalCache? = nil) {
+        self.init(evaluator: Evaluator(cache: cache), cache: cache)
+    }
+
+    private init(evaluator: Evaluator, cache: EvalCache?) {
+        self.evaluator = evaluator
+        self.cache = cache
+    }
+
+    /// A copy that records what one uncached evaluation reads, for the
+    /// entry it stores.
+    private func recording() -> FlakeEvaluator {
+        FlakeEvaluator(evaluator: Evaluator(cache: cache, reads: FileReads()), cache: cache)
     }
 
     // MARK: - Evaluate flake.nix
@@ -27,6 +42,7 @@ public struct FlakeEvaluator: Sendable {
             throw EvalError(message: "flake.nix not found at \(directory)")
         }
 
+        evaluator.reads?.record(.contents, flakePath)
         let source = try String(contentsOfFile: flakePath, encoding: .utf8)
         let env = Builtins.baseEnv(evaluator: evaluator)
 
@@ -99,8 +115,19 @@ public struct FlakeEvaluator: Sendable {
     }
 
     /// Evaluate a specific output path from a flake (e.g., "packages.x86_64-linux.hello").
-    public func evalFlakeOutput(at directory: String, path: [String]) async throws -> Value {
-        let outputs = try await evalFlake(at: directory)
+    /// Pass `fullyForced` when the caller forces the whole result anyway, as
+    /// `eval --json` does: only then is it captured into the cache, since
+    /// capturing forces every attribute a lazy caller would never touch.
+    public func evalFlakeOutput(
+        at directory: String, path: [String], fullyForced: Bool = false
+    ) async throws -> Value {
+        let fingerprint = cache?.fingerprint(flakeAt: directory)
+        if let fingerprint, let hit = cache?.value(fingerprint: fingerprint, path: path) {
+            return hit.value
+        }
+
+        let run = cache == nil ? self : recording()
+        let outputs = try await run.evalFlake(at: directory)
         var current = outputs
         for key in path {
             guard case .attrSet(let s) = current else {
@@ -109,7 +136,12 @@ public struct FlakeEvaluator: Sendable {
             guard s.has(key) else {
                 throw EvalError(message: "attribute '\(key)' not found in flake output")
             }
-            current = try await s.force(key, evaluator: evaluator)
+            current = try await s.force(key, evaluator: run.evaluator)
+        }
+
+        if fullyForced, let cache, let fingerprint, let reads = run.evaluator.reads,
+           let captured = await CachedValue.capture(current, evaluator: run.evaluator) {
+            cache.store(captured, fingerprint: fingerprint, path: path, reads: reads.all)
         }
         return current
     }
@@ -117,66 +149,124 @@ public struct FlakeEvaluator: Sendable {
     // MARK: - Pretty-print flake show
 
     /// Generate a tree representation of flake outputs (like `nix flake show`).
+    /// Outputs are forced in parallel, a level of the tree at a time, on a
+    /// ParallelPool.
     public func flakeShow(at directory: String) async throws -> String {
-        let outputs = try await evalFlake(at: directory)
-        guard case .attrSet(let outputsSet) = outputs else {
-            return "(flake outputs is not an attribute set)"
+        let fingerprint = cache?.fingerprint(flakeAt: directory)
+        let nodes: [ShowNode]
+        if let fingerprint, let hit = cache?.show(fingerprint: fingerprint) {
+            nodes = hit
+        } else {
+            let run = cache == nil ? self : recording()
+            let outputs = try await run.evalFlake(at: directory)
+            guard case .attrSet(let outputsSet) = outputs else {
+                return "(flake outputs is not an attribute set)"
+            }
+            nodes = try await run.showChildren(of: outputsSet)
+            if let fingerprint, let reads = run.evaluator.reads {
+                cache?.store(show: nodes, fingerprint: fingerprint, reads: reads.all)
+            }
         }
 
         var lines: [String] = []
         lines.append("git+file:///\(directory)?ref=main")
 
-        let keys = outputsSet.keys.sorted()
-        for (i, key) in keys.enumerated() {
-            let isLast = (i == keys.count - 1)
+        for (i, node) in nodes.enumerated() {
+            let isLast = (i == nodes.count - 1)
             let prefix = isLast ? "└───" : "├───"
             let childPrefix = isLast ? "    " : "│   "
-
-            let val = try? await outputsSet.force(key, evaluator: evaluator)
-            await appendFlakeTree(key: key, value: val, prefix: prefix, childPrefix: childPrefix, lines: &lines)
+            appendFlakeTree(node, prefix: prefix, childPrefix: childPrefix, lines: &lines)
         }
 
         return lines.joined(separator: "\n")
     }
 
-    private func appendFlakeTree(key: String, value: Value?, prefix: String, childPrefix: String, lines: inout [String]) async {
+    /// One line of `flake show` and the lines nested under it.
+    struct ShowNode: Codable, Sendable {
+        var key: String
+        var summary: String = ""
+        var children: [ShowNode] = []
+    }
+
+    /// One attribute of the `flake show` tree still to be forced.
+    private struct ShowItem: Sendable {
+        let attrs: AttrSetVal
+        let key: String
+        /// Index of the node it goes under, or -1 at the top.
+        let parent: Int
+    }
+
+    /// The `flake show` tree under `attrSet`. It is forced breadth first, each
+    /// level in one ParallelPool batch, so no more than one pool's width of
+    /// attributes is in flight however deeply the outputs nest.
+    private func showChildren(of attrSet: AttrSetVal) async throws -> [ShowNode] {
+        var nodes: [ShowNode] = []
+        var children: [[Int]] = []
+        var top: [Int] = []
+        var frontier = attrSet.keys.sorted().map { ShowItem(attrs: attrSet, key: $0, parent: -1) }
+        while !frontier.isEmpty {
+            let level = try await ParallelPool.map(frontier) { item in
+                let val = try? await item.attrs.force(item.key, evaluator: evaluator)
+                return await showNode(key: item.key, value: val)
+            }
+            var next: [ShowItem] = []
+            for (item, (node, expand)) in zip(frontier, level) {
+                let index = nodes.count
+                nodes.append(node)
+                children.append([])
+                if item.parent < 0 { top.append(index) } else { children[item.parent].append(index) }
+                if let s = expand {
+                    next += s.keys.sorted().map { ShowItem(attrs: s, key: $0, parent: index) }
+                }
+            }
+            frontier = next
+        }
+
+        func build(_ i: Int) -> ShowNode {
+            var node = nodes[i]
+            node.children = children[i].map(build)
+            return node
+        }
+        return top.map(build)
+    }
+
+    /// The line for one attribute, and the attrset to expand under it if it
+    /// is not a leaf.
+    private func showNode(key: String, value: Value?) async -> (ShowNode, AttrSetVal?) {
         guard let value = value else {
-            lines.append("\(prefix) \(key): «error»")
-            return
+            return (ShowNode(key: key, summary: ": «error»"), nil)
         }
 
         switch value {
         case .attrSet(let s):
-            let childKeys = s.keys.sorted()
-            if childKeys.isEmpty {
-                lines.append("\(prefix) \(key): { }")
-                return
+            if s.keys.isEmpty {
+                return (ShowNode(key: key, summary: ": { }"), nil)
             }
 
             // Detect known flake output types
-            let outputType = await detectOutputType(key: key, attrSet: s)
-            if let type = outputType {
-                lines.append("\(prefix) \(key): \(type)")
-                return
-            }
-
-            lines.append("\(prefix) \(key)")
-            for (j, childKey) in childKeys.enumerated() {
-                let isChildLast = (j == childKeys.count - 1)
-                let cp = isChildLast ? "\(childPrefix)└───" : "\(childPrefix)├───"
-                let ccp = isChildLast ? "\(childPrefix)    " : "\(childPrefix)│   "
-                let childVal = try? await s.force(childKey, evaluator: evaluator)
-                await appendFlakeTree(key: childKey, value: childVal, prefix: cp, childPrefix: ccp, lines: &lines)
+            if let type = await detectOutputType(key: key, attrSet: s) {
+                return (ShowNode(key: key, summary: ": \(type)"), nil)
             }
+            return (ShowNode(key: key), s)
 
         case .closure, .builtin:
-            lines.append("\(prefix) \(key): «function»")
+            return (ShowNode(key: key, summary: ": «function»"), nil)
 
         case .string(let s):
-            lines.append("\(prefix) \(key): \"\(s)\"")
+            return (ShowNode(key: key, summary: ": \"\(s)\""), nil)
 
         default:
-            lines.append("\(prefix) \(key): \(value)")
+            return (ShowNode(key: key, summary: ": \(value)"), nil)
+        }
+    }
+
+    private func appendFlakeTree(_ node: ShowNode, prefix: String, childPrefix: String, lines: inout [String]) {
+        lines.append("\(prefix) \(node.key)\(node.summary)")
+        for (j, child) in node.children.enumerated() {
+            let isChildLast = (j == node.children.count - 1)
+            let cp = isChildLast ? "\(childPrefix)└───" : "\(childPrefix)├───"
+            let ccp = isChildLast ? "\(childPrefix)    " : "\(childPrefix)│   "
+            appendFlakeTree(child, prefix: cp, childPrefix: ccp, lines: &lines)
         }
     }
 
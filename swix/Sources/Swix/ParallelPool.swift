@@ -0,0 +1,59 @@
+// ParallelPool.swift - Bounded Parallel Evaluation
+import Foundation
+import Synchronization
+
+/// Runs a batch of evaluations on a fixed number of worker tasks.
+///
+/// Workers take the next unclaimed item from a shared atomic cursor, so a
+/// worker that finishes early keeps taking work from the rest instead of
+/// idling, and no more than `width` items are in flight however large the
+/// batch. Thunks forced by two workers at once are evaluated once; the
+/// second waits for the first.
+public enum ParallelPool {
+    /// Workers per batch: one per active core.
+    public static var defaultWidth: Int {
+        ProcessInfo.processInfo.activeProcessorCount
+    }
+
+    private final class Cursor: Sendable {
+        let next = Atomic<Int>(0)
+    }
+
+    /// `body` applied to every item, results in item order. The first error
+    /// cancels the remaining work and is rethrown.
+    public static func map<T: Sendable, R: Sendable>(
+        _ items: [T], width: Int = defaultWidth,
+        _ body: @escaping @Sendable (T) async throws -> R
+    ) async throws -> [R] {
+        if items.isEmpty { return [] }
+        let workers = max(1, min(width, items.count))
+        if workers == 1 {
+            var results: [R] = []
+            results.reserveCapacity(items.count)
+            for item in items { results.append(try await body(item)) }
+            return results
+        }
+
+        let cursor = Cursor()
+        return try await withThrowingTaskGroup(of: [(Int, R)].self) { group in
+            for _ in 0..<workers {
+                group.addTask {
+                    var done: [(Int, R)] = []
+                    while !Task.isCancelled {
+                        let i = cursor.next.wrappingAdd(1, ordering: .relaxed).oldValue
+                        if i >= items.count { break }
+                        done.append((i, try await body(items[i])))
+                    }
+                    return done
+                }
+            }
+
+            var results = [R?](repeating: nil, count: items.count)
+            for try await batch in group {
+                for (i, r) in batch { results[i] = r }
+            }
+            try Task.checkCancellation()
+            return results.map { $0! }
+        }
+    }
+}
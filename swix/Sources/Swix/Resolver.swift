@@ -0,0 +1,270 @@
+// Resolver.swift - Nix Variable Resolution
+//
+// Runs between Parser and Evaluator and binds every variable it can
+// statically. A name bound by a lambda, `let` or `rec` set becomes a
+// `.local` slot reference: how many scopes up the environment chain its
+// frame is, and which slot of that frame. Names no binder covers stay
+// `.ident` and are looked up by name at run time, in the base environment's
+// bindings and then in the enclosing `with` scopes, innermost first.
+//
+// Attribute set, `let` and `rec` bindings come out with one single-key
+// binding per key, in slot order, which is the layout the evaluator builds
+// frames and sets from; nested paths like `a.b = 1; a.c = 2;` merge into
+// one attribute set. `inherit` clauses are rewritten into plain bindings.
+
+/// Static scope analysis producing slot-resolved expressions.
+public struct Resolver {
+    private enum Scope {
+        case frame([String: Int])
+        case with
+    }
+
+    /// Innermost last; one entry per environment the evaluator will create.
+    private var scopes: [Scope] = []
+
+    public init() {}
+
+    /// Resolve a parsed expression that will be evaluated directly in a base
+    /// environment.
+    public mutating func resolve(_ expr: Expr) throws -> Expr {
+        switch expr {
+        case .int, .float, .bool, .null, .path, .local:
+            return expr
+
+        case .string(let strExpr, let span):
+            return .string(try resolve(strExpr), span)
+
+        case .ident(let name, let span):
+            return reference(name, span: span)
+
+        case .list(let elems, let span):
+            var out: [Expr] = []
+            out.reserveCapacity(elems.count)
+            for e in elems { out.append(try resolve(e)) }
+            return .list(out, span)
+
+        case .attrSet(let attrSet, let span):
+            if attrSet.isRec {
+                return .attrSet(try resolveRec(attrSet), span)
+            }
+            return .attrSet(try resolvePlain(attrSet), span)
+
+        case .select(let base, let keys, let defaultExpr, let span):
+            let d = try defaultExpr.map { try resolve($0) }
+            return .select(try resolve(base), keys, d, span)
+
+        case .hasAttr(let base, let keys, let span):
+            return .hasAttr(try resolve(base), keys, span)
+
+        case .letIn(let bindings, let body, let span):
+            let slots = try layout(bindings, inherits: [])
+            scopes.append(.frame(slotIndex(slots)))
+            defer { scopes.removeLast() }
+            let resolved = try resolveSlots(slots)
+            return .letIn(resolved, try resolve(body), span)
+
+        case .with(let ns, let body, let span):
+            let resolvedNs = try resolve(ns)
+            scopes.append(.with)
+            defer { scopes.removeLast() }
+            return .with(resolvedNs, try resolve(body), span)
+
+        case .ifThenElse(let c, let t, let e, let span):
+            return .ifThenElse(try resolve(c), try resolve(t), try resolve(e), span)
+
+        case .assert(let c, let body, let span):
+            return .assert(try resolve(c), try resolve(body), span)
+
+        case .lambda(.ident(let name), let body, let span):
+            scopes.append(.frame([name: 0]))
+            defer { scopes.removeLast() }
+            return .lambda(.ident(name), try resolve(body), span)
+
+        case .lambda(.pattern(var pattern), let body, let span):
+            // Formals take slots in order, then the @-name. Defaults see
+            // every formal.
+            var index: [String: Int] = [:]
+            for (i, field) in pattern.fields.enumerated() { index[field.name] = i }
+            if let asName = pattern.asName, index[asName] == nil {
+                index[asName] = pattern.fields.count
+            }
+            scopes.append(.frame(index))
+            defer { scopes.removeLast() }
+            for i in pattern.fields.indices {
+                if let d = pattern.fields[i].defaultValue {
+                    pattern.fields[i].defaultValue = try resolve(d)
+                }
+            }
+            return .lambda(.pattern(pattern), try resolve(body), span)
+
+        case .apply(let fn, let arg, let span):
+            return .apply(try resolve(fn), try resolve(arg), span)
+
+        case .unaryNot(let e, let span):
+            return .unaryNot(try resolve(e), span)
+
+        case .unaryNeg(let e, let span):
+            return .unaryNeg(try resolve(e), span)
+
+        case .binary(let op, let l, let r, let span):
+            return .binary(op, try resolve(l), try resolve(r), span)
+        }
+    }
+
+    private mutating func resolve(_ strExpr: StringExpr) throws -> StringExpr {
+        var out = StringExpr()
+        out.segments.reserveCapacity(strExpr.segments.count)
+        for segment in strExpr.segments {
+            switch segment {
+            case .text:
+                out.segments.append(segment)
+            case .interp(let e):
+                out.segments.append(.interp(try resolve(e)))
+            }
+        }
+        return out
+    }
+
+    // MARK: - Names
+
+    /// The innermost binding of `name`, looking past the first `skip` scopes.
+    private func reference(_ name: String, span: Span, skip: Int = 0) -> Expr {
+        var depth = 0
+        for scope in scopes.reversed() {
+            if depth >= skip, case .frame(let index) = scope, let i = index[name] {
+                return .local(VarSlot(depth: depth, index: i, name: name), span)
+            }
+            depth += 1
+        }
+        return .ident(name, span)
+    }
+
+    // MARK: - Attribute sets
+
+    /// A non-recursive set gets the same one-binding-per-key layout as a
+    /// frame, resolved in the enclosing scope.
+    private mutating func resolvePlain(_ attrSet: AttrSet) throws -> AttrSet {
+        let slots = try layout(attrSet.bindings, inherits: attrSet.inherits)
+        return AttrSet(isRec: false, bindings: try resolveSlots(slots, inheritSkip: 0))
+    }
+
+    /// A `rec` set is a frame over its own keys; plain `inherit` still looks
+    /// outside it.
+    private mutating func resolveRec(_ attrSet: AttrSet) throws -> AttrSet {
+        let slots = try layout(attrSet.bindings, inherits: attrSet.inherits)
+        scopes.append(.frame(slotIndex(slots)))
+        defer { scopes.removeLast() }
+        return AttrSet(isRec: true, bindings: try resolveSlots(slots, inheritSkip: 1))
+    }
+
+    private func inherited(_ key: AttrKey, from: Expr?, span: Span, skip: Int) -> Binding {
+        let name = Resolver.name(of: key)
+        let value: Expr
+        if let from = from {
+            value = .select(from, [key], nil, span)
+        } else {
+            value = reference(name, span: span, skip: skip)
+        }
+        return Binding(path: [key], value: value, span: span)
+    }
+
+    // MARK: - Frame layout
+
+    /// One slot of a `let` or `rec` frame, before its value is resolved.
+    private enum Slot {
+        case value(String, Expr, Span)
+        /// A plain `inherit name`, which looks past the frame it defines.
+        case inherit(AttrKey, Span)
+        /// `inherit (e) name`: `e.name`, with `e` still to resolve.
+        case inheritFrom(String, Expr, Span)
+    }
+
+    private static func name(of key: AttrKey) -> String {
+        switch key {
+        case .ident(let n): return n
+        case .string(let s): return s
+        }
+    }
+
+    private static func name(of slot: Slot) -> String {
+        switch slot {
+        case .value(let n, _, _): return n
+        case .inherit(let key, _): return name(of: key)
+        case .inheritFrom(let n, _, _): return n
+        }
+    }
+
+    private func slotIndex(_ slots: [Slot]) -> [String: Int] {
+        var index: [String: Int] = [:]
+        index.reserveCapacity(slots.count)
+        for (i, slot) in slots.enumerated() { index[Resolver.name(of: slot)] = i }
+        return index
+    }
+
+    /// Group bindings by their first key, in order of first appearance. A key
+    /// bound more than once, or through a longer path, gets one attribute
+    /// set holding all of its parts.
+    private func layout(_ bindings: [Binding], inherits: [InheritClause]) throws -> [Slot] {
+        var order: [String] = []
+        var groups: [String: [Binding]] = [:]
+        for b in bindings {
+            guard let first = b.path.first else { continue }
+            let name = Resolver.name(of: first)
+            if groups[name] == nil { order.append(name) }
+            groups[name, default: []].append(b)
+        }
+
+        var slots: [Slot] = []
+        slots.reserveCapacity(order.count)
+        for name in order {
+            let group = groups[name]!
+            if group.count == 1 && group[0].path.count == 1 {
+                slots.append(.value(name, group[0].value, group[0].span))
+                continue
+            }
+            var merged = AttrSet(isRec: false)
+            for b in group {
+                if b.path.count > 1 {
+                    merged.bindings.append(
+                        Binding(path: Array(b.path.dropFirst()), value: b.value, span: b.span))
+                } else if case .attrSet(let inner, _) = b.value, !inner.isRec {
+                    merged.bindings += inner.bindings
+                    merged.inherits += inner.inherits
+                } else {
+                    throw EvalError(message: "attribute '\(name)' already defined and is not an attribute set")
+                }
+            }
+            slots.append(.value(name, .attrSet(merged, group[0].span), group[0].span))
+        }
+
+        for inherit in inherits {
+            for key in inherit.attrs {
+                let name = Resolver.name(of: key)
+                if let from = inherit.from {
+                    slots.append(.inheritFrom(name, from, inherit.span))
+                } else {
+                    slots.append(.inherit(key, inherit.span))
+                }
+            }
+        }
+        return slots
+    }
+
+    /// Resolve slot values inside the frame they belong to (already pushed;
+    /// `inheritSkip` is 1 then, so plain inherits look past it).
+    private mutating func resolveSlots(_ slots: [Slot], inheritSkip: Int = 1) throws -> [Binding] {
+        var out: [Binding] = []
+        out.reserveCapacity(slots.count)
+        for slot in slots {
+            switch slot {
+            case .value(let name, let value, let span):
+                out.append(Binding(path: [.ident(name)], value: try resolve(value), span: span))
+            case .inherit(let key, let span):
+                out.append(inherited(key, from: nil, span: span, skip: inheritSkip))
+            case .inheritFrom(let name, let from, let span):
+                out.append(inherited(.ident(name), from: try resolve(from), span: span, skip: 0))
+            }
+        }
+        return out
+    }
+}
@@ -0,0 +1,46 @@
+// Symbol.swift - Interned Attribute Names
+import Foundation
+
+/// An interned attribute name. Every spelling gets one id for the life of
+/// the process, so symbols compare and hash as integers; attribute sets
+/// keep their fields sorted by id.
+public struct Symbol: Hashable, Comparable, Sendable, CustomStringConvertible {
+    public let id: UInt32
+
+    public init(_ name: String) {
+        self.id = SymbolTable.shared.intern(name)
+    }
+
+    public var name: String { SymbolTable.shared.name(of: id) }
+
+    public var description: String { name }
+
+    public static func < (lhs: Symbol, rhs: Symbol) -> Bool {
+        lhs.id < rhs.id
+    }
+}
+
+/// Process-wide name <-> id table behind Symbol.
+final class SymbolTable: @unchecked Sendable {
+    static let shared = SymbolTable()
+
+    private var ids: [String: UInt32] = [:]
+    private var names: [String] = []
+    private let lock = NSLock()
+
+    func intern(_ name: String) -> UInt32 {
+        lock.lock()
+        defer { lock.unlock() }
+        if let id = ids[name] { return id }
+        let id = UInt32(names.count)
+        names.append(name)
+        ids[name] = id
+        return id
+    }
+
+    func name(of id: UInt32) -> String {
+        lock.lock()
+        defer { lock.unlock() }
+        return names[Int(id)]
+    }
+}
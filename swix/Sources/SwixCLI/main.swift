@@ -6,7 +6,10 @@ import Swix
 
 struct SwixCLI {
     static func main() async {
-        let args = Array(CommandLine.arguments.dropFirst())
+        var args = Array(CommandLine.arguments.dropFirst())
+        let useCache = !args.contains("--no-eval-cache")
+        args.removeAll { $0 == "--no-eval-cache" }
+        let cache: EvalCache? = useCache ? EvalCache.standard() : nil
 
         guard !args.isEmpty else {
             printUsage()
@@ -16,11 +19,11 @@ struct SwixCLI {
         do {
             switch args[0] {
             case "eval":
-                try await handleEval(args: Array(args.dropFirst()))
+                try await handleEval(args: Array(args.dropFirst()), cache: cache)
             case "flake":
-                try await handleFlake(args: Array(args.dropFirst()))
+                try await handleFlake(args: Array(args.dropFirst()), cache: cache)
             case "build":
-                try await handleBuild(args: Array(args.dropFirst()))
+                try await handleBuild(args: Array(args.dropFirst()), cache: cache)
             case "--help", "-h", "help":
                 printUsage()
             case "--version":
@@ -63,6 +66,8 @@ struct SwixCLI {
         OPTIONS:
           --json                             Output as JSON
           --raw                              Output strings without quotes
+          --no-eval-cache                    Ignore the parse and flake output cache
+                                             ($SWIX_CACHE_DIR, default ~/.cache/swix)
 
         EXAMPLES:
           swix eval --expr '1 + 2'
@@ -82,7 +87,7 @@ struct SwixCLI {
 
     // MARK: - eval command
 
-    static func handleEval(args: [String]) async throws {
+    static func handleEval(args: [String], cache: EvalCache?) async throws {
         var expr: String? = nil
         var filePath: String? = nil
         var flakeRef: String? = nil
@@ -125,7 +130,7 @@ struct SwixCLI {
             i += 1
         }
 
-        let evaluator = Evaluator()
+        let evaluator = Evaluator(cache: cache)
         let value: Value
 
         if let expr = expr {
@@ -140,11 +145,12 @@ struct SwixCLI {
         } else if let ref = flakeRef {
             // Evaluate flake output
             let (dir, attrPath) = parseFlakeRef(ref)
-            let flakeEval = FlakeEvaluator()
+            let flakeEval = FlakeEvaluator(cache: cache)
             if attrPath.isEmpty {
                 value = try await flakeEval.evalFlake(at: dir)
             } else {
-                value = try await flakeEval.evalFlakeOutput(at: dir, path: attrPath)
+                value = try await flakeEval.evalFlakeOutput(
+                    at: dir, path: attrPath, fullyForced: outputJSON)
             }
         } else {
             printError("error: no expression, file, or flake reference provided")
@@ -172,7 +178,7 @@ struct SwixCLI {
 
     // MARK: - flake command
 
-    static func handleFlake(args: [String]) async throws {
+    static func handleFlake(args: [String], cache: EvalCache?) async throws {
         guard !args.isEmpty else {
             printError("error: flake subcommand required (show, metadata)")
             exit(1)
@@ -182,7 +188,7 @@ struct SwixCLI {
         switch args[0] {
         case "show":
             let dir = args.count > 1 ? resolveFlakeDir(args[1]) : FileManager.default.currentDirectoryPath
-            let flakeEval = FlakeEvaluator()
+            let flakeEval = FlakeEvaluator(cache: cache)
             let output = try await flakeEval.flakeShow(at: dir)
             print(output)
 
@@ -243,7 +249,7 @@ struct SwixCLI {
 
     // MARK: - build command (stub)
 
-    static func handleBuild(args: [String]) async throws {
+    static func handleBuild(args: [String], cache: EvalCache?) async throws {
         var installable: String? = nil
         var dryRun = false
         var i = 0
@@ -285,7 +291,7 @@ struct SwixCLI {
 
         printError("evaluating '\(ref)'...")
 
-        let flakeEval = FlakeEvaluator()
+        let flakeEval = FlakeEvaluator(cache: cache)
         let value: Value
 
         do {
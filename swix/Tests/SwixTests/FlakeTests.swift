@@ -659,3 +659,192 @@ struct ValuePrinterTests {
         #expect(json.contains("true"))
     }
 }
+
+// MARK: - Eval Cache Tests
+
+@Suite("EvalCache")
+struct EvalCacheTests {
+    static func makeCache() throws -> (EvalCache, String) {
+        let dir = try FlakeEvaluatorTests.makeTmpDir()
+        return (EvalCache(directory: URL(fileURLWithPath: dir)), dir)
+    }
+
+    @Test func sha256Vectors() {
+        #expect(SHA256.hex([]) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855")
+        #expect(SHA256.hex(Array("abc".utf8)) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad")
+        let twoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+        #expect(SHA256.hex(Array(twoBlocks.utf8)) == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1")
+
+        // Split updates across block boundaries give the same digest.
+        var hasher = SHA256()
+        hasher.update(String(twoBlocks.prefix(7)))
+        hasher.update(String(twoBlocks.dropFirst(7)))
+        #expect(SHA256.hexString(hasher.finalize()) == SHA256.hex(Array(twoBlocks.utf8)))
+    }
+
+    @Test func codecRoundTrip() async throws {
+        let source = """
+        let
+          f = { a, b ? 2, ... }@args: a + b + builtins.length (builtins.attrNames args);
+          s = rec { x = 1; y = x + 1; inherit (builtins) length; "q z" = -3.5; };
+          name = "world";
+        in assert true; with s; [
+          (f { a = 1; c = null; }) y s ? "q z" s.nope or "dflt"
+          "hello ${name}" (if !false then x * 2 else 0) (length ([ 1 2 ] ++ [ ]))
+          ({ p.q = 1; } // { p = 2; }) (x: x) ./rel/path (s."q z" < 0)
+        ]
+        """
+        var parser = Parser(source: source)
+        let expr = try parser.parse()
+        let decoded = try ExprCodec.decode(Data(ExprCodec.encode(expr)))
+        #expect(ExprCodec.encode(decoded) == ExprCodec.encode(expr))
+
+        let evaluator = Evaluator()
+        let printer = ValuePrinter(evaluator: evaluator)
+        let env = Builtins.baseEnv(evaluator: evaluator)
+        let want = await printer.print(try await evaluator.eval(expr, env: env))
+        let got = await printer.print(try await evaluator.eval(decoded, env: env))
+        #expect(got == want)
+    }
+
+    @Test func codecRejectsGarbage() {
+        #expect(throws: (any Error).self) { try ExprCodec.decode(Data("not an ast".utf8)) }
+        var truncated = ExprCodec.encode(.int(7, Span()))
+        truncated.removeLast()
+        #expect(throws: (any Error).self) { try ExprCodec.decode(Data(truncated)) }
+        // A string table claiming 2^62 entries is refused, not reserved.
+        let huge = ExprCodec.magic + [ExprCodec.version] + [UInt8](repeating: 0xFF, count: 8) + [0x3F]
+        #expect(throws: (any Error).self) { try ExprCodec.decode(Data(huge)) }
+    }
+
+    @Test func parseCacheHit() async throws {
+        let (cache, dir) = try Self.makeCache()
+        defer { FlakeEvaluatorTests.cleanup(dir) }
+        let source = "let x = 40; in x + 2"
+        #expect(cache.expr(for: source) == nil)
+
+        let first = try await Evaluator(cache: cache).eval(source)
+        #expect(cache.expr(for: source) != nil)
+        let second = try await Evaluator(cache: cache).eval(source)
+        if case .int(42) = first, case .int(42) = second {} else {
+            Issue.record("Expected 42 twice, got \(first) and \(second)")
+        }
+    }
+
+    @Test func flakeOutputCachedUntilEdited() async throws {
+        let (cache, cacheDir) = try Self.makeCache()
+        defer { FlakeEvaluatorTests.cleanup(cacheDir) }
+        let dir = try FlakeEvaluatorTests.makeTmpDir()
+        defer { FlakeEvaluatorTests.cleanup(dir) }
+        try FlakeEvaluatorTests.writeFlake(dir, """
+        { outputs = { self }: { answer = { n = 42; s = [ "a" ]; }; lib = { f = x: x; }; }; }
+        """)
+
+        let flake = FlakeEvaluator(cache: cache)
+        let fingerprint = try #require(cache.fingerprint(flakeAt: dir))
+        // A lazy caller's result is not forced just to cache it.
+        _ = try await flake.evalFlakeOutput(at: dir, path: ["answer"])
+        #expect(cache.value(fingerprint: fingerprint, path: ["answer"]) == nil)
+
+        _ = try await flake.evalFlakeOutput(at: dir, path: ["answer"], fullyForced: true)
+        guard case .attrs(let fields)? = cache.value(fingerprint: fingerprint, path: ["answer"]),
+              case .int(42)? = fields["n"], case .list([.string("a")])? = fields["s"] else {
+            Issue.record("Expected cached answer")
+            return
+        }
+
+        // Anything holding a function is left to be evaluated every time.
+        let lib = try await flake.evalFlakeOutput(at: dir, path: ["lib"], fullyForced: true)
+        #expect(cache.value(fingerprint: fingerprint, path: ["lib"]) == nil)
+        guard case .attrSet(let libSet) = lib else {
+            Issue.record("Expected lib to be an attrset, got \(lib)")
+            return
+        }
+        let evaluator = Evaluator()
+        let f = try await libSet.force("f", evaluator: evaluator)
+        let applied = try await Builtins.applyFn(f, arg: .int(7), evaluator: evaluator)
+        if case .int(7) = applied {} else { Issue.record("Expected lib.f 7 = 7, got \(applied)") }
+
+        let hit = try await flake.evalFlakeOutput(at: dir, path: ["answer"])
+        guard case .attrSet(let s) = hit,
+              case .int(42) = try await s.force("n", evaluator: Evaluator()) else {
+            Issue.record("Expected n = 42 from the cache, got \(hit)")
+            return
+        }
+
+        try FlakeEvaluatorTests.writeFlake(dir, """
+        { outputs = { self }: { answer = { n = 43; s = [ "a" ]; }; lib = { f = x: x; }; }; }
+        """)
+        #expect(cache.fingerprint(flakeAt: dir) != fingerprint)
+        let edited = try await flake.evalFlakeOutput(at: dir, path: ["answer", "n"])
+        if case .int(43) = edited {} else { Issue.record("Expected 43 after the edit, got \(edited)") }
+    }
+
+    @Test func flakeOutputCheckedAgainstReads() async throws {
+        let (cache, cacheDir) = try Self.makeCache()
+        defer { FlakeEvaluatorTests.cleanup(cacheDir) }
+        let dir = try FlakeEvaluatorTests.makeTmpDir()
+        defer { FlakeEvaluatorTests.cleanup(dir) }
+        // Files outside the flake, a non-.nix file and a hidden directory:
+        // none of them are part of the fingerprint.
+        let data = try FlakeEvaluatorTests.makeTmpDir()
+        defer { FlakeEvaluatorTests.cleanup(data) }
+        let fm = FileManager.default
+        try fm.createDirectory(atPath: "\(data)/.hidden", withIntermediateDirectories: true)
+        try "one".write(toFile: "\(data)/notes.txt", atomically: true, encoding: .utf8)
+        try "{ answer = 42; }".write(toFile: "\(data)/lib.nix", atomically: true, encoding: .utf8)
+        try FlakeEvaluatorTests.writeFlake(dir, """
+        { outputs = { self }: { info = {
+            text = builtins.readFile "\(data)/notes.txt";
+            flag = builtins.pathExists "\(data)/flag";
+            names = builtins.attrNames (builtins.readDir "\(data)/.hidden");
+            answer = (import "\(data)/lib.nix").answer;
+        }; }; }
+        """)
+
+        let flake = FlakeEvaluator(cache: cache)
+        let fingerprint = try #require(cache.fingerprint(flakeAt: dir))
+        func recache() async throws {
+            _ = try await flake.evalFlakeOutput(at: dir, path: ["info"], fullyForced: true)
+            #expect(cache.value(fingerprint: fingerprint, path: ["info"]) != nil)
+        }
+        try await recache()
+        _ = try await flake.evalFlakeOutput(at: dir, path: ["info"])
+        #expect(cache.value(fingerprint: fingerprint, path: ["info"]) != nil)
+
+        try "two".write(toFile: "\(data)/notes.txt", atomically: true, encoding: .utf8)
+        #expect(cache.value(fingerprint: fingerprint, path: ["info"]) == nil)
+        let edited = try await flake.evalFlakeOutput(at: dir, path: ["info", "text"])
+        if case .string("two") = edited {} else { Issue.record("Expected the new notes, got \(edited)") }
+        try await recache()
+
+        try "".write(toFile: "\(data)/flag", atomically: true, encoding: .utf8)
+        #expect(cache.value(fingerprint: fingerprint, path: ["info"]) == nil)
+        try await recache()
+
+        try "".write(toFile: "\(data)/.hidden/new", atomically: true, encoding: .utf8)
+        #expect(cache.value(fingerprint: fingerprint, path: ["info"]) == nil)
+        try await recache()
+
+        try "{ answer = 43; }".write(toFile: "\(data)/lib.nix", atomically: true, encoding: .utf8)
+        #expect(cache.value(fingerprint: fingerprint, path: ["info"]) == nil)
+        #expect(cache.fingerprint(flakeAt: dir) == fingerprint)
+    }
+
+    @Test func flakeShowCached() async throws {
+        let (cache, cacheDir) = try Self.makeCache()
+        defer { FlakeEvaluatorTests.cleanup(cacheDir) }
+        let dir = try FlakeEvaluatorTests.makeTmpDir()
+        defer { FlakeEvaluatorTests.cleanup(dir) }
+        try FlakeEvaluatorTests.writeFlake(dir, """
+        { outputs = { self }: { lib.id = x: x; hello = "world"; }; }
+        """)
+
+        let flake = FlakeEvaluator(cache: cache)
+        let first = try await flake.flakeShow(at: dir)
+        let fingerprint = try #require(cache.fingerprint(flakeAt: dir))
+        #expect(cache.show(fingerprint: fingerprint) != nil)
+        #expect(try await flake.flakeShow(at: dir) == first)
+        #expect(try await FlakeEvaluator().flakeShow(at: dir) == first)
+    }
+}